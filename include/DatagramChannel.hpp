@@ -0,0 +1,158 @@
+#ifndef __DATAGRAM_CHANNEL_HPP__
+#define __DATAGRAM_CHANNEL_HPP__
+
+#include "def.hpp"
+#include "Message.hpp"
+#include "Frame.hpp"
+#include <netinet/in.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/*
+ * Statistics of a datagram channel.
+ */
+struct DatagramStats {
+    uint64_t sent_num;
+    uint64_t batch_num;     // sendmmsg calls which sent them.
+    uint64_t received_num;
+    uint64_t lost_num;      // Skipped sequence numbers.
+    uint64_t late_num;      // Arrived after a later one, dropped.
+};
+
+/*
+ * A UDP socket carrying small loss-tolerant packets beside the TCP connections,
+ * i.e. the heart beats and the DATAGRAMs, so they do not wait behind large frames.
+ * Every datagram is a u32 sequence number (network order) followed by one packet.
+ * The sequence numbers are counted per peer, so the receiver notices the losses,
+ * and drops a datagram overtaken by a later one.
+ * Only the datagrams from the registered peers are taken.
+ */
+class DatagramChannel {
+private:
+    struct Peer {
+        uint8_t id;
+        uint32_t send_seq;
+        uint32_t expected_seq;
+        // Whether a datagram was received, the first one sets expected_seq.
+        bool synced;
+    };
+
+    struct Outbound {
+        sockaddr_in addr;
+        uint32_t seq;   // Network order.
+        FrameRef frame;
+    };
+
+    int sockfd_;
+    uint16_t port_;
+    // Protected by mutex_.
+    std::mutex mutex_;
+    std::map<uint64_t, Peer> peers_;
+    std::vector<Outbound> queue_;
+    // Called when the queue stops being empty, null to flush on every send.
+    std::function<void()> on_queued_;
+    // Only touched by the thread receiving.
+    std::vector<uint8_t> receive_buffers_;
+    std::atomic_uint64_t sent_num_;
+    std::atomic_uint64_t batch_num_;
+    std::atomic_uint64_t received_num_;
+    std::atomic_uint64_t lost_num_;
+    std::atomic_uint64_t late_num_;
+
+    /*
+     * The key of a peer in peers_.
+     */
+    static uint64_t key(const sockaddr_in &addr);
+
+    /*
+     * Send the queued datagrams, in batches of DATAGRAM_BATCH.
+     * Must be called with mutex_ held.
+     */
+    void flush_queue();
+
+public:
+    /*
+     * Constructor.
+     * @param addr: The address to bind to, port 0 for any port.
+     * @param on_queued: Called when a datagram is queued to an empty queue,
+     *                   e.g. to schedule flush(). Null to send every datagram at once.
+     */
+    DatagramChannel(const sockaddr_in &addr, std::function<void()> on_queued = nullptr);
+
+    /*
+     * Constructor, taking a socket bound already, e.g. by a former process.
+     * @param sockfd: The UDP socket, closed even if it throws.
+     * @param on_queued: As above.
+     */
+    DatagramChannel(int sockfd, std::function<void()> on_queued = nullptr);
+    ~DatagramChannel();
+
+    DatagramChannel(const DatagramChannel &) = delete;
+    DatagramChannel &operator=(const DatagramChannel &) = delete;
+
+    /*
+     * Get the socket, to wait for it to be readable.
+     */
+    int get_fd() const;
+
+    /*
+     * Get the port bound to, in host order.
+     */
+    uint16_t get_port() const;
+
+    /*
+     * Take the datagrams from an address from now on, starting the sequence numbers over.
+     * @param addr: The address of the peer.
+     * @param id: The id of the peer, given with its packets.
+     * @param send_seq: The sequence number of the next datagram to the peer,
+     *                  to go on where another channel stopped.
+     */
+    void add_peer(const sockaddr_in &addr, uint8_t id, uint32_t send_seq = 0);
+
+    /*
+     * Get the sequence number of the next datagram to a peer.
+     * @param addr: The address of the peer.
+     * @return: The sequence number, 0 if the peer is unknown.
+     */
+    uint32_t get_send_seq(const sockaddr_in &addr);
+
+    /*
+     * Stop taking the datagrams from an address.
+     * @param addr: The address of the peer.
+     */
+    void remove_peer(const sockaddr_in &addr);
+
+    /*
+     * Queue a packet to a peer.
+     * @param addr: The address of the peer.
+     * @param message: The packet.
+     * @return: False if the peer is unknown or the packet is larger than MAX_DATAGRAM_SIZE,
+     *          then it should go through TCP.
+     */
+    bool send(const sockaddr_in &addr, const Message &message);
+
+    /*
+     * Send the queued datagrams. Those the socket can not take at once are dropped.
+     */
+    void flush();
+
+    /*
+     * Take the datagrams received, without waiting.
+     * One thread receives at a time.
+     * @param messages: Where to append the packets, with the ids of their peers.
+     * @return: The number of packets appended.
+     */
+    size_t receive(std::vector<std::pair<uint8_t, MessagePtr> > &messages);
+
+    /*
+     * Get the statistics of the channel.
+     */
+    DatagramStats get_stats() const;
+};
+
+#endif
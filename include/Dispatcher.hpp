@@ -0,0 +1,195 @@
+#ifndef __DISPATCHER_HPP__
+#define __DISPATCHER_HPP__
+
+#include "Message.hpp"
+#include <array>
+#include <utility>
+#include <type_traits>
+
+/*
+ * Bounds of the number of data segments a message may carry.
+ */
+struct SegmentBound {
+    uint8_t min;
+    uint8_t max;
+};
+
+/*
+ * Segment count rule of a message type, checked before dispatching.
+ * Specialize it for every message type which carries a fixed layout.
+ */
+template <MessageType Type>
+struct SegmentRule {
+    static constexpr SegmentBound bound = {0, 255};
+};
+
+template <> struct SegmentRule<MessageType::HEARTBEAT>   { static constexpr SegmentBound bound = {0, 0}; };
+template <> struct SegmentRule<MessageType::CONNECT>     { static constexpr SegmentBound bound = {1, 2}; };
+template <> struct SegmentRule<MessageType::DISCONNECT>  { static constexpr SegmentBound bound = {0, 0}; };
+template <> struct SegmentRule<MessageType::REQTIME>     { static constexpr SegmentBound bound = {0, 0}; };
+template <> struct SegmentRule<MessageType::REQHOST>     { static constexpr SegmentBound bound = {0, 0}; };
+template <> struct SegmentRule<MessageType::REQCLILIST>  { static constexpr SegmentBound bound = {0, 1}; };
+template <> struct SegmentRule<MessageType::REQSEND>     { static constexpr SegmentBound bound = {1, 255}; };
+template <> struct SegmentRule<MessageType::FWD>         { static constexpr SegmentBound bound = {1, 255}; };
+template <> struct SegmentRule<MessageType::REQMULTI>    { static constexpr SegmentBound bound = {2, 255}; };
+template <> struct SegmentRule<MessageType::SUBSCRIBE>   { static constexpr SegmentBound bound = {1, 1}; };
+template <> struct SegmentRule<MessageType::UNSUBSCRIBE> { static constexpr SegmentBound bound = {1, 1}; };
+template <> struct SegmentRule<MessageType::PUBLISH>     { static constexpr SegmentBound bound = {2, 255}; };
+template <> struct SegmentRule<MessageType::RESUME>      { static constexpr SegmentBound bound = {1, 2}; };
+template <> struct SegmentRule<MessageType::WAIT>        { static constexpr SegmentBound bound = {1, 1}; };
+template <> struct SegmentRule<MessageType::CREDIT>      { static constexpr SegmentBound bound = {2, 2}; };
+template <> struct SegmentRule<MessageType::REQCLILIST_SINCE> { static constexpr SegmentBound bound = {1, 1}; };
+template <> struct SegmentRule<MessageType::PRESENCE>    { static constexpr SegmentBound bound = {1, 255}; };
+template <> struct SegmentRule<MessageType::REQSEND_NAME> { static constexpr SegmentBound bound = {2, 255}; };
+template <> struct SegmentRule<MessageType::DATAGRAM>    { static constexpr SegmentBound bound = {1, 255}; };
+template <> struct SegmentRule<MessageType::PEER>        { static constexpr SegmentBound bound = {1, 255}; };
+template <> struct SegmentRule<MessageType::REDIRECT>    { static constexpr SegmentBound bound = {2, 2}; };
+template <> struct SegmentRule<MessageType::REQACKS>     { static constexpr SegmentBound bound = {1, 1}; };
+template <> struct SegmentRule<MessageType::ACKS>        { static constexpr SegmentBound bound = {1, 255}; };
+
+/*
+ * Segment count rule of an ACK, indexed by the type of the acknowledged request.
+ */
+template <MessageType Type>
+struct AckSegmentRule {
+    static constexpr SegmentBound bound = {0, 255};
+};
+
+template <> struct AckSegmentRule<MessageType::CONNECT>     { static constexpr SegmentBound bound = {1, 2}; };
+template <> struct AckSegmentRule<MessageType::REQTIME>     { static constexpr SegmentBound bound = {1, 1}; };
+template <> struct AckSegmentRule<MessageType::REQHOST>     { static constexpr SegmentBound bound = {1, 1}; };
+template <> struct AckSegmentRule<MessageType::REQCLILIST>  { static constexpr SegmentBound bound = {2, 255}; };
+template <> struct AckSegmentRule<MessageType::REQCLILIST_SINCE> { static constexpr SegmentBound bound = {2, 255}; };
+template <> struct AckSegmentRule<MessageType::REQSEND>     { static constexpr SegmentBound bound = {0, 2}; };
+template <> struct AckSegmentRule<MessageType::REQSEND_NAME> { static constexpr SegmentBound bound = {0, 2}; };
+template <> struct AckSegmentRule<MessageType::REQMULTI>    { static constexpr SegmentBound bound = {2, 2}; };
+template <> struct AckSegmentRule<MessageType::SUBSCRIBE>   { static constexpr SegmentBound bound = {0, 1}; };
+template <> struct AckSegmentRule<MessageType::UNSUBSCRIBE> { static constexpr SegmentBound bound = {0, 1}; };
+template <> struct AckSegmentRule<MessageType::PUBLISH>     { static constexpr SegmentBound bound = {1, 1}; };
+template <> struct AckSegmentRule<MessageType::RESUME>      { static constexpr SegmentBound bound = {0, 1}; };
+template <> struct AckSegmentRule<MessageType::PRESENCE>    { static constexpr SegmentBound bound = {0, 1}; };
+
+enum class DispatchResult {
+    DONE,       // The message is handled.
+    IGNORED,    // The message is dropped silently.
+    STOP,       // The message is handled and the connection should be closed.
+    INVALID,    // No handler is registered for the type.
+    MALFORMED   // The number of segments does not fit the type.
+};
+
+template <typename Owner, typename Context>
+struct HandlerTraits {
+    using type = DispatchResult (Owner::*)(Context &, MessagePtr &);
+};
+
+template <typename Owner>
+struct HandlerTraits<Owner, void> {
+    using type = DispatchResult (Owner::*)(MessagePtr &);
+};
+
+/*
+ * Dense jump table from MessageType to a member function of Owner.
+ * The segment bounds are generated at compile time from Rule,
+ * so dispatching costs one bound check and one indirect call.
+ * @tparam Owner: The class the handlers belong to.
+ * @tparam Context: The per-connection context passed to the handlers, or void.
+ * @tparam Rule: The segment count rule to validate with.
+ */
+template <
+    typename Owner,
+    typename Context = void,
+    template <MessageType> class Rule = SegmentRule
+>
+class Dispatcher {
+public:
+    using Handler = typename HandlerTraits<Owner, Context>::type;
+
+private:
+    template <size_t... I>
+    static constexpr std::array<SegmentBound, MESSAGE_TYPE_NUM> make_bounds(std::index_sequence<I...>) {
+        return {{ Rule<static_cast<MessageType>(I)>::bound... }};
+    }
+
+    static constexpr std::array<SegmentBound, MESSAGE_TYPE_NUM> bounds_ =
+        make_bounds(std::make_index_sequence<MESSAGE_TYPE_NUM>{});
+
+    std::array<Handler, MESSAGE_TYPE_NUM> table_ {};
+
+    /*
+     * Look up the handler and validate the segment count.
+     * @param type: The type to dispatch on.
+     * @param message: The message to validate.
+     * @param result: Set to the failure reason if no handler applies.
+     * @return: The handler, or nullptr.
+     */
+    Handler lookup(MessageType type, const MessagePtr &message, DispatchResult &result) const {
+        size_t index = static_cast<size_t>(type);
+        if (index >= MESSAGE_TYPE_NUM || table_[index] == nullptr) {
+            result = DispatchResult::INVALID;
+            return nullptr;
+        }
+        size_t data_num = message->get_data_num();
+        if (data_num < bounds_[index].min || data_num > bounds_[index].max) {
+            result = DispatchResult::MALFORMED;
+            return nullptr;
+        }
+        return table_[index];
+    }
+
+public:
+    /*
+     * Register the handler of a message type.
+     * Registering again replaces the former handler.
+     * @tparam Type: The message type to handle.
+     * @param handler: The member function to call.
+     */
+    template <MessageType Type>
+    void register_handler(Handler handler) {
+        static_assert(static_cast<size_t>(Type) < MESSAGE_TYPE_NUM, "Dispatcher: unknown message type");
+        static_assert(
+            Rule<Type>::bound.min <= Rule<Type>::bound.max,
+            "Dispatcher: invalid segment bound"
+        );
+        table_[static_cast<size_t>(Type)] = handler;
+    }
+
+    /*
+     * Dispatch a message on the given type.
+     * @param type: The type to dispatch on, which may differ from the type of the message.
+     * @param owner: The object to call the handler on.
+     * @param context: The per-connection context.
+     * @param message: The message to handle, the handler may take its ownership.
+     * @return: The result of the handler, INVALID or MALFORMED.
+     */
+    template <typename C = Context, typename = std::enable_if_t<!std::is_void<C>::value> >
+    DispatchResult dispatch(MessageType type, Owner *owner, C &context, MessagePtr &message) const {
+        DispatchResult result = DispatchResult::INVALID;
+        Handler handler = lookup(type, message, result);
+        if (handler == nullptr) {
+            return result;
+        }
+        return (owner->*handler)(context, message);
+    }
+
+    template <typename C = Context, typename = std::enable_if_t<!std::is_void<C>::value> >
+    DispatchResult dispatch(Owner *owner, C &context, MessagePtr &message) const {
+        return dispatch(message->get_type(), owner, context, message);
+    }
+
+    template <typename C = Context, typename = std::enable_if_t<std::is_void<C>::value> >
+    DispatchResult dispatch(MessageType type, Owner *owner, MessagePtr &message) const {
+        DispatchResult result = DispatchResult::INVALID;
+        Handler handler = lookup(type, message, result);
+        if (handler == nullptr) {
+            return result;
+        }
+        return (owner->*handler)(message);
+    }
+
+    template <typename C = Context, typename = std::enable_if_t<std::is_void<C>::value> >
+    DispatchResult dispatch(Owner *owner, MessagePtr &message) const {
+        return dispatch(message->get_type(), owner, message);
+    }
+};
+
+#endif
@@ -0,0 +1,277 @@
+#ifndef __EVENT_LOOP_HPP__
+#define __EVENT_LOOP_HPP__
+
+#include "def.hpp"
+#include "Task.hpp"
+#include <coroutine>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * A single threaded loop on epoll which runs coroutines.
+ * They suspend on timers, on readable or writable fds and on events
+ * instead of blocking a thread each.
+ * Except post(), spawn() and stop(), every method and every awaitable
+ * is only used on the thread running the loop, i.e. from the coroutines.
+ */
+class EventLoop {
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimerKey = std::pair<Clock::time_point, uint64_t>;
+
+private:
+    /*
+     * The detached coroutine running a spawned task,
+     * destroyed with the task if the loop is destroyed first.
+     */
+    struct Root {
+        struct promise_type {
+            Root get_return_object() {
+                return Root {std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+            std::suspend_always initial_suspend() noexcept {
+                return {};
+            }
+            std::suspend_never final_suspend() noexcept {
+                return {};
+            }
+            void return_void() {}
+            void unhandled_exception() {
+                std::terminate();
+            }
+        };
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    /*
+     * A coroutine waiting for an fd.
+     */
+    struct IoWaiter {
+        std::coroutine_handle<> handle;
+        bool *ready;
+        bool timed;
+        TimerKey timer;
+    };
+
+    int epollfd_;
+    // Written to wake up the loop.
+    int eventfd_;
+    std::atomic_bool stopping_;
+    std::mutex mutex_;
+    // Functions posted from the other threads, protected by mutex_.
+    std::vector<std::function<void()> > posted_;
+    // The rest are only touched on the loop thread.
+    // The nodes of the timers and the fds awaited are recycled through a pool,
+    // since every wait adds one and removes it again.
+    std::pmr::unsynchronized_pool_resource pool_;
+    std::pmr::map<TimerKey, std::function<void()> > timers_;
+    uint64_t next_timer_id_;
+    std::pmr::unordered_map<int, IoWaiter> io_waiters_;
+    std::unordered_map<uint64_t, std::coroutine_handle<> > roots_;
+    uint64_t next_root_id_;
+
+    Root run_root(Task<void> task, std::promise<void> done, uint64_t id);
+
+    /*
+     * Stop waiting for an fd and resume its coroutine.
+     * @param fd: The fd.
+     * @param ready: Whether the fd is ready, false if timed out.
+     */
+    void resume_io(int fd, bool ready);
+
+public:
+    /*
+     * Suspends until a time point.
+     */
+    class SleepAwaiter {
+    private:
+        EventLoop &loop_;
+        Clock::time_point time_;
+
+    public:
+        SleepAwaiter(EventLoop &loop, Clock::time_point time) : loop_(loop), time_(time) {}
+        bool await_ready() const noexcept {
+            return time_ <= Clock::now();
+        }
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() noexcept {}
+    };
+
+    /*
+     * Suspends until the next iteration of the loop, letting the other coroutines run.
+     */
+    class YieldAwaiter {
+    private:
+        EventLoop &loop_;
+
+    public:
+        explicit YieldAwaiter(EventLoop &loop) : loop_(loop) {}
+        bool await_ready() const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() noexcept {}
+    };
+
+    /*
+     * Suspends until an fd is ready, resumes with false if timed out.
+     */
+    class IoAwaiter {
+    private:
+        EventLoop &loop_;
+        int fd_;
+        uint32_t events_;
+        int timeout_;
+        bool ready_;
+
+    public:
+        IoAwaiter(EventLoop &loop, int fd, uint32_t events, int timeout)
+            : loop_(loop), fd_(fd), events_(events), timeout_(timeout), ready_(false) {}
+        bool await_ready() const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle);
+        bool await_resume() noexcept {
+            return ready_;
+        }
+    };
+
+    EventLoop();
+    ~EventLoop();
+
+    /*
+     * Run the loop on the calling thread until stop() is called.
+     */
+    void run();
+
+    /*
+     * Make run() return, the suspended coroutines are kept until the loop is destroyed.
+     * Thread safe.
+     */
+    void stop();
+
+    /*
+     * Call a function on the loop thread.
+     * Thread safe.
+     * @param function: The function to call.
+     */
+    void post(std::function<void()> function);
+
+    /*
+     * Start a task on the loop thread, detached from the caller.
+     * Thread safe.
+     * @param task: The task to run.
+     * @return: Ready once the task finishes, with its exception if any,
+     *          or broken if the loop is destroyed first.
+     */
+    std::future<void> spawn(Task<void> task);
+
+    /*
+     * Call a function once a time point has passed.
+     * @param time: The time point.
+     * @param function: The function to call.
+     * @return: The key to cancel the timer with.
+     */
+    TimerKey add_timer(Clock::time_point time, std::function<void()> function);
+
+    /*
+     * Cancel a timer which has not fired.
+     * @param key: The key of the timer.
+     */
+    void cancel_timer(const TimerKey &key);
+
+    SleepAwaiter sleep_until(Clock::time_point time) {
+        return SleepAwaiter(*this, time);
+    }
+
+    SleepAwaiter sleep_for(std::chrono::milliseconds duration) {
+        return SleepAwaiter(*this, Clock::now() + duration);
+    }
+
+    /*
+     * Give the other coroutines ready to run a turn, e.g. between the messages of a busy connection.
+     * @return: An awaitable resuming in the next iteration of the loop.
+     */
+    YieldAwaiter yield() {
+        return YieldAwaiter(*this);
+    }
+
+    /*
+     * Wait for an fd to be readable, one coroutine at a time for every fd.
+     * @param fd: The fd.
+     * @param timeout: The milliseconds to wait at most, negative to wait forever.
+     * @return: An awaitable resuming with whether the fd is readable.
+     */
+    IoAwaiter readable(int fd, int timeout = -1);
+
+    /*
+     * Wait for an fd to be writable, one coroutine at a time for every fd.
+     * @param fd: The fd.
+     * @param timeout: The milliseconds to wait at most, negative to wait forever.
+     * @return: An awaitable resuming with whether the fd is writable.
+     */
+    IoAwaiter writable(int fd, int timeout = -1);
+};
+
+/*
+ * An event set from any thread and awaited by one coroutine on the loop,
+ * e.g. an answer arriving on another thread. Once set it stays set.
+ * Copies share the same event.
+ */
+class AsyncEvent {
+private:
+    struct State {
+        EventLoop *loop;
+        bool set;
+        std::coroutine_handle<> waiter;
+        bool timed;
+        EventLoop::TimerKey timer;
+    };
+
+    std::shared_ptr<State> state_;
+
+public:
+    class Awaiter {
+    private:
+        std::shared_ptr<State> state_;
+        int timeout_;
+
+    public:
+        Awaiter(std::shared_ptr<State> state, int timeout) : state_(std::move(state)), timeout_(timeout) {}
+        bool await_ready() const noexcept {
+            return state_->set;
+        }
+        void await_suspend(std::coroutine_handle<> handle);
+        bool await_resume() noexcept {
+            return state_->set;
+        }
+    };
+
+    explicit AsyncEvent(EventLoop &loop);
+
+    /*
+     * Set the event and resume its waiter on the loop.
+     * Thread safe.
+     */
+    void set();
+
+    /*
+     * Wait for the event.
+     * @param timeout: The milliseconds to wait at most, negative to wait forever.
+     * @return: An awaitable resuming with whether the event is set, false if timed out.
+     */
+    Awaiter wait(int timeout = -1) {
+        return Awaiter(state_, timeout);
+    }
+};
+
+#endif
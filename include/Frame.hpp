@@ -0,0 +1,114 @@
+#ifndef __FRAME_HPP__
+#define __FRAME_HPP__
+
+#include "def.hpp"
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+/*
+ * A serialized packet, which may be shared by several outbound queues.
+ * Frames are reference counted by FrameRef and recycled by FramePool
+ * together with the capacity of their buffer.
+ */
+class Frame {
+private:
+    std::vector<uint8_t> buffer_;
+    std::atomic_uint32_t ref_count_;
+
+    friend class FrameRef;
+
+public:
+    Frame() : ref_count_(0) {}
+
+    std::vector<uint8_t> &get_buffer() {
+        return buffer_;
+    }
+
+    const std::vector<uint8_t> &get_buffer() const {
+        return buffer_;
+    }
+
+    size_t size() const {
+        return buffer_.size();
+    }
+};
+
+/*
+ * Process-wide free list of frames.
+ * Frames are usually released on another thread (the writer of a Sender)
+ * than they are built on, so the pool is shared and guarded by a mutex.
+ * It keeps up to FRAME_POOL_CAPACITY frames, as many as may wait for their ACKs,
+ * e.g. a burst of FWDs, and drops the buffers larger than MAX_BUFFER_SIZE.
+ */
+class FramePool {
+public:
+    /*
+     * Take a frame from the pool, or allocate one if the pool is empty.
+     * @return: An empty frame with no reference.
+     */
+    static Frame *acquire();
+
+    /*
+     * Give a frame without any reference back to the pool.
+     * @param frame: The frame to release.
+     */
+    static void release(Frame *frame);
+};
+
+/*
+ * Shared handle of a frame.
+ */
+class FrameRef {
+private:
+    Frame *frame_;
+
+public:
+    FrameRef() : frame_(nullptr) {}
+
+    explicit FrameRef(Frame *frame) : frame_(frame) {
+        if (frame_ != nullptr) {
+            frame_->ref_count_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    FrameRef(const FrameRef &other) : FrameRef(other.frame_) {}
+
+    FrameRef(FrameRef &&other) noexcept : frame_(other.frame_) {
+        other.frame_ = nullptr;
+    }
+
+    FrameRef &operator=(FrameRef other) noexcept {
+        std::swap(frame_, other.frame_);
+        return *this;
+    }
+
+    ~FrameRef() {
+        if (frame_ != nullptr && frame_->ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            FramePool::release(frame_);
+        }
+    }
+
+    /*
+     * Take an empty frame from FramePool.
+     */
+    static FrameRef make() {
+        return FrameRef(FramePool::acquire());
+    }
+
+    Frame *operator->() const {
+        return frame_;
+    }
+
+    Frame &operator*() const {
+        return *frame_;
+    }
+
+    explicit operator bool() const {
+        return frame_ != nullptr;
+    }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <map>
 #include <mutex>
+#include <memory_resource>
 
 inline void check_lock(std::unique_lock<std::mutex> &lock, std::mutex *mutex2) {
     // Check if lock is locked.
@@ -18,11 +19,13 @@ inline void check_lock(std::unique_lock<std::mutex> &lock, std::mutex *mutex2) {
 template <typename K, typename V, typename Compare = std::less<K> >
 class Map {
 private:
-    std::map<K, V, Compare> map_;
+    // Nodes are recycled through a pool, which is only touched with mutex_ held.
+    std::pmr::unsynchronized_pool_resource pool_;
+    std::pmr::map<K, V, Compare> map_;
     std::mutex mutex_;
 
 public:
-    Map() {}
+    Map() : map_(&pool_) {}
     ~Map() {}
 
     std::mutex &get_mutex() {
@@ -35,6 +38,11 @@ public:
         return map_.empty();
     }
 
+    size_t size(std::unique_lock<std::mutex> &lock) {
+        check_lock(lock, &mutex_);
+        return map_.size();
+    }
+
     // Write operations
     auto insert_or_assign(const K &key, V value, std::unique_lock<std::mutex> &lock) {
         check_lock(lock, &mutex_);
@@ -46,7 +54,7 @@ public:
         return map_.erase(key);
     }
 
-    auto erase(typename std::map<K, V, Compare>::iterator it, std::unique_lock<std::mutex> &lock) {
+    auto erase(typename std::pmr::map<K, V, Compare>::iterator it, std::unique_lock<std::mutex> &lock) {
         check_lock(lock, &mutex_);
         return map_.erase(it);
     }
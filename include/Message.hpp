@@ -2,6 +2,7 @@
 #define __MESSAGE_HPP__
 
 #include "def.hpp"
+#include "Pool.hpp"
 #include <vector>
 #include <string>
 #include <atomic>
@@ -15,9 +16,27 @@ enum class MessageType {
     REQCLILIST,
     REQSEND,
     ACK,
-    FWD
+    FWD,
+    REQMULTI,
+    SUBSCRIBE,
+    UNSUBSCRIBE,
+    PUBLISH,
+    RESUME,
+    WAIT,
+    CREDIT,
+    REQCLILIST_SINCE,
+    PRESENCE,
+    REQSEND_NAME,
+    DATAGRAM,
+    PEER,
+    REDIRECT,
+    REQACKS,
+    ACKS
 };
 
+// Number of message types, keep it in sync with the last type.
+constexpr size_t MESSAGE_TYPE_NUM = static_cast<size_t>(MessageType::ACKS) + 1;
+
 class Message {
 private:
     static std::atomic_uint16_t pakage_id_counter_;
@@ -44,29 +63,32 @@ public:
      * @param type: The type of the message.
      * @param sender_id: The id of the sender.
      * @param receiver_id: The id of the receiver.
-     * @param data: The data of the message.
+     * @param data: The data of the message, moved into the message.
      * @param increase_pakage_id: Whether to increase the pakage id.
      */
     explicit Message(
         MessageType type,
         uint8_t sender_id,
         uint8_t receiver_id,
-        const data_t &data = {},
+        data_t data = {},
         bool increase_pakage_id = true
     );
-    /*
-     * Copy constructor for Message.
-     * @param other: The Message to copy.
-     */
-    Message(const Message &other);
-    ~Message() {}
+    // Copying deep-copies the data, moving steals it.
+    Message(const Message &other) = default;
+    Message(Message &&other) = default;
+    Message &operator=(const Message &other) = default;
+    Message &operator=(Message &&other) = default;
+    ~Message() = default;
 
     // Getters
     uint16_t get_pakage_id() const;
     MessageType get_type() const;
     uint8_t get_sender_id() const;
     uint8_t get_receiver_id() const;
-    data_t get_data() const;
+    const data_t &get_data() const;
+    // Mutable access, e.g. to move the segments out.
+    data_t &get_data();
+    size_t get_data_num() const;
 
     // Setters
     void set_pakage_id(uint16_t pakage_id);
@@ -75,6 +97,14 @@ public:
     void set_sender_id(uint8_t sender_id);
     void set_receiver_id(uint8_t receiver_id);
     void set_data(const data_t &data);
+    void set_data(data_t &&data);
+
+    /*
+     * Get or set the pakage id the next message takes, e.g. to carry it over to another process
+     * so that the ids of the messages still tracked are not taken again.
+     */
+    static uint16_t get_pakage_id_counter();
+    static void set_pakage_id_counter(uint16_t pakage_id);
 
     /*
      * Serializes the message into a buffer.
@@ -90,6 +120,20 @@ public:
      */
     ssize_t get_serialized_size() const;
 
+    /*
+     * Parses a message from a buffer into this message.
+     * The segments are stored in buffers taken from BufferPool.
+     * @param buffer: The buffer to parse the message from.
+     * @param size: The size of the buffer.
+     */
+    void parse(const void *buffer, ssize_t size);
+
+    /*
+     * Resets the message to the empty state for reuse by ObjectPool.
+     * The segment buffers are given back to BufferPool.
+     */
+    void recycle();
+
     /*
      * Turns the message into a string.
      * @return: The string representation of the message.
@@ -105,9 +149,38 @@ public:
      */
     static ssize_t check_valid_message(const void *buffer, ssize_t size);
 
-    Message& operator=(const Message& other);
+    /*
+     * Pack package ids into the segments of an ACKS packet. Every run of consecutive ids
+     * takes 4 bytes, its first and last id in network order, several runs per segment.
+     * @param pakage_ids: The ids to pack, sorted.
+     * @param first: The index of the first id to pack.
+     * @param data: The segments are appended to it, at most max_segment_num of them.
+     * @param max_segment_num: The number of segments to fill at most.
+     * @return: The index after the last id packed, the rest are left for another packet.
+     */
+    static size_t pack_ack_ranges(
+        const std::vector<uint16_t> &pakage_ids,
+        size_t first,
+        data_t &data,
+        size_t max_segment_num
+    );
+
+    /*
+     * Unpack a segment of an ACKS packet.
+     * @param segment: The segment.
+     * @param pakage_ids: The ids are appended to it.
+     * @return: Whether the segment is well-formed.
+     */
+    static bool unpack_ack_ranges(const std::string &segment, std::vector<uint16_t> &pakage_ids);
 };
 
+// Move-only handle of a pooled message.
+using MessagePtr = Pooled<Message>;
+
+inline MessagePtr make_message() {
+    return make_pooled<Message>();
+}
+
 inline bool check_afk(
     const Message &message,
     const send_res_t &result,
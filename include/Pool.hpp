@@ -0,0 +1,138 @@
+#ifndef __POOL_HPP__
+#define __POOL_HPP__
+
+#include "def.hpp"
+#include <vector>
+#include <string>
+#include <memory>
+
+/*
+ * Per-thread free list of objects.
+ * Released objects are recycled by calling T::recycle() and kept for reuse,
+ * so that T keeps the capacity of its members between uses.
+ * Objects may be released on another thread than they are acquired on,
+ * they simply migrate to the pool of the releasing thread.
+ * @tparam T: The type of the objects, must have a recycle() method.
+ */
+template <typename T>
+class ObjectPool {
+private:
+    std::vector<T *> free_list_;
+
+    ObjectPool() {
+        free_list_.reserve(POOL_CAPACITY);
+    }
+
+public:
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    ~ObjectPool() {
+        for (T *object : free_list_) {
+            delete object;
+        }
+    }
+
+    /*
+     * Get the pool of the calling thread.
+     */
+    static ObjectPool &local() {
+        thread_local ObjectPool pool;
+        return pool;
+    }
+
+    /*
+     * Take an object from the pool, or allocate one if the pool is empty.
+     * @return: The object in its recycled state.
+     */
+    T *acquire() {
+        if (free_list_.empty()) {
+            return new T();
+        }
+        T *object = free_list_.back();
+        free_list_.pop_back();
+        return object;
+    }
+
+    /*
+     * Give an object back to the pool.
+     * The object is deleted if the pool is full.
+     * @param object: The object to release.
+     */
+    void release(T *object) {
+        if (free_list_.size() >= POOL_CAPACITY) {
+            delete object;
+            return;
+        }
+        object->recycle();
+        free_list_.push_back(object);
+    }
+};
+
+template <typename T>
+struct PoolDeleter {
+    void operator()(T *object) const {
+        ObjectPool<T>::local().release(object);
+    }
+};
+
+// Move-only handle of a pooled object.
+template <typename T>
+using Pooled = std::unique_ptr<T, PoolDeleter<T> >;
+
+template <typename T>
+inline Pooled<T> make_pooled() {
+    return Pooled<T>(ObjectPool<T>::local().acquire());
+}
+
+/*
+ * Per-thread slab of payload buffers.
+ * Keeps released strings together with their heap storage,
+ * so that parsing a segment into an acquired buffer does not allocate
+ * once the buffers have grown to the usual payload size.
+ */
+class BufferPool {
+private:
+    std::vector<std::string> free_list_;
+
+    BufferPool() {
+        free_list_.reserve(POOL_CAPACITY);
+    }
+
+public:
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    static BufferPool &local() {
+        thread_local BufferPool pool;
+        return pool;
+    }
+
+    /*
+     * Take an empty buffer from the pool.
+     * @return: The buffer, possibly with some capacity reserved.
+     */
+    std::string acquire() {
+        if (free_list_.empty()) {
+            return std::string();
+        }
+        std::string buffer = std::move(free_list_.back());
+        free_list_.pop_back();
+        return buffer;
+    }
+
+    /*
+     * Give a buffer back to the pool.
+     * Buffers without heap storage are not worth keeping.
+     * @param buffer: The buffer to release.
+     */
+    void release(std::string &&buffer) {
+        if (free_list_.size() >= POOL_CAPACITY || buffer.capacity() <= std::string().capacity()) {
+            return;
+        }
+        buffer.clear();
+        free_list_.push_back(std::move(buffer));
+    }
+};
+
+#endif
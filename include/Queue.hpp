@@ -19,12 +19,23 @@ public:
         queue_.push(value);
     }
 
+    void push(T &&value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push(std::move(value));
+    }
+
+    template <typename... Args>
+    void emplace(Args &&...args) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.emplace(std::forward<Args>(args)...);
+    }
+
     T pop() {
         std::lock_guard<std::mutex> lock(mutex_);
         if (queue_.empty()) {
             return T();
         }
-        T value = queue_.front();
+        T value = std::move(queue_.front());
         queue_.pop();
         return value;
     }
@@ -3,32 +3,114 @@
 
 #include "def.hpp"
 #include "Message.hpp"
+#include "RecvRing.hpp"
+#include "ShmRing.hpp"
 #include <mutex>
+#include <memory>
 #include <sys/epoll.h>
-#include <queue>
+
+/*
+ * How a Receiver waits for and reads the bytes of its socket.
+ */
+enum class IoBackend {
+    EPOLL,      // epoll_wait, then recv until drained.
+    IO_URING    // A multishot recv on an io_uring, see RecvRing.
+};
+
+#define IO_BACKEND_NUM 2
+
+/*
+ * System calls made by the receivers of a backend, over all the receivers of the process.
+ */
+struct ReceiverStats {
+    uint64_t syscall_num;
+    uint64_t message_num;
+};
 
 class Receiver {
 private:
     std::mutex mutex_;
     int sockfd_;
+    IoBackend backend_;
     int epollfd_;
+    // Only for IO_URING.
+    std::unique_ptr<RecvRing> ring_;
+    // Read instead of the socket once attached, see attach_ring().
+    std::unique_ptr<ShmRing> shm_ring_;
     std::atomic_char lose_heart_beat_;
+    // When the peer was last heard of, in milliseconds of CLOCK_MONOTONIC_COARSE.
+    std::atomic_int64_t last_heard_;
     std::vector<epoll_event> events_;
     uint8_t self_id_;
     std::vector<uint8_t> buffer_;
-    // It seems that message_queue_ is not needed
+    // It seems that remaining_buffer_ is not needed
     // to be protected by another mutex.
     std::vector<uint8_t> remaining_buffer_;
-    std::queue<Message> message_queue_;
+    // The packets are parsed one at a time from here, when taken by receive(),
+    // so only one message is out of the pool for a burst of them.
+    // The bytes before it are dropped before reading more.
+    size_t remaining_head_;
+    // Whether the peer has closed or the socket failed.
+    bool peer_closed_;
+    // Set by interrupt(), receive() returns instead of waiting.
+    std::atomic_bool interrupted_;
+    // Written by interrupt() to wake the epoll_wait up, watched by epollfd_ once it exists.
+    int wake_fd_;
+    // Whether a poll left the reader of shm_ring_ asleep, so that the writer signals it.
+    bool ring_asleep_;
+
+    /*
+     * Wait for bytes and append them to remaining_buffer_.
+     * @param timeout: The milliseconds to wait at most.
+     * @return: Positive if anything is received or closed, 0 if timed out, -1 on errors.
+     */
+    int fill_buffer(int timeout);
+
+    /*
+     * Wait for bytes from the shared memory ring, spinning a while before sleeping.
+     * The socket is watched too, for the bytes sent before the ring and for the close.
+     * @param timeout: The milliseconds to wait at most.
+     * @param syscall_num: Increased by the number of system calls made.
+     * @return: Positive if anything is received or closed, 0 if timed out, -1 on errors.
+     */
+    int fill_from_ring(int timeout, uint64_t &syscall_num);
+
+    /*
+     * Read the socket until it is drained, it is edge-triggered.
+     * @param syscall_num: Increased by the number of system calls made.
+     */
+    void drain_socket(uint64_t &syscall_num);
+
+    /*
+     * Add wake_fd_ to epollfd_, once it is created.
+     */
+    void watch_wake_fd();
 
 public:
     /*
      * Constructor.
+     * Uses the backend chosen by set_backend(), EPOLL by default.
      * @param sockfd: The sockfd to receive messages on.
      * @param self_id: The id of the receiver.
      */
     explicit Receiver(int sockfd, uint8_t self_id);
-    ~Receiver() {}
+    ~Receiver();
+
+    /*
+     * Choose the backend of the receivers created from now on.
+     * @param backend: The backend.
+     * @return: Whether the backend is supported, EPOLL is kept otherwise.
+     */
+    static bool set_backend(IoBackend backend);
+
+    static IoBackend get_backend();
+
+    /*
+     * Get the system calls made per message by a backend.
+     * @param backend: The backend.
+     * @return: The statistics of the backend.
+     */
+    static ReceiverStats get_stats(IoBackend backend);
 
     /*
      * Change self_id_.
@@ -36,18 +118,78 @@ public:
      */
     void set_self_id(uint8_t self_id);
 
+    /*
+     * Read the messages from a shared memory ring from now on, the socket
+     * is still watched for its close. Only right after the handshake.
+     * @param ring: The ring from the peer.
+     */
+    void attach_ring(std::unique_ptr<ShmRing> ring);
+
     /*
      * Receive a message.
-     * @param message: The message to receive.
-     * @return: The number of bytes received.
+     * The former message held by the handle is given back to its pool.
+     * @param message: The handle to move the received message into.
+     * @param timeout: The milliseconds to wait at most, negative to wait until a message
+     *                 arrives or the connection is closed.
+     * @return: The number of bytes received, 0 if the connection is closed,
+     *          or -1 if nothing is received in time.
+     */
+    ssize_t receive(MessagePtr &message, int timeout = -1);
+
+    /*
+     * Get an fd which polls readable once receive() has something to take,
+     * to wait for it on an event loop and then receive() with a timeout of 0.
+     * The lost heart beats and interrupt() are only noticed by receive(), wait for TIMEOUT at most.
+     * @return: The fd.
+     */
+    int get_fd();
+
+    /*
+     * Whether a message parsed already is waiting, i.e. the next receive() returns without reading.
+     * The batches of the ACKs are sent once it is false, at the end of what is read at once.
+     * @return: Whether a message is waiting.
+     */
+    bool has_buffered();
+
+    /*
+     * Make receive() return 0 once the messages parsed already are taken, at once with epoll,
+     * within TIMEOUT with io_uring. Nothing is read after that, e.g. to pass the socket over.
+     * Callable from any thread.
      */
-    ssize_t receive(Message &message);
+    void interrupt();
+
+    /*
+     * Take the bytes read but not taken as messages yet, e.g. a packet cut in the middle.
+     * Only once interrupted and receive() has returned, and no byte is read after that.
+     * @return: The bytes, to give to put_back() of the next receiver of the socket.
+     */
+    std::vector<uint8_t> take_buffered();
+
+    /*
+     * Put the bytes taken by take_buffered() of the former receiver in front of the socket.
+     * Only before the first receive().
+     * @param bytes: The bytes.
+     */
+    void put_back(const std::vector<uint8_t> &bytes);
+
+    /*
+     * Get the fds of the attached shared memory ring, see ShmRing::get_fds().
+     * @return: The fds, empty if none is attached.
+     */
+    std::vector<int> get_ring_fds();
 
     // operations on lose_heart_beat_
     void inc_lost_heart_beat();
     void set_lost_heart_beat(uint8_t lost_heart_beat);
+    // Also marks the peer as heard of now, called for every message.
     void reset_lost_heart_beat();
     uint8_t get_lost_heart_beat();
+
+    /*
+     * Get the time since the peer was last heard of, see reset_lost_heart_beat().
+     * @return: The milliseconds, with the resolution of a tick of the kernel.
+     */
+    int64_t get_idle_time();
 };
 
 #endif
@@ -0,0 +1,107 @@
+#ifndef __RECV_RING_HPP__
+#define __RECV_RING_HPP__
+
+#include "def.hpp"
+#include <linux/io_uring.h>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/*
+ * An io_uring receiving from one socket, for the io_uring backend of Receiver.
+ * A single multishot recv keeps completing into a ring of URING_BUFFER_NUM
+ * provided buffers, so one io_uring_enter reaps everything received meanwhile
+ * and the recv is only armed again when the kernel ends it.
+ * Not thread safe, Receiver calls it with its mutex held.
+ */
+class RecvRing {
+private:
+    int ring_fd_;
+    int sockfd_;
+    // The mapped submission and completion rings, and the submission entries.
+    void *ring_ptr_;
+    size_t ring_size_;
+    io_uring_sqe *sqes_;
+    size_t sqes_size_;
+    unsigned *sq_tail_;
+    unsigned *sq_mask_;
+    unsigned *sq_array_;
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned *cq_mask_;
+    io_uring_cqe *cqes_;
+    // The provided buffers, and the ring handing them to the kernel.
+    io_uring_buf_ring *buf_ring_;
+    size_t buf_ring_size_;
+    std::vector<uint8_t> buffers_;
+    uint16_t buf_tail_;
+    // Whether the multishot recv is still running.
+    bool armed_;
+    // Set by cancel(), the recv is not armed again.
+    bool cancelled_;
+    unsigned to_submit_;
+
+    /*
+     * Queue the multishot recv, submitted with the next wait.
+     */
+    void arm();
+
+    /*
+     * Give a buffer back to the kernel.
+     * @param bid: The id of the buffer.
+     */
+    void recycle(uint16_t bid);
+
+    /*
+     * Take the completions without a system call.
+     * @param buffer: Where to append the received bytes.
+     * @param closed: Set if the peer has closed or the socket failed.
+     * @return: Whether anything is received or closed.
+     */
+    bool reap(std::vector<uint8_t> &buffer, bool &closed);
+
+public:
+    /*
+     * Constructor.
+     * @param sockfd: The socket to receive from.
+     */
+    explicit RecvRing(int sockfd);
+    ~RecvRing();
+
+    RecvRing(const RecvRing &) = delete;
+    RecvRing &operator=(const RecvRing &) = delete;
+
+    /*
+     * Check if the kernel supports the features needed.
+     * @return: Whether a RecvRing can be created.
+     */
+    static bool supported();
+
+    /*
+     * Wait for bytes, and append all the bytes received to buffer.
+     * @param buffer: Where to append the received bytes.
+     * @param closed: Set if the peer has closed or the socket failed.
+     * @param timeout: The milliseconds to wait at most.
+     * @param syscall_num: Increased by the number of system calls made.
+     * @return: 1 if anything is received or closed, 0 if timed out, -1 on errors.
+     */
+    int receive(std::vector<uint8_t> &buffer, bool &closed, int timeout, uint64_t &syscall_num);
+
+    /*
+     * Get the fd of the io_uring, which polls readable once a completion is posted.
+     * @return: The fd.
+     */
+    int get_fd() const {
+        return ring_fd_;
+    }
+
+    /*
+     * Cancel the recv and wait for it to end, so no byte is taken from the socket any more,
+     * e.g. before the socket is passed to another process.
+     * @param buffer: Where to append the bytes received until then.
+     * @param closed: Set if the peer has closed or the socket failed.
+     */
+    void cancel(std::vector<uint8_t> &buffer, bool &closed);
+};
+
+#endif
@@ -3,14 +3,139 @@
 
 #include "def.hpp"
 #include "Message.hpp"
+#include "Frame.hpp"
+#include "ShmRing.hpp"
 #include <mutex>
+#include <condition_variable>
+#include <array>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <string_view>
 
+/*
+ * Priority classes of the outbound frames.
+ * Queued CONTROL frames are written before the queued BULK ones,
+ * a frame is never interleaved with another.
+ */
+enum class Lane : uint8_t {
+    CONTROL,    // Heartbeats, ACKs and the other requests.
+    BULK        // Messages: REQSEND, FWD, REQMULTI, PUBLISH, and DISCONNECT behind them.
+};
+
+constexpr size_t LANE_NUM = static_cast<size_t>(Lane::BULK) + 1;
+
+/*
+ * Queueing delay of a lane, from queueing a frame to writing its last byte.
+ */
+struct LaneStats {
+    uint64_t frame_num;
+    uint64_t total_delay;   // In microseconds.
+    uint64_t max_delay;     // In microseconds.
+};
+
+/*
+ * Sends the packets of one connection, in the order of their lanes.
+ * A frame is written at once on the thread sending if nothing is queued,
+ * until the socket or the ring is full. The rest is queued and written by the
+ * WritePoller of the process once it is writable again, so the sizes returned
+ * are the bytes taken to be sent, not the bytes on the wire; see flush().
+ */
 class Sender {
 private:
+    struct QueuedFrame {
+        FrameRef frame;
+        std::chrono::steady_clock::time_point queued_time;
+    };
+
+    // Frames from head on are waiting to be written.
+    struct LaneQueue {
+        std::vector<QueuedFrame> frames;
+        size_t head;
+    };
+
     int sockfd_;
     uint8_t self_id_;
+    // Outbound queues of frames, one per lane, protected by mutex_.
     std::mutex mutex_;
-    std::vector<uint8_t> buffer_;
+    std::condition_variable queue_cond_;
+    std::array<LaneQueue, LANE_NUM> lanes_;
+    // The frame cut by the last write, written up to partial_offset_.
+    // It is finished before any other frame.
+    QueuedFrame partial_;
+    Lane partial_lane_;
+    size_t partial_offset_;
+    // The number of frames of every lane in the batch being written.
+    std::array<size_t, LANE_NUM> batch_num_;
+    // The batch being written, kept to reuse its storage.
+    std::vector<iovec> iov_;
+    // Whether a thread is writing to the socket.
+    bool writing_;
+    // Whether the socket or the ring is full, and the WritePoller resumes the writing.
+    bool blocked_;
+    // Whether the socket failed, frames are dropped from then on.
+    bool broken_;
+    // Bytes written from the queue, telling the destructor the flush goes on.
+    uint64_t written_bytes_;
+    // Written instead of the socket once attached, see attach_ring().
+    std::unique_ptr<ShmRing> ring_;
+
+    friend class WritePoller;
+
+    /*
+     * Write the queued frames in batches, until the queue is empty or the socket is full.
+     * Must be called with mutex_ held by lock, and no thread writing.
+     * @param lock: The lock of mutex_, released while writing.
+     */
+    void write_queued(std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Let the WritePoller resume the writing once the socket or the ring is writable.
+     * Must be called with mutex_ held.
+     * @return: False if the ring got space meanwhile, then the caller writes again.
+     */
+    bool block();
+
+    /*
+     * Called by the WritePoller once the socket or the ring is writable.
+     */
+    void resume_writing();
+
+    /*
+     * Write bytes to the ring if attached, otherwise to the socket.
+     * @param iov: The bytes to write.
+     * @param num: The number of the iovecs.
+     * @return: The number of bytes written, or -1 with errno set.
+     */
+    ssize_t write_bytes(const iovec *iov, size_t num);
+
+    /*
+     * Write a frame at once, passing fds along through a unix socket.
+     * Only before anything else is sent.
+     * @param frame: The frame to send.
+     * @param fds: The fds to pass.
+     * @return: The number of bytes sent, or -1 if it can not be sent whole.
+     */
+    ssize_t send_frame_with_fds(FrameRef frame, const std::vector<int> &fds);
+
+    /*
+     * Pop the frames which are completely written.
+     * Must be called with mutex_ held.
+     * @param size: The number of bytes written of the batch.
+     */
+    void pop_written(size_t size);
+
+    /*
+     * Whether nothing is waiting to be written.
+     * Must be called with mutex_ held.
+     */
+    bool queue_empty() const;
+
+    /*
+     * Drop all the frames waiting to be written.
+     * Must be called with mutex_ held.
+     */
+    void clear_queue();
 
 public:
     /*
@@ -19,7 +144,12 @@ public:
      * @param self_id: The id of the sender.
      */
     explicit Sender(int sockfd, uint8_t self_id);
-    ~Sender() {}
+    /*
+     * Destructor.
+     * Flushes the outbound queue (giving up after TIMEOUT without progress),
+     * the socket is left open.
+     */
+    ~Sender();
 
     /*
      * Change self_id_.
@@ -27,71 +157,246 @@ public:
      */
     void set_self_id(uint8_t self_id);
 
+    /*
+     * Write the frames to a shared memory ring instead of the socket from now on.
+     * Only when nothing is queued, i.e. right after the handshake.
+     * @param ring: The ring to the peer.
+     */
+    void attach_ring(std::unique_ptr<ShmRing> ring);
+
+    /*
+     * Get the queueing delay of a lane, over all the senders of the process.
+     * @param lane: The lane.
+     * @return: The statistics of the lane.
+     */
+    static LaneStats get_lane_stats(Lane lane);
+
+    /*
+     * Wait until all the queued frames are written.
+     * @param timeout: The milliseconds to wait at most.
+     * @return: Whether everything is written, false if the socket is broken or it timed out.
+     */
+    bool flush(int timeout);
+
+    /*
+     * Get the fds of the attached shared memory ring, see ShmRing::get_fds().
+     * @return: The fds, empty if none is attached.
+     */
+    std::vector<int> get_ring_fds();
+
+    /*
+     * Serialize a message into a frame and queue it.
+     * @param message: The message to send.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_message(const Message &message);
+
     // FOR CLIENTS ONLY
     /*
      * Send a CONNECT REQUEST packet.
      * @param name: The name of the client.
-     * @return: The message id and the number of bytes sent.
+     * @param fds: The fds of the shared memory rings to pass along, if any.
+     * @param datagram_port: The port of the datagram channel of the client, 0 for none.
+     * @return: The message id and the number of bytes taken to be sent.
      */
-    send_res_t send_connect_request(std::string name);
+    send_res_t send_connect_request(
+        std::string_view name,
+        const std::vector<int> &fds = {},
+        uint16_t datagram_port = 0
+    );
+
+    /*
+     * Send a RESUME REQUEST packet, the sender id is the id to restore.
+     * @param token: The session token got when connecting.
+     * @param fds: The fds of the shared memory rings to pass along, if any.
+     * @param datagram_port: The port of the datagram channel of the client, 0 for none.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_resume_request(
+        std::string_view token,
+        const std::vector<int> &fds = {},
+        uint16_t datagram_port = 0
+    );
 
     /*
      * Send a DISCONNECT REQUEST packet.
      * @param receiver_id: The id of the receiver.
-     * @return: The message id and the number of bytes sent.
+     * @return: The message id and the number of bytes taken to be sent.
      */
     send_res_t send_disconnect_request(uint8_t receiver_id = SERVER_ID);
 
     /*
      * Send a REQUEST TIME packet.
-     * @return: The message id and the number of bytes sent.
+     * @return: The message id and the number of bytes taken to be sent.
      */
     send_res_t send_request_time();
 
     /*
      * Send a REQUEST HOST packet.
-     * @return: The message id and the number of bytes sent.
+     * @return: The message id and the number of bytes taken to be sent.
      */
     send_res_t send_request_host();
 
     /*
      * Send a REQUEST CLIENT LIST packet.
-     * @return: The message id and the number of bytes sent.
+     * @param cursor: Request the page after this id, 0 for the first page.
+     * @return: The message id and the number of bytes taken to be sent.
      */
-    send_res_t send_request_client_list();
+    send_res_t send_request_client_list(uint8_t cursor = 0);
+
+    /*
+     * Send a REQUEST CLIENT LIST SINCE packet.
+     * @param version: The version of the list the client has.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_request_client_list_since(uint64_t version);
+
+    /*
+     * Send a PRESENCE packet, turning the JOIN/LEAVE notifications on or off.
+     * @param enable: Whether to be notified.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_presence(bool enable);
+
+    /*
+     * Send a REQACKS packet, turning the batched ACKs of the REQUEST SENDs on or off.
+     * @param enable: Whether to batch them.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_request_acks(bool enable);
 
     /*
      * Send a REQUEST SEND packet.
      * @param receiver_id: The id of the receiver.
      * @param msg_string: The message to send.
-     * @return: The message id and the number of bytes sent.
+     * @return: The message id and the number of bytes taken to be sent.
      */
     send_res_t send_request_send(
         uint8_t receiver_id,
-        std::string msg_string
+        std::string_view msg_string
+    );
+
+    /*
+     * Send a REQUEST SEND BY NAME packet.
+     * @param receiver_name: The name of the receiver.
+     * @param msg_string: The message to send.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_request_send_by_name(
+        std::string_view receiver_name,
+        std::string_view msg_string
     );
 
+    /*
+     * Send a REQUEST MULTICAST packet.
+     * @param receiver_ids: The ids of the receivers, empty for all the clients.
+     * @param msg_string: The message to send.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_request_multicast(
+        const std::vector<uint8_t> &receiver_ids,
+        std::string_view msg_string
+    );
+
+    /*
+     * Send a SUBSCRIBE packet.
+     * @param topic: The topic to subscribe.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_subscribe(std::string_view topic);
+
+    /*
+     * Send an UNSUBSCRIBE packet.
+     * @param topic: The topic to unsubscribe.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_unsubscribe(std::string_view topic);
+
+    /*
+     * Send a PUBLISH packet.
+     * @param topic: The topic to publish on.
+     * @param msg_string: The message to publish.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_publish(std::string_view topic, std::string_view msg_string);
+
     // FOR SERVER AND CLIENTS
+    /*
+     * Send a DATAGRAM packet, which is not acknowledged,
+     * through TCP when there is no datagram channel.
+     * @param receiver_id: The id of the receiver.
+     * @param msg_string: The message to send.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_datagram(uint8_t receiver_id, std::string_view msg_string);
+
     /*
      * Send an ACKNOWLEDGE packet.
      * @param pakage_id: The id of the packet to acknowledge.
      * @param receiver_id: The id of the receiver.
-     * @param data: The data to send with the acknowledgement.
-     * @return: The message id and the number of bytes sent.
+     * @param data: The data to send with the acknowledgement, moved into the packet.
+     * @return: The message id and the number of bytes taken to be sent.
      */
     send_res_t send_acknowledge(
         uint16_t pakage_id,
         uint8_t receiver_id,
-        const data_t &data = {}
+        data_t data = {}
     );
 
+    /*
+     * Send an ACKS packet, acknowledging several packets at once,
+     * split into several packets if the ids are too scattered for one.
+     * @param receiver_id: The id of the receiver.
+     * @param pakage_ids: The ids acknowledged one by one, sorted in place.
+     * @param cumulative: The id of the last FWD acknowledged with all the FWDs before it, -1 for none.
+     * @return: The message id and the number of bytes taken to be sent of the last packet.
+     */
+    send_res_t send_acks(uint8_t receiver_id, std::vector<uint16_t> &pakage_ids, int cumulative = -1);
+
     /*
      * Send a FORWARD packet.
      * Packet id is set to the next packet id according to the counter.
+     * The message is given back to its pool once sent.
      * @param message: The message to forward.
-     * @return: The message id and the number of bytes sent.
+     * @param frame: If not null, set to the serialized FWD.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_forward(MessagePtr message, FrameRef *frame = nullptr);
+
+    /*
+     * Queue a serialized packet, which may be shared with other senders.
+     * Tries to write it at once if nothing is queued.
+     * @param frame: The frame to send.
+     * @param lane: The lane to queue it in.
+     * @return: The number of bytes taken to be sent, or -1 if the socket is broken.
+     */
+    ssize_t send_frame(FrameRef frame, Lane lane = Lane::BULK);
+
+    /*
+     * Send a WAIT packet, telling a REQUEST SEND is not forwarded
+     * because too much is buffered for its receiver.
+     * @param pakage_id: The id of the REQUEST SEND.
+     * @param receiver_id: The id of the receiver of the WAIT.
+     * @param destination_id: The id of the receiver which is busy.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_wait(uint16_t pakage_id, uint8_t receiver_id, uint8_t destination_id);
+
+    /*
+     * Send a CREDIT packet, telling a busy receiver can take messages again.
+     * @param receiver_id: The id of the receiver of the CREDIT.
+     * @param destination_id: The id of the receiver which was busy.
+     * @param credit: The number of bytes the receiver can take.
+     * @return: The message id and the number of bytes taken to be sent.
+     */
+    send_res_t send_credit(uint8_t receiver_id, uint8_t destination_id, size_t credit);
+
+    /*
+     * Send a PEER packet to another server of the cluster.
+     * @param data: The operation, then its entries.
+     * @return: The message id and the number of bytes taken to be sent.
      */
-    send_res_t send_forward(Message message);
+    send_res_t send_peer(data_t data);
 
     /*
      * Send a HEART BEAT packet.
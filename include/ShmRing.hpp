@@ -0,0 +1,133 @@
+#ifndef __SHM_RING_HPP__
+#define __SHM_RING_HPP__
+
+#include "def.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * A single producer single consumer ring of bytes in a memfd, carrying the frames
+ * of one direction between two processes on the same host instead of a socket.
+ * The writer only signals the data eventfd while the reader sleeps, and the reader
+ * only signals the space eventfd while the writer waits for a full ring,
+ * so a busy pair makes no system call at all.
+ * One thread writes and one thread reads at a time.
+ */
+class ShmRing {
+private:
+    /*
+     * At the start of the memfd, every position on its own cache line.
+     */
+    struct Control {
+        alignas(64) std::atomic_uint64_t head;          // Read up to, moved by the reader.
+        alignas(64) std::atomic_uint64_t tail;          // Written up to, moved by the writer.
+        alignas(64) std::atomic_uint32_t reader_idle;   // Set while the reader sleeps.
+        alignas(64) std::atomic_uint32_t writer_idle;   // Set while the writer waits for space.
+    };
+
+    int memfd_;
+    int data_fd_;
+    int space_fd_;
+    void *memory_;
+    size_t memory_size_;
+    Control *control_;
+    uint8_t *data_;
+
+    /*
+     * Map the memfd.
+     * @param create: Whether to size and initialize a new ring.
+     */
+    void map(bool create);
+
+    /*
+     * Unmap the memfd and close the fds.
+     */
+    void release();
+
+    /*
+     * Drop the counter of an eventfd.
+     */
+    static void drain(int fd);
+
+public:
+    /*
+     * Create a ring in a new memfd, with its eventfds.
+     */
+    ShmRing();
+
+    /*
+     * Map a ring created by the peer, taking the fds.
+     * @param fds: The memfd, the data eventfd and the space eventfd, as get_fds() gives,
+     *             closed even if it throws.
+     */
+    explicit ShmRing(const int *fds);
+    ~ShmRing();
+
+    ShmRing(const ShmRing &) = delete;
+    ShmRing &operator=(const ShmRing &) = delete;
+
+    /*
+     * Get the fds to pass to the peer, SHM_RING_FD_NUM of them.
+     * @return: The memfd, the data eventfd and the space eventfd.
+     */
+    std::vector<int> get_fds() const;
+
+    /*
+     * Get the eventfd signaled when bytes are written to an idle reader.
+     */
+    int get_data_fd() const;
+
+    /*
+     * Copy as many bytes as fit, like a non-blocking send.
+     * @param iov: The bytes to write.
+     * @param num: The number of the iovecs.
+     * @return: The number of bytes written, or -1 with errno EAGAIN if the ring is full.
+     */
+    ssize_t write(const iovec *iov, size_t num);
+
+    /*
+     * Get the eventfd signaled when an idle writer gets space.
+     */
+    int get_space_fd() const;
+
+    /*
+     * Mark the writer idle, before waiting on the space eventfd for a full ring.
+     * @return: False if space was made meanwhile, then the writer must not wait.
+     */
+    bool sleep_writer();
+
+    /*
+     * Clear the idle mark of the writer, and the space eventfd, after waiting.
+     */
+    void wake_writer();
+
+    /*
+     * Append all the bytes written to buffer.
+     * @param buffer: Where to append the bytes.
+     * @return: Whether anything is read.
+     */
+    bool read(std::vector<uint8_t> &buffer);
+
+    /*
+     * Whether there are bytes to read, without a system call.
+     */
+    bool readable() const;
+
+    /*
+     * Mark the reader idle, before sleeping on the data eventfd.
+     * @return: False if bytes arrived meanwhile, then the reader must not sleep.
+     */
+    bool sleep_reader();
+
+    /*
+     * Clear the idle mark after sleeping.
+     * @param signaled: Whether the data eventfd fired, then it is cleared too.
+     */
+    void wake_reader(bool signaled);
+};
+
+#endif
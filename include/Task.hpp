@@ -0,0 +1,145 @@
+#ifndef __TASK_HPP__
+#define __TASK_HPP__
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <type_traits>
+
+template <typename T>
+class Task;
+
+namespace task_detail {
+    /*
+     * Resume the coroutine awaiting the task when it finishes,
+     * without growing the stack.
+     */
+    struct FinalAwaiter {
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    struct PromiseBase {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr exception;
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        FinalAwaiter final_suspend() noexcept {
+            return {};
+        }
+
+        void unhandled_exception() {
+            exception = std::current_exception();
+        }
+    };
+
+    template <typename T>
+    struct Promise : PromiseBase {
+        std::optional<T> value;
+
+        Task<T> get_return_object();
+
+        template <typename U>
+        void return_value(U &&result) {
+            value.emplace(std::forward<U>(result));
+        }
+
+        T take() {
+            if (exception) {
+                std::rethrow_exception(exception);
+            }
+            return std::move(*value);
+        }
+    };
+
+    template <>
+    struct Promise<void> : PromiseBase {
+        Task<void> get_return_object();
+
+        void return_void() {}
+
+        void take() {
+            if (exception) {
+                std::rethrow_exception(exception);
+            }
+        }
+    };
+}
+
+/*
+ * A coroutine which starts when it is awaited, and resumes its awaiter
+ * with the result, or the exception, once it finishes.
+ * Owns the coroutine frame, destroying the task destroys the frame.
+ * @tparam T: The type of the result.
+ */
+template <typename T = void>
+class Task {
+public:
+    using promise_type = task_detail::Promise<T>;
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+
+public:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return !handle_ || handle_.done();
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+
+    T await_resume() {
+        return handle_.promise().take();
+    }
+};
+
+namespace task_detail {
+    template <typename T>
+    Task<T> Promise<T>::get_return_object() {
+        return Task<T>(std::coroutine_handle<Promise<T> >::from_promise(*this));
+    }
+
+    inline Task<void> Promise<void>::get_return_object() {
+        return Task<void>(std::coroutine_handle<Promise<void> >::from_promise(*this));
+    }
+}
+
+#endif
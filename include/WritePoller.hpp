@@ -0,0 +1,71 @@
+#ifndef __WRITE_POLLER_HPP__
+#define __WRITE_POLLER_HPP__
+
+#include "def.hpp"
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+class Sender;
+
+/*
+ * One thread of the process waiting for the full sockets and rings of all the senders,
+ * instead of a writer thread per Sender. A Sender writes on the thread sending until
+ * its socket or its ring is full, then waits here, and the rest of its queue is
+ * written on this thread once it is writable again.
+ */
+class WritePoller {
+private:
+    struct Registration {
+        Sender *sender;
+        int fd;
+        // Whether the fd is armed, an event may still be delivered after it is removed.
+        bool armed;
+    };
+
+    int epollfd_;
+    // Written to stop the thread.
+    int wake_fd_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable resumed_cond_;
+    // The fds added to epollfd_, kept until their senders are removed.
+    std::vector<Registration> registrations_;
+    // The sender being resumed on the thread, only removed once it is done.
+    Sender *resuming_;
+
+    WritePoller();
+
+    /*
+     * Wait for the fds, and resume the senders of the ready ones.
+     * Runs on thread_ until wake_fd_ is written.
+     */
+    void run();
+
+public:
+    ~WritePoller();
+
+    /*
+     * Get the poller of the process, started on first use.
+     */
+    static WritePoller &get();
+
+    /*
+     * Resume a sender once, on the thread of the poller, when an fd is ready.
+     * @param sender: The sender to resume.
+     * @param fd: The socket or the space eventfd of the ring of the sender.
+     * @param events: EPOLLOUT for a socket, EPOLLIN for an eventfd.
+     */
+    void wait(Sender *sender, int fd, uint32_t events);
+
+    /*
+     * Forget a sender, waiting for it to be resumed if it is.
+     * Must not be called with the mutex of the sender held.
+     * @param sender: The sender to forget.
+     */
+    void remove(Sender *sender);
+};
+
+#endif
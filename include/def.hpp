@@ -6,11 +6,48 @@
 #define MAX_EPOLL_EVENTS 1
 #define TIMEOUT 200
 #define HEART_BEAT_INTERVAL 10
+#define HEART_BEAT_JITTER 1000
 #define MAX_LOST_HEART_BEAT 3
+#define POOL_CAPACITY 256
+#define FRAME_POOL_CAPACITY 4096
+#define MAX_WRITE_BATCH 64
+#define MAX_SUBSCRIPTION_NUM 1024
+#define MAILBOX_SEGMENT_SIZE (8 << 20)
+#define MAILBOX_BATCH 64
+#define SESSION_TOKEN_SIZE 16
+#define SESSION_GRACE_PERIOD 30
+#define RESUME_RETRY_NUM 5
+#define FLOW_WINDOW (64 << 10)
+#define MAX_BUFFERED_BYTES (1 << 20)
+#define RATE_LIMIT_MESSAGES 1000
+#define RATE_LIMIT_BYTES (8 << 20)
+#define RATE_LIMIT_BURST 2
+#define MAX_CONNECTION_NUM 128
+#define CLIENT_LIST_PAGE_SIZE 64
+#define CLIENT_LIST_HISTORY 256
+#define PRESENCE_TICK 100
+#define REQUEST_TIMEOUT 30000
+#define MAX_LOOP_EVENTS 64
+#define RECEIVE_BATCH 32
+#define URING_BUFFER_NUM 16
+#define SHM_RING_SIZE (1 << 20)
+#define SHM_RING_FD_NUM 3
+#define SHM_SPIN_TIME 50
+#define MAX_DATAGRAM_SIZE 512
+#define DATAGRAM_BATCH 32
+#define MAX_NODE_NUM 16
+#define PEER_RETRY_INTERVAL 1000
+#define HASH_RING_REPLICAS 128
+#define SPLICE_SIZE (64 << 10)
+#define MAX_REDIRECT_NUM 3
+#define HANDOVER_TIMEOUT 30000
 
 #define SERVER_ID 0
+#define MULTICAST_ID 0
 #define SERVER_ADDR INADDR_ANY
 #define SERVER_PORT 2024
+#define SERVER_UNIX_PATH "/tmp/chatroom.sock"
+#define ROUTER_PORT 2023
 
 #define DIVISION_SIGNAL '\0'
 
@@ -0,0 +1,218 @@
+#include "DatagramChannel.hpp"
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <array>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+namespace {
+    // A slot of the receive buffers, the sequence number and the largest packet.
+    const size_t SLOT_SIZE = sizeof(uint32_t) + MAX_DATAGRAM_SIZE;
+
+    std::runtime_error channel_error(const std::string &what) {
+        return std::runtime_error(
+            "DatagramChannel failed: " + what + ". errno: " + std::to_string(errno) + " " + strerror(errno)
+        );
+    }
+}
+
+DatagramChannel::DatagramChannel(const sockaddr_in &addr, std::function<void()> on_queued)
+    : sockfd_(-1), port_(0), on_queued_(std::move(on_queued)), receive_buffers_(DATAGRAM_BATCH * SLOT_SIZE),
+      sent_num_(0), batch_num_(0), received_num_(0), lost_num_(0), late_num_(0) {
+    sockfd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd_ < 0) {
+        throw channel_error("failed to create a socket");
+    }
+    sockaddr_in bound = addr;
+    socklen_t bound_len = sizeof(bound);
+    if (bind(sockfd_, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        getsockname(sockfd_, cast_sockaddr_in(bound), &bound_len) < 0) {
+        int error = errno;
+        close(sockfd_);
+        errno = error;
+        throw channel_error("failed to bind the socket");
+    }
+    port_ = ntohs(bound.sin_port);
+}
+
+DatagramChannel::DatagramChannel(int sockfd, std::function<void()> on_queued)
+    : sockfd_(sockfd), port_(0), on_queued_(std::move(on_queued)), receive_buffers_(DATAGRAM_BATCH * SLOT_SIZE),
+      sent_num_(0), batch_num_(0), received_num_(0), lost_num_(0), late_num_(0) {
+    sockaddr_in bound;
+    socklen_t bound_len = sizeof(bound);
+    int flags = fcntl(sockfd_, F_GETFL, 0);
+    if (flags < 0 || fcntl(sockfd_, F_SETFL, flags | O_NONBLOCK) < 0 ||
+        getsockname(sockfd_, cast_sockaddr_in(bound), &bound_len) < 0 || bound.sin_family != AF_INET) {
+        int error = errno;
+        close(sockfd_);
+        errno = error;
+        throw channel_error("failed to take the socket");
+    }
+    port_ = ntohs(bound.sin_port);
+}
+
+DatagramChannel::~DatagramChannel() {
+    close(sockfd_);
+}
+
+uint64_t DatagramChannel::key(const sockaddr_in &addr) {
+    return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+int DatagramChannel::get_fd() const {
+    return sockfd_;
+}
+
+uint16_t DatagramChannel::get_port() const {
+    return port_;
+}
+
+void DatagramChannel::add_peer(const sockaddr_in &addr, uint8_t id, uint32_t send_seq) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    peers_[key(addr)] = Peer {id, send_seq, 0, false};
+}
+
+uint32_t DatagramChannel::get_send_seq(const sockaddr_in &addr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = peers_.find(key(addr));
+    return it == peers_.end() ? 0 : it->second.send_seq;
+}
+
+void DatagramChannel::remove_peer(const sockaddr_in &addr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    peers_.erase(key(addr));
+}
+
+bool DatagramChannel::send(const sockaddr_in &addr, const Message &message) {
+    if (message.get_serialized_size() > MAX_DATAGRAM_SIZE) {
+        return false;
+    }
+    FrameRef frame = FrameRef::make();
+    message.serialize(frame->get_buffer());
+    bool first;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = peers_.find(key(addr));
+        if (it == peers_.end()) {
+            return false;
+        }
+        first = queue_.empty();
+        queue_.push_back(Outbound {addr, htonl(it->second.send_seq++), std::move(frame)});
+        if (!on_queued_) {
+            flush_queue();
+            return true;
+        }
+    }
+    // Called once per batch, the later ones join the queue.
+    if (first) {
+        on_queued_();
+    }
+    return true;
+}
+
+void DatagramChannel::flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flush_queue();
+}
+
+void DatagramChannel::flush_queue() {
+    std::array<mmsghdr, DATAGRAM_BATCH> headers;
+    std::array<iovec, DATAGRAM_BATCH * 2> iovs;
+    size_t offset = 0;
+    while (offset < queue_.size()) {
+        size_t num = std::min<size_t>(queue_.size() - offset, DATAGRAM_BATCH);
+        for (size_t i = 0; i < num; i++) {
+            Outbound &outbound = queue_[offset + i];
+            std::vector<uint8_t> &buffer = outbound.frame->get_buffer();
+            iovs[i * 2] = iovec {&outbound.seq, sizeof(outbound.seq)};
+            iovs[i * 2 + 1] = iovec {buffer.data(), buffer.size()};
+            memset(&headers[i], 0, sizeof(headers[i]));
+            headers[i].msg_hdr.msg_name = &outbound.addr;
+            headers[i].msg_hdr.msg_namelen = sizeof(outbound.addr);
+            headers[i].msg_hdr.msg_iov = &iovs[i * 2];
+            headers[i].msg_hdr.msg_iovlen = 2;
+        }
+        int sent = sendmmsg(sockfd_, headers.data(), num, 0);
+        if (sent <= 0) {
+            // The socket buffer is full, the rest is lost like on the way.
+            break;
+        }
+        sent_num_ += sent;
+        batch_num_++;
+        offset += sent;
+    }
+    queue_.clear();
+}
+
+size_t DatagramChannel::receive(std::vector<std::pair<uint8_t, MessagePtr> > &messages) {
+    std::array<mmsghdr, DATAGRAM_BATCH> headers;
+    std::array<iovec, DATAGRAM_BATCH> iovs;
+    std::array<sockaddr_in, DATAGRAM_BATCH> addrs;
+    for (size_t i = 0; i < DATAGRAM_BATCH; i++) {
+        iovs[i] = iovec {receive_buffers_.data() + i * SLOT_SIZE, SLOT_SIZE};
+        memset(&headers[i], 0, sizeof(headers[i]));
+        headers[i].msg_hdr.msg_name = &addrs[i];
+        headers[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        headers[i].msg_hdr.msg_iov = &iovs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+    }
+    int received = recvmmsg(sockfd_, headers.data(), DATAGRAM_BATCH, MSG_DONTWAIT, nullptr);
+    if (received <= 0) {
+        return 0;
+    }
+
+    size_t taken = 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < received; i++) {
+        const uint8_t *data = receive_buffers_.data() + i * SLOT_SIZE;
+        ssize_t size = headers[i].msg_len;
+        if ((headers[i].msg_hdr.msg_flags & MSG_TRUNC) || size <= (ssize_t)sizeof(uint32_t) ||
+            addrs[i].sin_family != AF_INET) {
+            continue;
+        }
+        auto it = peers_.find(key(addrs[i]));
+        if (it == peers_.end()) {
+            continue;
+        }
+        size -= sizeof(uint32_t);
+        if (Message::check_valid_message(data + sizeof(uint32_t), size) != size) {
+            continue;
+        }
+        uint32_t seq;
+        memcpy(&seq, data, sizeof(seq));
+        seq = ntohl(seq);
+        Peer &peer = it->second;
+        if (peer.synced) {
+            int32_t gap = (int32_t)(seq - peer.expected_seq);
+            if (gap < 0) {
+                late_num_++;
+                continue;
+            }
+            lost_num_ += gap;
+        }
+        peer.expected_seq = seq + 1;
+        peer.synced = true;
+
+        MessagePtr message = make_message();
+        message->parse(data + sizeof(uint32_t), size);
+        messages.emplace_back(peer.id, std::move(message));
+        taken++;
+    }
+    received_num_ += taken;
+    return taken;
+}
+
+DatagramStats DatagramChannel::get_stats() const {
+    return DatagramStats {
+        sent_num_.load(),
+        batch_num_.load(),
+        received_num_.load(),
+        lost_num_.load(),
+        late_num_.load()
+    };
+}
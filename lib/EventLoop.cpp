@@ -0,0 +1,235 @@
+#include "EventLoop.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <array>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+namespace {
+    std::runtime_error loop_error(const std::string &what) {
+        return std::runtime_error(
+            "EventLoop failed: " + what + ". errno: " + std::to_string(errno) + " " + strerror(errno)
+        );
+    }
+}
+
+EventLoop::EventLoop()
+    : stopping_(false), timers_(&pool_), next_timer_id_(0), io_waiters_(&pool_), next_root_id_(0) {
+    epollfd_ = epoll_create1(0);
+    if (epollfd_ < 0) {
+        throw loop_error("failed to create the epoll");
+    }
+    eventfd_ = eventfd(0, EFD_NONBLOCK);
+    if (eventfd_ < 0) {
+        close(epollfd_);
+        throw loop_error("failed to create the eventfd");
+    }
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = eventfd_;
+    if (epoll_ctl(epollfd_, EPOLL_CTL_ADD, eventfd_, &event) < 0) {
+        close(eventfd_);
+        close(epollfd_);
+        throw loop_error("failed to watch the eventfd");
+    }
+}
+
+EventLoop::~EventLoop() {
+    // Drop what may still resume the coroutines first.
+    posted_.clear();
+    timers_.clear();
+    io_waiters_.clear();
+    // Destroying a root destroys the task it awaits, and so on.
+    std::unordered_map<uint64_t, std::coroutine_handle<> > roots;
+    roots.swap(roots_);
+    for (auto &it : roots) {
+        it.second.destroy();
+    }
+    close(eventfd_);
+    close(epollfd_);
+}
+
+EventLoop::Root EventLoop::run_root(Task<void> task, std::promise<void> done, uint64_t id) {
+    try {
+        co_await task;
+        done.set_value();
+    } catch (...) {
+        done.set_exception(std::current_exception());
+    }
+    roots_.erase(id);
+}
+
+void EventLoop::run() {
+    std::vector<std::function<void()> > posted;
+    std::array<epoll_event, MAX_LOOP_EVENTS> events;
+    while (!stopping_) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            posted.swap(posted_);
+        }
+        for (std::function<void()> &function : posted) {
+            function();
+        }
+        posted.clear();
+
+        // Fire the timers due, which may add new ones.
+        Clock::time_point now = Clock::now();
+        while (!timers_.empty() && timers_.begin()->first.first <= now) {
+            std::function<void()> function = std::move(timers_.begin()->second);
+            timers_.erase(timers_.begin());
+            function();
+        }
+        if (stopping_) {
+            break;
+        }
+
+        // Sleep until the next timer, the posted functions wake up the loop through the eventfd.
+        int timeout = -1;
+        if (!timers_.empty()) {
+            long left = std::chrono::ceil<std::chrono::milliseconds>(
+                timers_.begin()->first.first - Clock::now()
+            ).count();
+            timeout = left > 0 ? (int)left : 0;
+        }
+        int nfds = epoll_wait(epollfd_, events.data(), MAX_LOOP_EVENTS, timeout);
+        if (nfds < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw loop_error("failed to wait");
+        }
+        for (int i = 0; i < nfds; i++) {
+            int fd = events[i].data.fd;
+            if (fd == eventfd_) {
+                uint64_t count;
+                while (read(eventfd_, &count, sizeof(count)) > 0) {
+                }
+            } else {
+                resume_io(fd, true);
+            }
+        }
+    }
+}
+
+void EventLoop::stop() {
+    stopping_ = true;
+    uint64_t one = 1;
+    write(eventfd_, &one, sizeof(one));
+}
+
+void EventLoop::post(std::function<void()> function) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        posted_.push_back(std::move(function));
+    }
+    uint64_t one = 1;
+    write(eventfd_, &one, sizeof(one));
+}
+
+std::future<void> EventLoop::spawn(Task<void> task) {
+    std::promise<void> done;
+    std::future<void> future = done.get_future();
+    // Held by a shared_ptr, since std::function must be copyable.
+    std::shared_ptr<std::pair<Task<void>, std::promise<void> > > start =
+        std::make_shared<std::pair<Task<void>, std::promise<void> > >(std::move(task), std::move(done));
+    post([this, start] {
+        uint64_t id = next_root_id_++;
+        Root root = run_root(std::move(start->first), std::move(start->second), id);
+        roots_.emplace(id, root.handle);
+        root.handle.resume();
+    });
+    return future;
+}
+
+EventLoop::TimerKey EventLoop::add_timer(Clock::time_point time, std::function<void()> function) {
+    TimerKey key(time, next_timer_id_++);
+    timers_.emplace(key, std::move(function));
+    return key;
+}
+
+void EventLoop::cancel_timer(const TimerKey &key) {
+    timers_.erase(key);
+}
+
+void EventLoop::resume_io(int fd, bool ready) {
+    auto it = io_waiters_.find(fd);
+    if (it == io_waiters_.end()) {
+        return;
+    }
+    IoWaiter waiter = it->second;
+    io_waiters_.erase(it);
+    epoll_ctl(epollfd_, EPOLL_CTL_DEL, fd, nullptr);
+    if (ready && waiter.timed) {
+        cancel_timer(waiter.timer);
+    }
+    *waiter.ready = ready;
+    waiter.handle.resume();
+}
+
+void EventLoop::SleepAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    loop_.add_timer(time_, [handle] { handle.resume(); });
+}
+
+void EventLoop::YieldAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    // Fired with the timers of the next iteration, which does not sleep while it is due.
+    loop_.add_timer(Clock::now(), [handle] { handle.resume(); });
+}
+
+void EventLoop::IoAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    if (loop_.io_waiters_.count(fd_) > 0) {
+        throw std::runtime_error("EventLoop failed: the fd is awaited already.");
+    }
+    epoll_event event;
+    event.events = events_;
+    event.data.fd = fd_;
+    if (epoll_ctl(loop_.epollfd_, EPOLL_CTL_ADD, fd_, &event) < 0) {
+        throw loop_error("failed to watch the fd");
+    }
+    IoWaiter waiter {handle, &ready_, timeout_ >= 0, TimerKey()};
+    if (waiter.timed) {
+        EventLoop *loop = &loop_;
+        int fd = fd_;
+        waiter.timer = loop_.add_timer(
+            Clock::now() + std::chrono::milliseconds(timeout_),
+            [loop, fd] { loop->resume_io(fd, false); }
+        );
+    }
+    loop_.io_waiters_.emplace(fd_, waiter);
+}
+
+EventLoop::IoAwaiter EventLoop::readable(int fd, int timeout) {
+    return IoAwaiter(*this, fd, EPOLLIN, timeout);
+}
+
+EventLoop::IoAwaiter EventLoop::writable(int fd, int timeout) {
+    return IoAwaiter(*this, fd, EPOLLOUT, timeout);
+}
+
+AsyncEvent::AsyncEvent(EventLoop &loop)
+    : state_(std::make_shared<State>(State {&loop, false, nullptr, false, EventLoop::TimerKey()})) {}
+
+void AsyncEvent::set() {
+    std::shared_ptr<State> state = state_;
+    state->loop->post([state] {
+        state->set = true;
+        if (state->waiter) {
+            if (state->timed) {
+                state->loop->cancel_timer(state->timer);
+            }
+            std::exchange(state->waiter, nullptr).resume();
+        }
+    });
+}
+
+void AsyncEvent::Awaiter::await_suspend(std::coroutine_handle<> handle) {
+    state_->waiter = handle;
+    state_->timed = timeout_ >= 0;
+    if (state_->timed) {
+        std::shared_ptr<State> state = state_;
+        state_->timer = state_->loop->add_timer(
+            EventLoop::Clock::now() + std::chrono::milliseconds(timeout_),
+            [state] { std::exchange(state->waiter, nullptr).resume(); }
+        );
+    }
+}
@@ -0,0 +1,34 @@
+#include "Frame.hpp"
+#include <mutex>
+
+namespace {
+    std::mutex frame_pool_mutex;
+    std::vector<Frame *> frame_pool;
+}
+
+Frame *FramePool::acquire() {
+    {
+        std::lock_guard<std::mutex> lock(frame_pool_mutex);
+        if (!frame_pool.empty()) {
+            Frame *frame = frame_pool.back();
+            frame_pool.pop_back();
+            return frame;
+        }
+    }
+    return new Frame();
+}
+
+void FramePool::release(Frame *frame) {
+    std::vector<uint8_t> &buffer = frame->get_buffer();
+    buffer.clear();
+    // Only the usual packet sizes are kept, so the frames in flight can all be kept.
+    if (buffer.capacity() > MAX_BUFFER_SIZE) {
+        std::vector<uint8_t>().swap(buffer);
+    }
+    std::lock_guard<std::mutex> lock(frame_pool_mutex);
+    if (frame_pool.size() >= FRAME_POOL_CAPACITY) {
+        delete frame;
+        return;
+    }
+    frame_pool.push_back(frame);
+}
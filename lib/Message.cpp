@@ -1,5 +1,7 @@
 #include "Message.hpp"
 #include <stdexcept>
+#include <cstring>
+#include <arpa/inet.h>
 
 std::atomic_uint16_t Message::pakage_id_counter_ = 0;
 
@@ -19,40 +21,14 @@ Message::Message(bool increase_pakage_id) {
 }
 
 Message::Message(const void *buffer, ssize_t size) {
-    if (size < 6) {
-        throw std::runtime_error("Message buffer too small.");
-    }
-    const uint8_t *buffer_ptr = reinterpret_cast<const uint8_t *>(buffer);
-
-    // get the packet id, type, sender id and receiver id
-    pakage_id_ = *(reinterpret_cast<const uint16_t *>(buffer));
-    type_ = (MessageType)buffer_ptr[2];
-    sender_id_ = buffer_ptr[3];
-    receiver_id_ = buffer_ptr[4];
-    uint8_t num_data = buffer_ptr[5];
-
-    // get the data, every data is a vector of uchar
-    ssize_t data_size = size - 6;
-    const uint8_t *data_ptr = buffer_ptr + 6;
-    for (int i = 0; i < num_data; i++) {
-        if (data_size < 1) {
-            throw std::runtime_error("Message buffer error.");
-        }
-        uint8_t data_length = data_ptr[0];
-        if ((data_length + 1) > data_size) {
-            throw std::runtime_error("Message buffer overflow.");
-        }
-        data_.push_back(std::string(data_ptr + 1, data_ptr + 1 + data_length));
-        data_ptr += data_length + 1;
-        data_size -= data_length + 1;
-    }
+    parse(buffer, size);
 }
 
 Message::Message(
     MessageType type,
     uint8_t sender_id,
     uint8_t receiver_id,
-    const data_t &data,
+    data_t data,
     bool increase_pakage_id
 ) {
     // overflow is fine, it's unsigned
@@ -67,15 +43,7 @@ Message::Message(
     type_ = type;
     sender_id_ = sender_id;
     receiver_id_ = receiver_id;
-    data_ = data;
-}
-
-Message::Message(const Message &other) {
-    pakage_id_ = other.pakage_id_;
-    type_ = other.type_;
-    sender_id_ = other.sender_id_;
-    receiver_id_ = other.receiver_id_;
-    data_ = other.data_;
+    data_ = std::move(data);
 }
 
 
@@ -95,10 +63,18 @@ uint8_t Message::get_receiver_id() const {
     return receiver_id_;
 }
 
-data_t Message::get_data() const {
+const data_t &Message::get_data() const {
     return data_;
 }
 
+data_t &Message::get_data() {
+    return data_;
+}
+
+size_t Message::get_data_num() const {
+    return data_.size();
+}
+
 void Message::set_pakage_id(uint16_t pakage_id) {
     pakage_id_ = pakage_id;
 }
@@ -107,6 +83,14 @@ void Message::set_pakage_id_to_next() {
     pakage_id_ = pakage_id_counter_++;
 }
 
+uint16_t Message::get_pakage_id_counter() {
+    return pakage_id_counter_;
+}
+
+void Message::set_pakage_id_counter(uint16_t pakage_id) {
+    pakage_id_counter_ = pakage_id;
+}
+
 void Message::set_type(MessageType type) {
     type_ = type;
 }
@@ -123,13 +107,63 @@ void Message::set_data(const data_t &data) {
     data_ = data;
 }
 
+void Message::set_data(data_t &&data) {
+    data_ = std::move(data);
+}
+
+void Message::parse(const void *buffer, ssize_t size) {
+    if (size < 6) {
+        throw std::runtime_error("Message buffer too small.");
+    }
+    const uint8_t *buffer_ptr = reinterpret_cast<const uint8_t *>(buffer);
+
+    // get the packet id, type, sender id and receiver id
+    pakage_id_ = *(reinterpret_cast<const uint16_t *>(buffer));
+    type_ = (MessageType)buffer_ptr[2];
+    sender_id_ = buffer_ptr[3];
+    receiver_id_ = buffer_ptr[4];
+    uint8_t num_data = buffer_ptr[5];
+
+    // get the data, every data is a vector of uchar
+    data_.clear();
+    ssize_t data_size = size - 6;
+    const uint8_t *data_ptr = buffer_ptr + 6;
+    for (int i = 0; i < num_data; i++) {
+        if (data_size < 1) {
+            throw std::runtime_error("Message buffer error.");
+        }
+        uint8_t data_length = data_ptr[0];
+        if ((data_length + 1) > data_size) {
+            throw std::runtime_error("Message buffer overflow.");
+        }
+        std::string segment = BufferPool::local().acquire();
+        segment.assign(data_ptr + 1, data_ptr + 1 + data_length);
+        data_.push_back(std::move(segment));
+        data_ptr += data_length + 1;
+        data_size -= data_length + 1;
+    }
+}
+
+void Message::recycle() {
+    pakage_id_ = 0;
+    type_ = MessageType::HEARTBEAT;
+    sender_id_ = 0;
+    receiver_id_ = 0;
+    // keep the capacity of data_ and the segment buffers
+    for (auto &data : data_) {
+        BufferPool::local().release(std::move(data));
+    }
+    data_.clear();
+}
+
 ssize_t Message::serialize(std::vector<uint8_t> &buffer) const {
     if (data_.size() > 255) {
         throw std::runtime_error("Message data too large.");
     }
 
-    // clear the buffer
+    // clear the buffer, and grow it at most once
     buffer.clear();
+    buffer.reserve(get_serialized_size());
 
     // add the packet id, type, sender id and receiver id
     buffer.resize(2);
@@ -176,10 +210,61 @@ ssize_t Message::check_valid_message(const void *buffer, ssize_t size) {
         data_ptr += data_length + 1;
         data_size -= data_length + 1;
     }
+    if (data_size < 0) {
+        // The last element is not complete yet.
+        return -1;
+    }
 
     return data_ptr - buffer_ptr;
 }
 
+size_t Message::pack_ack_ranges(
+    const std::vector<uint16_t> &pakage_ids,
+    size_t first,
+    data_t &data,
+    size_t max_segment_num
+) {
+    // A segment is at most 255 bytes, i.e. 63 runs.
+    const size_t run_num_per_segment = 255 / 4;
+    size_t packed = first;
+    size_t segment_num = 0;
+    while (packed < pakage_ids.size() && segment_num < max_segment_num) {
+        std::string segment;
+        while (packed < pakage_ids.size() && segment.size() < run_num_per_segment * 4) {
+            // Take the run of consecutive ids, the duplicates as well.
+            size_t last = packed;
+            while (last + 1 < pakage_ids.size() && pakage_ids[last + 1] - pakage_ids[last] <= 1) {
+                last++;
+            }
+            uint16_t run[2] = {htons(pakage_ids[packed]), htons(pakage_ids[last])};
+            segment.append(reinterpret_cast<const char *>(run), sizeof(run));
+            packed = last + 1;
+        }
+        data.push_back(std::move(segment));
+        segment_num++;
+    }
+    return packed;
+}
+
+bool Message::unpack_ack_ranges(const std::string &segment, std::vector<uint16_t> &pakage_ids) {
+    if (segment.size() % 4 != 0) {
+        return false;
+    }
+    for (size_t offset = 0; offset < segment.size(); offset += 4) {
+        uint16_t run[2];
+        memcpy(run, segment.data() + offset, sizeof(run));
+        uint16_t first = ntohs(run[0]);
+        uint16_t last = ntohs(run[1]);
+        if (first > last) {
+            return false;
+        }
+        for (uint32_t id = first; id <= last; id++) {
+            pakage_ids.push_back(id);
+        }
+    }
+    return true;
+}
+
 std::string Message::to_string() const {
     std::string str = "Message(";
     str += "pakage_id=" + std::to_string(pakage_id_);
@@ -193,14 +278,3 @@ std::string Message::to_string() const {
     str += "])";
     return str;
 }
-
-Message& Message::operator=(const Message& other) {
-    if (this != &other) {
-        pakage_id_ = other.pakage_id_;
-        type_ = other.type_;
-        sender_id_ = other.sender_id_;
-        receiver_id_ = other.receiver_id_;
-        data_ = other.data_;
-    }
-    return *this;
-}
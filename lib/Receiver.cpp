@@ -1,19 +1,59 @@
 #include "Receiver.hpp"
 #include <sys/socket.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace {
+    struct BackendCounter {
+        std::atomic_uint64_t syscall_num;
+        std::atomic_uint64_t message_num;
+    };
+
+    BackendCounter backend_counters[IO_BACKEND_NUM];
+
+    std::atomic<IoBackend> default_backend(IoBackend::EPOLL);
+
+    /*
+     * Read the coarse monotonic clock, cheap enough to be read for every message.
+     * @return: The milliseconds.
+     */
+    int64_t get_coarse_time() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+}
 
 Receiver::Receiver(int sockfd, uint8_t self_id) {
     sockfd_ = sockfd;
     self_id_ = self_id;
-    buffer_.resize(MAX_BUFFER_SIZE);
+    backend_ = default_backend;
+    remaining_head_ = 0;
+    peer_closed_ = false;
+    interrupted_ = false;
+    // Only written by interrupt(), it stays readable from then on.
+    wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring_asleep_ = false;
 
-    // prepare epoll
-    epollfd_ = epoll_create(MAX_EPOLL_EVENTS);
-    epoll_event event;
-    event.events = EPOLLIN | EPOLLET;
-    event.data.fd = sockfd_;
-    epoll_ctl(epollfd_, EPOLL_CTL_ADD, sockfd_, &event);
-    events_.resize(MAX_EPOLL_EVENTS);
+    epollfd_ = -1;
+    if (backend_ == IoBackend::IO_URING) {
+        ring_ = std::make_unique<RecvRing>(sockfd_);
+    } else {
+        buffer_.resize(MAX_BUFFER_SIZE);
+        // prepare epoll
+        epollfd_ = epoll_create(MAX_EPOLL_EVENTS);
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = sockfd_;
+        epoll_ctl(epollfd_, EPOLL_CTL_ADD, sockfd_, &event);
+        watch_wake_fd();
+        events_.resize(MAX_EPOLL_EVENTS);
+    }
 
     // change the socket to non-blocking
     int oldSocketFlag = fcntl(sockfd_, F_GETFL, 0);
@@ -22,65 +62,274 @@ Receiver::Receiver(int sockfd, uint8_t self_id) {
 
     // initialize lose_heart_beat_
     lose_heart_beat_ = 0;
+    last_heard_ = get_coarse_time();
 }
 
-void Receiver::set_self_id(uint8_t self_id) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    self_id_ = self_id;
+Receiver::~Receiver() {
+    if (epollfd_ >= 0) {
+        close(epollfd_);
+    }
+    close(wake_fd_);
 }
 
-ssize_t Receiver::receive(Message &message) {
-    // TODO: handle the error and timeout
+void Receiver::watch_wake_fd() {
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = wake_fd_;
+    epoll_ctl(epollfd_, EPOLL_CTL_ADD, wake_fd_, &event);
+}
+
+bool Receiver::set_backend(IoBackend backend) {
+    if (backend == IoBackend::IO_URING && !RecvRing::supported()) {
+        return false;
+    }
+    default_backend = backend;
+    return true;
+}
+
+IoBackend Receiver::get_backend() {
+    return default_backend;
+}
+
+ReceiverStats Receiver::get_stats(IoBackend backend) {
+    BackendCounter &counter = backend_counters[static_cast<size_t>(backend)];
+    return ReceiverStats {
+        counter.syscall_num.load(std::memory_order_relaxed),
+        counter.message_num.load(std::memory_order_relaxed)
+    };
+}
+
+void Receiver::attach_ring(std::unique_ptr<ShmRing> ring) {
     std::lock_guard<std::mutex> lock(mutex_);
-    if (message_queue_.empty()) {
-        // use epoll_wait to wait for the socket to be readable
-        int nfds;
-        while ((nfds = epoll_wait(epollfd_, events_.data(), MAX_EPOLL_EVENTS, TIMEOUT)) == 0) {
-            if (lose_heart_beat_ >= MAX_LOST_HEART_BEAT) {
-                return 0;
-            }
+    if (backend_ == IoBackend::IO_URING) {
+        // Closing the io_uring cancels its recv, the socket is watched by epoll instead.
+        ring_.reset();
+        buffer_.resize(MAX_BUFFER_SIZE);
+        epollfd_ = epoll_create(MAX_EPOLL_EVENTS);
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = sockfd_;
+        epoll_ctl(epollfd_, EPOLL_CTL_ADD, sockfd_, &event);
+        watch_wake_fd();
+    }
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = ring->get_data_fd();
+    epoll_ctl(epollfd_, EPOLL_CTL_ADD, ring->get_data_fd(), &event);
+    events_.resize(3);
+    shm_ring_ = std::move(ring);
+}
+
+void Receiver::drain_socket(uint64_t &syscall_num) {
+    ssize_t size;
+    while ((size = recv(sockfd_, reinterpret_cast<void *>(buffer_.data()), MAX_BUFFER_SIZE, 0)) > 0) {
+        syscall_num++;
+        // append the new data to the remaining buffer
+        remaining_buffer_.insert(remaining_buffer_.end(), buffer_.begin(), buffer_.begin() + size);
+    }
+    syscall_num++;
+    // if recv returns -1 other than EAGAIN, it means that an error occurs
+    // if recv returns 0, it means that the peer has closed the connection
+    // the messages received before are still delivered
+    if (size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        std::string error_message = "recv error: size = " + std::to_string(size) +
+                                    ", errno = " + std::to_string(errno);
+        perror(error_message.c_str());
+        peer_closed_ = true;
+    }
+}
+
+int Receiver::fill_from_ring(int timeout, uint64_t &syscall_num) {
+    if (ring_asleep_) {
+        // Left asleep by the last poll, stop the signals.
+        ring_asleep_ = false;
+        shm_ring_->wake_reader(true);
+        syscall_num++;
+    }
+    if (shm_ring_->read(remaining_buffer_)) {
+        return 1;
+    }
+    // A busy peer writes again soon, spin a while rather than sleep and be woken up,
+    // unless the spinning would keep the peer from running, or a poll would keep an event loop.
+    static const bool spin = std::thread::hardware_concurrency() > 1;
+    std::chrono::steady_clock::time_point spin_end =
+        std::chrono::steady_clock::now() + std::chrono::microseconds(spin && timeout != 0 ? SHM_SPIN_TIME : 0);
+    while (std::chrono::steady_clock::now() < spin_end) {
+        if (shm_ring_->readable()) {
+            shm_ring_->read(remaining_buffer_);
+            return 1;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    if (!shm_ring_->sleep_reader()) {
+        shm_ring_->read(remaining_buffer_);
+        return 1;
+    }
+    int result = epoll_wait(epollfd_, events_.data(), events_.size(), timeout);
+    syscall_num++;
+    if (result == -1) {
+        shm_ring_->wake_reader(false);
+        std::string error_message = "epoll_wait error: nfds = " + std::to_string(result) +
+                                    ", errno = " + std::to_string(errno);
+        perror(error_message.c_str());
+        return -1;
+    }
+    if (result == 0 && timeout == 0 && !shm_ring_->readable()) {
+        // Polled, the caller waits for get_fd() next, which the writer signals while the reader sleeps.
+        ring_asleep_ = true;
+        return 0;
+    }
+    bool signaled = false;
+    for (int i = 0; i < result; i++) {
+        if (events_[i].data.fd == sockfd_) {
+            drain_socket(syscall_num);
+        } else if (events_[i].data.fd == shm_ring_->get_data_fd()) {
+            signaled = true;
         }
+    }
+    shm_ring_->wake_reader(signaled);
+    syscall_num += signaled;
+    // The bytes written right before the close are still delivered.
+    if (shm_ring_->read(remaining_buffer_)) {
+        result = 1;
+    }
+    return peer_closed_ ? 1 : result;
+}
+
+int Receiver::fill_buffer(int timeout) {
+    uint64_t syscall_num = 0;
+    int result;
+    if (shm_ring_) {
+        result = fill_from_ring(timeout, syscall_num);
+    } else if (backend_ == IoBackend::IO_URING) {
+        result = ring_->receive(remaining_buffer_, peer_closed_, timeout, syscall_num);
+        if (result < 0) {
+            std::string error_message = "io_uring_enter error: errno = " + std::to_string(errno);
+            perror(error_message.c_str());
+        }
+    } else {
+        // use epoll_wait to wait for the socket to be readable
         // if epoll_wait returns 0, it means that the timeout expires
         // if epoll_wait returns -1, it means that an error occurs
-        if (nfds == -1) {
-            std::string error_message = "epoll_wait error: nfds = " + std::to_string(nfds) +
+        result = epoll_wait(epollfd_, events_.data(), MAX_EPOLL_EVENTS, timeout);
+        syscall_num++;
+        if (result == -1) {
+            std::string error_message = "epoll_wait error: nfds = " + std::to_string(result) +
                                         ", errno = " + std::to_string(errno);
             perror(error_message.c_str());
-            return 0;
         }
+        for (int i = 0; i < result; i++) {
+            if (events_[i].data.fd == sockfd_) {
+                // the socket is readable, it is edge-triggered, so read until it is drained
+                drain_socket(syscall_num);
+            }
+        }
+    }
+    backend_counters[static_cast<size_t>(backend_)].syscall_num.fetch_add(syscall_num, std::memory_order_relaxed);
+    return result;
+}
 
-        // if epoll_wait returns a positive number, it means that the socket is readable
-        ssize_t size = recv(sockfd_, reinterpret_cast<void *>(buffer_.data()), MAX_BUFFER_SIZE, 0);
-        // if recv returns -1, it means that an error occurs
-        // if recv returns 0, it means that the peer has closed the connection
-        if (size == ssize_t(-1) || size == 0) {
-            std::string error_message = "recv error: size = " + std::to_string(size) +
-                                        ", errno = " + std::to_string(errno);
-            perror(error_message.c_str());
+void Receiver::set_self_id(uint8_t self_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    self_id_ = self_id;
+}
+
+ssize_t Receiver::receive(MessagePtr &message, int timeout) {
+    // TODO: handle the error
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(timeout, 0));
+    // Wait in slices of TIMEOUT, to notice the lost heart beats.
+    auto wait_time = [&]() -> int {
+        if (timeout < 0) {
+            return TIMEOUT;
+        }
+        long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()
+        ).count();
+        return std::clamp<long>(left, 0, TIMEOUT);
+    };
+    // wait until at least one complete message is received
+    ssize_t length;
+    while ((length = Message::check_valid_message(
+                remaining_buffer_.data() + remaining_head_, remaining_buffer_.size() - remaining_head_
+            )) <= 0) {
+        remaining_buffer_.erase(remaining_buffer_.begin(), remaining_buffer_.begin() + remaining_head_);
+        remaining_head_ = 0;
+        if (peer_closed_ || interrupted_) {
             return 0;
         }
-
-        // append the new data to the remaining buffer
-        remaining_buffer_.insert(remaining_buffer_.end(), buffer_.begin(), buffer_.begin() + size);
-        ssize_t length;
-        while ((length = Message::check_valid_message(remaining_buffer_.data(), remaining_buffer_.size())) > 0) {
-            // get the message
-            Message message_to_push(remaining_buffer_.data(), length);
-            // push the message to the queue
-            message_queue_.push(message_to_push);
-            // remove the message from the remaining buffer
-            remaining_buffer_.erase(remaining_buffer_.begin(), remaining_buffer_.begin() + length);
+        int result;
+        while ((result = fill_buffer(wait_time())) == 0) {
+            if (lose_heart_beat_ >= MAX_LOST_HEART_BEAT || interrupted_) {
+                return 0;
+            }
+            if (timeout >= 0 && std::chrono::steady_clock::now() >= deadline) {
+                return -1;
+            }
+        }
+        if (result < 0) {
+            return 0;
         }
     }
 
-    // get the message from the queue
-    if (!message_queue_.empty()) {
-        message = message_queue_.front();
-        message_queue_.pop();
-        return message.get_serialized_size();
-    } else {
-        return 0;
+    // get the message from the pool, giving the last one back
+    message = make_message();
+    message->parse(remaining_buffer_.data() + remaining_head_, length);
+    remaining_head_ += length;
+    backend_counters[static_cast<size_t>(backend_)].message_num.fetch_add(1, std::memory_order_relaxed);
+    return length;
+}
+
+int Receiver::get_fd() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The epoll also watches the shared memory ring and the wake up of interrupt().
+    return ring_ ? ring_->get_fd() : epollfd_;
+}
+
+bool Receiver::has_buffered() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Message::check_valid_message(
+        remaining_buffer_.data() + remaining_head_, remaining_buffer_.size() - remaining_head_
+    ) > 0;
+}
+
+void Receiver::interrupt() {
+    interrupted_ = true;
+    // Not taking mutex_, which receive() holds while waiting.
+    // The eventfd wakes the epoll_wait up, an io_uring waits out its TIMEOUT.
+    uint64_t wake = 1;
+    if (write(wake_fd_, &wake, sizeof(wake)) < 0) {
+        perror("eventfd write error");
+    }
+}
+
+std::vector<uint8_t> Receiver::take_buffered() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ring_) {
+        // The completions already posted still hold bytes of the socket.
+        ring_->cancel(remaining_buffer_, peer_closed_);
+    }
+    std::vector<uint8_t> bytes(remaining_buffer_.begin() + remaining_head_, remaining_buffer_.end());
+    remaining_buffer_.clear();
+    remaining_head_ = 0;
+    return bytes;
+}
+
+void Receiver::put_back(const std::vector<uint8_t> &bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The complete packets are taken by the next receive() without waiting.
+    remaining_buffer_.insert(remaining_buffer_.begin() + remaining_head_, bytes.begin(), bytes.end());
+}
+
+std::vector<int> Receiver::get_ring_fds() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!shm_ring_) {
+        return {};
     }
+    return shm_ring_->get_fds();
 }
 
 void Receiver::inc_lost_heart_beat() {
@@ -93,8 +342,13 @@ void Receiver::set_lost_heart_beat(uint8_t lost_heart_beat) {
 
 void Receiver::reset_lost_heart_beat() {
     lose_heart_beat_ = 0;
+    last_heard_.store(get_coarse_time(), std::memory_order_relaxed);
 }
 
 uint8_t Receiver::get_lost_heart_beat() {
     return lose_heart_beat_;
 }
+
+int64_t Receiver::get_idle_time() {
+    return get_coarse_time() - last_heard_.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,251 @@
+#include "RecvRing.hpp"
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace {
+    // The only buffer group of a ring.
+    const uint16_t BUFFER_GROUP = 0;
+    // The user data of the recv, and of the request cancelling it.
+    const uint64_t RECV_USER_DATA = 0;
+    const uint64_t CANCEL_USER_DATA = 1;
+
+    int io_uring_setup(unsigned entries, io_uring_params *params) {
+        return (int)syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t size) {
+        return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, size);
+    }
+
+    int io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned num) {
+        return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, num);
+    }
+
+    std::runtime_error ring_error(const std::string &what) {
+        return std::runtime_error(
+            "RecvRing failed: " + what + ". errno: " + std::to_string(errno) + " " + strerror(errno)
+        );
+    }
+}
+
+RecvRing::RecvRing(int sockfd)
+    : ring_fd_(-1), sockfd_(sockfd), ring_ptr_(MAP_FAILED), ring_size_(0), sqes_(nullptr), sqes_size_(0),
+      buf_ring_(nullptr), buf_ring_size_(0), buf_tail_(0), armed_(false), cancelled_(false), to_submit_(0) {
+    // At most one recv and URING_BUFFER_NUM completions are in flight.
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_BUFFER_NUM * 2;
+    ring_fd_ = io_uring_setup(2, &params);
+    if (ring_fd_ < 0) {
+        throw ring_error("failed to set up the ring");
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring_fd_);
+        errno = ENOSYS;
+        throw ring_error("the kernel is too old");
+    }
+
+    // The submission and the completion rings share one mapping.
+    ring_size_ = std::max(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe)
+    );
+    ring_ptr_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    buf_ring_size_ = URING_BUFFER_NUM * sizeof(io_uring_buf);
+    void *buf_ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring_ptr_ == MAP_FAILED || sqes == MAP_FAILED || buf_ring == MAP_FAILED) {
+        int error = errno;
+        if (ring_ptr_ != MAP_FAILED) {
+            munmap(ring_ptr_, ring_size_);
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size_);
+        }
+        if (buf_ring != MAP_FAILED) {
+            munmap(buf_ring, buf_ring_size_);
+        }
+        close(ring_fd_);
+        errno = error;
+        throw ring_error("failed to map the ring");
+    }
+    uint8_t *ring = reinterpret_cast<uint8_t *>(ring_ptr_);
+    sq_tail_ = reinterpret_cast<unsigned *>(ring + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned *>(ring + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(ring + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(ring + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(ring + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned *>(ring + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(ring + params.cq_off.cqes);
+    sqes_ = reinterpret_cast<io_uring_sqe *>(sqes);
+    buf_ring_ = reinterpret_cast<io_uring_buf_ring *>(buf_ring);
+
+    // Register the provided buffers.
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+    reg.ring_entries = URING_BUFFER_NUM;
+    reg.bgid = BUFFER_GROUP;
+    if (io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int error = errno;
+        munmap(buf_ring_, buf_ring_size_);
+        munmap(sqes_, sqes_size_);
+        munmap(ring_ptr_, ring_size_);
+        close(ring_fd_);
+        errno = error;
+        throw ring_error("failed to register the buffers");
+    }
+    buffers_.resize(URING_BUFFER_NUM * MAX_BUFFER_SIZE);
+    for (uint16_t bid = 0; bid < URING_BUFFER_NUM; bid++) {
+        recycle(bid);
+    }
+    arm();
+}
+
+RecvRing::~RecvRing() {
+    // Closing the ring cancels the recv.
+    close(ring_fd_);
+    munmap(buf_ring_, buf_ring_size_);
+    munmap(sqes_, sqes_size_);
+    munmap(ring_ptr_, ring_size_);
+}
+
+bool RecvRing::supported() {
+    try {
+        // A socket is not needed until the first wait.
+        RecvRing ring(-1);
+    } catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
+void RecvRing::arm() {
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & *sq_mask_;
+    io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sockfd_;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = RECV_USER_DATA;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    to_submit_++;
+    armed_ = true;
+}
+
+void RecvRing::recycle(uint16_t bid) {
+    // Not through bufs, the flexible array of the kernel header is misplaced in C++.
+    io_uring_buf *buf = reinterpret_cast<io_uring_buf *>(buf_ring_) + (buf_tail_ & (URING_BUFFER_NUM - 1));
+    buf->addr = reinterpret_cast<uint64_t>(buffers_.data() + (size_t)bid * MAX_BUFFER_SIZE);
+    buf->len = MAX_BUFFER_SIZE;
+    buf->bid = bid;
+    buf_tail_++;
+    __atomic_store_n(&buf_ring_->tail, buf_tail_, __ATOMIC_RELEASE);
+}
+
+bool RecvRing::reap(std::vector<uint8_t> &buffer, bool &closed) {
+    bool received = false;
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+        if (cqe->user_data == CANCEL_USER_DATA) {
+            head++;
+            continue;
+        }
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            const uint8_t *data = buffers_.data() + (size_t)bid * MAX_BUFFER_SIZE;
+            buffer.insert(buffer.end(), data, data + cqe->res);
+            recycle(bid);
+            received = true;
+        } else if (cqe->res == 0) {
+            // The peer has closed the connection.
+            closed = true;
+            received = true;
+        } else if (cqe->res != -ENOBUFS && !(cancelled_ && cqe->res == -ECANCELED)) {
+            // Out of buffers only ends the recv, which is armed again below.
+            errno = -cqe->res;
+            closed = true;
+            received = true;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            armed_ = false;
+        }
+        head++;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    if (!armed_ && !closed && !cancelled_) {
+        arm();
+    }
+    return received;
+}
+
+int RecvRing::receive(std::vector<uint8_t> &buffer, bool &closed, int timeout, uint64_t &syscall_num) {
+    if (reap(buffer, closed)) {
+        return 1;
+    }
+    // Submit the recv if it is armed again, and wait in the same call.
+    __kernel_timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    int ret = io_uring_enter(
+        ring_fd_,
+        to_submit_,
+        1,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+        &arg,
+        sizeof(arg)
+    );
+    syscall_num++;
+    if (ret >= 0) {
+        to_submit_ -= std::min<unsigned>(ret, to_submit_);
+    } else if (errno != ETIME && errno != EINTR) {
+        return -1;
+    }
+    return reap(buffer, closed) ? 1 : 0;
+}
+
+void RecvRing::cancel(std::vector<uint8_t> &buffer, bool &closed) {
+    cancelled_ = true;
+    reap(buffer, closed);
+    if (!armed_) {
+        return;
+    }
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & *sq_mask_;
+    io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = RECV_USER_DATA;
+    sqe->user_data = CANCEL_USER_DATA;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    to_submit_++;
+    // The recv ends with its last completion, the bytes before it are kept.
+    while (armed_) {
+        int ret = io_uring_enter(ring_fd_, to_submit_, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret >= 0) {
+            to_submit_ -= std::min<unsigned>(ret, to_submit_);
+        } else if (errno != EINTR) {
+            break;
+        }
+        reap(buffer, closed);
+    }
+}
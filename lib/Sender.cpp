@@ -1,102 +1,568 @@
 #include "Sender.hpp"
+#include "WritePoller.hpp"
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+namespace {
+    struct LaneCounter {
+        std::atomic_uint64_t frame_num;
+        std::atomic_uint64_t total_delay;
+        std::atomic_uint64_t max_delay;
+    };
+
+    LaneCounter lane_counters[LANE_NUM];
+
+    Lane get_lane(MessageType type) {
+        switch (type) {
+            case MessageType::REQSEND:
+            case MessageType::REQSEND_NAME:
+            case MessageType::FWD:
+            case MessageType::REQMULTI:
+            case MessageType::PUBLISH:
+            // Not to overtake the messages before it.
+            case MessageType::DISCONNECT:
+                return Lane::BULK;
+            default:
+                return Lane::CONTROL;
+        }
+    }
+
+    void count_delay(
+        Lane lane,
+        std::chrono::steady_clock::time_point queued_time,
+        std::chrono::steady_clock::time_point now
+    ) {
+        LaneCounter &counter = lane_counters[static_cast<size_t>(lane)];
+        uint64_t delay = std::chrono::duration_cast<std::chrono::microseconds>(now - queued_time).count();
+        counter.frame_num.fetch_add(1, std::memory_order_relaxed);
+        counter.total_delay.fetch_add(delay, std::memory_order_relaxed);
+        uint64_t max_delay = counter.max_delay.load(std::memory_order_relaxed);
+        while (delay > max_delay &&
+               !counter.max_delay.compare_exchange_weak(max_delay, delay, std::memory_order_relaxed)) {
+        }
+    }
+}
 
 // FOR CLIENTS ONLY
 Sender::Sender(int sockfd, uint8_t self_id) {
     sockfd_ = sockfd;
     self_id_ = self_id;
-    buffer_.resize(MAX_BUFFER_SIZE);
+    lanes_ = {};
+    partial_lane_ = Lane::BULK;
+    partial_offset_ = 0;
+    batch_num_ = {};
+    iov_.reserve(MAX_WRITE_BATCH);
+    writing_ = false;
+    blocked_ = false;
+    broken_ = false;
+    written_bytes_ = 0;
+}
+
+Sender::~Sender() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // The WritePoller writes the rest, give up once it makes no progress for TIMEOUT.
+    uint64_t written_bytes = written_bytes_;
+    while (!broken_ && !queue_empty()) {
+        if (!queue_cond_.wait_for(lock, std::chrono::milliseconds(TIMEOUT), [&] {
+            return broken_ || queue_empty() || written_bytes_ != written_bytes;
+        })) {
+            break;
+        }
+        written_bytes = written_bytes_;
+    }
+    // Drop the frames which can not be sent.
+    clear_queue();
+    lock.unlock();
+    WritePoller::get().remove(this);
 }
 
 void Sender::set_self_id(uint8_t self_id) {
     self_id_ = self_id;
 }
 
-send_res_t Sender::send_connect_request(std::string name) {
+void Sender::attach_ring(std::unique_ptr<ShmRing> ring) {
     std::lock_guard<std::mutex> lock(mutex_);
-    data_t data;
-    data.push_back(name);
-    Message message(MessageType::CONNECT, self_id_, SERVER_ID, data);
-    ssize_t size = message.serialize(buffer_);
-    size = send(sockfd_, reinterpret_cast<void *>(buffer_.data()), size, 0);
+    if (writing_ || blocked_ || !queue_empty()) {
+        throw std::runtime_error("Sender failed: frames are still queued on the socket.");
+    }
+    ring_ = std::move(ring);
+}
+
+ssize_t Sender::write_bytes(const iovec *iov, size_t num) {
+    if (ring_) {
+        return ring_->write(iov, num);
+    }
+    msghdr header {};
+    header.msg_iov = const_cast<iovec *>(iov);
+    header.msg_iovlen = num;
+    // Never blocks the thread sending, even if the socket is blocking.
+    return sendmsg(sockfd_, &header, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+bool Sender::block() {
+    if (ring_) {
+        if (!ring_->sleep_writer()) {
+            return false;
+        }
+        blocked_ = true;
+        WritePoller::get().wait(this, ring_->get_space_fd(), EPOLLIN);
+    } else {
+        blocked_ = true;
+        WritePoller::get().wait(this, sockfd_, EPOLLOUT);
+    }
+    return true;
+}
+
+void Sender::resume_writing() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    blocked_ = false;
+    if (ring_) {
+        ring_->wake_writer();
+    }
+    if (!writing_) {
+        write_queued(lock);
+    }
+}
+
+ssize_t Sender::send_frame_with_fds(FrameRef frame, const std::vector<int> &fds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (broken_ || writing_ || blocked_ || !queue_empty()) {
+        return -1;
+    }
+    std::vector<uint8_t> &buffer = frame->get_buffer();
+    iovec iov {buffer.data(), buffer.size()};
+    std::vector<uint8_t> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    msghdr header {};
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.data();
+    header.msg_controllen = control.size();
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    // The fds go with the first byte, so the rest could not be queued anyway,
+    // but a fresh socket takes a handshake whole.
+    ssize_t written = sendmsg(sockfd_, &header, MSG_NOSIGNAL);
+    if (written != (ssize_t)buffer.size()) {
+        broken_ = true;
+        return -1;
+    }
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    count_delay(Lane::CONTROL, now, now);
+    return written;
+}
+
+bool Sender::flush(int timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return queue_cond_.wait_for(lock, std::chrono::milliseconds(timeout), [this] {
+        return broken_ || (!writing_ && queue_empty());
+    }) && !broken_;
+}
+
+std::vector<int> Sender::get_ring_fds() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ring_) {
+        return {};
+    }
+    return ring_->get_fds();
+}
+
+LaneStats Sender::get_lane_stats(Lane lane) {
+    LaneCounter &counter = lane_counters[static_cast<size_t>(lane)];
+    return LaneStats {
+        counter.frame_num.load(std::memory_order_relaxed),
+        counter.total_delay.load(std::memory_order_relaxed),
+        counter.max_delay.load(std::memory_order_relaxed)
+    };
+}
+
+send_res_t Sender::send_message(const Message &message) {
+    FrameRef frame = FrameRef::make();
+    message.serialize(frame->get_buffer());
+    ssize_t size = send_frame(std::move(frame), get_lane(message.get_type()));
     return std::make_pair(message.get_pakage_id(), size);
 }
 
+ssize_t Sender::send_frame(FrameRef frame, Lane lane) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (broken_) {
+        return -1;
+    }
+    ssize_t size = frame->size();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (writing_ || blocked_ || !queue_empty()) {
+        // Let the thread writing or the WritePoller send it in the order of its lane.
+        lanes_[static_cast<size_t>(lane)].frames.push_back(QueuedFrame {std::move(frame), now});
+        if (!writing_ && !blocked_) {
+            write_queued(lock);
+        }
+        return size;
+    }
+
+    // Nothing queued, try to write it at once.
+    writing_ = true;
+    lock.unlock();
+    iovec iov {frame->get_buffer().data(), frame->get_buffer().size()};
+    ssize_t written = write_bytes(&iov, 1);
+    int error = errno;
+    lock.lock();
+    writing_ = false;
+    if (written < 0 && error != EAGAIN && error != EWOULDBLOCK && error != EINTR) {
+        broken_ = true;
+        // Drop the frames queued meanwhile.
+        clear_queue();
+        queue_cond_.notify_all();
+        return -1;
+    }
+    if (written < size) {
+        // Finish it before the frames queued meanwhile, once the socket is writable.
+        partial_ = QueuedFrame {std::move(frame), now};
+        partial_lane_ = lane;
+        partial_offset_ = written < 0 ? 0 : written;
+        if (!block()) {
+            write_queued(lock);
+        }
+    } else {
+        count_delay(lane, now, now);
+        // The frames queued while writing.
+        write_queued(lock);
+    }
+    queue_cond_.notify_all();
+    return size;
+}
+
+bool Sender::queue_empty() const {
+    if (partial_.frame) {
+        return false;
+    }
+    for (const LaneQueue &queue : lanes_) {
+        if (queue.head < queue.frames.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Sender::clear_queue() {
+    for (LaneQueue &queue : lanes_) {
+        queue.frames.clear();
+        queue.head = 0;
+    }
+    partial_ = QueuedFrame();
+    partial_offset_ = 0;
+}
+
+void Sender::pop_written(size_t size) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    written_bytes_ += size;
+    if (partial_.frame) {
+        size_t remaining = partial_.frame->size() - partial_offset_;
+        if (size < remaining) {
+            partial_offset_ += size;
+            return;
+        }
+        size -= remaining;
+        count_delay(partial_lane_, partial_.queued_time, now);
+        partial_ = QueuedFrame();
+        partial_offset_ = 0;
+    }
+    // The batch took the lanes in order, from their heads.
+    for (size_t i = 0; i < LANE_NUM; i++) {
+        LaneQueue &queue = lanes_[i];
+        for (; size > 0 && batch_num_[i] > 0; batch_num_[i]--) {
+            QueuedFrame &front = queue.frames[queue.head++];
+            if (size < front.frame->size()) {
+                // Cut in the middle, finish it first in the next batch.
+                partial_ = std::move(front);
+                partial_lane_ = static_cast<Lane>(i);
+                partial_offset_ = size;
+                size = 0;
+            } else {
+                size -= front.frame->size();
+                count_delay(static_cast<Lane>(i), front.queued_time, now);
+                front = QueuedFrame();
+            }
+        }
+        if (queue.head == queue.frames.size()) {
+            // Reuse the storage of the queue.
+            queue.frames.clear();
+            queue.head = 0;
+        } else if (queue.head >= MAX_WRITE_BATCH && queue.head * 2 >= queue.frames.size()) {
+            queue.frames.erase(queue.frames.begin(), queue.frames.begin() + queue.head);
+            queue.head = 0;
+        }
+    }
+}
+
+void Sender::write_queued(std::unique_lock<std::mutex> &lock) {
+    while (!broken_ && !queue_empty()) {
+        // Gather a batch of frames into one write, the cut frame first,
+        // then the lanes in the order of priority.
+        iov_.clear();
+        size_t batch_size = 0;
+        if (partial_.frame) {
+            std::vector<uint8_t> &buffer = partial_.frame->get_buffer();
+            iov_.push_back(iovec {buffer.data() + partial_offset_, buffer.size() - partial_offset_});
+            batch_size += buffer.size() - partial_offset_;
+        }
+        for (size_t i = 0; i < LANE_NUM; i++) {
+            LaneQueue &queue = lanes_[i];
+            batch_num_[i] = 0;
+            for (size_t j = queue.head; j < queue.frames.size() && iov_.size() < MAX_WRITE_BATCH; j++) {
+                std::vector<uint8_t> &buffer = queue.frames[j].frame->get_buffer();
+                iov_.push_back(iovec {buffer.data(), buffer.size()});
+                batch_size += buffer.size();
+                batch_num_[i]++;
+            }
+        }
+        writing_ = true;
+        lock.unlock();
+
+        ssize_t written = write_bytes(iov_.data(), iov_.size());
+        int error = errno;
+
+        lock.lock();
+        writing_ = false;
+        if (written > 0) {
+            pop_written(written);
+        } else if (written < 0 && error != EAGAIN && error != EWOULDBLOCK && error != EINTR) {
+            broken_ = true;
+            // Drop the frames which can not be sent.
+            clear_queue();
+            break;
+        }
+        // Cut short, the socket or the ring is full.
+        bool full = written < 0 ? error != EINTR : (size_t)written < batch_size;
+        if (full && block()) {
+            break;
+        }
+    }
+    // Wake up flush() and the destructor.
+    queue_cond_.notify_all();
+}
+
+send_res_t Sender::send_connect_request(
+    std::string_view name,
+    const std::vector<int> &fds,
+    uint16_t datagram_port
+) {
+    data_t data;
+    data.emplace_back(name);
+    if (datagram_port != 0) {
+        data.push_back(std::to_string(datagram_port));
+    }
+    Message message(MessageType::CONNECT, self_id_, SERVER_ID, std::move(data));
+    if (fds.empty()) {
+        return send_message(message);
+    }
+    FrameRef frame = FrameRef::make();
+    message.serialize(frame->get_buffer());
+    return std::make_pair(message.get_pakage_id(), send_frame_with_fds(std::move(frame), fds));
+}
+
+send_res_t Sender::send_resume_request(
+    std::string_view token,
+    const std::vector<int> &fds,
+    uint16_t datagram_port
+) {
+    data_t data;
+    data.emplace_back(token);
+    if (datagram_port != 0) {
+        data.push_back(std::to_string(datagram_port));
+    }
+    Message message(MessageType::RESUME, self_id_, SERVER_ID, std::move(data));
+    if (fds.empty()) {
+        return send_message(message);
+    }
+    FrameRef frame = FrameRef::make();
+    message.serialize(frame->get_buffer());
+    return std::make_pair(message.get_pakage_id(), send_frame_with_fds(std::move(frame), fds));
+}
+
 send_res_t Sender::send_disconnect_request(uint8_t receiver_id) {
-    std::lock_guard<std::mutex> lock(mutex_);
     Message message(MessageType::DISCONNECT, self_id_, receiver_id);
-    ssize_t size = message.serialize(buffer_);
-    size = send(sockfd_, reinterpret_cast<void *>(buffer_.data()), size, 0);
-    return std::make_pair(message.get_pakage_id(), size);
+    return send_message(message);
 }
 
 send_res_t Sender::send_request_time() {
-    std::lock_guard<std::mutex> lock(mutex_);
     Message message(MessageType::REQTIME, self_id_, SERVER_ID);
-    ssize_t size = message.serialize(buffer_);
-    size = send(sockfd_, reinterpret_cast<void *>(buffer_.data()), size, 0);
-    return std::make_pair(message.get_pakage_id(), size);
+    return send_message(message);
 }
 
 send_res_t Sender::send_request_host() {
-    std::lock_guard<std::mutex> lock(mutex_);
     Message message(MessageType::REQHOST, self_id_, SERVER_ID);
-    ssize_t size = message.serialize(buffer_);
-    size = send(sockfd_, reinterpret_cast<void *>(buffer_.data()), size, 0);
-    return std::make_pair(message.get_pakage_id(), size);
+    return send_message(message);
 }
 
-send_res_t Sender::send_request_client_list() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    Message message(MessageType::REQCLILIST, self_id_, SERVER_ID);
-    ssize_t size = message.serialize(buffer_);
-    size = send(sockfd_, reinterpret_cast<void *>(buffer_.data()), size, 0);
-    return std::make_pair(message.get_pakage_id(), size);
+send_res_t Sender::send_request_client_list(uint8_t cursor) {
+    data_t data;
+    if (cursor != 0) {
+        data.emplace_back(1, (char)cursor);
+    }
+    Message message(MessageType::REQCLILIST, self_id_, SERVER_ID, std::move(data));
+    return send_message(message);
+}
+
+send_res_t Sender::send_request_client_list_since(uint64_t version) {
+    data_t data;
+    data.emplace_back(reinterpret_cast<const char *>(&version), sizeof(version));
+    Message message(MessageType::REQCLILIST_SINCE, self_id_, SERVER_ID, std::move(data));
+    return send_message(message);
+}
+
+send_res_t Sender::send_presence(bool enable) {
+    data_t data;
+    data.emplace_back(enable ? "1" : "0");
+    Message message(MessageType::PRESENCE, self_id_, SERVER_ID, std::move(data));
+    return send_message(message);
+}
+
+send_res_t Sender::send_request_acks(bool enable) {
+    data_t data;
+    data.emplace_back(enable ? "1" : "0");
+    Message message(MessageType::REQACKS, self_id_, SERVER_ID, std::move(data));
+    return send_message(message);
 }
 
 send_res_t Sender::send_request_send(
     uint8_t receiver_id,
-    std::string msg_string
+    std::string_view msg_string
 ) {
-    std::lock_guard<std::mutex> lock(mutex_);
     data_t data;
-    data.push_back(msg_string);
-    Message message(MessageType::REQSEND, self_id_, receiver_id, data);
-    ssize_t size = message.serialize(buffer_);
-    size = send(sockfd_, reinterpret_cast<void *>(buffer_.data()), size, 0);
-    return std::make_pair(message.get_pakage_id(), size);
+    data.emplace_back(msg_string);
+    Message message(MessageType::REQSEND, self_id_, receiver_id, std::move(data));
+    return send_message(message);
+}
+
+send_res_t Sender::send_request_send_by_name(
+    std::string_view receiver_name,
+    std::string_view msg_string
+) {
+    data_t data;
+    data.emplace_back(receiver_name);
+    data.emplace_back(msg_string);
+    Message message(MessageType::REQSEND_NAME, self_id_, SERVER_ID, std::move(data));
+    return send_message(message);
+}
+
+send_res_t Sender::send_request_multicast(
+    const std::vector<uint8_t> &receiver_ids,
+    std::string_view msg_string
+) {
+    data_t data;
+    data.emplace_back(receiver_ids.begin(), receiver_ids.end());
+    data.emplace_back(msg_string);
+    Message message(MessageType::REQMULTI, self_id_, SERVER_ID, std::move(data));
+    return send_message(message);
+}
+
+send_res_t Sender::send_subscribe(std::string_view topic) {
+    data_t data;
+    data.emplace_back(topic);
+    Message message(MessageType::SUBSCRIBE, self_id_, SERVER_ID, std::move(data));
+    return send_message(message);
+}
+
+send_res_t Sender::send_unsubscribe(std::string_view topic) {
+    data_t data;
+    data.emplace_back(topic);
+    Message message(MessageType::UNSUBSCRIBE, self_id_, SERVER_ID, std::move(data));
+    return send_message(message);
+}
+
+send_res_t Sender::send_publish(std::string_view topic, std::string_view msg_string) {
+    data_t data;
+    data.emplace_back(topic);
+    data.emplace_back(msg_string);
+    Message message(MessageType::PUBLISH, self_id_, SERVER_ID, std::move(data));
+    return send_message(message);
 }
 
 // FOR SERVER AND CLIENTS
+send_res_t Sender::send_datagram(uint8_t receiver_id, std::string_view msg_string) {
+    data_t data;
+    data.emplace_back(msg_string);
+    Message message(MessageType::DATAGRAM, self_id_, receiver_id, std::move(data));
+    return send_message(message);
+}
+
 send_res_t Sender::send_acknowledge(
     uint16_t pakage_id,
     uint8_t receiver_id,
-    const data_t &data
+    data_t data
 ) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    Message message(MessageType::ACK, self_id_, receiver_id, data);
+    Message message(MessageType::ACK, self_id_, receiver_id, std::move(data));
     message.set_pakage_id(pakage_id);
-    ssize_t size = message.serialize(buffer_);
-    size = send(sockfd_, reinterpret_cast<void *>(buffer_.data()), size, 0);
-    return std::make_pair(message.get_pakage_id(), size);
+    return send_message(message);
 }
 
-send_res_t Sender::send_forward(Message message) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    message.set_type(MessageType::FWD);
-    message.set_pakage_id_to_next();
-    ssize_t size = message.serialize(buffer_);
-    size = send(sockfd_, reinterpret_cast<void *>(buffer_.data()), size, 0);
-    return std::make_pair(message.get_pakage_id(), size);
+send_res_t Sender::send_acks(uint8_t receiver_id, std::vector<uint16_t> &pakage_ids, int cumulative) {
+    send_res_t result;
+    std::sort(pakage_ids.begin(), pakage_ids.end());
+    size_t packed = 0;
+    do {
+        data_t data;
+        // The cumulative id first, empty for none, then the runs of the others.
+        if (cumulative >= 0) {
+            uint16_t id = htons((uint16_t)cumulative);
+            data.emplace_back(reinterpret_cast<const char *>(&id), sizeof(id));
+            cumulative = -1;
+        } else {
+            data.emplace_back();
+        }
+        packed = Message::pack_ack_ranges(pakage_ids, packed, data, 254);
+        Message message(MessageType::ACKS, self_id_, receiver_id, std::move(data));
+        result = send_message(message);
+    } while (packed < pakage_ids.size());
+    return result;
+}
+
+send_res_t Sender::send_forward(MessagePtr message, FrameRef *frame) {
+    message->set_type(MessageType::FWD);
+    message->set_pakage_id_to_next();
+    if (frame == nullptr) {
+        return send_message(*message);
+    }
+    *frame = FrameRef::make();
+    message->serialize((*frame)->get_buffer());
+    ssize_t size = send_frame(*frame);
+    return std::make_pair(message->get_pakage_id(), size);
+}
+
+send_res_t Sender::send_wait(uint16_t pakage_id, uint8_t receiver_id, uint8_t destination_id) {
+    data_t data;
+    data.emplace_back(1, (char)destination_id);
+    Message message(MessageType::WAIT, self_id_, receiver_id, std::move(data), false);
+    message.set_pakage_id(pakage_id);
+    return send_message(message);
+}
+
+send_res_t Sender::send_credit(uint8_t receiver_id, uint8_t destination_id, size_t credit) {
+    data_t data;
+    data.emplace_back(1, (char)destination_id);
+    data.push_back(std::to_string(credit));
+    Message message(MessageType::CREDIT, self_id_, receiver_id, std::move(data));
+    return send_message(message);
+}
+
+send_res_t Sender::send_peer(data_t data) {
+    Message message(MessageType::PEER, self_id_, SERVER_ID, std::move(data));
+    return send_message(message);
 }
 
 void Sender::send_heart_beat(uint16_t receiver_id) {
-    std::lock_guard<std::mutex> lock(mutex_);
     Message message;
     message.set_pakage_id(0);
     message.set_type(MessageType::HEARTBEAT);
     message.set_sender_id(self_id_);
     message.set_receiver_id(receiver_id);
-    ssize_t size = message.serialize(buffer_);
-    size = send(sockfd_, reinterpret_cast<void *>(buffer_.data()), size, 0);
+    send_message(message);
 }
@@ -0,0 +1,192 @@
+#include "ShmRing.hpp"
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+namespace {
+    const uint64_t RING_MASK = SHM_RING_SIZE - 1;
+
+    std::runtime_error ring_error(const std::string &what) {
+        return std::runtime_error(
+            "ShmRing failed: " + what + ". errno: " + std::to_string(errno) + " " + strerror(errno)
+        );
+    }
+}
+
+ShmRing::ShmRing()
+    : memfd_(-1), data_fd_(-1), space_fd_(-1), memory_(MAP_FAILED),
+      memory_size_(sizeof(Control) + SHM_RING_SIZE), control_(nullptr), data_(nullptr) {
+    memfd_ = memfd_create("shm-ring", MFD_CLOEXEC);
+    data_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    space_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (memfd_ < 0 || data_fd_ < 0 || space_fd_ < 0) {
+        int error = errno;
+        release();
+        errno = error;
+        throw ring_error("failed to create the fds");
+    }
+    map(true);
+}
+
+ShmRing::ShmRing(const int *fds)
+    : memfd_(fds[0]), data_fd_(fds[1]), space_fd_(fds[2]), memory_(MAP_FAILED),
+      memory_size_(sizeof(Control) + SHM_RING_SIZE), control_(nullptr), data_(nullptr) {
+    map(false);
+}
+
+ShmRing::~ShmRing() {
+    release();
+}
+
+void ShmRing::release() {
+    if (memory_ != MAP_FAILED) {
+        munmap(memory_, memory_size_);
+        memory_ = MAP_FAILED;
+    }
+    for (int *fd : {&memfd_, &data_fd_, &space_fd_}) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void ShmRing::map(bool create) {
+    if (create) {
+        if (ftruncate(memfd_, memory_size_) < 0) {
+            int error = errno;
+            release();
+            errno = error;
+            throw ring_error("failed to size the memfd");
+        }
+    } else {
+        // A shorter memfd would fault on access rather than fail here.
+        struct stat status;
+        if (fstat(memfd_, &status) < 0 || (size_t)status.st_size != memory_size_) {
+            release();
+            errno = EINVAL;
+            throw ring_error("the memfd is not a ring");
+        }
+    }
+    memory_ = mmap(nullptr, memory_size_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+    if (memory_ == MAP_FAILED) {
+        int error = errno;
+        release();
+        errno = error;
+        throw ring_error("failed to map the memfd");
+    }
+    control_ = reinterpret_cast<Control *>(memory_);
+    data_ = reinterpret_cast<uint8_t *>(memory_) + sizeof(Control);
+    if (create) {
+        new (control_) Control();
+    }
+}
+
+void ShmRing::drain(int fd) {
+    uint64_t count;
+    while (::read(fd, &count, sizeof(count)) > 0) {
+    }
+}
+
+std::vector<int> ShmRing::get_fds() const {
+    return {memfd_, data_fd_, space_fd_};
+}
+
+int ShmRing::get_data_fd() const {
+    return data_fd_;
+}
+
+ssize_t ShmRing::write(const iovec *iov, size_t num) {
+    uint64_t tail = control_->tail.load(std::memory_order_relaxed);
+    uint64_t head = control_->head.load(std::memory_order_acquire);
+    size_t space = SHM_RING_SIZE - std::min<uint64_t>(tail - head, SHM_RING_SIZE);
+    if (space == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t written = 0;
+    for (size_t i = 0; i < num && space > 0; i++) {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(iov[i].iov_base);
+        size_t size = std::min(iov[i].iov_len, space);
+        size_t offset = tail & RING_MASK;
+        size_t first = std::min(size, SHM_RING_SIZE - offset);
+        memcpy(data_ + offset, bytes, first);
+        memcpy(data_, bytes + first, size - first);
+        tail += size;
+        space -= size;
+        written += size;
+    }
+    // Paired with sleep_reader(), either the reader sees the bytes or it is woken up.
+    control_->tail.store(tail, std::memory_order_seq_cst);
+    if (control_->reader_idle.load(std::memory_order_seq_cst)) {
+        uint64_t one = 1;
+        ::write(data_fd_, &one, sizeof(one));
+    }
+    return written;
+}
+
+int ShmRing::get_space_fd() const {
+    return space_fd_;
+}
+
+bool ShmRing::sleep_writer() {
+    control_->writer_idle.store(1, std::memory_order_seq_cst);
+    uint64_t head = control_->head.load(std::memory_order_seq_cst);
+    if (control_->tail.load(std::memory_order_relaxed) - head < SHM_RING_SIZE) {
+        control_->writer_idle.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void ShmRing::wake_writer() {
+    control_->writer_idle.store(0, std::memory_order_relaxed);
+    drain(space_fd_);
+}
+
+bool ShmRing::read(std::vector<uint8_t> &buffer) {
+    uint64_t head = control_->head.load(std::memory_order_relaxed);
+    uint64_t tail = control_->tail.load(std::memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+    size_t size = std::min<uint64_t>(tail - head, SHM_RING_SIZE);
+    size_t offset = head & RING_MASK;
+    size_t first = std::min(size, SHM_RING_SIZE - offset);
+    buffer.insert(buffer.end(), data_ + offset, data_ + offset + first);
+    buffer.insert(buffer.end(), data_, data_ + (size - first));
+    // Paired with wait_writable(), either the writer sees the space or it is woken up.
+    control_->head.store(head + size, std::memory_order_seq_cst);
+    if (control_->writer_idle.load(std::memory_order_seq_cst)) {
+        uint64_t one = 1;
+        ::write(space_fd_, &one, sizeof(one));
+    }
+    return true;
+}
+
+bool ShmRing::readable() const {
+    return control_->tail.load(std::memory_order_acquire) != control_->head.load(std::memory_order_relaxed);
+}
+
+bool ShmRing::sleep_reader() {
+    control_->reader_idle.store(1, std::memory_order_seq_cst);
+    if (control_->tail.load(std::memory_order_seq_cst) != control_->head.load(std::memory_order_relaxed)) {
+        control_->reader_idle.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void ShmRing::wake_reader(bool signaled) {
+    control_->reader_idle.store(0, std::memory_order_relaxed);
+    if (signaled) {
+        drain(data_fd_);
+    }
+}
@@ -0,0 +1,128 @@
+#include "WritePoller.hpp"
+#include "Sender.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <algorithm>
+#include <array>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+namespace {
+    std::runtime_error poller_error(const std::string &what) {
+        return std::runtime_error(
+            "WritePoller failed: " + what + ". errno: " + std::to_string(errno) + " " + strerror(errno)
+        );
+    }
+}
+
+WritePoller::WritePoller() : resuming_(nullptr) {
+    epollfd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd_ < 0) {
+        throw poller_error("failed to create the epoll");
+    }
+    wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd_ < 0) {
+        close(epollfd_);
+        throw poller_error("failed to create the eventfd");
+    }
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(epollfd_, EPOLL_CTL_ADD, wake_fd_, &event) < 0) {
+        close(wake_fd_);
+        close(epollfd_);
+        throw poller_error("failed to watch the eventfd");
+    }
+    thread_ = std::thread(&WritePoller::run, this);
+}
+
+WritePoller::~WritePoller() {
+    uint64_t wake = 1;
+    if (write(wake_fd_, &wake, sizeof(wake)) < 0) {
+        perror("eventfd write error");
+    }
+    thread_.join();
+    close(wake_fd_);
+    close(epollfd_);
+}
+
+WritePoller &WritePoller::get() {
+    static WritePoller poller;
+    return poller;
+}
+
+void WritePoller::wait(Sender *sender, int fd, uint32_t events) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = sender;
+    auto it = std::find_if(registrations_.begin(), registrations_.end(), [&](const Registration &registration) {
+        return registration.sender == sender && registration.fd == fd;
+    });
+    if (it == registrations_.end()) {
+        registrations_.push_back(Registration {sender, fd, true});
+        epoll_ctl(epollfd_, EPOLL_CTL_ADD, fd, &event);
+    } else {
+        // Disarmed by the last event, arm it again.
+        it->armed = true;
+        epoll_ctl(epollfd_, EPOLL_CTL_MOD, fd, &event);
+    }
+}
+
+void WritePoller::remove(Sender *sender) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < registrations_.size();) {
+        if (registrations_[i].sender == sender) {
+            // Fails if the fd is already closed, which removed it.
+            epoll_ctl(epollfd_, EPOLL_CTL_DEL, registrations_[i].fd, nullptr);
+            registrations_[i] = registrations_.back();
+            registrations_.pop_back();
+        } else {
+            i++;
+        }
+    }
+    resumed_cond_.wait(lock, [&] {
+        return resuming_ != sender;
+    });
+}
+
+void WritePoller::run() {
+    std::array<epoll_event, MAX_LOOP_EVENTS> events;
+    while (true) {
+        int result = epoll_wait(epollfd_, events.data(), events.size(), -1);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait error");
+            return;
+        }
+        for (int i = 0; i < result; i++) {
+            Sender *sender = static_cast<Sender *>(events[i].data.ptr);
+            if (sender == nullptr) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            // The event may come from before the sender was removed, or armed again.
+            auto it = std::find_if(registrations_.begin(), registrations_.end(), [&](const Registration &registration) {
+                return registration.sender == sender && registration.armed;
+            });
+            if (it == registrations_.end()) {
+                continue;
+            }
+            it->armed = false;
+            resuming_ = sender;
+            lock.unlock();
+
+            sender->resume_writing();
+
+            lock.lock();
+            resuming_ = nullptr;
+            lock.unlock();
+            resumed_cond_.notify_all();
+        }
+    }
+}
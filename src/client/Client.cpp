@@ -5,12 +5,23 @@
 #include <chrono>
 #include <ctime>
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <poll.h>
 
 Client::Client(
-    std::string name
-) : name_(name) {  // in order not to increase the pakage id
+    std::string name,
+    bool own_loop
+) : name_(std::move(name)), datagram_stopping_(false), own_loop_(own_loop), received_num_(0),
+    flows_(), client_list_version_(0), client_list_valid_(false),
+    client_list_pages_version_(0), watching_presence_(false), batching_acks_(false),
+    cumulative_ack_(-1) {  // in order not to increase the pakage id
     // Prepare the server_addr_.
-    server_addr_.sin_family = AF_INET;
+    memset(&server_addr_, 0, sizeof(server_addr_));
+    server_addr_len_ = 0;
+    shared_memory_ = false;
+    use_datagram_ = false;
+    memset(&datagram_server_addr_, 0, sizeof(datagram_server_addr_));
 
     // Not to create a socket until call connect_to_server().
     sockfd_ = -1;
@@ -21,16 +32,28 @@ Client::Client(
 
     // Not to get self_id_ until call connect_to_server().
     self_id_ = 0;
+    closing_ = false;
 
-    // Initialize the message_type_map_.
-    message_type_map_ = std::make_unique<Map<uint16_t, MessageType> >();
+    // Initialize the request_table_.
+    request_table_ = std::make_unique<RequestTable>();
 
-    // Initialize the message_queue_.
+    // Initialize the message_queue_, nothing is kept in it until set_logging().
     output_queue_ = std::make_unique<Queue<std::string> >();
+    logging_ = false;
+
+    // Prepare the message handlers.
+    register_handlers();
 }
 
 Client::~Client() {
-    if (sockfd_ < 0) {
+    bool connected;
+    {
+        // Not to resume the session any more.
+        std::lock_guard<std::mutex> lock(resume_mutex_);
+        closing_ = true;
+        connected = sockfd_ >= 0;
+    }
+    if (!connected) {
         // Not connected to the server.
         join_threads();
         return;
@@ -39,20 +62,35 @@ Client::~Client() {
     // Try to disconnect from the server.
     try {
         disconnect_from_server();
+        if (!own_loop_) {
+            // Drive the loop until the ACK, as the thread would.
+            std::chrono::steady_clock::time_point deadline =
+                std::chrono::steady_clock::now() + std::chrono::milliseconds(REQUEST_TIMEOUT);
+            while (std::chrono::steady_clock::now() < deadline && run_once(TIMEOUT)) {
+            }
+            if (sockfd_ >= 0) {
+                throw std::runtime_error("Disconnect Request failed: no answer from the server.");
+            }
+        }
         // Wait for the threads to finish.
         join_threads();
     } catch (const std::exception &e) {
         // Error in disconnection, delete sockfd_ anyway.
-        output_queue_->push("[WARN] " + std::string(e.what()));
-        output_queue_->push("[WARN] Release the client anyway.");
+        output("[WARN] " + std::string(e.what()));
+        output("[WARN] Release the client anyway.");
         // Close the socket.
         close(sockfd_);
         // Terminate the threads.
         std::thread::native_handle_type handle;
-        if (receive_thread_->joinable()) {
+        if (receive_thread_ != nullptr && receive_thread_->joinable()) {
             handle = receive_thread_->native_handle();
             pthread_cancel(handle);
         }
+        // Only waits for the datagrams, it stops in time.
+        datagram_stopping_ = true;
+        if (datagram_thread_ != nullptr && datagram_thread_->joinable()) {
+            datagram_thread_->join();
+        }
     }
 
     // Output the remaining messages.
@@ -64,11 +102,60 @@ bool Client::connect_to_server(in_addr_t addr, int port) {
         throw std::runtime_error("Connect Request failed: already connected to the server.");
     }
     // Prepare the server_addr_.
-    server_addr_.sin_port = htons(port);
-    server_addr_.sin_addr.s_addr = addr;
+    memset(&server_addr_, 0, sizeof(server_addr_));
+    sockaddr_in *server_addr = reinterpret_cast<sockaddr_in *>(&server_addr_);
+    server_addr->sin_family = AF_INET;
+    server_addr->sin_port = htons(port);
+    server_addr->sin_addr.s_addr = addr;
+    server_addr_len_ = sizeof(sockaddr_in);
+    shared_memory_ = false;
+    return connect_session();
+}
 
+bool Client::connect_to_server(const std::string &path, bool shared_memory) {
+    if (sockfd_ >= 0) {
+        throw std::runtime_error("Connect Request failed: already connected to the server.");
+    }
+    // Prepare the server_addr_.
+    memset(&server_addr_, 0, sizeof(server_addr_));
+    sockaddr_un *server_addr = reinterpret_cast<sockaddr_un *>(&server_addr_);
+    if (path.size() >= sizeof(server_addr->sun_path)) {
+        throw std::runtime_error("Connect Request failed: the unix socket path is too long.");
+    }
+    server_addr->sun_family = AF_UNIX;
+    memcpy(server_addr->sun_path, path.c_str(), path.size());
+    server_addr_len_ = sizeof(sockaddr_un);
+    shared_memory_ = shared_memory;
+    return connect_session();
+}
+
+void Client::set_datagram(bool enable) {
+    use_datagram_ = enable;
+}
+
+send_res_t Client::send_handshake(Sender &sender, Receiver &receiver, bool resume, uint16_t datagram_port) {
+    std::vector<int> fds;
+    std::unique_ptr<ShmRing> to_server;
+    std::unique_ptr<ShmRing> from_server;
+    if (shared_memory_) {
+        to_server = std::make_unique<ShmRing>();
+        from_server = std::make_unique<ShmRing>();
+        fds = to_server->get_fds();
+        std::vector<int> from_server_fds = from_server->get_fds();
+        fds.insert(fds.end(), from_server_fds.begin(), from_server_fds.end());
+    }
+    send_res_t result = resume ? sender.send_resume_request(session_token_, fds, datagram_port)
+                               : sender.send_connect_request(name_, fds, datagram_port);
+    if (shared_memory_) {
+        sender.attach_ring(std::move(to_server));
+        receiver.attach_ring(std::move(from_server));
+    }
+    return result;
+}
+
+bool Client::connect_session(int redirect_num) {
     // Create a socket.
-    sockfd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd_ = socket(server_addr_.ss_family, SOCK_STREAM, 0);
     if (sockfd_ < 0) {
         std::string error_msg = "Connect Request failed: failed to create a socket. errno: " +
                                 std::to_string(errno) + " " + strerror(errno);
@@ -76,7 +163,7 @@ bool Client::connect_to_server(in_addr_t addr, int port) {
     }
 
     // Connect to the server.
-    if (connect(sockfd_, cast_sockaddr_in(server_addr_), sizeof(server_addr_)) < 0) {
+    if (connect(sockfd_, cast_sockaddr_in(server_addr_), server_addr_len_) < 0) {
         close(sockfd_);
         sockfd_ = -1;
         std::string error_msg = "Connect Request failed: failed to connect to the server. errno: " +
@@ -85,34 +172,120 @@ bool Client::connect_to_server(in_addr_t addr, int port) {
     }
 
     // Create a sender and a receiver.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
     sender_ = std::make_unique<Sender>(sockfd_, 0);
     receiver_ = std::make_unique<Receiver>(sockfd_, 0);
+    connection_lock.unlock();
+
+    // Open a datagram channel on any port, kept if the server answers with its port.
+    std::unique_ptr<DatagramChannel> datagram_channel;
+    if (use_datagram_ && server_addr_.ss_family == AF_INET) {
+        sockaddr_in any_addr;
+        memset(&any_addr, 0, sizeof(any_addr));
+        any_addr.sin_family = AF_INET;
+        any_addr.sin_addr.s_addr = INADDR_ANY;
+        try {
+            datagram_channel = std::make_unique<DatagramChannel>(any_addr);
+        } catch (std::exception &e) {
+            output("[WARN] " + std::string(e.what()));
+        }
+    }
 
     // Send a Connect Request.
-    send_res_t result = sender_->send_connect_request(name_);
-    Message response(false);
+    send_res_t result;
+    try {
+        result = send_handshake(*sender_, *receiver_, false, datagram_channel ? datagram_channel->get_port() : 0);
+    } catch (std::exception &e) {
+        close(sockfd_);
+        sockfd_ = -1;
+        throw std::runtime_error("Connect Request failed: " + std::string(e.what()));
+    }
+    MessagePtr response = make_message();
     receiver_->receive(response);
-    if (check_afk(response, result)) {
+    if (response->get_type() == MessageType::REDIRECT && response->get_pakage_id() == result.first &&
+        response->get_data_num() == 2 && server_addr_.ss_family == AF_INET) {
+        // Placed on another server by a router, connect to it instead, and resume there later.
+        // Stopped before the fd can be reused by the next connection.
+        connection_lock.lock();
+        sender_.reset();
+        receiver_.reset();
+        close(sockfd_);
+        sockfd_ = -1;
+        connection_lock.unlock();
+        sockaddr_in *server_addr = reinterpret_cast<sockaddr_in *>(&server_addr_);
+        const data_t &data = response->get_data();
+        unsigned long port = strtoul(data[1].c_str(), nullptr, 10);
+        if (redirect_num >= MAX_REDIRECT_NUM || port == 0 || port > UINT16_MAX ||
+            inet_pton(AF_INET, data[0].c_str(), &server_addr->sin_addr) != 1) {
+            throw std::runtime_error("Connect Request failed: invalid redirect.");
+        }
+        server_addr->sin_port = htons((uint16_t)port);
+        output("[INFO] Redirected to " + data[0] + ":" + data[1] + ".");
+        return connect_session(redirect_num + 1);
+    }
+    if (check_afk(*response, result) && response->get_receiver_id() == SERVER_ID) {
+        // Refused, e.g. the server is full.
+        close(sockfd_);
+        sockfd_ = -1;
+        std::string reason = response->get_data_num() == 1 ? response->get_data()[0] : "refused";
+        throw std::runtime_error("Connect Request failed: " + reason);
+    }
+    if (check_afk(*response, result)) {
         // Successfully connected to the server.
-        self_id_ = response.get_receiver_id();
+        self_id_ = response->get_receiver_id();
+        session_token_ = response->get_data_num() >= 1 ? response->get_data()[0] : std::string();
         sender_->set_self_id(self_id_);
         receiver_->set_self_id(self_id_);
         // Start the threads.
         join_threads();
-        std::unique_lock<std::mutex> lock(message_type_map_->get_mutex());
-        message_type_map_->clear(lock);
-        receive_thread_ = std::move(
-            std::make_unique<std::thread>(
-                std::thread(
-                    &Client::receive_message,
-                    this
+        // The second element is the port of the datagram channel of the server, if it agrees.
+        datagram_channel_.reset();
+        unsigned long datagram_port = 0;
+        if (datagram_channel && response->get_data_num() == 2) {
+            datagram_port = strtoul(response->get_data()[1].c_str(), nullptr, 10);
+        }
+        if (datagram_port > 0 && datagram_port <= UINT16_MAX) {
+            datagram_server_addr_ = *reinterpret_cast<sockaddr_in *>(&server_addr_);
+            datagram_server_addr_.sin_port = htons((uint16_t)datagram_port);
+            datagram_channel->add_peer(datagram_server_addr_, SERVER_ID);
+            datagram_channel_ = std::move(datagram_channel);
+        }
+        std::unique_lock<std::mutex> flow_lock(flow_mutex_);
+        flows_ = {};
+        inflight_sends_.clear();
+        flow_lock.unlock();
+        // The ids may belong to others on this server.
+        std::unique_lock<std::mutex> client_list_lock(client_list_mutex_);
+        client_list_valid_ = false;
+        client_list_lock.unlock();
+        watching_presence_ = false;
+        batching_acks_ = false;
+        // Left by a former connection, if any.
+        close_requests();
+        if (own_loop_) {
+            receive_thread_ = std::move(
+                std::make_unique<std::thread>(
+                    std::thread(
+                        &Client::receive_message,
+                        this
+                    )
                 )
-            )
-        );
-        output_queue_->push(
+            );
+            if (datagram_channel_) {
+                datagram_stopping_ = false;
+                datagram_thread_ = std::make_unique<std::thread>(&Client::receive_datagrams, this);
+            }
+        }
+        output(
             "[INFO] Connected to the server with name \"" + name_ +
             "\" and id \"" + std::to_string((int)self_id_) + "\"."
         );
+        if (datagram_channel_) {
+            output(
+                "[INFO] Heart beats and datagrams go through UDP port " +
+                std::to_string(ntohs(datagram_server_addr_.sin_port)) + "."
+            );
+        }
     } else {
         // Error in connection.
         close(sockfd_);
@@ -124,230 +297,1048 @@ bool Client::connect_to_server(in_addr_t addr, int port) {
 }
 
 bool Client::disconnect_from_server() {
-    // Check if connected to the server.
-    if (sockfd_ < 0) {
-        throw std::runtime_error("Request failed: not connected to the server.");
-    }
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
 
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
     // Send a Disconnect Request.
     send_res_t result = sender_->send_disconnect_request();
-    std::unique_lock<std::mutex> lock(message_type_map_->get_mutex());
-    check_message_exist(result, lock);
-    message_type_map_->insert_or_assign(result.first, MessageType::DISCONNECT, lock);
+    add_request(result, MessageType::DISCONNECT, lock);
 
     return true;
 }
 
 bool Client::get_time() {
-    // Check if connected to the server.
-    if (sockfd_ < 0) {
-        throw std::runtime_error("Request failed: not connected to the server.");
-    }
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
 
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
     // Send a Request Time.
     send_res_t result = sender_->send_request_time();
-    std::unique_lock<std::mutex> lock(message_type_map_->get_mutex());
-    check_message_exist(result, lock);
-    message_type_map_->insert_or_assign(result.first, MessageType::REQTIME, lock);
+    add_request(result, MessageType::REQTIME, lock);
 
     return true;
 }
 
 bool Client::get_name() {
-    // Check if connected to the server.
-    if (sockfd_ < 0) {
-        throw std::runtime_error("Request failed: not connected to the server.");
-    }
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
 
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
     // Send a Request HOST.
     send_res_t result = sender_->send_request_host();
-    std::unique_lock<std::mutex> lock(message_type_map_->get_mutex());
-    check_message_exist(result, lock);
-    message_type_map_->insert_or_assign(result.first, MessageType::REQHOST, lock);
+    add_request(result, MessageType::REQHOST, lock);
 
     return true;
 }
 
 bool Client::get_client_list() {
-    // Check if connected to the server.
-    if (sockfd_ < 0) {
-        throw std::runtime_error("Request failed: not connected to the server.");
-    }
+    // Check if connected to the server, checked again when sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+    connection_lock.unlock();
 
-    // Send a Request Client List.
-    send_res_t result = sender_->send_request_client_list();
-    std::unique_lock<std::mutex> lock(message_type_map_->get_mutex());
-    check_message_exist(result, lock);
-    message_type_map_->insert_or_assign(result.first, MessageType::REQCLILIST, lock);
+    std::unique_lock<std::mutex> client_list_lock(client_list_mutex_);
+    if (client_list_valid_) {
+        request_client_list(MessageType::REQCLILIST_SINCE, 0);
+    } else {
+        client_list_pages_.clear();
+        client_list_pages_version_ = 0;
+        request_client_list(MessageType::REQCLILIST, 0);
+    }
 
     return true;
 }
 
-bool Client::send_message(uint8_t receiver_id, std::string content) {
-    static int cnt = 0;
-    // Check if connected to the server.
-    if (sockfd_ < 0) {
-        throw std::runtime_error("Request failed: not connected to the server.");
+void Client::request_client_list(MessageType type, uint8_t cursor) {
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    send_res_t result = type == MessageType::REQCLILIST_SINCE ?
+                        sender_->send_request_client_list_since(client_list_version_) :
+                        sender_->send_request_client_list(cursor);
+    add_request(result, type, lock);
+}
+
+bool Client::send_message(uint8_t receiver_id, std::string_view content) {
+    // Check if connected to the server, checked again when sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+    connection_lock.unlock();
+
+    std::unique_lock<std::mutex> flow_lock(flow_mutex_);
+    Flow &flow = flows_[receiver_id];
+    // Hold it back while the receiver is busy, behind the ones held before.
+    if (flow.waiting || !flow.backlog.empty() ||
+        (flow.inflight_bytes > 0 && flow.inflight_bytes + content.size() > FLOW_WINDOW)) {
+        flow.backlog.emplace_back(content);
+        output(
+            "[INFO] Receiver " + std::to_string(receiver_id) + " is busy, " +
+            std::to_string(flow.backlog.size()) + " message(s) queued."
+        );
+        return true;
     }
+    send_request_send(receiver_id, std::string(content), flow_lock);
 
+    return true;
+}
+
+void Client::send_request_send(
+    uint8_t receiver_id,
+    std::string content,
+    std::unique_lock<std::mutex> &flow_lock
+) {
+    // flows_ and inflight_sends_ are updated below.
+    check_lock(flow_lock, &flow_mutex_);
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+    static int cnt = 0;
     // Send a Request Send.
-    output_queue_->push("[DEBUG] Send message No." + std::to_string(++cnt));
+    if (logging_) {
+        output("[DEBUG] Send message No." + std::to_string(++cnt));
+    }
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
     send_res_t result = sender_->send_request_send(receiver_id, content);
-    std::unique_lock<std::mutex> lock(message_type_map_->get_mutex());
-    check_message_exist(result, lock);
-    message_type_map_->insert_or_assign(result.first, MessageType::REQSEND, lock);
+    add_request(result, MessageType::REQSEND, lock);
+    lock.unlock();
+    // Kept until acknowledged, to send it again after a WAIT.
+    flows_[receiver_id].inflight_bytes += content.size();
+    inflight_sends_[result.first] = std::make_pair(receiver_id, std::move(content));
+}
+
+void Client::flush_backlog(uint8_t receiver_id, std::unique_lock<std::mutex> &flow_lock) {
+    Flow &flow = flows_[receiver_id];
+    while (!flow.waiting && !flow.backlog.empty() &&
+           (flow.inflight_bytes == 0 || flow.inflight_bytes + flow.backlog.front().size() <= FLOW_WINDOW)) {
+        std::string content = std::move(flow.backlog.front());
+        flow.backlog.pop_front();
+        try {
+            send_request_send(receiver_id, std::move(content), flow_lock);
+        } catch (const std::exception &e) {
+            output("[ERR] " + std::string(e.what()));
+            break;
+        }
+    }
+}
+
+void Client::return_window(uint16_t pakage_id) {
+    std::unique_lock<std::mutex> flow_lock(flow_mutex_);
+    auto it = inflight_sends_.find(pakage_id);
+    if (it == inflight_sends_.end()) {
+        return;
+    }
+    uint8_t receiver_id = it->second.first;
+    Flow &flow = flows_[receiver_id];
+    flow.inflight_bytes -= std::min(flow.inflight_bytes, it->second.second.size());
+    inflight_sends_.erase(it);
+    flush_backlog(receiver_id, flow_lock);
+}
+
+void Client::reset_flows() {
+    std::unique_lock<std::mutex> flow_lock(flow_mutex_);
+    inflight_sends_.clear();
+    for (size_t id = 0; id <= MAX_CLIENT_NUM; id++) {
+        flows_[id].inflight_bytes = 0;
+        flows_[id].waiting = false;
+        flows_[id].requeued_num = 0;
+        flush_backlog(id, flow_lock);
+    }
+}
+
+bool Client::attach_client(std::string_view name) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+
+    // A CONNECT on the connection, answered with the id of the attached client.
+    std::string client_name(name);
+    data_t data;
+    data.push_back(client_name);
+    Message message(MessageType::CONNECT, self_id_, SERVER_ID, std::move(data));
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    send_res_t result = sender_->send_message(message);
+    add_request(result, MessageType::CONNECT, lock, [this, client_name](Reply &reply) {
+        if (reply.status != ReplyStatus::ACKED) {
+            output("[ERR] Attach failed: no answer from the server.");
+            return;
+        }
+        // The id, a single byte, or the reason of the refusal.
+        const data_t &answer = reply.message->get_data();
+        if (answer.size() != 1 || answer[0].size() != 1) {
+            output("[ERR] Attach failed: " + (answer.empty() ? "invalid answer." : answer[0]));
+            return;
+        }
+        uint8_t id = answer[0][0];
+        std::unique_lock<std::mutex> attached_lock(attached_mutex_);
+        attached_.set(id);
+        attached_lock.unlock();
+        output(
+            "[INFO] Attached client \"" + client_name + "\" with id \"" + std::to_string(id) + "\"."
+        );
+    });
+
+    return true;
+}
+
+bool Client::detach_client(uint8_t client_id) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+    std::unique_lock<std::mutex> attached_lock(attached_mutex_);
+    if (!attached_.test(client_id)) {
+        throw std::runtime_error("Request failed: client " + std::to_string(client_id) + " is not attached.");
+    }
+    attached_lock.unlock();
+
+    // A DISCONNECT on behalf of the attached client, the ACK comes to it.
+    Message message(MessageType::DISCONNECT, client_id, SERVER_ID);
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    send_res_t result = sender_->send_message(message);
+    add_request(result, MessageType::DISCONNECT, lock, [this, client_id](Reply &reply) {
+        std::unique_lock<std::mutex> attached_lock(attached_mutex_);
+        attached_.reset(client_id);
+        attached_lock.unlock();
+        if (reply.status == ReplyStatus::ACKED) {
+            output("[INFO] Detached client \"" + std::to_string(client_id) + "\".");
+        } else {
+            output("[WARN] Detached client \"" + std::to_string(client_id) + "\" without an answer.");
+        }
+    });
+
+    return true;
+}
+
+bool Client::send_message_as(uint8_t client_id, uint8_t receiver_id, std::string_view content) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+    std::unique_lock<std::mutex> attached_lock(attached_mutex_);
+    if (!attached_.test(client_id)) {
+        throw std::runtime_error("Request failed: client " + std::to_string(client_id) + " is not attached.");
+    }
+    attached_lock.unlock();
+
+    data_t data;
+    data.emplace_back(content);
+    Message message(MessageType::REQSEND, client_id, receiver_id, std::move(data));
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    send_res_t result = sender_->send_message(message);
+    add_request(result, MessageType::REQSEND, lock);
+
+    return true;
+}
+
+bool Client::send_message_by_name(std::string_view receiver_name, std::string_view content) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    // Send a Request Send By Name.
+    send_res_t result = sender_->send_request_send_by_name(receiver_name, content);
+    add_request(result, MessageType::REQSEND_NAME, lock);
+
+    return true;
+}
+
+bool Client::send_datagram(uint8_t receiver_id, std::string_view content) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+
+    // Not registered as a request, nothing answers it.
+    if (datagram_channel_) {
+        data_t data;
+        data.emplace_back(content);
+        Message message(MessageType::DATAGRAM, self_id_, receiver_id, std::move(data));
+        if (datagram_channel_->send(datagram_server_addr_, message)) {
+            return true;
+        }
+        // Too large for a datagram.
+    }
+    sender_->send_datagram(receiver_id, content);
+    return true;
+}
+
+bool Client::send_multicast(const std::vector<uint8_t> &receiver_ids, std::string_view content) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    // Send a Request Multicast.
+    send_res_t result = sender_->send_request_multicast(receiver_ids, content);
+    add_request(result, MessageType::REQMULTI, lock);
+
+    return true;
+}
+
+bool Client::subscribe(std::string_view topic) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    // Send a Subscribe.
+    send_res_t result = sender_->send_subscribe(topic);
+    add_request(result, MessageType::SUBSCRIBE, lock);
+
+    return true;
+}
+
+bool Client::unsubscribe(std::string_view topic) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    // Send an Unsubscribe.
+    send_res_t result = sender_->send_unsubscribe(topic);
+    add_request(result, MessageType::UNSUBSCRIBE, lock);
+
+    return true;
+}
+
+bool Client::publish(std::string_view topic, std::string_view content) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    // Send a Publish.
+    send_res_t result = sender_->send_publish(topic, content);
+    add_request(result, MessageType::PUBLISH, lock);
+
+    return true;
+}
+
+bool Client::watch_presence(bool enable) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+
+    watching_presence_ = enable;
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    // Send a Presence.
+    send_res_t result = sender_->send_presence(enable);
+    add_request(result, MessageType::PRESENCE, lock);
+
+    return true;
+}
+
+bool Client::batch_acks(bool enable) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+
+    // The server takes ACKS either way, the FWDs are batched from now on.
+    batching_acks_ = enable;
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    // Send a Request ACKS.
+    send_res_t result = sender_->send_request_acks(enable);
+    add_request(result, MessageType::REQACKS, lock);
 
     return true;
 }
 
 void Client::receive_message() {
+    while (run_once(TIMEOUT)) {
+    }
+}
+
+void Client::receive_datagrams() {
+    while (!datagram_stopping_) {
+        poll_datagrams(TIMEOUT);
+    }
+}
+
+void Client::poll_datagrams(int timeout) {
+    pollfd poll_fd {datagram_channel_->get_fd(), POLLIN, 0};
+    if (timeout > 0 && poll(&poll_fd, 1, timeout) <= 0) {
+        return;
+    }
+    std::vector<std::pair<uint8_t, MessagePtr> > messages;
+    datagram_channel_->receive(messages);
+    for (auto &it : messages) {
+        MessagePtr &message = it.second;
+        if (message->get_receiver_id() != self_id_) {
+            continue;
+        }
+        if (message->get_type() == MessageType::HEARTBEAT) {
+            // Answer through the channel it came from.
+            Message heart_beat(MessageType::HEARTBEAT, self_id_, SERVER_ID, {}, false);
+            heart_beat.set_pakage_id(0);
+            datagram_channel_->send(datagram_server_addr_, heart_beat);
+        } else if (message->get_type() == MessageType::DATAGRAM && message->get_data_num() > 0) {
+            handle_datagram(message);
+        }
+    }
+}
+
+bool Client::run_once(int timeout) {
     // Check if connected to the server.
     if (sockfd_ < 0) {
-        throw std::runtime_error("Receive failed: not connected to the server.");
+        return false;
     }
 
-    Message message;
-    int cnt = 0;
-    while (receiver_->receive(message)) {
-        // If heartbeat, not to output.
-        if (message.get_type() != MessageType::HEARTBEAT) {
-            output_queue_->push("[DEBUG] Receive message No." +
-                                std::to_string(++cnt) +
-                                " : " +
-                                message.to_string());
+    expire_requests();
+    if (!own_loop_ && datagram_channel_) {
+        // Without datagram_thread_, take the datagrams on the way.
+        poll_datagrams(0);
+    }
+    ssize_t size = receiver_->receive(loop_message_, timeout);
+    if (size < 0) {
+        // Nothing in time.
+        return true;
+    }
+    // Whether the connection is closed on purpose, rather than dropped.
+    bool stopped = false;
+    if (size > 0) {
+        if (handle_message(loop_message_)) {
+            // Acknowledge the FWDs read at once together, before waiting for more.
+            if (!receiver_->has_buffered()) {
+                flush_acks();
+            }
+            return true;
+        }
+        stopped = true;
+    }
+
+    // Remove the connection, once no other thread is sending through it.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    int sockfd = sockfd_;
+    sockfd_ = -1;
+    // The FWDs not acknowledged are replayed after resuming.
+    cumulative_ack_ = -1;
+    selective_acks_.clear();
+    // Flush and stop the sender before the socket is closed.
+    sender_.reset();
+    receiver_.reset();
+    close(sockfd);
+    connection_lock.unlock();
+    // The attached clients leave with it, and are not resumed.
+    std::unique_lock<std::mutex> attached_lock(attached_mutex_);
+    if (attached_.any()) {
+        output("[INFO] " + std::to_string(attached_.count()) + " attached client(s) left with the connection.");
+        attached_.reset();
+    }
+    attached_lock.unlock();
+
+    // The connection dropped, try to get the session back.
+    if (!stopped) {
+        output("[WARN] Connection dropped, resuming the session...");
+        if (resume_session()) {
+            output(
+                "[INFO] Resumed the session with id \"" + std::to_string((int)self_id_) + "\"."
+            );
+            reset_flows();
+            // The server forgets the watchers whose connection drops.
+            if (watching_presence_) {
+                watch_presence(true);
+            }
+            if (batching_acks_) {
+                batch_acks(true);
+            }
+            return true;
         }
-        // Check if message sent to self.
-        if (!message.get_receiver_id() == self_id_) {
+    }
+    close_requests();
+    datagram_stopping_ = true;
+    output("[INFO] Disconnected from the server.");
+    return false;
+}
+
+bool Client::handle_message(MessagePtr &message) {
+    // If heartbeat, not to output, nor to format it for nothing.
+    if (logging_ && message->get_type() != MessageType::HEARTBEAT) {
+        output("[DEBUG] Receive message No." +
+               std::to_string(++received_num_) +
+               " : " +
+               message->to_string());
+    }
+    // Check if message sent to self, or shared by several receivers.
+    if (message->get_receiver_id() != self_id_ &&
+        !((message->get_type() == MessageType::FWD || message->get_type() == MessageType::PUBLISH ||
+           message->get_type() == MessageType::PRESENCE) &&
+          message->get_receiver_id() == MULTICAST_ID)) {
+        // Or to a client attached to the connection.
+        std::unique_lock<std::mutex> attached_lock(attached_mutex_);
+        if (!attached_.test(message->get_receiver_id())) {
             // ignore the message.
+            return true;
+        }
+    }
+
+    DispatchResult result = dispatcher_.dispatch(this, message);
+    if (result == DispatchResult::STOP) {
+        return false;
+    } else if (result == DispatchResult::INVALID) {
+        output("[ERR] Unknown message type.");
+    } else if (result == DispatchResult::MALFORMED) {
+        output("[ERR] Malformed message: " + message->to_string());
+    }
+    return true;
+}
+
+bool Client::resume_session() {
+    if (session_token_.empty()) {
+        return false;
+    }
+    for (int i = 0; i < RESUME_RETRY_NUM; i++) {
+        // Back off with jitter, so that the clients dropped together do not come back together.
+        std::this_thread::sleep_for(std::chrono::milliseconds((TIMEOUT << i) + rand() % TIMEOUT));
+        if (closing_) {
+            return false;
+        }
+
+        int sockfd = socket(server_addr_.ss_family, SOCK_STREAM, 0);
+        if (sockfd < 0) {
+            continue;
+        }
+        if (connect(sockfd, cast_sockaddr_in(server_addr_), server_addr_len_) < 0) {
+            close(sockfd);
             continue;
         }
 
-        // Check the type of the message
-        if (message.get_type() == MessageType::DISCONNECT) {
-            // Send an ACK.
-            sender_->send_acknowledge(message.get_pakage_id(), message.get_sender_id());
-            break;
-        } else if (message.get_type() == MessageType::FWD) {
-            std::string content;
-            data_t data = message.get_data();
-            for (auto &str : data) {
-                content += str;
-                content += "$\n";
+        // Send a Resume Request with the old id.
+        std::unique_ptr<Sender> sender = std::make_unique<Sender>(sockfd, self_id_);
+        std::unique_ptr<Receiver> receiver = std::make_unique<Receiver>(sockfd, self_id_);
+        send_res_t result;
+        try {
+            result = send_handshake(*sender, *receiver, true, datagram_channel_ ? datagram_channel_->get_port() : 0);
+        } catch (std::exception &e) {
+            sender.reset();
+            receiver.reset();
+            close(sockfd);
+            continue;
+        }
+        MessagePtr response = make_message();
+        bool received = receiver->receive(response) && check_afk(*response, result);
+        if (received && response->get_data_num() == 0) {
+            std::lock_guard<std::mutex> lock(resume_mutex_);
+            if (!closing_) {
+                std::lock_guard<std::mutex> connection_lock(connection_mutex_);
+                sockfd_ = sockfd;
+                sender_ = std::move(sender);
+                receiver_ = std::move(receiver);
+                // The server starts the sequence numbers over, and expects them to.
+                if (datagram_channel_) {
+                    datagram_channel_->add_peer(datagram_server_addr_, SERVER_ID);
+                }
+                return true;
             }
-            output_queue_->push("Message from client " +
-                                std::to_string((int)message.get_sender_id()) +
-                                ": " +
-                                content);
-            // Send an ACK.
-            sender_->send_acknowledge(message.get_pakage_id(), message.get_sender_id());
-        } else if (message.get_type() == MessageType::ACK) {
-            std::unique_lock<std::mutex> lock(message_type_map_->get_mutex());
-            // Check if the pakage id exists.
-            if (!message_type_map_->check_exist(message.get_pakage_id(), lock)) {
-                // ignore the message.
-                continue;
+        }
+        sender.reset();
+        receiver.reset();
+        close(sockfd);
+        if (received) {
+            // Refused, the session is gone, or the client is being released.
+            if (response->get_data_num() != 0) {
+                output("[ERR] Resume failed: " + response->get_data()[0]);
             }
+            return false;
+        }
+    }
+    return false;
+}
 
-            // Get the type of the message.
-            MessageType type = message_type_map_->at(message.get_pakage_id(), lock);
-            // Remove the pakage id.
-            message_type_map_->erase(message.get_pakage_id(), lock);
-            // Check if the sender id is correct.
-            if (message.get_sender_id() != SERVER_ID) {
-                output_queue_->push("[ERR] ACK failed: wrong sender id.");
-                if (type != MessageType::DISCONNECT) {
-                    // ignore the message.
-                    continue;
-                } else {
-                    output_queue_->push("[WARN] Release the connection anyway.");
-                }
-            }
+void Client::register_handlers() {
+    dispatcher_.register_handler<MessageType::HEARTBEAT>(&Client::handle_heart_beat);
+    dispatcher_.register_handler<MessageType::DISCONNECT>(&Client::handle_disconnect);
+    dispatcher_.register_handler<MessageType::FWD>(&Client::handle_forward);
+    dispatcher_.register_handler<MessageType::PUBLISH>(&Client::handle_publish);
+    dispatcher_.register_handler<MessageType::ACK>(&Client::handle_acknowledge);
+    dispatcher_.register_handler<MessageType::WAIT>(&Client::handle_wait);
+    dispatcher_.register_handler<MessageType::CREDIT>(&Client::handle_credit);
+    dispatcher_.register_handler<MessageType::PRESENCE>(&Client::handle_presence);
+    dispatcher_.register_handler<MessageType::DATAGRAM>(&Client::handle_datagram);
+    dispatcher_.register_handler<MessageType::ACKS>(&Client::handle_batched_acknowledge);
 
-            // Do different things according to the type of the message.
-            if (type == MessageType::DISCONNECT) {
-                break;
-            } else if (type == MessageType::REQTIME) {
-                // Get the time.
-                data_t data = message.get_data();
-                if (data.size() != 1) {
-                    output_queue_->push("[ERR] Request Time failed: data size is not 1.");
-                    // ignore the message.
-                    continue;
-                }
-                std::string timestamp = data[0];
-                std::time_t t = std::stol(timestamp);
-                std::string time = std::ctime(&t);
-                // remove the '\n' at the end of the string.
-                time.pop_back();
-                output_queue_->push("Time: " + time);
-            } else if (type == MessageType::REQHOST) {
-                // Get the name.
-                data_t data = message.get_data();
-                if (data.size() != 1) {
-                    output_queue_->push("[ERR] Request Host failed: data size is not 1.");
-                    // ignore the message.
-                    continue;
-                }
-                output_queue_->push("Server name: " + data[0]);
-            } else if (type == MessageType::REQCLILIST) {
-                // Get the client list.
-                data_t data = message.get_data();
-                /* In the data, one client occupies 4 elements:
-                 * 1. id
-                 * 2. name
-                 * 3. ip
-                 * 4. port
-                 */
-                output_queue_->push("---- Client List ----");
-                for (auto it : data) {
-                    // Find the positions of the 4 DIVISION_SIGNALs
-                    int pos1 = it.find(DIVISION_SIGNAL);
-                    int pos2 = it.find(DIVISION_SIGNAL, pos1 + 1);
-                    int pos3 = it.find(DIVISION_SIGNAL, pos2 + 1);
-                    int pos4 = it.find(DIVISION_SIGNAL, pos3 + 1);
-                    if (pos1 == std::string::npos ||
-                        pos2 == std::string::npos ||
-                        pos3 == std::string::npos ||
-                        pos4 == std::string::npos) {
-                        output_queue_->push("[ERR] Request Client List failed: invalid data.");
-                        // ignore the message.
-                        continue;
-                    }
-                    std::string id_str = it.substr(0, pos1);
-                    std::string name_str = it.substr(pos1 + 1, pos2 - pos1 - 1);
-                    std::string ip_str = it.substr(pos2 + 1, pos3 - pos2 - 1);
-                    std::string port_str = it.substr(pos3 + 1, pos4 - pos3 - 1);
-                    output_queue_->push("  ID: " + id_str);
-                    output_queue_->push("Name: " + name_str);
-                    output_queue_->push("  IP: " + ip_str);
-                    output_queue_->push("Port: " + port_str);
-                    output_queue_->push("---------------------");
-                }
-            } else if (type == MessageType::REQSEND) {
-                // Get the result.
-                data_t data = message.get_data();
-                if (data.size() != 0) {
-                    std::string error_msg = "[ERR] Request Send failed: " + data[0];
-                    output_queue_->push(error_msg);
-                } else {
-                    output_queue_->push("[INFO] Request Send succeeded.");
-                }
-            } else {
-                output_queue_->push("[ERR] Unknown message type.");
-            }
-        } else if (message.get_type() == MessageType::HEARTBEAT) {
-            // Response to a heartbeat.
-            sender_->send_heart_beat(message.get_sender_id());
+    ack_dispatcher_.register_handler<MessageType::DISCONNECT>(&Client::handle_disconnect_ack);
+    ack_dispatcher_.register_handler<MessageType::REQTIME>(&Client::handle_request_time_ack);
+    ack_dispatcher_.register_handler<MessageType::REQHOST>(&Client::handle_request_host_ack);
+    ack_dispatcher_.register_handler<MessageType::REQCLILIST>(&Client::handle_request_client_list_ack);
+    ack_dispatcher_.register_handler<MessageType::REQCLILIST_SINCE>(&Client::handle_request_client_list_since_ack);
+    ack_dispatcher_.register_handler<MessageType::REQSEND>(&Client::handle_request_send_ack);
+    ack_dispatcher_.register_handler<MessageType::REQSEND_NAME>(&Client::handle_request_send_ack);
+    ack_dispatcher_.register_handler<MessageType::REQMULTI>(&Client::handle_request_multicast_ack);
+    ack_dispatcher_.register_handler<MessageType::SUBSCRIBE>(&Client::handle_subscribe_ack);
+    ack_dispatcher_.register_handler<MessageType::UNSUBSCRIBE>(&Client::handle_unsubscribe_ack);
+    ack_dispatcher_.register_handler<MessageType::PUBLISH>(&Client::handle_publish_ack);
+    ack_dispatcher_.register_handler<MessageType::PRESENCE>(&Client::handle_presence_ack);
+    ack_dispatcher_.register_handler<MessageType::REQACKS>(&Client::handle_request_acks_ack);
+}
+
+DispatchResult Client::handle_heart_beat(MessagePtr &message) {
+    // Response to a heartbeat.
+    sender_->send_heart_beat(message->get_sender_id());
+    return DispatchResult::IGNORED;
+}
+
+DispatchResult Client::handle_disconnect(MessagePtr &message) {
+    // Send an ACK.
+    sender_->send_acknowledge(message->get_pakage_id(), message->get_sender_id());
+    return DispatchResult::STOP;
+}
+
+DispatchResult Client::handle_forward(MessagePtr &message) {
+    uint8_t receiver_id = message->get_receiver_id();
+    bool attached = receiver_id != self_id_ && receiver_id != MULTICAST_ID;
+    if (logging_) {
+        std::string content;
+        for (const auto &str : message->get_data()) {
+            content += str;
+            content += "$\n";
+        }
+        output("Message from client " +
+               std::to_string((int)message->get_sender_id()) +
+               (attached ? " to client " + std::to_string(receiver_id) : "") +
+               ": " +
+               content);
+    }
+    if (batching_acks_) {
+        // Sent with the others read at once, see flush_acks().
+        if (receiver_id == MULTICAST_ID) {
+            selective_acks_.push_back(message->get_pakage_id());
         } else {
-            output_queue_->push("[ERR] Unknown message type.");
+            cumulative_ack_ = message->get_pakage_id();
         }
+        return DispatchResult::DONE;
+    }
+    // Send an ACK, on behalf of the attached client it is for.
+    if (attached) {
+        Message ack(MessageType::ACK, receiver_id, message->get_sender_id(), {}, false);
+        ack.set_pakage_id(message->get_pakage_id());
+        sender_->send_message(ack);
+    } else {
+        sender_->send_acknowledge(message->get_pakage_id(), message->get_sender_id());
+    }
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_datagram(MessagePtr &message) {
+    std::string content;
+    for (const auto &str : message->get_data()) {
+        content += str;
+        content += "$\n";
+    }
+    output("Datagram from client " +
+           std::to_string((int)message->get_sender_id()) +
+           ": " +
+           content);
+    // Datagrams are not acknowledged.
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_publish(MessagePtr &message) {
+    // The first element is the topic, the rest is the content.
+    const data_t &data = message->get_data();
+    std::string content;
+    for (size_t i = 1; i < data.size(); i++) {
+        content += data[i];
+        content += "$\n";
+    }
+    output("Message on topic \"" + data[0] + "\" from client " +
+           std::to_string((int)message->get_sender_id()) +
+           ": " +
+           content);
+    // Published messages are not acknowledged.
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_acknowledge(MessagePtr &message) {
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    // Check if the pakage id is pending, and take the request out.
+    PendingRequest request;
+    if (!request_table_->take(message->get_pakage_id(), request, lock)) {
+        // ignore the message.
+        return DispatchResult::IGNORED;
+    }
+    MessageType type = request.type;
+    // Check if the sender id is correct.
+    if (message->get_sender_id() != SERVER_ID) {
+        output("[ERR] ACK failed: wrong sender id.");
+        if (type != MessageType::DISCONNECT) {
+            // ignore the message, the request still waits for its ACK.
+            request_table_->insert(std::move(request), lock);
+            return DispatchResult::IGNORED;
+        } else {
+            output("[WARN] Release the connection anyway.");
+        }
+    }
+    lock.unlock();
+
+    if (request.callback) {
+        complete_request(request, ReplyStatus::ACKED, std::move(message));
+        return DispatchResult::DONE;
+    }
+
+    // Do different things according to the type of the message.
+    DispatchResult result = ack_dispatcher_.dispatch(type, this, message);
+    if (result == DispatchResult::INVALID) {
+        output("[ERR] Unknown message type.");
+        return DispatchResult::IGNORED;
+    } else if (result == DispatchResult::MALFORMED) {
+        output("[ERR] Malformed ACK: " + message->to_string());
+        return DispatchResult::IGNORED;
+    }
+    return result;
+}
+
+DispatchResult Client::handle_batched_acknowledge(MessagePtr &message) {
+    if (message->get_sender_id() != SERVER_ID) {
+        output("[ERR] ACKS failed: wrong sender id.");
+        return DispatchResult::IGNORED;
+    }
+    // Only the ranges come from the server, the first element is empty.
+    std::vector<uint16_t> pakage_ids;
+    const data_t &data = message->get_data();
+    for (size_t i = 1; i < data.size(); i++) {
+        if (!Message::unpack_ack_ranges(data[i], pakage_ids)) {
+            return DispatchResult::MALFORMED;
+        }
+    }
+    // Every request is answered as by an ACK of its own.
+    for (uint16_t pakage_id : pakage_ids) {
+        MessagePtr ack = make_message();
+        ack->set_type(MessageType::ACK);
+        ack->set_pakage_id(pakage_id);
+        ack->set_sender_id(SERVER_ID);
+        ack->set_receiver_id(message->get_receiver_id());
+        handle_acknowledge(ack);
+    }
+    return DispatchResult::DONE;
+}
+
+void Client::flush_acks() {
+    if (cumulative_ack_ < 0 && selective_acks_.empty()) {
+        return;
+    }
+    sender_->send_acks(SERVER_ID, selective_acks_, cumulative_ack_);
+    cumulative_ack_ = -1;
+    selective_acks_.clear();
+}
+
+DispatchResult Client::handle_wait(MessagePtr &message) {
+    uint8_t receiver_id = message->get_data()[0][0];
+    // The WAIT answers the request instead of an ACK.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    PendingRequest request;
+    bool pending = request_table_->take(message->get_pakage_id(), request, lock);
+    lock.unlock();
+    if (pending && request.callback) {
+        // Up to the caller to send it again, after the CREDIT if any.
+        complete_request(request, ReplyStatus::WAITED, std::move(message));
+        return DispatchResult::DONE;
+    }
+
+    if (receiver_id == SERVER_ID) {
+        // Dropped by the rate limit of the server, not to be sent again.
+        output("[WARN] Request dropped: rate limit exceeded.");
+        return_window(message->get_pakage_id());
+        return DispatchResult::DONE;
+    }
+    std::unique_lock<std::mutex> flow_lock(flow_mutex_);
+    Flow &flow = flows_[receiver_id];
+    if (!flow.waiting) {
+        output("[WARN] Receiver " + std::to_string(receiver_id) + " is busy, waiting for credit.");
+    }
+    flow.waiting = true;
+    auto it = inflight_sends_.find(message->get_pakage_id());
+    if (it != inflight_sends_.end()) {
+        // Put it back before the messages never sent, after the ones put back before.
+        flow.inflight_bytes -= std::min(flow.inflight_bytes, it->second.second.size());
+        flow.backlog.insert(flow.backlog.begin() + flow.requeued_num, std::move(it->second.second));
+        flow.requeued_num++;
+        inflight_sends_.erase(it);
+    } else {
+        // Sent by name, not kept to be sent again.
+        output("[WARN] Request dropped: receiver " + std::to_string(receiver_id) + " is busy.");
+    }
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_credit(MessagePtr &message) {
+    uint8_t receiver_id = message->get_data()[0][0];
+    std::unique_lock<std::mutex> flow_lock(flow_mutex_);
+    Flow &flow = flows_[receiver_id];
+    output(
+        "[INFO] Receiver " + std::to_string(receiver_id) + " can take " +
+        message->get_data()[1] + " byte(s), sending " + std::to_string(flow.backlog.size()) +
+        " queued message(s)."
+    );
+    flow.waiting = false;
+    flow.requeued_num = 0;
+    flush_backlog(receiver_id, flow_lock);
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_disconnect_ack(MessagePtr &) {
+    return DispatchResult::STOP;
+}
+
+DispatchResult Client::handle_request_time_ack(MessagePtr &message) {
+    // Get the time.
+    std::time_t t = std::stol(message->get_data()[0]);
+    std::string time = std::ctime(&t);
+    // remove the '\n' at the end of the string.
+    time.pop_back();
+    output("Time: " + time);
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_request_host_ack(MessagePtr &message) {
+    // Get the name.
+    output("Server name: " + message->get_data()[0]);
+    return DispatchResult::DONE;
+}
+
+namespace {
+    /* Element 1 is the version, element 2 the cursor of the next page,
+     * the rest are the entries, the first byte is the kind:
+     * '+' u8 id, u32 address, u16 port (network order), name
+     * '-' u8 id
+     * '=' the entries replace the whole list
+     */
+    bool parse_version(const data_t &data, uint64_t &version) {
+        if (data[0].size() != sizeof(version)) {
+            return false;
+        }
+        memcpy(&version, data[0].data(), sizeof(version));
+        return true;
+    }
+
+    template <typename Entry>
+    void apply_entry(const std::string &entry, std::map<uint8_t, Entry> &list) {
+        if (entry.size() >= 8 && entry[0] == '+') {
+            in_addr addr;
+            uint16_t port;
+            memcpy(&addr.s_addr, &entry[2], 4);
+            memcpy(&port, &entry[6], 2);
+            list[(uint8_t)entry[1]] = Entry {entry.substr(8), inet_ntoa(addr), ntohs(port)};
+        } else if (entry.size() == 2 && entry[0] == '-') {
+            list.erase((uint8_t)entry[1]);
+        }
+    }
+}
+
+DispatchResult Client::handle_request_client_list_ack(MessagePtr &message) {
+    uint64_t version;
+    if (!parse_version(message->get_data(), version)) {
+        output("[ERR] Request Client List failed: invalid data.");
+        return DispatchResult::IGNORED;
+    }
+    std::unique_lock<std::mutex> client_list_lock(client_list_mutex_);
+    gather_client_list_page(version, message->get_data(), 2);
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_request_client_list_since_ack(MessagePtr &message) {
+    const data_t &data = message->get_data();
+    uint64_t version;
+    if (!parse_version(data, version)) {
+        output("[ERR] Request Client List failed: invalid data.");
+        return DispatchResult::IGNORED;
+    }
+    std::unique_lock<std::mutex> client_list_lock(client_list_mutex_);
+    if (data.size() > 2 && data[2] == "=") {
+        // Too far behind, the first page of the whole list follows.
+        client_list_pages_.clear();
+        client_list_pages_version_ = 0;
+        gather_client_list_page(version, data, 3);
+        return DispatchResult::DONE;
+    }
+    for (size_t i = 2; i < data.size(); i++) {
+        apply_entry(data[i], client_list_);
+    }
+    output(
+        "[INFO] Client list updated with " + std::to_string(data.size() - 2) + " change(s)."
+    );
+    client_list_version_ = version;
+    print_client_list();
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_presence(MessagePtr &message) {
+    // Element 1 is the version of the former notification, element 2 the version,
+    // the rest are the entries of the changed clients.
+    const data_t &data = message->get_data();
+    uint64_t since;
+    uint64_t version;
+    if (data.size() < 2 || !parse_version(data, since) || data[1].size() != sizeof(version)) {
+        output("[ERR] Presence failed: invalid data.");
+        return DispatchResult::IGNORED;
+    }
+    memcpy(&version, data[1].data(), sizeof(version));
+    if (data.size() > 2 && data[2] == "=") {
+        output("[INFO] Too many clients joined or left, use getcli to get the list.");
+        return DispatchResult::DONE;
+    }
+    std::map<uint8_t, ClientEntry> changes;
+    for (size_t i = 2; i < data.size(); i++) {
+        if (data[i].size() == 2 && data[i][0] == '-') {
+            output("[INFO] Client " + std::to_string((uint8_t)data[i][1]) + " left.");
+            continue;
+        }
+        apply_entry(data[i], changes);
+    }
+    for (const auto &it : changes) {
+        output(
+            "[INFO] Client " + std::to_string(it.first) + " joined: " + it.second.name +
+            " (" + it.second.ip + ":" + std::to_string(it.second.port) + ")"
+        );
+    }
+    // The entries tell the latest state of the changed clients, so they also apply
+    // to a cached list between the two versions.
+    std::unique_lock<std::mutex> client_list_lock(client_list_mutex_);
+    if (client_list_valid_ && since <= client_list_version_ && client_list_version_ < version) {
+        for (size_t i = 2; i < data.size(); i++) {
+            apply_entry(data[i], client_list_);
+        }
+        client_list_version_ = version;
+    }
+    // Notifications are not acknowledged.
+    return DispatchResult::DONE;
+}
+
+void Client::gather_client_list_page(uint64_t version, const data_t &data, size_t first) {
+    if (client_list_pages_version_ == 0) {
+        client_list_pages_version_ = version;
+    } else if (client_list_pages_version_ != version) {
+        // Changed between the pages, start over.
+        client_list_pages_.clear();
+        client_list_pages_version_ = 0;
+        request_client_list(MessageType::REQCLILIST, 0);
+        return;
+    }
+    for (size_t i = first; i < data.size(); i++) {
+        apply_entry(data[i], client_list_pages_);
+    }
+    if (!data[1].empty()) {
+        request_client_list(MessageType::REQCLILIST, data[1][0]);
+        return;
+    }
+    client_list_.swap(client_list_pages_);
+    client_list_pages_.clear();
+    client_list_pages_version_ = 0;
+    client_list_version_ = version;
+    client_list_valid_ = true;
+    print_client_list();
+}
+
+void Client::print_client_list() {
+    output("---- Client List (version " + std::to_string(client_list_version_) + ") ----");
+    for (const auto &it : client_list_) {
+        output("  ID: " + std::to_string(it.first));
+        output("Name: " + it.second.name);
+        output("  IP: " + it.second.ip);
+        output("Port: " + std::to_string(it.second.port));
+        output("---------------------");
+    }
+}
+
+DispatchResult Client::handle_request_send_ack(MessagePtr &message) {
+    // Get the result.
+    if (message->get_data_num() == 2) {
+        // Stored for an offline receiver.
+        output("[INFO] Request Send deferred: " + message->get_data()[1]);
+    } else if (message->get_data_num() != 0) {
+        std::string error_msg = "[ERR] Request Send failed: " + message->get_data()[0];
+        output(error_msg);
+    } else {
+        output("[INFO] Request Send succeeded.");
+    }
+
+    return_window(message->get_pakage_id());
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_request_multicast_ack(MessagePtr &message) {
+    // Element 1 lists the receivers which succeeded, element 2 the ones which failed.
+    const data_t &data = message->get_data();
+    std::string succeeded;
+    std::string failed;
+    for (uint8_t id : data[0]) {
+        succeeded += " " + std::to_string(id);
+    }
+    for (uint8_t id : data[1]) {
+        failed += " " + std::to_string(id);
+    }
+    output("[INFO] Request Multicast delivered to:" + (succeeded.empty() ? " none" : succeeded));
+    if (!failed.empty()) {
+        output("[ERR] Request Multicast failed for:" + failed);
+    }
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_subscribe_ack(MessagePtr &message) {
+    // Get the result.
+    if (message->get_data_num() != 0) {
+        output("[ERR] Subscribe failed: " + message->get_data()[0]);
+    } else {
+        output("[INFO] Subscribe succeeded.");
+    }
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_unsubscribe_ack(MessagePtr &message) {
+    // Get the result.
+    if (message->get_data_num() != 0) {
+        output("[ERR] Unsubscribe failed: " + message->get_data()[0]);
+    } else {
+        output("[INFO] Unsubscribe succeeded.");
+    }
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_presence_ack(MessagePtr &message) {
+    // Get the result.
+    if (message->get_data_num() != 0) {
+        output("[ERR] Presence failed: " + message->get_data()[0]);
+    } else {
+        output("[INFO] Presence succeeded.");
+    }
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_request_acks_ack(MessagePtr &message) {
+    // Get the result.
+    if (message->get_data_num() != 0) {
+        output("[ERR] Batch ACKs failed: " + message->get_data()[0]);
+    } else {
+        output("[INFO] Batch ACKs succeeded.");
+    }
+    return DispatchResult::DONE;
+}
+
+DispatchResult Client::handle_publish_ack(MessagePtr &message) {
+    // Get the number of subscribers reached.
+    output("[INFO] Publish delivered to " + message->get_data()[0] + " subscriber(s).");
+    return DispatchResult::DONE;
+}
+
+void Client::check_connected(std::unique_lock<std::mutex> &connection_lock) {
+    check_lock(connection_lock, &connection_mutex_);
+    if (sockfd_ < 0 || sender_ == nullptr) {
+        throw std::runtime_error("Request failed: not connected to the server.");
     }
-    // Remove the connection.
-    close(sockfd_);
-    sockfd_ = -1;
-    sender_.release();
-    receiver_.release();
-    output_queue_->push("[INFO] Disconnected from the server.");
 }
 
 void Client::join_threads() {
@@ -355,6 +1346,22 @@ void Client::join_threads() {
         receive_thread_->join();
         receive_thread_.release();
     }
+    // Stopped once the receiving is over.
+    datagram_stopping_ = true;
+    if (datagram_thread_ != nullptr && datagram_thread_->joinable()) {
+        datagram_thread_->join();
+        datagram_thread_.reset();
+    }
+}
+
+void Client::set_logging(bool enable) {
+    logging_ = enable;
+}
+
+void Client::output(std::string line) {
+    if (logging_) {
+        output_queue_->push(std::move(line));
+    }
 }
 
 bool Client::output_message() {
@@ -369,9 +1376,155 @@ bool Client::output_message() {
     return true;
 }
 
-bool Client::check_message_exist(send_res_t result, std::unique_lock<std::mutex> &lock) {
-    if (message_type_map_->check_exist(result.first, lock)) {
+void Client::add_request(
+    send_res_t result,
+    MessageType type,
+    std::unique_lock<std::mutex> &lock,
+    ReplyCallback callback,
+    int timeout
+) {
+    PendingRequest request {
+        result.first,
+        type,
+        std::move(callback),
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout)
+    };
+    if (!request_table_->insert(std::move(request), lock)) {
         throw std::runtime_error("Request failed: pakage id already exists.");
     }
-    return true;
+}
+
+void Client::request_async(
+    MessageType type,
+    uint8_t receiver_id,
+    data_t data,
+    ReplyCallback callback,
+    int timeout
+) {
+    // Check if connected to the server, and stay connected while sending.
+    std::unique_lock<std::mutex> connection_lock(connection_mutex_);
+    check_connected(connection_lock);
+    switch (type) {
+        case MessageType::REQTIME:
+        case MessageType::REQHOST:
+        case MessageType::REQCLILIST:
+        case MessageType::REQCLILIST_SINCE:
+        case MessageType::REQSEND:
+        case MessageType::REQSEND_NAME:
+        case MessageType::REQMULTI:
+        case MessageType::SUBSCRIBE:
+        case MessageType::UNSUBSCRIBE:
+        case MessageType::PUBLISH:
+        case MessageType::PRESENCE:
+            break;
+        default:
+            throw std::runtime_error("Request failed: the type is not answered by an ACK.");
+    }
+
+    // Register the request before the ACK can arrive.
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    Message message(type, self_id_, receiver_id, std::move(data));
+    send_res_t result = sender_->send_message(message);
+    add_request(result, type, lock, std::move(callback), timeout);
+}
+
+std::future<Reply> Client::request_async(
+    MessageType type,
+    uint8_t receiver_id,
+    data_t data,
+    int timeout
+) {
+    // Shared by the callback, which may be copied.
+    std::shared_ptr<std::promise<Reply> > promise = std::make_shared<std::promise<Reply> >();
+    std::future<Reply> future = promise->get_future();
+    request_async(
+        type,
+        receiver_id,
+        std::move(data),
+        [promise](Reply &reply) { promise->set_value(std::move(reply)); },
+        timeout
+    );
+    return future;
+}
+
+ReplyAwaiter Client::request(
+    EventLoop &loop,
+    MessageType type,
+    uint8_t receiver_id,
+    data_t data,
+    int timeout
+) {
+    return ReplyAwaiter(*this, loop, type, receiver_id, std::move(data), timeout);
+}
+
+ReplyAwaiter::ReplyAwaiter(
+    Client &client,
+    EventLoop &loop,
+    MessageType type,
+    uint8_t receiver_id,
+    data_t data,
+    int timeout
+) : client_(client), loop_(loop), type_(type), receiver_id_(receiver_id), data_(std::move(data)),
+    timeout_(timeout), reply_(std::make_shared<Reply>()) {}
+
+void ReplyAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    std::shared_ptr<Reply> reply = reply_;
+    EventLoop *loop = &loop_;
+    client_.request_async(
+        type_,
+        receiver_id_,
+        std::move(data_),
+        [reply, loop, handle](Reply &answer) {
+            *reply = std::move(answer);
+            // Answered on the loop of the client, resume on the loop of the coroutine.
+            loop->post([handle] { handle.resume(); });
+        },
+        timeout_
+    );
+}
+
+void Client::complete_request(PendingRequest &request, ReplyStatus status, MessagePtr message) {
+    if (request.callback) {
+        Reply reply {status, request.type, std::move(message)};
+        request.callback(reply);
+        return;
+    }
+    // The ACKs and the WAITs of the others are handled by the handlers.
+    if (status == ReplyStatus::TIMED_OUT) {
+        output("[WARN] Request No." + std::to_string(request.package_id) + " timed out.");
+        if (request.type == MessageType::REQSEND) {
+            return_window(request.package_id);
+        }
+    }
+}
+
+void Client::expire_requests() {
+    std::vector<PendingRequest> requests;
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    if (request_table_->take_expired(std::chrono::steady_clock::now(), requests, lock) == 0) {
+        return;
+    }
+    lock.unlock();
+    for (PendingRequest &request : requests) {
+        complete_request(request, ReplyStatus::TIMED_OUT, MessagePtr());
+    }
+}
+
+void Client::close_requests() {
+    std::vector<PendingRequest> requests;
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    request_table_->take_all(requests, lock);
+    lock.unlock();
+    for (PendingRequest &request : requests) {
+        complete_request(request, ReplyStatus::CLOSED, MessagePtr());
+    }
+}
+
+size_t Client::get_pending_num() {
+    std::unique_lock<std::mutex> lock(request_table_->get_mutex());
+    return request_table_->size(lock);
+}
+
+uint8_t Client::get_self_id() {
+    return self_id_;
 }
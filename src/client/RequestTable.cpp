@@ -0,0 +1,55 @@
+#include "RequestTable.hpp"
+
+bool RequestTable::insert(PendingRequest request, std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    if (requests_.count(request.package_id) > 0) {
+        return false;
+    }
+    DeadlineMap::iterator deadline = deadlines_.emplace(request.deadline, request.package_id);
+    uint16_t package_id = request.package_id;
+    requests_.emplace(package_id, std::make_pair(std::move(request), deadline));
+    return true;
+}
+
+bool RequestTable::take(uint16_t package_id, PendingRequest &request, std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    auto it = requests_.find(package_id);
+    if (it == requests_.end()) {
+        return false;
+    }
+    request = std::move(it->second.first);
+    deadlines_.erase(it->second.second);
+    requests_.erase(it);
+    return true;
+}
+
+size_t RequestTable::take_expired(
+    std::chrono::steady_clock::time_point now,
+    std::vector<PendingRequest> &requests,
+    std::unique_lock<std::mutex> &lock
+) {
+    check_lock(lock, &mutex_);
+    requests.clear();
+    while (!deadlines_.empty() && deadlines_.begin()->first <= now) {
+        auto it = requests_.find(deadlines_.begin()->second);
+        requests.push_back(std::move(it->second.first));
+        requests_.erase(it);
+        deadlines_.erase(deadlines_.begin());
+    }
+    return requests.size();
+}
+
+void RequestTable::take_all(std::vector<PendingRequest> &requests, std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    requests.clear();
+    for (auto &it : requests_) {
+        requests.push_back(std::move(it.second.first));
+    }
+    requests_.clear();
+    deadlines_.clear();
+}
+
+size_t RequestTable::size(std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    return requests_.size();
+}
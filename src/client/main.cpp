@@ -1,7 +1,10 @@
 #include "Client.hpp"
+#include "EventLoop.hpp"
 #include <iostream>
 #include <future>
 #include <chrono>
+#include <algorithm>
+#include <sys/resource.h>
 
 enum Choice {
     BAD_CHOICE = -1,
@@ -12,6 +15,19 @@ enum Choice {
     GET_NAME,
     GET_CLIENT_LIST,
     SEND_MESSAGE,
+    SEND_BY_NAME,
+    MULTICAST,
+    SUBSCRIBE,
+    UNSUBSCRIBE,
+    PUBLISH,
+    PRESENCE,
+    UDP,
+    SEND_DATAGRAM,
+    ATTACH,
+    DETACH,
+    SEND_AS,
+    ACKS,
+    BENCH,
     HELP
 };
 
@@ -30,6 +46,32 @@ Choice get_choice(std::string choice) {
         return GET_CLIENT_LIST;
     } else if (choice == "send") {
         return SEND_MESSAGE;
+    } else if (choice == "sendto") {
+        return SEND_BY_NAME;
+    } else if (choice == "multi") {
+        return MULTICAST;
+    } else if (choice == "sub") {
+        return SUBSCRIBE;
+    } else if (choice == "unsub") {
+        return UNSUBSCRIBE;
+    } else if (choice == "pub") {
+        return PUBLISH;
+    } else if (choice == "presence") {
+        return PRESENCE;
+    } else if (choice == "udp") {
+        return UDP;
+    } else if (choice == "dgram") {
+        return SEND_DATAGRAM;
+    } else if (choice == "attach") {
+        return ATTACH;
+    } else if (choice == "detach") {
+        return DETACH;
+    } else if (choice == "as") {
+        return SEND_AS;
+    } else if (choice == "acks") {
+        return ACKS;
+    } else if (choice == "bench") {
+        return BENCH;
     } else if (choice == "help") {
         return HELP;
     } else {
@@ -38,10 +80,13 @@ Choice get_choice(std::string choice) {
 }
 
 void print_help() {
-    std::cout << "1. connect [<server address> <server port>]: Connect to the server." << std::endl
+    std::cout << "1. connect [<server address> <server port> | unix|shm [<path>]]: Connect to the server." << std::endl
                 << "\t<server address>: The address of the server." << std::endl
                 << "\t<server port>: The port of the server." << std::endl
                 << "\tIf not specified, the default address and port will be used." << std::endl
+                << "\tunix: Connect to the server on this host through its unix socket at <path>," << std::endl
+                << "\t      " << SERVER_UNIX_PATH << " if not specified." << std::endl
+                << "\tshm: Connect like unix, then carry the packets through shared memory." << std::endl
                 << "2. disconnect: Disconnect from the server." << std::endl
                 << "3. gettime: Get the time from the server." << std::endl
                 << "4. gethost: Get the name of the server." << std::endl
@@ -49,11 +94,73 @@ void print_help() {
                 << "6. send <id> \"<content>\": Send a message to a client." << std::endl
                 << "\t<id>: The id of the receiver." << std::endl
                 << "\t<content>: The content of the message. Need to be quoted." << std::endl
-                << "7. help: Print this message." << std::endl
+                << "7. sendto <name> \"<content>\": Send a message to a client by its name." << std::endl
+                << "\t<name>: The name of the receiver." << std::endl
+                << "\t<content>: The content of the message. Need to be quoted." << std::endl
+                << "8. multi <ids|all> \"<content>\": Send a message to several clients." << std::endl
+                << "\t<ids>: The ids of the receivers, separated by ','." << std::endl
+                << "\tall: Send to all the other clients." << std::endl
+                << "\t<content>: The content of the message. Need to be quoted." << std::endl
+                << "9. sub <topic>: Subscribe to a topic." << std::endl
+                << "10. unsub <topic>: Unsubscribe from a topic." << std::endl
+                << "11. pub <topic> \"<content>\": Publish a message to the subscribers of a topic." << std::endl
+                << "\t<topic>: The topic to publish on." << std::endl
+                << "\t<content>: The content of the message. Need to be quoted." << std::endl
+                << "12. presence <on|off>: Get notified when clients join or leave." << std::endl
+                << "13. udp <on|off>: Carry the heart beats and the datagrams through UDP from the next connect." << std::endl
+                << "14. dgram <id> \"<content>\": Send a datagram to a client, not acknowledged and may be lost." << std::endl
+                << "\t<id>: The id of the receiver." << std::endl
+                << "\t<content>: The content of the message. Need to be quoted." << std::endl
+                << "15. attach <name>: Attach another client to this connection, e.g. as a gateway." << std::endl
+                << "16. detach <id>: Remove a client attached to this connection." << std::endl
+                << "17. as <id> <receiver id> \"<content>\": Send a message on behalf of an attached client." << std::endl
+                << "\t<id>: The id of the attached client." << std::endl
+                << "\t<receiver id>: The id of the receiver." << std::endl
+                << "\t<content>: The content of the message. Need to be quoted." << std::endl
+                << "18. acks <on|off>: Acknowledge the messages read at once together, and get the ACKs so." << std::endl
+                << "19. bench <n> [co|seq|send]: Send n time requests at once and wait for all of them." << std::endl
+                << "\tco: Await every request in a coroutine instead of a future." << std::endl
+                << "\tseq: Send the next request after the last one is answered, to measure the latency." << std::endl
+                << "\tsend: Send n messages to this client instead, to measure the cost of every delivery." << std::endl
+                << "20. help: Print this message." << std::endl
                 << "0. exit: Exit." << std::endl
                 << std::endl;
 }
 
+/*
+ * Send a time request from a coroutine, and count its answer.
+ * @param client The client.
+ * @param loop The loop the coroutine runs on.
+ * @param counts The numbers of the answers by status, only touched on the loop.
+ */
+Task<> request_time(std::shared_ptr<Client> client, EventLoop &loop, size_t *counts) {
+    Reply reply = co_await client->request(loop, MessageType::REQTIME, SERVER_ID, data_t());
+    counts[static_cast<int>(reply.status)]++;
+}
+
+/*
+ * Count the frames written by all the senders of the process.
+ * @return The number of the frames.
+ */
+uint64_t count_sent_frames() {
+    uint64_t frame_num = 0;
+    for (size_t lane = 0; lane < LANE_NUM; lane++) {
+        frame_num += Sender::get_lane_stats(static_cast<Lane>(lane)).frame_num;
+    }
+    return frame_num;
+}
+
+/*
+ * Get the CPU time of the process, of all its threads.
+ * @return The microseconds spent in the user and the system mode.
+ */
+uint64_t get_cpu_time() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ull +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
 std::string get_command() {
     std::cout << "client> ";
     std::string command;
@@ -72,6 +179,13 @@ bool process_command(std::string command,
             int connect_port = port;
             int pos1 = command.find(' ');
             int pos2 = command.find(' ', pos1 + 1);
+            std::string transport = pos1 == std::string::npos ? "" : command.substr(pos1 + 1, pos2 - pos1 - 1);
+            if (transport == "unix" || transport == "shm") {
+                // Connect through the unix socket of the server on this host.
+                std::string path = pos2 == std::string::npos ? SERVER_UNIX_PATH : command.substr(pos2 + 1);
+                client->connect_to_server(path, transport == "shm");
+                break;
+            }
             if (pos1 != std::string::npos && pos2 != std::string::npos) {
                 std::string connect_addr_str = command.substr(pos1 + 1, pos2 - pos1 - 1);
                 std::string connect_port_str = command.substr(pos2 + 1);
@@ -129,6 +243,269 @@ bool process_command(std::string command,
             // }
             break;
         }
+        case Choice::SEND_BY_NAME : {
+            int pos1 = command.find(' ');
+            int pos2 = command.find('\"', pos1 + 1);
+            int pos3 = command.find('\"', pos2 + 1);
+            if (pos1 == std::string::npos ||
+                pos2 == std::string::npos ||
+                pos3 == std::string::npos ||
+                pos2 - pos1 < 3) {
+                std::cerr << "[WARN] Invalid input: " << command << std::endl;
+                break;
+            }
+            // Get the name and the content.
+            std::string name = command.substr(pos1 + 1, pos2 - pos1 - 2);
+            std::string content = command.substr(pos2 + 1, pos3 - pos2 - 1);
+            std::cout << "[INFO] Sending message \"" << content
+                      << "\" to client " << name << std::endl;
+            client->send_message_by_name(name, content);
+            break;
+        }
+        case Choice::MULTICAST : {
+            int pos1 = command.find(' ');
+            int pos2 = command.find('\"', pos1 + 1);
+            int pos3 = command.find('\"', pos2 + 1);
+            if (pos1 == std::string::npos ||
+                pos2 == std::string::npos ||
+                pos3 == std::string::npos) {
+                std::cerr << "[WARN] Invalid input: " << command << std::endl;
+                break;
+            }
+            // Get the ids and the content.
+            std::string ids_str = command.substr(pos1 + 1, pos2 - pos1 - 2);
+            std::string content = command.substr(pos2 + 1, pos3 - pos2 - 1);
+            std::vector<uint8_t> receiver_ids;
+            if (ids_str != "all") {
+                bool valid = true;
+                size_t begin = 0;
+                while (begin <= ids_str.size()) {
+                    size_t end = ids_str.find(',', begin);
+                    if (end == std::string::npos) {
+                        end = ids_str.size();
+                    }
+                    int id = atoi(ids_str.substr(begin, end - begin).c_str());
+                    if (id <= 0 || id > 255) {
+                        valid = false;
+                        break;
+                    }
+                    receiver_ids.push_back((uint8_t)id);
+                    begin = end + 1;
+                }
+                if (!valid) {
+                    std::cerr << "[WARN] Invalid id." << std::endl;
+                    break;
+                }
+            }
+            std::cout << "[INFO] Sending message \"" << content
+                      << "\" to clients " << ids_str << std::endl;
+            client->send_multicast(receiver_ids, content);
+            break;
+        }
+        case Choice::SUBSCRIBE :
+        case Choice::UNSUBSCRIBE : {
+            int pos1 = command.find(' ');
+            if (pos1 == std::string::npos || pos1 + 1 == command.size()) {
+                std::cerr << "[WARN] Invalid input: " << command << std::endl;
+                break;
+            }
+            std::string topic = command.substr(pos1 + 1);
+            if (get_choice(choice) == Choice::SUBSCRIBE) {
+                client->subscribe(topic);
+            } else {
+                client->unsubscribe(topic);
+            }
+            break;
+        }
+        case Choice::PUBLISH : {
+            int pos1 = command.find(' ');
+            int pos2 = command.find('\"', pos1 + 1);
+            int pos3 = command.find('\"', pos2 + 1);
+            if (pos1 == std::string::npos ||
+                pos2 == std::string::npos ||
+                pos3 == std::string::npos ||
+                pos2 - pos1 < 3) {
+                std::cerr << "[WARN] Invalid input: " << command << std::endl;
+                break;
+            }
+            // Get the topic and the content.
+            std::string topic = command.substr(pos1 + 1, pos2 - pos1 - 2);
+            std::string content = command.substr(pos2 + 1, pos3 - pos2 - 1);
+            std::cout << "[INFO] Publishing message \"" << content
+                      << "\" on topic " << topic << std::endl;
+            client->publish(topic, content);
+            break;
+        }
+        case Choice::PRESENCE : {
+            int pos1 = command.find(' ');
+            std::string flag = pos1 == std::string::npos ? "" : command.substr(pos1 + 1);
+            if (flag != "on" && flag != "off") {
+                std::cerr << "[WARN] Invalid input: " << command << std::endl;
+                break;
+            }
+            client->watch_presence(flag == "on");
+            break;
+        }
+        case Choice::ACKS : {
+            int pos1 = command.find(' ');
+            std::string flag = pos1 == std::string::npos ? "" : command.substr(pos1 + 1);
+            if (flag != "on" && flag != "off") {
+                std::cerr << "[WARN] Invalid input: " << command << std::endl;
+                break;
+            }
+            client->batch_acks(flag == "on");
+            break;
+        }
+        case Choice::UDP : {
+            int pos1 = command.find(' ');
+            std::string flag = pos1 == std::string::npos ? "" : command.substr(pos1 + 1);
+            if (flag != "on" && flag != "off") {
+                std::cerr << "[WARN] Invalid input: " << command << std::endl;
+                break;
+            }
+            client->set_datagram(flag == "on");
+            std::cout << "[INFO] UDP " << flag << " from the next connect." << std::endl;
+            break;
+        }
+        case Choice::SEND_DATAGRAM : {
+            int pos1 = command.find(' ');
+            int pos2 = command.find('\"', pos1 + 1);
+            int pos3 = command.find('\"', pos2 + 1);
+            if (pos1 == std::string::npos ||
+                pos2 == std::string::npos ||
+                pos3 == std::string::npos) {
+                std::cerr << "[WARN] Invalid input: " << command << std::endl;
+                break;
+            }
+            // Get the id and the content.
+            std::string id_str = command.substr(pos1 + 1, pos2 - pos1 - 2);
+            std::string content = command.substr(pos2 + 1, pos3 - pos2 - 1);
+            int id = atoi(id_str.c_str());
+            if (id <= 0 || id > 255) {
+                std::cerr << "[WARN] Invalid id." << std::endl;
+                break;
+            }
+            client->send_datagram((uint8_t)id, content);
+            break;
+        }
+        case Choice::ATTACH : {
+            int pos1 = command.find(' ');
+            if (pos1 == std::string::npos || pos1 + 1 == command.size()) {
+                std::cerr << "[WARN] Invalid input: " << command << std::endl;
+                break;
+            }
+            client->attach_client(command.substr(pos1 + 1));
+            break;
+        }
+        case Choice::DETACH : {
+            int pos1 = command.find(' ');
+            int id = pos1 == std::string::npos ? 0 : atoi(command.substr(pos1 + 1).c_str());
+            if (id <= 0 || id > 255) {
+                std::cerr << "[WARN] Invalid id." << std::endl;
+                break;
+            }
+            client->detach_client((uint8_t)id);
+            break;
+        }
+        case Choice::SEND_AS : {
+            int pos1 = command.find(' ');
+            int pos2 = command.find(' ', pos1 + 1);
+            int pos3 = command.find('\"', pos2 + 1);
+            int pos4 = command.find('\"', pos3 + 1);
+            if (pos1 == std::string::npos ||
+                pos2 == std::string::npos ||
+                pos3 == std::string::npos ||
+                pos4 == std::string::npos) {
+                std::cerr << "[WARN] Invalid input: " << command << std::endl;
+                break;
+            }
+            // Get the ids and the content.
+            int id = atoi(command.substr(pos1 + 1, pos2 - pos1 - 1).c_str());
+            int receiver_id = atoi(command.substr(pos2 + 1, pos3 - pos2 - 1).c_str());
+            std::string content = command.substr(pos3 + 1, pos4 - pos3 - 1);
+            if (id <= 0 || id > 255 || receiver_id < 0 || receiver_id > 255) {
+                std::cerr << "[WARN] Invalid id." << std::endl;
+                break;
+            }
+            std::cout << "[INFO] Sending message \"" << content << "\" as client " << id
+                      << " to client " << receiver_id << std::endl;
+            client->send_message_as((uint8_t)id, (uint8_t)receiver_id, content);
+            break;
+        }
+        case Choice::BENCH : {
+            int pos1 = command.find(' ');
+            int pos2 = command.find(' ', pos1 + 1);
+            int num = pos1 == std::string::npos ? 0 : atoi(command.substr(pos1 + 1).c_str());
+            std::string mode = pos2 == std::string::npos ? "" : command.substr(pos2 + 1);
+            if (num <= 0 || (mode != "" && mode != "co" && mode != "seq" && mode != "send")) {
+                std::cerr << "[WARN] Invalid input: " << command << std::endl;
+                break;
+            }
+            // Pipeline the requests, then wait for the replies.
+            ReceiverStats start_stats = Receiver::get_stats(Receiver::get_backend());
+            uint64_t start_frame_num = count_sent_frames();
+            uint64_t start_cpu_time = get_cpu_time();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            size_t counts[4] = {0, 0, 0, 0};
+            if (mode == "co") {
+                EventLoop loop;
+                std::vector<std::future<void> > done;
+                done.reserve(num);
+                for (int i = 0; i < num; i++) {
+                    done.push_back(loop.spawn(request_time(client, loop, counts)));
+                }
+                std::thread loop_thread(&EventLoop::run, &loop);
+                for (std::future<void> &task : done) {
+                    task.wait();
+                }
+                loop.stop();
+                loop_thread.join();
+            } else if (mode == "seq") {
+                for (int i = 0; i < num; i++) {
+                    Reply reply = client->request_async(MessageType::REQTIME, SERVER_ID, data_t()).get();
+                    counts[static_cast<int>(reply.status)]++;
+                }
+            } else {
+                // The messages come back to this client, and are acknowledged by it.
+                MessageType type = mode == "send" ? MessageType::REQSEND : MessageType::REQTIME;
+                uint8_t receiver_id = mode == "send" ? client->get_self_id() : SERVER_ID;
+                std::vector<std::future<Reply> > replies;
+                replies.reserve(num);
+                for (int i = 0; i < num; i++) {
+                    data_t data;
+                    if (mode == "send") {
+                        data.emplace_back("bench");
+                    }
+                    replies.push_back(client->request_async(type, receiver_id, std::move(data)));
+                }
+                for (std::future<Reply> &reply : replies) {
+                    counts[static_cast<int>(reply.get().status)]++;
+                }
+            }
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start
+            ).count();
+            std::cout << "[INFO] " << num << " requests in " << elapsed << " us: "
+                      << counts[static_cast<int>(ReplyStatus::ACKED)] << " acked, "
+                      << counts[static_cast<int>(ReplyStatus::WAITED)] << " waited, "
+                      << counts[static_cast<int>(ReplyStatus::TIMED_OUT)] << " timed out, "
+                      << counts[static_cast<int>(ReplyStatus::CLOSED)] << " closed." << std::endl;
+            std::cout << "[INFO] " << (double)num * 1000000 / std::max<long>(elapsed, 1) << " requests/s, "
+                      << (double)elapsed / num << " us per request." << std::endl;
+            ReceiverStats stats = Receiver::get_stats(Receiver::get_backend());
+            std::cout << "[INFO] Receiver: " << stats.syscall_num - start_stats.syscall_num
+                      << " system call(s) for " << stats.message_num - start_stats.message_num
+                      << " message(s)." << std::endl;
+            // Every message is one frame, sent or received.
+            uint64_t sent_num = count_sent_frames() - start_frame_num;
+            uint64_t received_num = stats.message_num - start_stats.message_num;
+            uint64_t cpu_time = get_cpu_time() - start_cpu_time;
+            std::cout << "[INFO] Frames: " << sent_num << " sent, " << received_num << " received, "
+                      << (double)(sent_num + received_num) / num << " per request." << std::endl;
+            std::cout << "[INFO] CPU time: " << cpu_time << " us, "
+                      << (double)cpu_time / num << " us per request." << std::endl;
+            break;
+        }
         case Choice::HELP : {
             // Help.
             print_help();
@@ -164,14 +541,29 @@ int main(int argc, char *argv[]) {
     if (argc > 3) {
         port = atoi(argv[3]);
     }
+    if (argc > 4) {
+        std::string backend = argv[4];
+        if (backend == "uring") {
+            if (!Receiver::set_backend(IoBackend::IO_URING)) {
+                std::cout << "[WARN] io_uring is not supported, using epoll." << std::endl;
+            }
+        } else if (backend != "epoll") {
+            std::cout << "[ERR] Unknown backend: " << backend << std::endl;
+            return 1;
+        }
+    }
 
     std::cout << "[INFO] Client name: " << name << std::endl;
     std::cout << "[INFO] Server address: " << inet_ntoa(*(in_addr *)&addr) << std::endl;
     std::cout << "[INFO] Server port: " << port << std::endl;
+    std::cout << "[INFO] Backend: "
+              << (Receiver::get_backend() == IoBackend::IO_URING ? "io_uring" : "epoll") << std::endl;
     print_help();
 
     // Create a client.
     std::shared_ptr<Client> client = std::shared_ptr<Client>(new Client(name));
+    // Print what the client reports, as the console is for.
+    client->set_logging(true);
     // Create a thread to get commands.
     std::future<std::string> command_future = std::async(std::launch::async, get_command);
 
@@ -0,0 +1,18 @@
+#ifndef __ALLOC_STATS_HPP__
+#define __ALLOC_STATS_HPP__
+
+#include <cstdint>
+
+/*
+ * Get the number of heap allocations made by the whole process.
+ * Counted by the global operator new replaced in src/server/AllocStats.cpp,
+ * which is linked into the server only.
+ */
+uint64_t get_alloc_count();
+
+/*
+ * Get the number of heap allocations made by the calling thread.
+ */
+uint64_t get_thread_alloc_count();
+
+#endif
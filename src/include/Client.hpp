@@ -7,52 +7,345 @@
 #include "Sender.hpp"
 #include "Map.hpp"
 #include "Queue.hpp"
+#include "Dispatcher.hpp"
+#include "RequestTable.hpp"
+#include "EventLoop.hpp"
+#include "DatagramChannel.hpp"
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <future>
+#include <array>
+#include <bitset>
+#include <deque>
+#include <map>
+
+class Client;
+
+/*
+ * Suspends a coroutine on an EventLoop until a request is answered,
+ * see Client::request().
+ */
+class ReplyAwaiter {
+private:
+    Client &client_;
+    EventLoop &loop_;
+    MessageType type_;
+    uint8_t receiver_id_;
+    data_t data_;
+    int timeout_;
+    // Written on the loop of the client, read once resumed.
+    std::shared_ptr<Reply> reply_;
+
+public:
+    ReplyAwaiter(Client &client, EventLoop &loop, MessageType type, uint8_t receiver_id, data_t data, int timeout);
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle);
+
+    Reply await_resume() {
+        return std::move(*reply_);
+    }
+};
 
 class Client {
 private:
+    /*
+     * Flow control toward a receiver. At most FLOW_WINDOW bytes are sent
+     * without an ACK, the rest is held back in the backlog, in order.
+     */
+    struct Flow {
+        size_t inflight_bytes;
+        // Told to WAIT by the server, until a CREDIT.
+        bool waiting;
+        // Sent again first, the number of messages put back by WAITs.
+        size_t requeued_num;
+        std::deque<std::string> backlog;
+    };
+
+    /*
+     * A client in the cached client list.
+     */
+    struct ClientEntry {
+        std::string name;
+        std::string ip;
+        uint16_t port;
+    };
+
     int sockfd_;
     const std::string name_;
-    sockaddr_in server_addr_;
+    // A sockaddr_in, or a sockaddr_un for the server on the same host.
+    sockaddr_storage server_addr_;
+    socklen_t server_addr_len_;
+    // Whether to move the connection to shared memory rings, only through a unix socket.
+    bool shared_memory_;
+    // Whether to ask for a datagram channel on the next connect, only through TCP.
+    bool use_datagram_;
+    // The heart beats and the DATAGRAMs go through it, null if not negotiated.
+    // Replaced only while datagram_thread_ is stopped.
+    std::unique_ptr<DatagramChannel> datagram_channel_;
+    sockaddr_in datagram_server_addr_;
+    // Receives from datagram_channel_, if the client runs its own loop.
+    std::unique_ptr<std::thread> datagram_thread_;
+    std::atomic_bool datagram_stopping_;
     uint8_t self_id_;
+    // Issued by the server when connecting, to RESUME the session.
+    std::string session_token_;
+    // Stop resuming once the client is being released.
+    bool closing_;
+    std::mutex resume_mutex_;
 
+    // Whether the client runs its own loop on receive_thread_,
+    // rather than the application calling run_once().
+    const bool own_loop_;
     std::unique_ptr<std::thread> receive_thread_;
+    // State of the loop, only touched by the thread running it.
+    MessagePtr loop_message_;
+    size_t received_num_;
 
+    // Replaced by the thread running the loop when the connection drops or resumes,
+    // with connection_mutex_ held. Other threads hold it while sending through sender_.
     std::unique_ptr<Sender> sender_;
     std::unique_ptr<Receiver> receiver_;
-    std::unique_ptr<Map<uint16_t, MessageType> > message_type_map_;
+    std::mutex connection_mutex_;
+    // The requests waiting for their answers.
+    std::unique_ptr<RequestTable> request_table_;
     std::unique_ptr<Queue<std::string> > output_queue_;
+    // Whether to keep the outputs in output_queue_, off unless the application prints them.
+    std::atomic_bool logging_;
+    Dispatcher<Client> dispatcher_;
+    // Dispatch ACKs on the type of the acknowledged request.
+    Dispatcher<Client, void, AckSegmentRule> ack_dispatcher_;
+    // Protected by flow_mutex_, which is taken before the lock of request_table_.
+    std::array<Flow, MAX_CLIENT_NUM + 1> flows_;
+    // The REQUEST SENDs not acknowledged, key is the package id.
+    std::map<uint16_t, std::pair<uint8_t, std::string> > inflight_sends_;
+    std::mutex flow_mutex_;
+    // Cached client list, updated by REQCLILIST_SINCE, protected by client_list_mutex_.
+    // The pages of a whole list are gathered in client_list_pages_ first.
+    std::map<uint8_t, ClientEntry> client_list_;
+    uint64_t client_list_version_;
+    bool client_list_valid_;
+    std::map<uint8_t, ClientEntry> client_list_pages_;
+    uint64_t client_list_pages_version_;
+    std::mutex client_list_mutex_;
+    // Whether to watch the presence, again after resuming.
+    std::atomic_bool watching_presence_;
+    // Whether to batch the ACKs into ACKS, again after resuming.
+    std::atomic_bool batching_acks_;
+    // The ACKs of the FWDs to send once what was read at once is handled, only touched
+    // by the thread running the loop: the last FWD, acknowledged with all the ones before
+    // it, -1 for none, and the shared FWDs, acknowledged one by one.
+    int cumulative_ack_;
+    std::vector<uint16_t> selective_acks_;
+    // The clients attached to the connection, e.g. the users behind a gateway,
+    // protected by attached_mutex_. They leave with the connection.
+    std::bitset<MAX_CLIENT_NUM + 1> attached_;
+    std::mutex attached_mutex_;
+
+    /*
+     * Register the message handlers into dispatcher_ and ack_dispatcher_.
+     */
+    void register_handlers();
+
+    // Message handlers, called by dispatcher_.
+    DispatchResult handle_heart_beat(MessagePtr &message);
+    DispatchResult handle_disconnect(MessagePtr &message);
+    DispatchResult handle_forward(MessagePtr &message);
+    DispatchResult handle_publish(MessagePtr &message);
+    DispatchResult handle_acknowledge(MessagePtr &message);
+    DispatchResult handle_wait(MessagePtr &message);
+    DispatchResult handle_credit(MessagePtr &message);
+    DispatchResult handle_presence(MessagePtr &message);
+    DispatchResult handle_datagram(MessagePtr &message);
+    DispatchResult handle_batched_acknowledge(MessagePtr &message);
+
+    // ACK handlers, called by ack_dispatcher_.
+    DispatchResult handle_disconnect_ack(MessagePtr &message);
+    DispatchResult handle_request_time_ack(MessagePtr &message);
+    DispatchResult handle_request_host_ack(MessagePtr &message);
+    DispatchResult handle_request_client_list_ack(MessagePtr &message);
+    DispatchResult handle_request_client_list_since_ack(MessagePtr &message);
+    DispatchResult handle_request_send_ack(MessagePtr &message);
+    DispatchResult handle_request_multicast_ack(MessagePtr &message);
+    DispatchResult handle_subscribe_ack(MessagePtr &message);
+    DispatchResult handle_unsubscribe_ack(MessagePtr &message);
+    DispatchResult handle_publish_ack(MessagePtr &message);
+    DispatchResult handle_presence_ack(MessagePtr &message);
+    DispatchResult handle_request_acks_ack(MessagePtr &message);
+
+    /*
+     * Send a REQUEST SEND and charge it to the window of the receiver.
+     * @param receiver_id The id of the receiver.
+     * @param content The content of the message.
+     * @param flow_lock The unique_lock of flow_mutex_.
+     */
+    void send_request_send(uint8_t receiver_id, std::string content, std::unique_lock<std::mutex> &flow_lock);
+
+    /*
+     * Send the backlog of a receiver, as far as its window allows.
+     * @param receiver_id The id of the receiver.
+     * @param flow_lock The unique_lock of flow_mutex_.
+     */
+    void flush_backlog(uint8_t receiver_id, std::unique_lock<std::mutex> &flow_lock);
+
+    /*
+     * Give the bytes of an answered REQUEST SEND back to the window of its receiver.
+     * @param pakage_id The package id of the REQUEST SEND, others are ignored.
+     */
+    void return_window(uint16_t pakage_id);
+
+    /*
+     * Forget the REQUEST SENDs in flight, whose ACKs may be lost with the
+     * connection, then send the backlogs.
+     */
+    void reset_flows();
+
+    /*
+     * Send a REQUEST CLIENT LIST, or a REQUEST CLIENT LIST SINCE the cached version.
+     * Must be called with client_list_mutex_ held.
+     * @param type REQCLILIST or REQCLILIST_SINCE.
+     * @param cursor The cursor of the page, for REQCLILIST.
+     */
+    void request_client_list(MessageType type, uint8_t cursor);
+
+    /*
+     * Gather a page of the whole client list, requesting the next page if any.
+     * Must be called with client_list_mutex_ held.
+     * @param version The version of the list.
+     * @param data The data of the ACK.
+     * @param first The index of the first entry.
+     */
+    void gather_client_list_page(uint64_t version, const data_t &data, size_t first);
 
     /*
-     * Keep receiving messages from the server.
+     * Print the cached client list.
+     * Must be called with client_list_mutex_ held.
+     */
+    void print_client_list();
+
+    /*
+     * Keep running the loop, on receive_thread_.
      */
     void receive_message();
 
+    /*
+     * Keep receiving from datagram_channel_, on datagram_thread_.
+     */
+    void receive_datagrams();
+
+    /*
+     * Handle the packets received from datagram_channel_,
+     * answering the heart beats through it.
+     * @param timeout The milliseconds to wait for a packet at most, 0 not to wait.
+     */
+    void poll_datagrams(int timeout);
+
+    /*
+     * Dispatch a message received from the server.
+     * @param message The message.
+     * @return Whether to keep the connection.
+     */
+    bool handle_message(MessagePtr &message);
+
+    /*
+     * Send the ACKs of the FWDs batched from what was read at once, in an ACKS.
+     */
+    void flush_acks();
+
+    /*
+     * Complete a request, by its callback or by the ACK handlers.
+     * @param request The request.
+     * @param status How the request is completed.
+     * @param message The ACK or the WAIT, null otherwise.
+     */
+    void complete_request(PendingRequest &request, ReplyStatus status, MessagePtr message);
+
+    /*
+     * Complete the requests not answered in time.
+     */
+    void expire_requests();
+
+    /*
+     * Complete all the pending requests, once the connection is closed.
+     */
+    void close_requests();
+
+    /*
+     * Reconnect and RESUME the session, backing off between the tries.
+     * @return Whether the session is resumed.
+     */
+    bool resume_session();
+
+    /*
+     * Connect to server_addr_ and send a Connect Request,
+     * following the REDIRECT of a router, which replaces server_addr_.
+     * @param redirect_num The redirects followed so far, up to MAX_REDIRECT_NUM.
+     * @return Whether the connection is successful.
+     */
+    bool connect_session(int redirect_num = 0);
+
+    /*
+     * Send a Connect or Resume Request on a new connection. If shared_memory_ is set,
+     * pass the fds of two new rings along and move the connection to them,
+     * the response already comes through the ring, or through the socket if refused.
+     * @param sender The sender of the connection.
+     * @param receiver The receiver of the connection.
+     * @param resume Whether to resume the session rather than connect.
+     * @param datagram_port The port of the datagram channel to ask for, 0 for none.
+     * @return The message id and the number of bytes sent.
+     */
+    send_res_t send_handshake(Sender &sender, Receiver &receiver, bool resume, uint16_t datagram_port);
+
+    /*
+     * Check if connected to the server, sender_ stays while the lock is held.
+     * @param connection_lock The unique_lock of connection_mutex_.
+     */
+    void check_connected(std::unique_lock<std::mutex> &connection_lock);
+
+    /*
+     * Keep a line in output_queue_ for output_message(), if logging_ is set.
+     * @param line The line to print.
+     */
+    void output(std::string line);
+
     /*
      * Join the threads.
      */
     void join_threads();
 
     /*
-     * Check whether the message exists.
-     * @param result The result of sending the message.
-     * @param lock The unique_lock of the mutex.
-     * @return Whether the message exists.
+     * Wait for the answer of a request just sent.
+     * @param result The result of sending the request.
+     * @param type The type of the request.
+     * @param lock The unique_lock of request_table_, held since before sending.
+     * @param callback Called with the answer, null to report it through the ACK handlers.
+     * @param timeout The milliseconds to wait for the answer.
      */
-    bool check_message_exist(send_res_t result, std::unique_lock<std::mutex> &lock);
+    void add_request(
+        send_res_t result,
+        MessageType type,
+        std::unique_lock<std::mutex> &lock,
+        ReplyCallback callback = nullptr,
+        int timeout = REQUEST_TIMEOUT
+    );
 
 public:
     /*
      * Connect to the server.
      * @param name The name of the client.
+     * @param own_loop Whether to receive on a thread of the client, otherwise
+     *                 the application drives the client with run_once().
      */
-    Client(std::string name);
+    Client(std::string name, bool own_loop = true);
     ~Client();
 
     /*
@@ -63,6 +356,23 @@ public:
      */
     bool connect_to_server(in_addr_t addr, int port);
 
+    /*
+     * Connect to the server on the same host through its unix socket,
+     * with the same packets as through TCP.
+     * @param path The path of the unix socket.
+     * @param shared_memory Whether to carry the packets through shared memory rings
+     *                      instead, the socket is kept to hand them over and to notice the close.
+     * @return Whether the connection is successful.
+     */
+    bool connect_to_server(const std::string &path, bool shared_memory = false);
+
+    /*
+     * Ask for a datagram channel beside the TCP connection, taking effect on the next connect.
+     * It carries the heart beats and the DATAGRAMs, which then do not wait behind large frames.
+     * @param enable Whether to ask for it.
+     */
+    void set_datagram(bool enable);
+
     /*
      * Disconnect from the server.
      * @return Whether the disconnection is successful.
@@ -83,17 +393,184 @@ public:
 
     /*
      * Get the list of the clients.
-     * @return The list of the clients.
+     * Only the changes are requested once the list is cached.
+     * @return Whether the request is sent.
      */
     bool get_client_list();
 
     /*
      * Send a message to the server.
+     * The message is queued if the receiver is busy, see Flow.
+     * @param receiver_id The id of the receiver.
+     * @param content The content of the message.
+     * @return Whether the sending is successful.
+     */
+    bool send_message(uint8_t receiver_id, std::string_view content);
+
+    /*
+     * Attach another client to this connection, e.g. a user behind a gateway, so that
+     * many clients share one connection, its buffers and its heart beats. The server
+     * answers with the id of the client, which is printed. The packets to it come through
+     * this client, the FWDs are acknowledged on its behalf.
+     * @param name The name of the client.
+     * @return Whether the sending is successful.
+     */
+    bool attach_client(std::string_view name);
+
+    /*
+     * Remove a client attached to this connection, the connection stays.
+     * @param client_id The id of the attached client.
+     * @return Whether the sending is successful.
+     */
+    bool detach_client(uint8_t client_id);
+
+    /*
+     * Send a message on behalf of a client attached to this connection.
+     * Not held back by the flow control of the client, see Flow.
+     * @param client_id The id of the attached client.
+     * @param receiver_id The id of the receiver.
+     * @param content The content of the message.
+     * @return Whether the sending is successful.
+     */
+    bool send_message_as(uint8_t client_id, uint8_t receiver_id, std::string_view content);
+
+    /*
+     * Send a message to the client holding a name, resolved by the server.
+     * Not held back by the flow control of the client, see Flow.
+     * @param receiver_name The name of the receiver.
+     * @param content The content of the message.
+     * @return Whether the sending is successful.
+     */
+    bool send_message_by_name(std::string_view receiver_name, std::string_view content);
+
+    /*
+     * Send a DATAGRAM to a client, through the datagram channel if any, otherwise through TCP.
+     * It is not acknowledged, and may be lost or dropped by the server.
      * @param receiver_id The id of the receiver.
      * @param content The content of the message.
      * @return Whether the sending is successful.
      */
-    bool send_message(uint8_t receiver_id, std::string content);
+    bool send_datagram(uint8_t receiver_id, std::string_view content);
+
+    /*
+     * Send a message to several clients at once.
+     * @param receiver_ids The ids of the receivers, empty for all the other clients.
+     * @param content The content of the message.
+     * @return Whether the sending is successful.
+     */
+    bool send_multicast(const std::vector<uint8_t> &receiver_ids, std::string_view content);
+
+    /*
+     * Subscribe to a topic.
+     * @param topic The topic to subscribe.
+     * @return Whether the sending is successful.
+     */
+    bool subscribe(std::string_view topic);
+
+    /*
+     * Unsubscribe from a topic.
+     * @param topic The topic to unsubscribe.
+     * @return Whether the sending is successful.
+     */
+    bool unsubscribe(std::string_view topic);
+
+    /*
+     * Publish a message to the subscribers of a topic.
+     * @param topic The topic to publish on.
+     * @param content The content of the message.
+     * @return Whether the sending is successful.
+     */
+    bool publish(std::string_view topic, std::string_view content);
+
+    /*
+     * Turn the notifications of the clients joining and leaving on or off.
+     * @param enable Whether to be notified.
+     * @return Whether the sending is successful.
+     */
+    bool watch_presence(bool enable);
+
+    /*
+     * Turn the batched ACKs on or off. Once on, the FWDs read at once are acknowledged
+     * together in an ACKS, and the server answers the REQUEST SENDs of the connection
+     * the same way, rather than with an ACK each.
+     * @param enable Whether to batch them.
+     * @return Whether the sending is successful.
+     */
+    bool batch_acks(bool enable);
+
+    /*
+     * Send a request, completed once by its ACK, a WAIT, the timeout or the
+     * connection closing. The callback runs on the loop of the client.
+     * Any number of requests may be pending at once.
+     * REQSENDs sent this way are not held back by the flow control of the client.
+     * @param type The type of the request, one answered by an ACK.
+     * @param receiver_id The id of the receiver, SERVER_ID for the server.
+     * @param data The data of the request.
+     * @param callback Called with the answer.
+     * @param timeout The milliseconds to wait for the answer.
+     */
+    void request_async(
+        MessageType type,
+        uint8_t receiver_id,
+        data_t data,
+        ReplyCallback callback,
+        int timeout = REQUEST_TIMEOUT
+    );
+
+    /*
+     * Send a request, see above.
+     * @return The future of the answer. Do not wait for it on the loop of the client.
+     */
+    std::future<Reply> request_async(
+        MessageType type,
+        uint8_t receiver_id,
+        data_t data,
+        int timeout = REQUEST_TIMEOUT
+    );
+
+    /*
+     * Send a request from a coroutine running on an EventLoop, see above.
+     * The loop is not the one of the client, which keeps receiving on its own.
+     * @param loop The loop the coroutine runs on.
+     * @return An awaitable resuming the coroutine on the loop with the answer,
+     *         i.e. Reply reply = co_await client.request(loop, ...);
+     */
+    ReplyAwaiter request(
+        EventLoop &loop,
+        MessageType type,
+        uint8_t receiver_id,
+        data_t data,
+        int timeout = REQUEST_TIMEOUT
+    );
+
+    /*
+     * Receive and handle at most one message, and expire the requests not
+     * answered in time. Only for a client created without its own loop.
+     * Resumes the session if the connection drops.
+     * @param timeout The milliseconds to wait for a message at most.
+     * @return Whether still connected to the server.
+     */
+    bool run_once(int timeout);
+
+    /*
+     * Get the number of the requests waiting for their answers.
+     * @return The number of the pending requests.
+     */
+    size_t get_pending_num();
+
+    /*
+     * Get the id given by the server.
+     * @return The id of the client, meaningless if not connected.
+     */
+    uint8_t get_self_id();
+
+    /*
+     * Keep the outputs of the client, e.g. the received messages, the answers of the
+     * requests without a callback and the debug lines, to be printed by output_message().
+     * Off by default, so that the library does not gather them for nothing.
+     * @param enable Whether to keep the outputs.
+     */
+    void set_logging(bool enable);
 
     /*
      * Print the message queue.
@@ -0,0 +1,145 @@
+#ifndef __CLIENT_DIRECTORY_HPP__
+#define __CLIENT_DIRECTORY_HPP__
+
+#include "def.hpp"
+#include "Map.hpp"
+#include "Message.hpp"
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <array>
+#include <unordered_map>
+#include <cstdint>
+
+/*
+ * Versioned list of the connected clients, answering REQCLILIST and
+ * REQCLILIST_SINCE with pre-serialized ACKs.
+ * Every client is encoded once when it joins, the pages of the list are
+ * serialized on the first request after a change, and the last
+ * CLIENT_LIST_HISTORY changes are kept to answer with deltas.
+ * The ACKs are serialized with package id and receiver id 0, to be
+ * patched by the caller, see patch_header(). The same deltas are pushed
+ * to the clients watching the presence, see encode_presence().
+ * The ids are also indexed by name for REQSEND_NAME. A name belongs to
+ * the client which joined first with it, the later ones take it over in
+ * order when it leaves.
+ * Like Map, every operation requires the lock of get_mutex().
+ */
+class ClientDirectory {
+private:
+    struct Change {
+        uint64_t version;
+        uint8_t client_id;
+    };
+
+    // '+' entries of the connected clients.
+    std::map<uint8_t, std::string> entries_;
+    uint64_t version_;
+    std::deque<Change> history_;
+    // Serialized pages of version_, key is the cursor.
+    std::map<uint8_t, std::vector<uint8_t> > pages_;
+    // The ids holding every name, in the order they joined.
+    std::unordered_map<std::string, std::vector<uint8_t> > name_index_;
+    std::array<std::string, MAX_CLIENT_NUM + 1> names_;
+    std::mutex mutex_;
+
+    /*
+     * Record a change and drop the pages of the former version.
+     */
+    void add_change(uint8_t client_id);
+
+    /*
+     * Drop a client from the name index.
+     */
+    void remove_name(uint8_t client_id);
+
+    /*
+     * Serialize a page of the list.
+     * @param cursor: The page lists the clients with a greater id.
+     * @param reset: Whether to lead the entries with a '=' entry.
+     * @param buffer: Filled with the serialized ACK.
+     */
+    void encode_page(uint8_t cursor, bool reset, std::vector<uint8_t> &buffer);
+
+    /*
+     * Collect the entries of the clients changed since a version.
+     * @param version: The version to start from.
+     * @param entries: Filled with a '+' or '-' entry for every changed client.
+     * @return: Whether the changes are kept and fit in a page.
+     */
+    bool collect_changes(uint64_t version, data_t &entries);
+
+public:
+    ClientDirectory() : version_(0) {}
+
+    std::mutex &get_mutex() {
+        return mutex_;
+    }
+
+    /*
+     * Add or update a client.
+     * @param client_id: The id of the client.
+     * @param name: The name of the client.
+     * @param addr: The address of the client.
+     * @param lock: The unique_lock of get_mutex().
+     */
+    void join(uint8_t client_id, const std::string &name, sockaddr_in addr, std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Remove a client.
+     * @param client_id: The id of the client.
+     * @param lock: The unique_lock of get_mutex().
+     */
+    void leave(uint8_t client_id, std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Get the serialized ACK of a page of the list, cached until the next change.
+     * @param cursor: The page lists the clients with a greater id, 0 for the first page.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: The serialized ACK, valid while the lock is held.
+     */
+    const std::vector<uint8_t> &get_page(uint8_t cursor, std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Serialize the ACK of the changes since a version. If the changes are
+     * not kept any more, or do not fit in a page, the first page of the
+     * list is serialized instead, led by a '=' entry.
+     * @param version: The version the requester has.
+     * @param buffer: Filled with the serialized ACK.
+     * @param lock: The unique_lock of get_mutex().
+     */
+    void encode_changes(uint64_t version, std::vector<uint8_t> &buffer, std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Serialize the PRESENCE notification of the changes since a version,
+     * shared by all the watching clients. If the changes are not kept any
+     * more, or do not fit in a page, a single '=' entry tells the clients
+     * to request the list again.
+     * @param version: The version of the last notification.
+     * @param buffer: Filled with the serialized PRESENCE.
+     * @param lock: The unique_lock of get_mutex().
+     */
+    void encode_presence(uint64_t version, std::vector<uint8_t> &buffer, std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Find the client holding a name.
+     * @param name: The name to look up.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: The id of the client, or 0 if no client has the name.
+     */
+    uint8_t find_by_name(const std::string &name, std::unique_lock<std::mutex> &lock);
+
+    uint64_t get_version(std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Set the package id and the receiver id of a serialized ACK.
+     * @param buffer: The serialized ACK.
+     * @param pakage_id: The id of the request.
+     * @param receiver_id: The id of the requester.
+     */
+    static void patch_header(std::vector<uint8_t> &buffer, uint16_t pakage_id, uint8_t receiver_id);
+};
+
+#endif
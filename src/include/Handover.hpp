@@ -0,0 +1,88 @@
+#ifndef __HANDOVER_HPP__
+#define __HANDOVER_HPP__
+
+#include "def.hpp"
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/*
+ * Kinds of the records passed from a running server to the one replacing it.
+ * In order: LISTENERS, a CLIENT per connection, STATE, END.
+ */
+enum class HandoverKind : uint8_t {
+    LISTENERS = 'L',    // The listening sockets and the UDP socket.
+    CLIENT = 'C',       // A connection, its socket and the rings of a local client.
+    STATE = 'S',        // The sessions, the FWDs not acknowledged and the other tables.
+    END = 'E'
+};
+
+/*
+ * A record of the handover, written and read in order.
+ * On the unix socket, every record is a u32 size (network order) and the bytes,
+ * with the fds passed along with its first byte through SCM_RIGHTS.
+ * The readers throw std::runtime_error on a truncated record.
+ */
+class HandoverRecord {
+private:
+    std::vector<uint8_t> bytes_;
+    size_t offset_;
+    std::vector<int> fds_;
+
+    /*
+     * Take the next bytes.
+     * @param size The number of bytes.
+     * @return Where they start.
+     */
+    const uint8_t *take(size_t size);
+
+public:
+    HandoverRecord() : offset_(0) {}
+    explicit HandoverRecord(HandoverKind kind);
+
+    HandoverKind get_kind() const;
+
+    void put_u8(uint8_t value);
+    void put_u16(uint16_t value);
+    void put_u32(uint32_t value);
+    void put_u64(uint64_t value);
+    void put_string(const std::string &value);
+    void put_bytes(const std::vector<uint8_t> &value);
+    // The family, the address and the port, as they are.
+    void put_addr(const sockaddr_in &addr);
+
+    uint8_t get_u8();
+    uint16_t get_u16();
+    uint32_t get_u32();
+    uint64_t get_u64();
+    std::string get_string();
+    std::vector<uint8_t> get_bytes();
+    sockaddr_in get_addr();
+
+    /*
+     * Pass an fd along with the record, it stays open here.
+     */
+    void put_fd(int fd);
+
+    /*
+     * Get the fds received with the record, which the caller takes.
+     */
+    std::vector<int> &get_fds();
+
+    /*
+     * Write the record.
+     * @param sockfd The unix socket.
+     * @return Whether it is written whole.
+     */
+    bool send(int sockfd) const;
+
+    /*
+     * Read a record, replacing this one.
+     * @param sockfd The unix socket.
+     * @return Whether a whole record is read, false once the socket is closed.
+     */
+    bool receive(int sockfd);
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef __HASH_RING_HPP__
+#define __HASH_RING_HPP__
+
+#include "def.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+/*
+ * Consistent hashing of the client names onto the backends.
+ * Every backend owns HASH_RING_REPLICAS points of a 64-bit ring, hashed from its key,
+ * and a name belongs to the backend of the first point at or after the hash of the name.
+ * So adding a backend only moves the names which land on its points, about 1 / N of them,
+ * and every router with the same backends places a name on the same one.
+ * Not thread safe, the owner locks it.
+ */
+class HashRing {
+private:
+    // Points of the ring, to the index of their backend.
+    std::map<uint64_t, size_t> points_;
+    size_t backend_num_;
+
+public:
+    HashRing() : backend_num_(0) {}
+
+    /*
+     * Hash a string, the same on every host.
+     * @param key: The string.
+     * @return: The 64-bit hash.
+     */
+    static uint64_t hash(std::string_view key);
+
+    /*
+     * Add the points of a backend.
+     * @param backend: The index of the backend.
+     * @param key: What the points are hashed from, e.g. the address, not to depend on the order.
+     */
+    void add(size_t backend, std::string_view key);
+
+    /*
+     * Remove the points of a backend, its names move to the next points.
+     * @param backend: The index of the backend.
+     */
+    void remove(size_t backend);
+
+    /*
+     * Get the backend of a name.
+     * @param name: The name.
+     * @return: The index of the backend, SIZE_MAX if there is none.
+     */
+    size_t locate(std::string_view name) const;
+
+    /*
+     * Get all the backends in the order a name tries them, the one it belongs to first,
+     * then the owners of the following points, e.g. while a backend is down.
+     * @param name: The name.
+     * @return: The distinct indexes of the backends.
+     */
+    std::vector<size_t> lookup(std::string_view name) const;
+
+    size_t get_backend_num() const;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef __MAILBOX_HPP__
+#define __MAILBOX_HPP__
+
+#include "def.hpp"
+#include "Map.hpp"
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+
+/*
+ * A stored message, pointing into the mapped segment.
+ * Only valid while the lock of the mailbox is held.
+ */
+struct MailboxRecord {
+    uint64_t seq;
+    const uint8_t *data;
+    size_t size;
+};
+
+/*
+ * Who to tell once a stored message is durable.
+ */
+struct MailboxTicket {
+    uint16_t package_id;
+    uint8_t sender_id;
+    std::string key;
+};
+
+/*
+ * Durable store of the messages for recipients which are not connected.
+ * The messages are appended to a log of fixed size segments mapped into
+ * memory, and looked up through a per-recipient index rebuilt from the
+ * log at startup. Appends are group committed: a commit thread calls
+ * fdatasync once for all the records appended since the last commit,
+ * then hands their tickets to the commit callback.
+ * Like Map, the operations taking a lock require the lock of get_mutex().
+ */
+class Mailbox {
+public:
+    using CommitCallback = std::function<void(std::vector<MailboxTicket> &)>;
+
+private:
+    struct Segment {
+        uint64_t number;
+        int fd;
+        uint8_t *base;
+        size_t size;        // Bytes written.
+        size_t live_num;    // Stored messages not delivered yet.
+        bool dirty;         // Written since the last commit.
+    };
+
+    struct Location {
+        uint64_t seq;
+        uint64_t segment;
+        size_t offset;
+    };
+
+    const std::string dir_;
+    std::deque<Segment> segments_;
+    std::unordered_map<std::string, std::deque<Location> > index_;
+    uint64_t next_seq_;
+    size_t stored_num_;
+
+    // Group commit.
+    std::vector<MailboxTicket> tickets_;
+    CommitCallback commit_callback_;
+    uint64_t commit_num_;
+    bool pending_;      // Appended since the last commit.
+    bool stopping_;
+    std::condition_variable commit_cond_;
+    std::thread committer_;
+    std::mutex mutex_;
+
+    /*
+     * Map a segment file, creating it if it does not exist.
+     * @param number: The number of the segment.
+     */
+    void open_segment(uint64_t number);
+
+    /*
+     * Rebuild the index from the records of a segment.
+     * @param segment: The segment to scan.
+     */
+    void recover_segment(Segment &segment);
+
+    /*
+     * Append a record to the active segment, rolling to a new one if full.
+     * @return: The segment and offset of the record.
+     */
+    Location append_record(
+        uint8_t kind,
+        const std::string &key,
+        uint64_t seq,
+        const void *payload,
+        size_t payload_size
+    );
+
+    /*
+     * Unlink the oldest segments without any live message.
+     */
+    void remove_delivered_segments();
+
+    /*
+     * Keep committing the appended records.
+     */
+    void commit_records();
+
+    Segment *find_segment(uint64_t number);
+
+public:
+    /*
+     * Open the mailbox in a directory, recovering the stored messages.
+     * @param dir: The directory of the segments, created if not exists.
+     * @param commit_callback: Called on the commit thread with the tickets
+     *                         of every committed batch, without the lock held.
+     */
+    Mailbox(std::string dir, CommitCallback commit_callback);
+    ~Mailbox();
+
+    std::mutex &get_mutex() {
+        return mutex_;
+    }
+
+    /*
+     * Store a message for a recipient.
+     * The ticket is handed to the commit callback once the message is durable.
+     * @param key: The key of the recipient.
+     * @param buffer: The serialized message.
+     * @param size: The size of the serialized message.
+     * @param ticket: The ticket of the message.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: Whether the message is stored.
+     */
+    bool store(
+        const std::string &key,
+        const void *buffer,
+        size_t size,
+        MailboxTicket ticket,
+        std::unique_lock<std::mutex> &lock
+    );
+
+    /*
+     * Get the oldest messages of a recipient, after the ones being delivered.
+     * @param key: The key of the recipient.
+     * @param after_seq: Only the messages with greater sequence numbers are got.
+     * @param max_num: The maximum number of messages to get.
+     * @param records: Filled with the messages, cleared first.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: The number of messages got.
+     */
+    size_t fetch(
+        const std::string &key,
+        uint64_t after_seq,
+        size_t max_num,
+        std::vector<MailboxRecord> &records,
+        std::unique_lock<std::mutex> &lock
+    );
+
+    /*
+     * Mark the messages of a recipient as delivered, up to a sequence number.
+     * @param key: The key of the recipient.
+     * @param seq: The sequence number of the last delivered message.
+     * @param lock: The unique_lock of get_mutex().
+     */
+    void mark_delivered(const std::string &key, uint64_t seq, std::unique_lock<std::mutex> &lock);
+
+    size_t get_stored_num(std::unique_lock<std::mutex> &lock);
+    size_t get_segment_num(std::unique_lock<std::mutex> &lock);
+    uint64_t get_commit_num(std::unique_lock<std::mutex> &lock);
+};
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef __REQUEST_TABLE_HPP__
+#define __REQUEST_TABLE_HPP__
+
+#include "def.hpp"
+#include "Message.hpp"
+#include "Map.hpp"
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <vector>
+#include <chrono>
+
+/*
+ * How a request is completed.
+ */
+enum class ReplyStatus {
+    ACKED,      // Answered by an ACK.
+    WAITED,     // Answered by a WAIT, the request is dropped.
+    TIMED_OUT,  // Not answered in time.
+    CLOSED      // The connection is closed before the answer.
+};
+
+/*
+ * The completion of a request.
+ */
+struct Reply {
+    ReplyStatus status;
+    // The type of the request.
+    MessageType type;
+    // The ACK or the WAIT, null otherwise.
+    MessagePtr message;
+};
+
+using ReplyCallback = std::function<void(Reply &)>;
+
+/*
+ * A request waiting for its answer.
+ */
+struct PendingRequest {
+    uint16_t package_id;
+    MessageType type;
+    // Null for the requests reported through the output queue of the client.
+    ReplyCallback callback;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+/*
+ * The requests of a client waiting for their answers, by package id,
+ * with their deadlines kept in order so that expiring them does not
+ * scan all the pending requests.
+ * Like Map, every operation requires the lock of get_mutex().
+ */
+class RequestTable {
+private:
+    using DeadlineMap = std::multimap<std::chrono::steady_clock::time_point, uint16_t>;
+
+    std::unordered_map<uint16_t, std::pair<PendingRequest, DeadlineMap::iterator> > requests_;
+    DeadlineMap deadlines_;
+    std::mutex mutex_;
+
+public:
+    std::mutex &get_mutex() {
+        return mutex_;
+    }
+
+    /*
+     * Add a request.
+     * @param request: The request, with the package id it is sent with.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: Whether the request is added, false if the package id is still pending.
+     */
+    bool insert(PendingRequest request, std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Take a request out, once it is answered.
+     * @param package_id: The package id of the request.
+     * @param request: Set to the request.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: Whether the request is pending.
+     */
+    bool take(uint16_t package_id, PendingRequest &request, std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Take the requests out whose deadlines have passed.
+     * @param now: The current time.
+     * @param requests: Filled with the expired requests, in the order of the deadlines.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: The number of the expired requests.
+     */
+    size_t take_expired(
+        std::chrono::steady_clock::time_point now,
+        std::vector<PendingRequest> &requests,
+        std::unique_lock<std::mutex> &lock
+    );
+
+    /*
+     * Take all the requests out.
+     * @param requests: Filled with the requests.
+     * @param lock: The unique_lock of get_mutex().
+     */
+    void take_all(std::vector<PendingRequest> &requests, std::unique_lock<std::mutex> &lock);
+
+    size_t size(std::unique_lock<std::mutex> &lock);
+};
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef __ROUTER_HPP__
+#define __ROUTER_HPP__
+
+#include "def.hpp"
+#include "Message.hpp"
+#include "Queue.hpp"
+#include "HashRing.hpp"
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <list>
+#include <string>
+#include <vector>
+
+/*
+ * A client connection placed on a backend, and the threads splicing it.
+ */
+struct Route {
+    int client_sockfd;
+    int backend_sockfd;
+    std::string name;
+    size_t backend;
+    // Places the client, then splices from the client to the backend.
+    std::thread upstream;
+    // Splices from the backend to the client.
+    std::thread downstream;
+    // The threads done, the route is released at 2.
+    std::atomic_int finished_num;
+
+    Route(int client_sockfd);
+    ~Route();
+};
+
+/*
+ * The front of several servers, e.g. the nodes of a cluster, which places every client
+ * on one of them by consistent hashing of its name, so no lookup is needed per message
+ * and the routers need no shared state.
+ * Only the CONNECT or RESUME REQUEST is parsed. Then the client is either told to
+ * connect to its backend with a REDIRECT, or its connection is spliced to the backend
+ * through pipes, without copying the bytes out of the kernel.
+ */
+class Router {
+private:
+    int sockfd_;
+    sockaddr_in router_addr_;
+    // Whether to redirect the clients rather than splicing them.
+    const bool redirect_;
+    std::atomic_bool running_;
+    // Protected by mutex_.
+    std::mutex mutex_;
+    std::vector<sockaddr_in> backends_;
+    HashRing ring_;
+    std::list<std::unique_ptr<Route> > routes_;
+    // Statistics.
+    std::atomic_uint64_t accepted_num_;
+    std::atomic_uint64_t spliced_num_;
+    std::atomic_uint64_t redirected_num_;
+    std::atomic_uint64_t failed_over_num_;
+    std::atomic_uint64_t refused_num_;
+    std::atomic_uint64_t spliced_bytes_;
+    std::unique_ptr<Queue<std::string> > output_queue_;
+
+    /*
+     * Format an address as host:port.
+     */
+    static std::string to_string(const sockaddr_in &addr);
+
+    /*
+     * Read a whole packet, leaving the bytes after it in buffer.
+     * @param sockfd The socket.
+     * @param buffer Where the bytes are read into, may hold some already.
+     * @return The size of the packet at the front of buffer, or -1 if the connection ends first.
+     */
+    ssize_t read_packet(int sockfd, std::vector<uint8_t> &buffer);
+
+    /*
+     * Write all the bytes.
+     * @return Whether all of them are written.
+     */
+    static bool write_all(int sockfd, const uint8_t *data, size_t size);
+
+    /*
+     * Connect to a backend.
+     * @param backend The index of the backend.
+     * @return The socket, or -1 if the backend is down.
+     */
+    int connect_backend(size_t backend);
+
+    /*
+     * Place a client and splice its connection, on the upstream thread of its route.
+     * @param route The route of the client.
+     */
+    void serve(Route *route);
+
+    /*
+     * Move the bytes from one socket to the other through a pipe, until the first ends.
+     * @param from The socket to read.
+     * @param to The socket to write.
+     */
+    void pump(int from, int to);
+
+    /*
+     * Join and release the routes whose threads are done.
+     * Must be called with mutex_ held.
+     */
+    void reap_routes();
+
+public:
+    /*
+     * Constructor.
+     * @param addr The address to listen on.
+     * @param port The port to listen on.
+     * @param backends The servers to place the clients on, at least one.
+     * @param redirect Whether to redirect the clients rather than splicing them.
+     */
+    Router(in_addr_t addr, int port, std::vector<sockaddr_in> backends, bool redirect);
+    ~Router();
+
+    /*
+     * Keep accepting the clients, every one on a thread of its own.
+     */
+    void run();
+
+    /*
+     * Stop the router.
+     */
+    void stop();
+
+    /*
+     * Add a backend, taking the new clients whose names land on its points.
+     * The connected clients stay where they are until they connect again.
+     * @param addr The address of the backend.
+     */
+    void add_backend(const sockaddr_in &addr);
+
+    /*
+     * Measure the cost of adding a backend, on the current ring:
+     * the share of the clients placed elsewhere, against the modulo placement,
+     * the spread of the clients and the time spent.
+     * @param client_num The number of the names to place.
+     */
+    void bench_rebalance(size_t client_num);
+
+    /*
+     * Print the message queue.
+     * @return Whether the printing is successful.
+     */
+    bool output_message();
+
+    /*
+     * Push the statistics into the message queue.
+     * @return Whether the pushing is successful.
+     */
+    bool output_stats();
+};
+
+#endif
@@ -7,13 +7,28 @@
 #include "Sender.hpp"
 #include "Map.hpp"
 #include "Queue.hpp"
+#include "Dispatcher.hpp"
+#include "TopicIndex.hpp"
+#include "Mailbox.hpp"
+#include "TokenBucket.hpp"
+#include "ClientDirectory.hpp"
+#include "EventLoop.hpp"
+#include "DatagramChannel.hpp"
+#include "Handover.hpp"
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
+#include <future>
 #include <thread>
+#include <bitset>
+#include <array>
+#include <chrono>
+#include <vector>
+#include <deque>
 
 class ClientInfo {
 private:
@@ -21,10 +36,18 @@ private:
     std::string name_;
     sockaddr_in addr_;
     uint8_t client_id_;
-    std::unique_ptr<Sender> sender_;
-    std::unique_ptr<Receiver> receiver_;
+    // The client owning the connection, its own id unless attached to the connection of another,
+    // e.g. of a gateway. The attached clients share the Sender and the Receiver of the owner.
+    uint8_t gateway_id_;
+    std::shared_ptr<Sender> sender_;
+    std::shared_ptr<Receiver> receiver_;
     std::unique_ptr<std::map<uint16_t, MessageType> > message_type_map_;
-
+    // The address of the datagram channel of the client, if negotiated.
+    bool has_datagram_addr_;
+    sockaddr_in datagram_addr_;
+    // The rate limits of the client, only touched by the receiving coroutine of the connection.
+    TokenBucket message_bucket_;
+    TokenBucket byte_bucket_;
 
 public:
     ClientInfo(
@@ -35,19 +58,134 @@ public:
         Sender *sender,
         Receiver *receiver
     );
+
+    /*
+     * Attach a client to the connection of another.
+     * @param name The name of the client.
+     * @param id The id of the client.
+     * @param gateway The client owning the connection.
+     */
+    ClientInfo(std::string name, uint8_t id, ClientInfo &gateway);
     ~ClientInfo();
 
-    std::string get_name();
+    int get_sockfd();
+    uint8_t get_gateway_id();
+    const std::string &get_name();
     sockaddr_in get_addr();
     Sender *get_sender();
     Receiver *get_receiver();
+
+    /*
+     * Set the address of the datagram channel of the client.
+     * @param addr The address, in network order.
+     */
+    void set_datagram_addr(const sockaddr_in &addr);
+
+    /*
+     * Get the address of the datagram channel of the client.
+     * @param addr Set to the address if any.
+     * @return Whether the client has a datagram channel.
+     */
+    bool get_datagram_addr(sockaddr_in &addr);
+
+    /*
+     * Get the buckets the requests of the client are charged to,
+     * only by the receiving coroutine of the connection.
+     */
+    TokenBucket &get_message_bucket();
+    TokenBucket &get_byte_bucket();
+
+    /*
+     * Shut down the connection, so that its receiving coroutine stops.
+     * The clients attached to it leave along.
+     */
+    void shutdown_connection();
 };
 
 struct PacketInfo {
     uint16_t package_id;
+    // SERVER_ID for a FWD from the mailbox, whose sender is acknowledged already.
     uint8_t sender_id;
     uint8_t receiver_id;
     MessageType message_type;
+    // The FWD, kept for replaying after a RESUME.
+    FrameRef frame;
+    // Order of the FWDs, package ids may wrap around.
+    // A cumulative ACKS acknowledges the ones before it on the connection.
+    uint64_t seq;
+    // The sequence number of a FWD from the mailbox, delivered once acknowledged, otherwise 0.
+    uint64_t mailbox_seq;
+};
+
+/*
+ * The stored messages of a name being forwarded to the client holding it,
+ * at most MAX_BUFFERED_BYTES of them at once.
+ */
+struct MailboxDelivery {
+    // "@<name>", empty if nothing is being delivered.
+    std::string key;
+    // The sequence number of the last message forwarded.
+    uint64_t sent_seq;
+    // The messages forwarded and not delivered yet, in order, and whether acknowledged.
+    std::deque<std::pair<uint64_t, bool> > pending;
+};
+
+/*
+ * Session of a client, kept for SESSION_GRACE_PERIOD seconds
+ * after the connection drops so that the client can RESUME it.
+ */
+struct Session {
+    std::string token;
+    std::string name;
+    bool suspended;
+    std::chrono::steady_clock::time_point expire_time;
+};
+
+/*
+ * Status of a REQUEST MULTICAST whose shared FWD is not fully acknowledged.
+ */
+struct MulticastInfo {
+    uint16_t package_id;
+    uint8_t sender_id;
+    std::bitset<MAX_CLIENT_NUM + 1> pending;
+    std::bitset<MAX_CLIENT_NUM + 1> succeeded;
+    std::bitset<MAX_CLIENT_NUM + 1> failed;
+};
+
+/*
+ * The heart beat coroutine of a client.
+ */
+struct Monitor {
+    // Set to stop the coroutine early, e.g. when the client leaves.
+    AsyncEvent stop_event;
+    // Set by the coroutine once it finishes.
+    AsyncEvent finished;
+};
+
+/*
+ * Context of the client connection which a message is received from.
+ */
+struct ClientContext {
+    uint8_t client_id;
+    Sender *sender;
+    Receiver *receiver;
+    std::unique_lock<std::mutex> &clientinfo_list_lock;
+};
+
+/*
+ * A link to another server of the cluster, carrying the REQSENDs to its clients
+ * and their answers back, and the joins and the leaves of the clients.
+ * The Sender queues the frames of all the clients and writes them in batches.
+ */
+struct PeerLink {
+    int sockfd;
+    std::unique_ptr<Sender> sender;
+    std::unique_ptr<Receiver> receiver;
+    // The clients of the peer, joined into the ClientDirectory.
+    std::bitset<MAX_CLIENT_NUM + 1> members;
+
+    PeerLink(int sockfd, std::unique_ptr<Sender> sender, std::unique_ptr<Receiver> receiver);
+    ~PeerLink();
 };
 
 class Server {
@@ -55,14 +193,483 @@ private:
     int sockfd_;
     const std::string name_;
     sockaddr_in server_addr_;
+    // The listener for the local clients, -1 if disabled.
+    int unix_sockfd_;
+    const std::string unix_path_;
+    // Connections accepted through TCP and through the unix socket.
+    std::atomic_uint64_t tcp_accepted_num_;
+    std::atomic_uint64_t unix_accepted_num_;
+    // Connections through the unix socket which moved to shared memory rings.
+    std::atomic_uint64_t shm_accepted_num_;
+    // Clients attached to the connections of others, e.g. of the gateways.
+    std::atomic_uint64_t attached_num_;
     uint8_t self_id_;
     std::atomic_bool running_;
+    // Statistics of the forward path.
+    std::atomic_uint64_t forwarded_num_;
+    std::atomic_uint64_t forward_alloc_num_;
+    // Statistics of the publish path.
+    std::atomic_uint64_t published_num_;
+    std::atomic_uint64_t delivered_num_;
+    std::atomic_uint64_t resumed_num_;
+    uint64_t forward_seq_;
+    // Flow control, protected by the lock of clientinfo_list_.
+    // Bytes forwarded to every receiver and not acknowledged yet.
+    std::array<size_t, MAX_CLIENT_NUM + 1> buffered_bytes_;
+    // Senders told to WAIT, for every receiver.
+    std::array<std::bitset<MAX_CLIENT_NUM + 1>, MAX_CLIENT_NUM + 1> waiting_senders_;
+    size_t peak_buffered_bytes_;
+    std::atomic_uint64_t waited_num_;
+    // Per-client rate limits, 0 for unlimited, and the admission limit.
+    std::atomic_uint32_t message_rate_limit_;
+    std::atomic_uint32_t byte_rate_limit_;
+    std::atomic_uint32_t connection_limit_;
+    std::atomic_uint64_t rate_limited_num_;
+    std::atomic_uint64_t rejected_num_;
+    // Whether the kernel probes the idle TCP connections accepted from now on, see set_keepalive().
+    std::atomic_bool keepalive_;
+    // Whether every message received is logged, see set_tracing().
+    std::atomic_bool tracing_;
+    // The heart beats sent, and those not needed as the client was heard of lately.
+    std::atomic_uint64_t heart_beat_num_;
+    std::atomic_uint64_t skipped_heart_beat_num_;
+    // Clients watching the presence, and the version of the last notification,
+    // protected by the lock of clientinfo_list_.
+    std::bitset<MAX_CLIENT_NUM + 1> presence_watchers_;
+    uint64_t presence_version_;
+    std::atomic_uint64_t presence_event_num_;
+    std::atomic_uint64_t presence_sent_num_;
+    // The connections asking for the ACKs of their REQUEST SENDs in ACKS, and the package ids
+    // of the next ACKS of every connection, protected by the lock of clientinfo_list_.
+    std::bitset<MAX_CLIENT_NUM + 1> ack_batching_;
+    std::array<std::vector<uint16_t>, MAX_CLIENT_NUM + 1> ack_batches_;
+    // The number of the ids in ack_batches_, read without the lock to skip flushing.
+    std::atomic_size_t ack_batch_size_;
+    // The ACKs of the FWDs taken alone and in ACKS, and the ACKS,
+    // then the ones relayed to the senders.
+    std::atomic_uint64_t single_ack_in_num_;
+    std::atomic_uint64_t batched_ack_in_num_;
+    std::atomic_uint64_t ack_batch_in_num_;
+    std::atomic_uint64_t single_ack_out_num_;
+    std::atomic_uint64_t batched_ack_out_num_;
+    std::atomic_uint64_t ack_batch_out_num_;
     // Use Map/Queue with mutex for thread safety.
     std::unique_ptr<Map<uint8_t, std::unique_ptr<ClientInfo> > > clientinfo_list_;
-    std::unique_ptr<Map<uint8_t, std::unique_ptr<std::thread> > > client_recv_list_;
-    std::unique_ptr<Map<uint8_t, std::unique_ptr<std::thread> > > client_monitor_list_;
+    // Ready once the receiving coroutine of the client finishes.
+    std::unique_ptr<Map<uint8_t, std::future<void> > > client_recv_list_;
+    std::unique_ptr<Map<uint8_t, Monitor> > client_monitor_list_;
     std::unique_ptr<Map<uint16_t, PacketInfo> > message_status_map_;
+    // Key is the shared FWD's package id.
+    std::unique_ptr<Map<uint16_t, MulticastInfo> > multicast_status_map_;
+    // Sessions of the connected and the suspended clients.
+    std::unique_ptr<Map<uint8_t, Session> > session_map_;
+    std::unique_ptr<TopicIndex> topic_index_;
+    // The connected clients, for REQCLILIST.
+    std::unique_ptr<ClientDirectory> client_directory_;
+    // Null if the mailbox is disabled.
+    std::unique_ptr<Mailbox> mailbox_;
+    // For every client, protected by the lock of clientinfo_list_.
+    std::array<MailboxDelivery, MAX_CLIENT_NUM + 1> mailbox_deliveries_;
     std::unique_ptr<Queue<std::string> > output_queue_;
+    Dispatcher<Server, ClientContext> dispatcher_;
+    // Carries the heart beats and the DATAGRAMs of the clients which asked for it,
+    // null if the port can not be bound. Flushed on loop_ once per iteration.
+    std::unique_ptr<DatagramChannel> datagram_channel_;
+    // DATAGRAMs relayed through TCP, to the clients without a datagram channel.
+    std::atomic_uint64_t datagram_fallback_num_;
+    // Runs the receiving and the heart beats of all the clients, the session expiry
+    // and the presence notifications as coroutines, on loop_thread_.
+    std::unique_ptr<EventLoop> loop_;
+    std::thread loop_thread_;
+    // The connections closed on loop_, destroyed on releaser_ instead, since their senders
+    // wait up to TIMEOUT to write what is still queued. Protected by released_mutex_.
+    std::vector<std::unique_ptr<ClientInfo> > released_;
+    bool releaser_stopping_;
+    std::mutex released_mutex_;
+    std::condition_variable released_cond_;
+    std::thread releaser_;
+    // The cluster, a client id belongs to node (id - 1) % node_num_, so the node of
+    // a receiver is known without asking. A single server is node 0 of 1.
+    uint8_t node_index_;
+    uint8_t node_num_;
+    std::vector<sockaddr_in> node_addrs_;
+    // The links to the other nodes and their receiving threads, protected by the
+    // lock of clientinfo_list_. The node with the greater index connects.
+    std::array<std::unique_ptr<PeerLink>, MAX_NODE_NUM> peer_links_;
+    std::array<std::thread, MAX_NODE_NUM> peer_threads_;
+    // REQSENDs forwarded to the other nodes, received from them, and the answers relayed back.
+    std::atomic_uint64_t peer_forwarded_num_;
+    std::atomic_uint64_t peer_received_num_;
+    std::atomic_uint64_t peer_relayed_num_;
+    // The hot upgrade, set while the connections are passed to the server replacing this one,
+    // then the receiving coroutines stop without dropping their clients.
+    std::atomic_bool handing_over_;
+    // Set once they are passed, the sockets are left to the new server from then on.
+    bool handed_over_;
+    // Held by run() while accepting, which is woken up through wake_fd_.
+    std::mutex accept_mutex_;
+    int wake_fd_;
+
+    /*
+     * Register the message handlers into dispatcher_.
+     */
+    void register_handlers();
+
+    // Message handlers, called by dispatcher_ with clientinfo_list_ locked.
+    DispatchResult handle_heart_beat(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_connect(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_disconnect(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_request_time(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_request_host(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_request_client_list(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_request_client_list_since(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_request_send(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_request_send_by_name(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_request_multicast(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_subscribe(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_unsubscribe(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_publish(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_presence(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_acknowledge(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_datagram(ClientContext &context, MessagePtr &message);
+    DispatchResult handle_request_acks(ClientContext &context, MessagePtr &message);
+
+    /*
+     * Handle an ACKS, acknowledging the FWDs up to the cumulative one on the connection,
+     * i.e. forwarded before it, and the ones in the ranges, shared FWDs too.
+     * @param context The context of the client acknowledging.
+     * @param message The ACKS.
+     * @return The result of the dispatching.
+     */
+    DispatchResult handle_batched_acknowledge(ClientContext &context, MessagePtr &message);
+
+    /*
+     * Tell the sender of an acknowledged FWD, in the next ACKS of its connection if it asked.
+     * @param packet_info The package info of the FWD.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void relay_acknowledge(const PacketInfo &packet_info, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Send the ACKS of every connection with ids batched. Called by the receiving coroutines
+     * once what was read at once is handled, so no ACK waits for more than that.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void flush_acks(std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Handle an ACK to a shared FWD of a REQUEST MULTICAST.
+     * @param context The context of the client acknowledging.
+     * @param message The ACK.
+     * @return The result of the dispatching.
+     */
+    DispatchResult handle_multicast_acknowledge(ClientContext &context, MessagePtr &message);
+
+    /*
+     * Mark the receivers of a shared FWD on a connection as acknowledged,
+     * sending the aggregated ACK once all the receivers answered.
+     * @param pakage_id The package id of the shared FWD.
+     * @param connection The id of the owner of the connection.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     * @return Whether a receiver is on the connection.
+     */
+    bool acknowledge_multicast(
+        uint16_t pakage_id,
+        uint8_t connection,
+        std::unique_lock<std::mutex> &clientinfo_list_lock
+    );
+
+    /*
+     * Send the aggregated ACK of a REQUEST MULTICAST to its sender.
+     * @param info The status of the REQUEST MULTICAST.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void send_multicast_result(
+        const MulticastInfo &info,
+        std::unique_lock<std::mutex> &clientinfo_list_lock
+    );
+
+    /*
+     * Store a REQUEST SEND to a client which is not connected.
+     * The sender is acknowledged once the message is durable.
+     * @param context The context of the client sending.
+     * @param message The REQUEST SEND.
+     * @param key The key of the receiver, "@<name>".
+     * @return Whether the message is stored.
+     */
+    bool store_in_mailbox(ClientContext &context, MessagePtr &message, const std::string &key);
+
+    /*
+     * Acknowledge the senders of the stored messages, called by the mailbox.
+     * @param tickets The tickets of the committed messages.
+     */
+    void acknowledge_stored(std::vector<MailboxTicket> &tickets);
+
+    /*
+     * Start forwarding the stored messages of a client which has just connected, if it holds its name,
+     * or go on after a RESUME.
+     * @param client_id The id of the client.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void deliver_mailbox(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Forward the next stored messages of a client, as long as its buffer takes them.
+     * They are kept in message_status_map_ with their frames, to be replayed after a RESUME.
+     * @param client_id The id of the client.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void send_mailbox(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Take the ACK of a FWD from the mailbox. The messages acknowledged in order are marked delivered,
+     * then the next ones are forwarded once half of the buffer of the client is drained.
+     * @param packet_info The FWD.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void acknowledge_mailbox(const PacketInfo &packet_info, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Validate a RESUME REQUEST, taking over the connection of its session
+     * if the server has not noticed the old connection is dropped.
+     * @param request The RESUME REQUEST.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_, may be released meanwhile.
+     * @return The id to restore, or 0 if the session can not be resumed.
+     */
+    uint8_t accept_resume(MessagePtr &request, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Send the FWDs to a resumed client again, which are not acknowledged yet.
+     * @param client_id The id of the client.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void replay_forwards(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Charge a REQUEST SEND to the buffer of its receiver.
+     * If MAX_BUFFERED_BYTES would be exceeded, the sender is told to WAIT
+     * until a CREDIT, and the message is dropped.
+     * @param context The context of the client sending.
+     * @param message The REQUEST SEND.
+     * @return Whether the message can be forwarded.
+     */
+    bool take_credit(ClientContext &context, MessagePtr &message);
+
+    /*
+     * Give back the bytes of an acknowledged FWD, sending a CREDIT to the
+     * waiting senders once the buffer of the receiver is half drained.
+     * @param receiver_id The id of the receiver.
+     * @param size The size of the FWD.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void return_credit(uint8_t receiver_id, size_t size, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Keep a REQUEST SEND to a suspended client for replaying.
+     * @param context The context of the client sending.
+     * @param message The REQUEST SEND.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     * @return Whether the receiver is suspended.
+     */
+    bool keep_for_session(
+        ClientContext &context,
+        MessagePtr &message,
+        std::unique_lock<std::mutex> &clientinfo_list_lock
+    );
+
+    /*
+     * Release everything left by a client, once its session ends.
+     * @param client_id The id of the client.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void release_client(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Take a connection out of clientinfo_list_, to be closed on releaser_.
+     * @param client_id The id of the client owning the connection.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void retire_connection(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Destroy the retired connections, flushing their senders.
+     * Runs on releaser_ until the server is destroyed.
+     */
+    void release_connections();
+
+    /*
+     * Find a free client id of this node, the ids of the suspended sessions are kept.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     * @return The id, or 0 if none is free.
+     */
+    uint8_t find_free_id(std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Remove a client attached to the connection of another, the connection stays.
+     * @param client_id The id of the attached client.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void detach_client(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Keep releasing the suspended sessions which expire.
+     * Runs on loop_.
+     */
+    Task<> expire_sessions();
+
+    /*
+     * Keep notifying the watching clients of the joins and the leaves,
+     * once every PRESENCE_TICK milliseconds with all the changes of the tick.
+     * Runs on loop_.
+     */
+    Task<> notify_presence();
+
+    /*
+     * Relay a DATAGRAM to its receiver, through the datagram channel if the receiver
+     * has one, otherwise through TCP. Dropped if the receiver is not connected.
+     * @param message The DATAGRAM.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void relay_datagram(MessagePtr &message, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Keep receiving from the datagram channel, the heart beats and the DATAGRAMs.
+     * Runs on loop_.
+     */
+    Task<> receive_datagrams();
+
+    /*
+     * Get the node of the cluster which a client belongs to.
+     * @param client_id The id of the client.
+     * @return The index of the node.
+     */
+    uint8_t get_node(uint8_t client_id) const;
+
+    /*
+     * Get the connection to send to a client through, the one of the client
+     * if it is connected here, otherwise the link to its node.
+     * @param client_id The id of the client.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     * @return The sender, or null if the client can not be reached.
+     */
+    Sender *route(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Forward a REQUEST SEND to the node of its receiver, which acknowledges it.
+     * @param context The context of the client sending.
+     * @param message The REQUEST SEND.
+     * @param node The node of the receiver.
+     * @return The result of the dispatching.
+     */
+    DispatchResult forward_to_node(ClientContext &context, MessagePtr &message, uint8_t node);
+
+    /*
+     * Keep connecting to the nodes with a smaller index, every PEER_RETRY_INTERVAL
+     * milliseconds while a link is down.
+     * Runs on loop_.
+     */
+    Task<> connect_peers();
+
+    /*
+     * Take a link to another node, send it the clients connected here,
+     * and start receiving from it.
+     * @param node The index of the node.
+     * @param sockfd The socket of the link.
+     * @param sender The sender of the link.
+     * @param receiver The receiver of the link.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     * @return False if the node is linked already, then the socket is closed.
+     */
+    bool add_peer_link(
+        uint8_t node,
+        int sockfd,
+        std::unique_ptr<Sender> sender,
+        std::unique_ptr<Receiver> receiver,
+        std::unique_lock<std::mutex> &clientinfo_list_lock
+    );
+
+    /*
+     * Tell the other nodes that a client joined or left.
+     * @param client_id The id of the client.
+     * @param joined Whether the client joined.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void announce_member(uint8_t client_id, bool joined, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Apply a PEER packet from another node to the ClientDirectory.
+     * @param node The index of the node.
+     * @param message The PEER packet.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void update_members(uint8_t node, MessagePtr &message, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Keep receiving from the link to another node, until it drops.
+     * @param node The index of the node.
+     */
+    void receive_from_peer(uint8_t node);
+
+    /*
+     * Drop the links to the other nodes, and join their receiving threads.
+     */
+    void drop_peer_links();
+
+    /*
+     * Bind and listen on the TCP port.
+     */
+    void open_tcp_listener();
+
+    /*
+     * Bind and listen on the unix socket, if enabled.
+     * Closes the TCP listener if it fails.
+     */
+    void open_unix_listener();
+
+    /*
+     * Connect to the running server being upgraded, and take its listeners
+     * once it has stopped receiving from its clients.
+     * @param path The unix socket the running server waits on.
+     * @param datagram_sockfd Set to its UDP socket, -1 if it has none.
+     * @return The socket to take the clients through, see take_over().
+     */
+    int take_listeners(const std::string &path, int &datagram_sockfd);
+
+    /*
+     * Take the clients and the tables of the running server being upgraded, then start
+     * receiving from the clients. Errors are logged, the clients taken until then are kept.
+     * @param sockfd The socket from take_listeners(), closed.
+     */
+    void take_over(int sockfd);
+
+    /*
+     * Take a connection passed by the former server.
+     * @param record The CLIENT record, with the socket and the fds of the rings,
+     *               none for a client attached to the connection of another.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     * @return The id of the client.
+     */
+    uint8_t adopt_client(HandoverRecord &record, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Restore the sessions, the FWDs not acknowledged and the other tables of the former server.
+     * @param record The STATE record.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void restore_state(HandoverRecord &record, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Write the tables restored by restore_state().
+     * @param record The STATE record.
+     * @param clientinfo_list_lock The unique_lock of the clientinfo_list_.
+     */
+    void save_state(HandoverRecord &record, std::unique_lock<std::mutex> &clientinfo_list_lock);
+
+    /*
+     * Start the receiving and the heart beats of a client on loop_.
+     * @param client_id The id of the client.
+     */
+    void start_client(uint8_t client_id);
 
     /*
      * Wait for clients to connect.
@@ -71,19 +678,53 @@ private:
     uint8_t wait_for_client();
 
     /*
-     * Keep receiving messages from the client.
+     * Get the fds passed with the first packet of a unix socket connection,
+     * without taking the packet, which the Receiver reads as usual.
+     * Blocks until the packet arrives.
+     * @param sockfd The socket of the connection.
+     * @return The fds passed, empty if none.
+     */
+    std::vector<int> peek_fds(int sockfd);
+
+    /*
+     * Check a request against the rate limits of its sender, the client or one attached to it.
+     * HEARTBEAT, ACK and DISCONNECT are never limited.
+     * @param message The request.
+     * @param message_bucket The message bucket of the client.
+     * @param byte_bucket The byte bucket of the client.
+     * @return Whether the request is admitted.
+     */
+    bool admit_request(const Message &message, TokenBucket &message_bucket, TokenBucket &byte_bucket);
+
+    /*
+     * Keep receiving messages from the client, and handle them.
+     * Runs on loop_, suspended while the connection has nothing to read,
+     * and giving the other clients a turn after RECEIVE_BATCH messages.
+     * @param client_id The id of the client.
+     */
+    Task<> receive_from_client(uint8_t client_id);
+
+    /*
+     * Keep sending heart beats to the client, until it loses MAX_LOST_HEART_BEAT of them.
+     * Any message counts as an answer, so a heart beat is only sent once the client has been
+     * idle for HEART_BEAT_INTERVAL, and none at all on a connection probed by the kernel.
+     * Every wait is lengthened by up to HEART_BEAT_JITTER, so the heart beats of the clients
+     * connected at once spread out instead of going out together.
+     * Runs on loop_, suspended between the heart beats.
      * @param client_id The id of the client.
+     * @param monitor Its stop_event is set to stop early, its finished is set at the end.
      */
-    void receive_from_client(uint8_t client_id);
+    Task<> monitor_client(uint8_t client_id, Monitor monitor);
 
     /*
-     * Keep monitoring the client.
+     * Stop the heart beats of a client, and wait for its coroutine to finish.
+     * Runs on loop_, from the receiving coroutine of the client.
      * @param client_id The id of the client.
      */
-    void monitor_client(uint8_t client_id);
+    Task<> stop_monitor(uint8_t client_id);
 
     /*
-     * Join the threads.
+     * Wait for the receiving coroutines, and join the threads of the links to the other nodes.
      */
     void join_threads();
 
@@ -99,12 +740,33 @@ private:
         std::unique_lock<std::mutex> &clientinfo_list_lock
     );
 
+    /*
+     * Fail the shared FWDs waiting for the given client id.
+     * @param client_id The id of the client.
+     * @param lock The unique_lock of the clientinfo_list_.
+     */
+    void clear_multicast_status_map(
+        uint16_t client_id,
+        std::unique_lock<std::mutex> &clientinfo_list_lock
+    );
+
 public:
     /*
      * Connect to the server.
      * @param name The name of the client.
+     * @param mailbox_dir The directory of the mailbox, empty to disable it.
+     * @param unix_path The path to listen on for the local clients, empty to disable it.
+     * @param upgrade_path The unix socket of a running server to take the listeners and the clients
+     *                     over from, see hand_over(), empty to start afresh.
      */
-    Server(std::string name, in_addr_t addr, int port);
+    Server(
+        std::string name,
+        in_addr_t addr,
+        int port,
+        std::string mailbox_dir = "",
+        std::string unix_path = "",
+        const std::string &upgrade_path = ""
+    );
     ~Server();
 
     /*
@@ -120,11 +782,68 @@ public:
      */
     void stop();
 
+    /*
+     * Change the limits, taking effect on the next request of every client.
+     * @param message_rate The messages per second of a client, 0 for unlimited.
+     * @param byte_rate The bytes per second of a client, 0 for unlimited.
+     * @param connection_num The maximum number of connected clients.
+     */
+    void set_limits(uint32_t message_rate, uint32_t byte_rate, uint32_t connection_num);
+
+    /*
+     * Let the kernel probe the idle TCP connections accepted from now on, with TCP keepalive,
+     * instead of sending them heart beats. A connection dies after MAX_LOST_HEART_BEAT probes
+     * HEART_BEAT_INTERVAL apart, or once its data is not acknowledged for as long.
+     * The clients with a datagram channel still get their heart beats through it.
+     * @param enable Whether to use TCP keepalive.
+     */
+    void set_keepalive(bool enable);
+
+    /*
+     * Log every message received, off by default since building the lines
+     * allocates on the forward path.
+     * @param enable Whether to log the messages.
+     */
+    void set_tracing(bool enable);
+
+    /*
+     * Measure the TopicIndex on its own, with topics whose subscriber counts are skewed
+     * as in a Zipf distribution: the topic of rank r has MAX_CLIENT_NUM / r subscribers, at least 1.
+     * Prints the time per subscription, per lookup of a PUBLISH and per subscription dropped.
+     * @param topic_num The number of the topics.
+     */
+    void bench_topics(size_t topic_num);
+
+    /*
+     * Join a cluster of servers, before running.
+     * The clients of every node are listed on all of them, and the REQUEST SENDs
+     * to the clients of another node are forwarded over the link to it.
+     * @param node_index The index of this server in nodes.
+     * @param nodes The addresses of all the servers of the cluster, in the same order on every one.
+     */
+    void join_cluster(uint8_t node_index, std::vector<sockaddr_in> nodes);
+
+    /*
+     * Pass the listeners and the clients to a new server started with the given upgrade path,
+     * for upgrading without dropping a connection. The clients are paused from the time
+     * the new server connects until it has taken them, then this server only has to stop.
+     * The links to the other nodes are dropped, and connected again by the new server.
+     * @param path The unix socket to wait on for the new server, for HANDOVER_TIMEOUT milliseconds.
+     * @return Whether the clients are passed, false if no server connected.
+     */
+    bool hand_over(const std::string &path);
+
     /*
      * Print the message queue.
      * @return Whether the printing is successful.
      */
     bool output_message();
+
+    /*
+     * Push the statistics into the message queue.
+     * @return Whether the pushing is successful.
+     */
+    bool output_stats();
 };
 
 #endif
@@ -0,0 +1,61 @@
+#ifndef __TOKEN_BUCKET_HPP__
+#define __TOKEN_BUCKET_HPP__
+
+#include <chrono>
+#include <algorithm>
+
+/*
+ * Token bucket refilled at a fixed rate up to its burst.
+ * Not thread safe, the buckets of a client are only touched by the receiving coroutine of its connection.
+ */
+class TokenBucket {
+private:
+    double rate_;       // Tokens per second, 0 for unlimited.
+    double burst_;
+    double tokens_;
+    std::chrono::steady_clock::time_point last_time_;
+
+public:
+    TokenBucket() : rate_(0), burst_(0), tokens_(0), last_time_() {}
+
+    /*
+     * Change the rate, the bucket starts full.
+     * @param rate: The tokens per second, 0 for unlimited.
+     * @param burst: The maximum tokens kept.
+     */
+    void set_rate(double rate, double burst) {
+        rate_ = rate;
+        burst_ = burst;
+        tokens_ = burst;
+        last_time_ = std::chrono::steady_clock::time_point();
+    }
+
+    double get_rate() const {
+        return rate_;
+    }
+
+    /*
+     * Take tokens if there are enough. A full bucket always gives,
+     * going into debt, so that a request larger than the burst passes.
+     * @param tokens: The tokens to take.
+     * @param now: The current time.
+     * @return: Whether the tokens are taken.
+     */
+    bool take(double tokens, std::chrono::steady_clock::time_point now) {
+        if (rate_ <= 0) {
+            return true;
+        }
+        if (last_time_ != std::chrono::steady_clock::time_point()) {
+            std::chrono::duration<double> elapsed = now - last_time_;
+            tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+        }
+        last_time_ = now;
+        if (tokens_ < tokens && tokens_ < burst_) {
+            return false;
+        }
+        tokens_ -= tokens;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef __TOPIC_INDEX_HPP__
+#define __TOPIC_INDEX_HPP__
+
+#include "def.hpp"
+#include "Map.hpp"
+#include <string>
+#include <vector>
+#include <array>
+#include <bitset>
+#include <unordered_map>
+
+using SubscriberSet = std::bitset<MAX_CLIENT_NUM + 1>;
+
+/*
+ * Index of the topic subscriptions.
+ * Topics are hashed to a compact set of subscriber ids, and every client
+ * keeps the list of its topics so that its subscriptions can be dropped
+ * without scanning all the topics.
+ * Like Map, every operation requires the lock of get_mutex().
+ */
+class TopicIndex {
+private:
+    std::unordered_map<std::string, SubscriberSet> topics_;
+    // Reverse index, the topics subscribed by every client id.
+    std::array<std::vector<std::string>, MAX_CLIENT_NUM + 1> client_topics_;
+    size_t subscription_num_;
+    std::mutex mutex_;
+
+public:
+    TopicIndex() : subscription_num_(0) {}
+
+    std::mutex &get_mutex() {
+        return mutex_;
+    }
+
+    /*
+     * Subscribe a client to a topic.
+     * @param topic: The topic to subscribe.
+     * @param client_id: The id of the client.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: Whether the subscription is added, false if it already exists
+     *          or the client has reached MAX_SUBSCRIPTION_NUM.
+     */
+    bool subscribe(const std::string &topic, uint8_t client_id, std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Unsubscribe a client from a topic.
+     * @param topic: The topic to unsubscribe.
+     * @param client_id: The id of the client.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: Whether the client was subscribed to the topic.
+     */
+    bool unsubscribe(const std::string &topic, uint8_t client_id, std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Drop all the subscriptions of a client.
+     * @param client_id: The id of the client.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: The number of subscriptions dropped.
+     */
+    size_t remove_client(uint8_t client_id, std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Get the subscribers of a topic.
+     * @param topic: The topic to look up.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: The ids of the subscribers, empty if the topic is unknown.
+     */
+    SubscriberSet get_subscribers(const std::string &topic, std::unique_lock<std::mutex> &lock);
+
+    /*
+     * Get the topics subscribed by a client.
+     * @param client_id: The id of the client.
+     * @param lock: The unique_lock of get_mutex().
+     * @return: The topics.
+     */
+    const std::vector<std::string> &get_topics(uint8_t client_id, std::unique_lock<std::mutex> &lock);
+
+    size_t get_topic_num(std::unique_lock<std::mutex> &lock);
+    size_t get_subscription_num(std::unique_lock<std::mutex> &lock);
+};
+
+#endif
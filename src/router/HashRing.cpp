@@ -0,0 +1,84 @@
+#include "HashRing.hpp"
+#include <algorithm>
+
+uint64_t HashRing::hash(std::string_view key) {
+    // FNV-1a, then the finalizer of splitmix64, so the close keys spread over the ring.
+    uint64_t value = 14695981039346656037ULL;
+    for (char c : key) {
+        value ^= (uint8_t)c;
+        value *= 1099511628211ULL;
+    }
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+    return value;
+}
+
+void HashRing::add(size_t backend, std::string_view key) {
+    std::string point_key(key);
+    point_key.push_back('#');
+    size_t prefix_size = point_key.size();
+    for (size_t i = 0; i < HASH_RING_REPLICAS; i++) {
+        point_key.resize(prefix_size);
+        point_key += std::to_string(i);
+        points_.emplace(hash(point_key), backend);
+    }
+    backend_num_++;
+}
+
+void HashRing::remove(size_t backend) {
+    size_t removed = 0;
+    for (auto it = points_.begin(); it != points_.end();) {
+        if (it->second == backend) {
+            it = points_.erase(it);
+            removed++;
+        } else {
+            it++;
+        }
+    }
+    if (removed > 0) {
+        backend_num_--;
+    }
+}
+
+size_t HashRing::locate(std::string_view name) const {
+    if (points_.empty()) {
+        return SIZE_MAX;
+    }
+    auto it = points_.lower_bound(hash(name));
+    if (it == points_.end()) {
+        // Wrap around.
+        it = points_.begin();
+    }
+    return it->second;
+}
+
+std::vector<size_t> HashRing::lookup(std::string_view name) const {
+    std::vector<size_t> backends;
+    if (points_.empty()) {
+        return backends;
+    }
+    auto start = points_.lower_bound(hash(name));
+    if (start == points_.end()) {
+        start = points_.begin();
+    }
+    auto it = start;
+    do {
+        if (std::find(backends.begin(), backends.end(), it->second) == backends.end()) {
+            backends.push_back(it->second);
+            if (backends.size() == backend_num_) {
+                break;
+            }
+        }
+        if (++it == points_.end()) {
+            it = points_.begin();
+        }
+    } while (it != start);
+    return backends;
+}
+
+size_t HashRing::get_backend_num() const {
+    return backend_num_;
+}
@@ -0,0 +1,492 @@
+#include "Router.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+
+Route::Route(int client_sockfd)
+    : client_sockfd(client_sockfd), backend_sockfd(-1), backend(SIZE_MAX), finished_num(0) {}
+
+Route::~Route() {
+    close(client_sockfd);
+    if (backend_sockfd >= 0) {
+        close(backend_sockfd);
+    }
+}
+
+Router::Router(in_addr_t addr, int port, std::vector<sockaddr_in> backends, bool redirect)
+    : redirect_(redirect), running_(true), backends_(std::move(backends)), accepted_num_(0), spliced_num_(0),
+      redirected_num_(0), failed_over_num_(0), refused_num_(0), spliced_bytes_(0) {
+    if (backends_.empty()) {
+        throw std::runtime_error("Router Init failed: no backend.");
+    }
+    for (size_t i = 0; i < backends_.size(); i++) {
+        ring_.add(i, to_string(backends_[i]));
+    }
+
+    // Prepare the router_addr_.
+    memset(&router_addr_, 0, sizeof(router_addr_));
+    router_addr_.sin_family = AF_INET;
+    router_addr_.sin_port = htons(port);
+    router_addr_.sin_addr.s_addr = addr;
+
+    // Create a socket.
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        std::string error_msg = "Router Init failed: failed to create a socket. errno: " +
+                                std::to_string(errno) + " " + strerror(errno);
+        throw std::runtime_error(error_msg);
+    }
+
+    // Set the socket to be reusable.
+    int opt = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        close(sockfd);
+        std::string error_msg = "Router Init failed: failed to set the socket to be reusable. errno: " +
+                                std::to_string(errno) + " " + strerror(errno);
+        throw std::runtime_error(error_msg);
+    }
+
+    // Bind the socket to the router address and port.
+    if (bind(sockfd, cast_sockaddr_in(router_addr_), sizeof(router_addr_)) < 0) {
+        close(sockfd);
+        std::string error_msg = "Router Init failed: failed to bind the socket to the router address and port. errno: " +
+                                std::to_string(errno) + " " + strerror(errno);
+        throw std::runtime_error(error_msg);
+    }
+    listen(sockfd, MAX_CLIENT_NUM);
+    sockfd_ = sockfd;
+
+    output_queue_ = std::unique_ptr<Queue<std::string> >(
+        new Queue<std::string>()
+    );
+}
+
+Router::~Router() {
+    // Join the threads of all the routes, stop() has shut their connections down.
+    output_queue_->push("[INFO] Releasing the threads.");
+    output_message();
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::list<std::unique_ptr<Route> > routes = std::move(routes_);
+    lock.unlock();
+    for (std::unique_ptr<Route> &route : routes) {
+        route->upstream.join();
+        if (route->downstream.joinable()) {
+            route->downstream.join();
+        }
+    }
+    routes.clear();
+    close(sockfd_);
+    output_queue_->push("[INFO] Released the router.");
+    output_message();
+}
+
+std::string Router::to_string(const sockaddr_in &addr) {
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+    return std::string(host) + ":" + std::to_string(ntohs(addr.sin_port));
+}
+
+ssize_t Router::read_packet(int sockfd, std::vector<uint8_t> &buffer) {
+    // Not held forever by a client which never speaks.
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(REQUEST_TIMEOUT);
+    ssize_t size;
+    while ((size = Message::check_valid_message(buffer.data(), buffer.size())) < 0) {
+        if (!running_ || std::chrono::steady_clock::now() >= deadline) {
+            return -1;
+        }
+        pollfd poll_fd {sockfd, POLLIN, 0};
+        int ready = poll(&poll_fd, 1, TIMEOUT);
+        if (ready < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        size_t offset = buffer.size();
+        buffer.resize(offset + MAX_BUFFER_SIZE);
+        ssize_t received = recv(sockfd, buffer.data() + offset, MAX_BUFFER_SIZE, 0);
+        buffer.resize(offset + std::max<ssize_t>(received, 0));
+        if (received <= 0) {
+            return -1;
+        }
+    }
+    return size;
+}
+
+bool Router::write_all(int sockfd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(sockfd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+int Router::connect_backend(size_t backend) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    sockaddr_in addr = backends_[backend];
+    lock.unlock();
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    if (connect(sockfd, cast_sockaddr_in(addr), sizeof(addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    // The spliced packets are small, not to wait for more.
+    int opt = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return sockfd;
+}
+
+void Router::serve(Route *route) {
+    // Only the first packet is parsed, a CONNECT or a RESUME REQUEST.
+    std::vector<uint8_t> buffer;
+    ssize_t size = read_packet(route->client_sockfd, buffer);
+    MessagePtr request = make_message();
+    if (size > 0) {
+        request->parse(buffer.data(), size);
+    }
+    if (size <= 0 || (request->get_type() != MessageType::CONNECT && request->get_type() != MessageType::RESUME) ||
+        request->get_data_num() < 1) {
+        refused_num_++;
+        route->finished_num += 2;
+        return;
+    }
+    bool resumed = request->get_type() == MessageType::RESUME;
+    // The bytes the client sent after it, if any.
+    buffer.erase(buffer.begin(), buffer.begin() + size);
+
+    // A session is not placed by its token, every backend is asked for it in turn.
+    std::vector<size_t> backends;
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (resumed) {
+        for (size_t i = 0; i < backends_.size(); i++) {
+            backends.push_back(i);
+        }
+    } else {
+        route->name = request->get_data()[0];
+        backends = ring_.lookup(route->name);
+    }
+    lock.unlock();
+
+    if (redirect_ && !resumed) {
+        // The client connects to its backend itself, and resumes there too.
+        lock.lock();
+        sockaddr_in addr = backends_[backends[0]];
+        lock.unlock();
+        char host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+        data_t data;
+        data.push_back(host);
+        data.push_back(std::to_string(ntohs(addr.sin_port)));
+        Message redirect(MessageType::REDIRECT, SERVER_ID, request->get_sender_id(), std::move(data), false);
+        redirect.set_pakage_id(request->get_pakage_id());
+        std::vector<uint8_t> packet;
+        redirect.serialize(packet);
+        if (write_all(route->client_sockfd, packet.data(), packet.size())) {
+            redirected_num_++;
+            output_queue_->push("[INFO] Redirected " + route->name + " to " + to_string(addr) + ".");
+        }
+        route->finished_num += 2;
+        return;
+    }
+
+    // Without the port of the datagram channel, which would be the one of the router.
+    request->get_data().resize(1);
+    std::vector<uint8_t> handshake;
+    request->serialize(handshake);
+    std::vector<uint8_t> reply;
+    int backend_sockfd = -1;
+    size_t backend = SIZE_MAX;
+    for (size_t i = 0; i < backends.size() && running_; i++) {
+        int sockfd = connect_backend(backends[i]);
+        if (sockfd < 0) {
+            continue;
+        }
+        if (!write_all(sockfd, handshake.data(), handshake.size())) {
+            close(sockfd);
+            continue;
+        }
+        if (resumed) {
+            // Only the backend keeping the session answers without an error.
+            reply.clear();
+            ssize_t reply_size = read_packet(sockfd, reply);
+            MessagePtr response = make_message();
+            if (reply_size > 0) {
+                response->parse(reply.data(), reply_size);
+            }
+            if (reply_size <= 0 || response->get_type() != MessageType::ACK || response->get_data_num() != 0) {
+                close(sockfd);
+                continue;
+            }
+        } else if (i > 0) {
+            failed_over_num_++;
+        }
+        backend_sockfd = sockfd;
+        backend = backends[i];
+        break;
+    }
+    if (backend_sockfd < 0) {
+        // The last refusal of a RESUME tells the client to connect again.
+        if (!reply.empty()) {
+            write_all(route->client_sockfd, reply.data(), reply.size());
+        }
+        refused_num_++;
+        output_queue_->push("[ERR] No backend takes " + (resumed ? std::string("the session") : route->name) + ".");
+        route->finished_num += 2;
+        return;
+    }
+
+    lock.lock();
+    route->backend_sockfd = backend_sockfd;
+    route->backend = backend;
+    sockaddr_in addr = backends_[backend];
+    if (!running_) {
+        shutdown(backend_sockfd, SHUT_RDWR);
+    }
+    lock.unlock();
+    // The answer to the RESUME and the replayed FWDs after it, then what the client sent meanwhile.
+    if (!write_all(route->client_sockfd, reply.data(), reply.size()) ||
+        !write_all(backend_sockfd, buffer.data(), buffer.size())) {
+        route->finished_num += 2;
+        return;
+    }
+    spliced_num_++;
+    output_queue_->push(
+        "[INFO] Spliced " + (resumed ? std::string("a resumed session") : route->name) + " to " + to_string(addr) + "."
+    );
+    route->downstream = std::thread([this, route] {
+        pump(route->backend_sockfd, route->client_sockfd);
+        route->finished_num++;
+    });
+    pump(route->client_sockfd, backend_sockfd);
+    route->finished_num++;
+}
+
+void Router::pump(int from, int to) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        shutdown(from, SHUT_RDWR);
+        shutdown(to, SHUT_RDWR);
+        return;
+    }
+    bool closed = false;
+    while (true) {
+        ssize_t size = splice(from, nullptr, pipe_fds[1], nullptr, SPLICE_SIZE, SPLICE_F_MOVE);
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            closed = size == 0;
+            break;
+        }
+        ssize_t left = size;
+        while (left > 0) {
+            ssize_t moved = splice(pipe_fds[0], nullptr, to, nullptr, left, SPLICE_F_MOVE);
+            if (moved < 0 && errno == EINTR) {
+                continue;
+            }
+            if (moved <= 0) {
+                break;
+            }
+            left -= moved;
+        }
+        if (left > 0) {
+            break;
+        }
+        spliced_bytes_ += size;
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    if (closed) {
+        // Half closed, the other way still drains, e.g. the ACK to a DISCONNECT.
+        shutdown(to, SHUT_WR);
+    } else {
+        shutdown(from, SHUT_RDWR);
+        shutdown(to, SHUT_RDWR);
+    }
+}
+
+void Router::reap_routes() {
+    for (auto it = routes_.begin(); it != routes_.end();) {
+        if ((*it)->finished_num < 2) {
+            it++;
+            continue;
+        }
+        (*it)->upstream.join();
+        if ((*it)->downstream.joinable()) {
+            (*it)->downstream.join();
+        }
+        it = routes_.erase(it);
+    }
+}
+
+void Router::run() {
+    while (running_) {
+        sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_sockfd = accept(sockfd_, cast_sockaddr_in(client_addr), &client_addr_len);
+        if (!running_) {
+            if (client_sockfd >= 0) {
+                close(client_sockfd);
+            }
+            break;
+        }
+        if (client_sockfd < 0) {
+            output_queue_->push(
+                "[ERR] Router Run failed: failed to accept a connection. errno: " +
+                std::to_string(errno) + " " + strerror(errno)
+            );
+            continue;
+        }
+        accepted_num_++;
+        std::unique_ptr<Route> route = std::make_unique<Route>(client_sockfd);
+        std::unique_lock<std::mutex> lock(mutex_);
+        reap_routes();
+        // Started with the lock held, so the route is listed before it can be reaped.
+        route->upstream = std::thread(&Router::serve, this, route.get());
+        routes_.push_back(std::move(route));
+    }
+}
+
+void Router::stop() {
+    output_queue_->push("[INFO] Stopping the router...");
+    running_ = false;
+    shutdown(sockfd_, SHUT_RDWR);
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (std::unique_ptr<Route> &route : routes_) {
+        shutdown(route->client_sockfd, SHUT_RDWR);
+        if (route->backend_sockfd >= 0) {
+            shutdown(route->backend_sockfd, SHUT_RDWR);
+        }
+    }
+}
+
+void Router::add_backend(const sockaddr_in &addr) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t backend = backends_.size();
+    backends_.push_back(addr);
+    ring_.add(backend, to_string(addr));
+    // The routes are not moved, the router keeps no state to move them with.
+    size_t client_num = 0;
+    size_t moved_num = 0;
+    for (std::unique_ptr<Route> &route : routes_) {
+        if (route->backend == SIZE_MAX || route->name.empty() || route->finished_num >= 2) {
+            continue;
+        }
+        client_num++;
+        moved_num += ring_.locate(route->name) == backend;
+    }
+    lock.unlock();
+    output_queue_->push(
+        "[INFO] Added backend " + to_string(addr) + ", " + std::to_string(moved_num) + " of " +
+        std::to_string(client_num) + " connected client(s) belong to it from now on, once they connect again."
+    );
+}
+
+void Router::bench_rebalance(size_t client_num) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    HashRing ring = ring_;
+    size_t backend_num = backends_.size();
+    lock.unlock();
+    if (client_num == 0) {
+        return;
+    }
+
+    std::vector<std::string> names(client_num);
+    for (size_t i = 0; i < client_num; i++) {
+        names[i] = "client-" + std::to_string(i);
+    }
+    std::vector<size_t> before(client_num);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < client_num; i++) {
+        before[i] = ring.locate(names[i]);
+    }
+    std::chrono::steady_clock::time_point placed = std::chrono::steady_clock::now();
+    // A backend which does not exist, only its points matter.
+    ring.add(backend_num, "bench#" + std::to_string(backend_num));
+    std::chrono::steady_clock::time_point added = std::chrono::steady_clock::now();
+
+    size_t moved_num = 0;
+    size_t modulo_moved_num = 0;
+    std::vector<size_t> load(backend_num + 1);
+    for (size_t i = 0; i < client_num; i++) {
+        size_t after = ring.locate(names[i]);
+        moved_num += after != before[i];
+        load[after]++;
+        uint64_t hash = HashRing::hash(names[i]);
+        modulo_moved_num += hash % backend_num != hash % (backend_num + 1);
+    }
+    auto [min_load, max_load] = std::minmax_element(load.begin(), load.end());
+
+    output_queue_->push(
+        "[STAT] Rebalance: adding backend " + std::to_string(backend_num + 1) + " moves " +
+        std::to_string(moved_num) + " of " + std::to_string(client_num) + " client(s) (" +
+        std::to_string(100.0 * moved_num / client_num) + "%), ideally " +
+        std::to_string(100.0 / (backend_num + 1)) + "%, placing by modulo would move " +
+        std::to_string(100.0 * modulo_moved_num / client_num) + "%"
+    );
+    output_queue_->push(
+        "[STAT] Rebalance: " +
+        std::to_string(std::chrono::duration_cast<std::chrono::nanoseconds>(placed - start).count() / client_num) +
+        " ns per placement, " +
+        std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(added - placed).count()) +
+        " us to add the backend, " + std::to_string(*min_load) + " to " + std::to_string(*max_load) +
+        " client(s) per backend after, " + std::to_string(client_num / (backend_num + 1)) + " on average"
+    );
+}
+
+bool Router::output_message() {
+    if (output_queue_->empty()) {
+        return false;
+    }
+    std::cout << std::endl;
+    while (!output_queue_->empty()) {
+        std::string output = output_queue_->pop();
+        std::cout << output << std::endl;
+    }
+    return true;
+}
+
+bool Router::output_stats() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t backend_num = backends_.size();
+    std::vector<size_t> load(backend_num);
+    size_t route_num = 0;
+    for (std::unique_ptr<Route> &route : routes_) {
+        if (route->backend != SIZE_MAX && route->finished_num < 2) {
+            load[route->backend]++;
+            route_num++;
+        }
+    }
+    std::string backends;
+    for (size_t i = 0; i < backend_num; i++) {
+        backends += (i == 0 ? "" : ", ") + to_string(backends_[i]) + " (" + std::to_string(load[i]) + ")";
+    }
+    lock.unlock();
+    output_queue_->push(
+        "[STAT] Backends (spliced clients): " + backends + ", " + (redirect_ ? "redirecting" : "splicing")
+    );
+    output_queue_->push(
+        "[STAT] Clients: " + std::to_string(accepted_num_.load()) + " accepted, " +
+        std::to_string(spliced_num_.load()) + " spliced (" + std::to_string(failed_over_num_.load()) +
+        " past a backend down), " + std::to_string(redirected_num_.load()) + " redirected, " +
+        std::to_string(refused_num_.load()) + " refused, " + std::to_string(route_num) + " connected"
+    );
+    output_queue_->push("[STAT] Spliced bytes: " + std::to_string(spliced_bytes_.load()));
+    return true;
+}
@@ -0,0 +1,158 @@
+#include "Router.hpp"
+#include <iostream>
+#include <future>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+std::string get_command() {
+    std::string command;
+    std::getline(std::cin, command);
+    return command;
+}
+
+/*
+ * Parse an address as host:port.
+ * @param text The address.
+ * @param addr Set to the address.
+ * @return Whether the address is valid.
+ */
+bool parse_addr(const std::string &text, sockaddr_in &addr) {
+    size_t colon = text.rfind(':');
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (colon == std::string::npos || inet_pton(AF_INET, text.substr(0, colon).c_str(), &addr.sin_addr) != 1) {
+        return false;
+    }
+    int port = atoi(text.substr(colon + 1).c_str());
+    if (port <= 0 || port > UINT16_MAX) {
+        return false;
+    }
+    addr.sin_port = htons(port);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    // Prepare arguments.
+    in_addr_t addr = SERVER_ADDR;
+    int port = ROUTER_PORT;
+    bool redirect = false;
+    std::vector<sockaddr_in> backends;
+
+    // If there are arguments, use them.
+    // in order: <addr> <port> <splice|redirect> <backends, <host:port>,<host:port>,...>
+    if (argc > 1) {
+        addr = inet_addr(argv[1]);
+    }
+    if (argc > 2) {
+        port = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        std::string mode = argv[3];
+        if (mode == "redirect") {
+            redirect = true;
+        } else if (mode != "splice") {
+            std::cout << "[ERR] Unknown mode: " << mode << std::endl;
+            return 1;
+        }
+    }
+    if (argc > 4) {
+        std::string list = argv[4];
+        size_t start = 0;
+        while (start < list.size()) {
+            size_t end = std::min(list.find(',', start), list.size());
+            sockaddr_in backend;
+            if (!parse_addr(list.substr(start, end - start), backend)) {
+                std::cout << "[ERR] Invalid backend: " << list.substr(start, end - start) << std::endl;
+                return 1;
+            }
+            backends.push_back(backend);
+            start = end + 1;
+        }
+    } else {
+        // The server on this host.
+        sockaddr_in backend;
+        parse_addr("127.0.0.1:" + std::to_string(SERVER_PORT), backend);
+        backends.push_back(backend);
+    }
+
+    std::cout << "[INFO] Router address: " << inet_ntoa(*(in_addr *)&addr) << std::endl;
+    std::cout << "[INFO] Router port: " << port << std::endl;
+    std::cout << "[INFO] Router mode: " << (redirect ? "redirect" : "splice") << std::endl;
+    std::cout << "[INFO] Router backends: " << backends.size() << std::endl;
+
+    // Create a router.
+    std::unique_ptr<Router> router;
+    try {
+        router = std::unique_ptr<Router>(new Router(addr, port, std::move(backends), redirect));
+    } catch (std::exception &e) {
+        std::cout << "[ERR] " << e.what() << std::endl;
+        return 1;
+    }
+
+    // Create a thread to run the router.
+    std::thread runner(&Router::run, router.get());
+    // The thread to get commands is started by the loop below.
+    std::future<std::string> command_future;
+
+    std::string command;
+    std::future_status status = std::future_status::deferred;
+    try {
+        while (true) {
+            // Print outputs in the msg queue.
+            router->output_message();
+
+            // Get the command.
+            if (status == std::future_status::deferred) {
+                command_future = std::async(std::launch::async, get_command);
+            }
+            status = command_future.wait_for(std::chrono::milliseconds(1));
+            if (status == std::future_status::ready) {
+                command = command_future.get();
+                // Prepare but not start the next thread.
+                status = std::future_status::deferred;
+            } else if (status == std::future_status::timeout) {
+                continue;
+            } else { // status == std::future_status::deferred
+                throw std::runtime_error("Invalid future status (Deferred).");
+            }
+
+            if (command == "exit") {
+                break;
+            } else if (command == "stats") {
+                router->output_stats();
+            } else if (command.rfind("add ", 0) == 0) {
+                sockaddr_in backend;
+                if (parse_addr(command.substr(4), backend)) {
+                    router->add_backend(backend);
+                } else {
+                    std::cout << "[ERR] Usage: add <host:port>" << std::endl;
+                }
+            } else if (command.rfind("bench ", 0) == 0) {
+                unsigned long client_num;
+                if (sscanf(command.c_str(), "bench %lu", &client_num) == 1) {
+                    router->bench_rebalance(client_num);
+                } else {
+                    std::cout << "[ERR] Usage: bench <clients>" << std::endl;
+                }
+            } else {
+                std::cout << "[INFO] Please enter \"exit\" to close the router, "
+                          << "\"stats\" to print the statistics, "
+                          << "\"add <host:port>\" to add a backend, "
+                          << "or \"bench <clients>\" to measure the cost of adding a backend." << std::endl;
+            }
+        }
+    } catch (std::exception &e) {
+        // Stop the router.
+        router->stop();
+        runner.join();
+        std::cerr << "[ERR] " << e.what() << std::endl;
+        return 1;
+    }
+
+    // Stop the router.
+    router->stop();
+    runner.join();
+
+    return 0;
+}
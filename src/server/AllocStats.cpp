@@ -0,0 +1,51 @@
+#include "AllocStats.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+    std::atomic<uint64_t> total_count(0);
+    thread_local uint64_t thread_count = 0;
+
+    void *counted_alloc(std::size_t size) {
+        total_count.fetch_add(1, std::memory_order_relaxed);
+        thread_count++;
+        void *ptr = std::malloc(size == 0 ? 1 : size);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+}
+
+uint64_t get_alloc_count() {
+    return total_count.load(std::memory_order_relaxed);
+}
+
+uint64_t get_thread_alloc_count() {
+    return thread_count;
+}
+
+void *operator new(std::size_t size) {
+    return counted_alloc(size);
+}
+
+void *operator new[](std::size_t size) {
+    return counted_alloc(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
@@ -0,0 +1,185 @@
+#include "ClientDirectory.hpp"
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+#include <set>
+
+/* Layout of the ACK:
+ * element 1  u64 version
+ * element 2  the cursor of the next page, empty on the last page
+ * element 3~ the entries, the first byte is the kind:
+ *            '+' u8 id, u32 address, u16 port (network order), name
+ *            '-' u8 id
+ *            '=' the entries replace the whole list
+ *
+ * Layout of the PRESENCE notification:
+ * element 1  u64 version of the former notification
+ * element 2  u64 version
+ * element 3~ the '+' and '-' entries, or a single '=' if too much has changed
+ */
+namespace {
+    void encode_ack(uint64_t version, std::string cursor, data_t &entries, std::vector<uint8_t> &buffer) {
+        data_t data;
+        data.reserve(entries.size() + 2);
+        data.emplace_back(reinterpret_cast<const char *>(&version), sizeof(version));
+        data.push_back(std::move(cursor));
+        for (std::string &entry : entries) {
+            data.push_back(std::move(entry));
+        }
+        Message message(MessageType::ACK, SERVER_ID, 0, std::move(data), false);
+        message.serialize(buffer);
+    }
+}
+
+void ClientDirectory::add_change(uint8_t client_id) {
+    version_++;
+    history_.push_back(Change {version_, client_id});
+    if (history_.size() > CLIENT_LIST_HISTORY) {
+        history_.pop_front();
+    }
+    pages_.clear();
+}
+
+void ClientDirectory::remove_name(uint8_t client_id) {
+    auto it = name_index_.find(names_[client_id]);
+    if (it == name_index_.end()) {
+        return;
+    }
+    std::vector<uint8_t> &ids = it->second;
+    ids.erase(std::find(ids.begin(), ids.end(), client_id));
+    if (ids.empty()) {
+        name_index_.erase(it);
+    }
+    names_[client_id].clear();
+}
+
+void ClientDirectory::join(
+    uint8_t client_id,
+    const std::string &name,
+    sockaddr_in addr,
+    std::unique_lock<std::mutex> &lock
+) {
+    check_lock(lock, &mutex_);
+    std::string entry(8, '\0');
+    entry[0] = '+';
+    entry[1] = client_id;
+    memcpy(&entry[2], &addr.sin_addr.s_addr, 4);
+    memcpy(&entry[6], &addr.sin_port, 2);
+    // An element holds at most 255 bytes.
+    entry.append(name, 0, UINT8_MAX - entry.size());
+    if (entries_.count(client_id) > 0) {
+        // Joined again, e.g. resumed.
+        remove_name(client_id);
+    }
+    entries_[client_id] = std::move(entry);
+    names_[client_id] = name;
+    name_index_[name].push_back(client_id);
+    add_change(client_id);
+}
+
+void ClientDirectory::leave(uint8_t client_id, std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    if (entries_.erase(client_id) > 0) {
+        remove_name(client_id);
+        add_change(client_id);
+    }
+}
+
+void ClientDirectory::encode_page(uint8_t cursor, bool reset, std::vector<uint8_t> &buffer) {
+    data_t entries;
+    if (reset) {
+        entries.emplace_back("=");
+    }
+    std::string next;
+    size_t count = 0;
+    for (auto it = entries_.upper_bound(cursor); it != entries_.end(); it++) {
+        if (count == CLIENT_LIST_PAGE_SIZE) {
+            next.push_back(std::prev(it)->first);
+            break;
+        }
+        entries.push_back(it->second);
+        count++;
+    }
+    encode_ack(version_, std::move(next), entries, buffer);
+}
+
+const std::vector<uint8_t> &ClientDirectory::get_page(uint8_t cursor, std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    auto it = pages_.find(cursor);
+    if (it == pages_.end()) {
+        it = pages_.emplace(cursor, std::vector<uint8_t>()).first;
+        encode_page(cursor, false, it->second);
+    }
+    return it->second;
+}
+
+bool ClientDirectory::collect_changes(uint64_t version, data_t &entries) {
+    // Every change takes one version, so the kept ones cover the last history_.size() versions.
+    if (version > version_ || version_ - version > history_.size()) {
+        return false;
+    }
+    std::set<uint8_t> changed;
+    for (auto it = history_.rbegin(); it != history_.rend() && it->version > version; it++) {
+        changed.insert(it->client_id);
+    }
+    if (changed.size() > CLIENT_LIST_PAGE_SIZE) {
+        return false;
+    }
+    for (uint8_t client_id : changed) {
+        auto entry = entries_.find(client_id);
+        if (entry != entries_.end()) {
+            entries.push_back(entry->second);
+        } else {
+            entries.push_back(std::string {'-', (char)client_id});
+        }
+    }
+    return true;
+}
+
+void ClientDirectory::encode_changes(
+    uint64_t version,
+    std::vector<uint8_t> &buffer,
+    std::unique_lock<std::mutex> &lock
+) {
+    check_lock(lock, &mutex_);
+    data_t entries;
+    if (!collect_changes(version, entries)) {
+        encode_page(0, true, buffer);
+        return;
+    }
+    encode_ack(version_, std::string(), entries, buffer);
+}
+
+void ClientDirectory::encode_presence(
+    uint64_t version,
+    std::vector<uint8_t> &buffer,
+    std::unique_lock<std::mutex> &lock
+) {
+    check_lock(lock, &mutex_);
+    data_t data;
+    data.emplace_back(reinterpret_cast<const char *>(&version), sizeof(version));
+    data.emplace_back(reinterpret_cast<const char *>(&version_), sizeof(version_));
+    if (!collect_changes(version, data)) {
+        data.resize(2);
+        data.emplace_back("=");
+    }
+    Message message(MessageType::PRESENCE, SERVER_ID, MULTICAST_ID, std::move(data), false);
+    message.serialize(buffer);
+}
+
+uint8_t ClientDirectory::find_by_name(const std::string &name, std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    auto it = name_index_.find(name);
+    return it == name_index_.end() ? 0 : it->second.front();
+}
+
+uint64_t ClientDirectory::get_version(std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    return version_;
+}
+
+void ClientDirectory::patch_header(std::vector<uint8_t> &buffer, uint16_t pakage_id, uint8_t receiver_id) {
+    // See Message::serialize().
+    memcpy(buffer.data(), &pakage_id, sizeof(pakage_id));
+    buffer[4] = receiver_id;
+}
@@ -0,0 +1,218 @@
+#include "Handover.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace {
+    // A CLIENT carries its socket and the fds of two rings.
+    const size_t MAX_RECORD_FD_NUM = 1 + 2 * SHM_RING_FD_NUM;
+
+    /*
+     * Read exactly size bytes.
+     * @return Whether all of them are read.
+     */
+    bool read_all(int sockfd, uint8_t *data, size_t size) {
+        while (size > 0) {
+            ssize_t received = recv(sockfd, data, size, MSG_WAITALL);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                return false;
+            }
+            data += received;
+            size -= received;
+        }
+        return true;
+    }
+}
+
+HandoverRecord::HandoverRecord(HandoverKind kind) : offset_(0) {
+    bytes_.push_back(static_cast<uint8_t>(kind));
+}
+
+HandoverKind HandoverRecord::get_kind() const {
+    return bytes_.empty() ? HandoverKind::END : static_cast<HandoverKind>(bytes_[0]);
+}
+
+const uint8_t *HandoverRecord::take(size_t size) {
+    // The kind is not read as a field.
+    size_t start = std::max<size_t>(offset_, 1);
+    if (start + size > bytes_.size()) {
+        throw std::runtime_error("Handover failed: truncated record.");
+    }
+    offset_ = start + size;
+    return bytes_.data() + start;
+}
+
+void HandoverRecord::put_u8(uint8_t value) {
+    bytes_.push_back(value);
+}
+
+void HandoverRecord::put_u16(uint16_t value) {
+    value = htons(value);
+    bytes_.insert(bytes_.end(), reinterpret_cast<uint8_t *>(&value), reinterpret_cast<uint8_t *>(&value) + 2);
+}
+
+void HandoverRecord::put_u32(uint32_t value) {
+    value = htonl(value);
+    bytes_.insert(bytes_.end(), reinterpret_cast<uint8_t *>(&value), reinterpret_cast<uint8_t *>(&value) + 4);
+}
+
+void HandoverRecord::put_u64(uint64_t value) {
+    put_u32((uint32_t)(value >> 32));
+    put_u32((uint32_t)value);
+}
+
+void HandoverRecord::put_string(const std::string &value) {
+    put_u32(value.size());
+    bytes_.insert(bytes_.end(), value.begin(), value.end());
+}
+
+void HandoverRecord::put_bytes(const std::vector<uint8_t> &value) {
+    put_u32(value.size());
+    bytes_.insert(bytes_.end(), value.begin(), value.end());
+}
+
+void HandoverRecord::put_addr(const sockaddr_in &addr) {
+    put_u16(addr.sin_family);
+    bytes_.insert(
+        bytes_.end(),
+        reinterpret_cast<const uint8_t *>(&addr.sin_addr.s_addr),
+        reinterpret_cast<const uint8_t *>(&addr.sin_addr.s_addr) + 4
+    );
+    bytes_.insert(
+        bytes_.end(),
+        reinterpret_cast<const uint8_t *>(&addr.sin_port),
+        reinterpret_cast<const uint8_t *>(&addr.sin_port) + 2
+    );
+}
+
+uint8_t HandoverRecord::get_u8() {
+    return *take(1);
+}
+
+uint16_t HandoverRecord::get_u16() {
+    uint16_t value;
+    memcpy(&value, take(2), 2);
+    return ntohs(value);
+}
+
+uint32_t HandoverRecord::get_u32() {
+    uint32_t value;
+    memcpy(&value, take(4), 4);
+    return ntohl(value);
+}
+
+uint64_t HandoverRecord::get_u64() {
+    uint64_t high = get_u32();
+    return (high << 32) | get_u32();
+}
+
+std::string HandoverRecord::get_string() {
+    size_t size = get_u32();
+    const uint8_t *data = take(size);
+    return std::string(reinterpret_cast<const char *>(data), size);
+}
+
+std::vector<uint8_t> HandoverRecord::get_bytes() {
+    size_t size = get_u32();
+    const uint8_t *data = take(size);
+    return std::vector<uint8_t>(data, data + size);
+}
+
+sockaddr_in HandoverRecord::get_addr() {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = get_u16();
+    memcpy(&addr.sin_addr.s_addr, take(4), 4);
+    memcpy(&addr.sin_port, take(2), 2);
+    return addr;
+}
+
+void HandoverRecord::put_fd(int fd) {
+    if (fds_.size() >= MAX_RECORD_FD_NUM) {
+        throw std::runtime_error("Handover failed: too many fds in a record.");
+    }
+    fds_.push_back(fd);
+}
+
+std::vector<int> &HandoverRecord::get_fds() {
+    return fds_;
+}
+
+bool HandoverRecord::send(int sockfd) const {
+    uint32_t size = htonl(bytes_.size());
+    iovec iov[2] = {
+        {&size, sizeof(size)},
+        {const_cast<uint8_t *>(bytes_.data()), bytes_.size()}
+    };
+    std::vector<uint8_t> control(CMSG_SPACE(sizeof(int) * fds_.size()));
+    msghdr header {};
+    header.msg_iov = iov;
+    header.msg_iovlen = 2;
+    if (!fds_.empty()) {
+        header.msg_control = control.data();
+        header.msg_controllen = control.size();
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds_.size());
+        memcpy(CMSG_DATA(cmsg), fds_.data(), sizeof(int) * fds_.size());
+    }
+    ssize_t written = sendmsg(sockfd, &header, MSG_NOSIGNAL);
+    if (written < (ssize_t)sizeof(size)) {
+        return false;
+    }
+    // A large record may be cut, the fds went with its first byte.
+    size_t offset = written - sizeof(size);
+    while (offset < bytes_.size()) {
+        written = ::send(sockfd, bytes_.data() + offset, bytes_.size() - offset, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        offset += written;
+    }
+    return true;
+}
+
+bool HandoverRecord::receive(int sockfd) {
+    bytes_.clear();
+    offset_ = 0;
+    fds_.clear();
+    // Read the size alone, so the fds of the next record are not taken with this one.
+    uint32_t size;
+    iovec iov {&size, sizeof(size)};
+    std::vector<uint8_t> control(CMSG_SPACE(sizeof(int) * MAX_RECORD_FD_NUM));
+    msghdr header {};
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.data();
+    header.msg_controllen = control.size();
+    ssize_t received;
+    do {
+        received = recvmsg(sockfd, &header, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0) {
+        return false;
+    }
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            size_t offset = fds_.size();
+            fds_.resize(offset + num);
+            memcpy(fds_.data() + offset, CMSG_DATA(cmsg), num * sizeof(int));
+        }
+    }
+    if ((size_t)received < sizeof(size) &&
+        !read_all(sockfd, reinterpret_cast<uint8_t *>(&size) + received, sizeof(size) - received)) {
+        return false;
+    }
+    bytes_.resize(ntohl(size));
+    return read_all(sockfd, bytes_.data(), bytes_.size());
+}
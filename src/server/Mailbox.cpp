@@ -0,0 +1,345 @@
+#include "Mailbox.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Layout of a record, every record starts with a header:
+ * 0  u32 size of the record, 0 marks the end of the segment
+ * 4  u32 checksum of the rest of the record
+ * 8  u64 sequence number
+ * 16 u8  kind
+ * 17 u8  length of the key
+ * 18 key, then the serialized message
+ */
+namespace {
+    const size_t RECORD_HEADER_SIZE = 18;
+    const uint8_t RECORD_MESSAGE = 0;
+    // The sequence number is the last delivered message of the key.
+    const uint8_t RECORD_DELIVERED = 1;
+
+    uint32_t checksum(const uint8_t *data, size_t size) {
+        // FNV-1a
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ data[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    std::string segment_path(const std::string &dir, uint64_t number) {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llu.log", (unsigned long long)number);
+        return dir + name;
+    }
+
+    std::runtime_error mailbox_error(const std::string &what) {
+        return std::runtime_error(
+            "Mailbox failed: " + what + ". errno: " + std::to_string(errno) + " " + strerror(errno)
+        );
+    }
+}
+
+Mailbox::Mailbox(
+    std::string dir,
+    CommitCallback commit_callback
+) : dir_(std::move(dir)), next_seq_(1), stored_num_(0),
+    commit_callback_(std::move(commit_callback)), commit_num_(0), pending_(false), stopping_(false) {
+    if (mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+        throw mailbox_error("failed to create " + dir_);
+    }
+
+    // Find the segments left by the last run.
+    std::vector<uint64_t> numbers;
+    DIR *dir_ptr = opendir(dir_.c_str());
+    if (dir_ptr == nullptr) {
+        throw mailbox_error("failed to open " + dir_);
+    }
+    while (dirent *entry = readdir(dir_ptr)) {
+        unsigned long long number;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%llu.%7s", &number, suffix) == 2 && strcmp(suffix, "log") == 0) {
+            numbers.push_back(number);
+        }
+    }
+    closedir(dir_ptr);
+    std::sort(numbers.begin(), numbers.end());
+
+    // Replay them in order to rebuild the index.
+    for (uint64_t number : numbers) {
+        open_segment(number);
+        recover_segment(segments_.back());
+    }
+    if (segments_.empty()) {
+        open_segment(0);
+    }
+    remove_delivered_segments();
+
+    committer_ = std::thread(&Mailbox::commit_records, this);
+}
+
+Mailbox::~Mailbox() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    commit_cond_.notify_all();
+    committer_.join();
+    for (Segment &segment : segments_) {
+        munmap(segment.base, MAILBOX_SEGMENT_SIZE);
+        close(segment.fd);
+    }
+}
+
+void Mailbox::open_segment(uint64_t number) {
+    std::string path = segment_path(dir_, number);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        throw mailbox_error("failed to open " + path);
+    }
+    // New segments are zero filled, which marks the end of the records.
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size < MAILBOX_SEGMENT_SIZE && ftruncate(fd, MAILBOX_SEGMENT_SIZE) < 0)) {
+        close(fd);
+        throw mailbox_error("failed to allocate " + path);
+    }
+    void *base = mmap(nullptr, MAILBOX_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        throw mailbox_error("failed to map " + path);
+    }
+    segments_.push_back(Segment {number, fd, reinterpret_cast<uint8_t *>(base), 0, 0, false});
+}
+
+void Mailbox::recover_segment(Segment &segment) {
+    size_t offset = 0;
+    while (offset + RECORD_HEADER_SIZE <= MAILBOX_SEGMENT_SIZE) {
+        const uint8_t *record = segment.base + offset;
+        uint32_t size;
+        uint32_t sum;
+        uint64_t seq;
+        memcpy(&size, record, sizeof(size));
+        memcpy(&sum, record + 4, sizeof(sum));
+        memcpy(&seq, record + 8, sizeof(seq));
+        uint8_t kind = record[16];
+        uint8_t key_len = record[17];
+        if (size == 0) {
+            break;
+        }
+        // A torn record of an uncommitted batch ends the segment.
+        if (size < RECORD_HEADER_SIZE + key_len ||
+            offset + size > MAILBOX_SEGMENT_SIZE ||
+            checksum(record + 8, size - 8) != sum) {
+            memset(segment.base + offset, 0, MAILBOX_SEGMENT_SIZE - offset);
+            break;
+        }
+
+        std::string key(reinterpret_cast<const char *>(record + RECORD_HEADER_SIZE), key_len);
+        if (kind == RECORD_MESSAGE) {
+            index_[key].push_back(Location {seq, segment.number, offset});
+            segment.live_num++;
+            stored_num_++;
+        } else if (kind == RECORD_DELIVERED) {
+            auto it = index_.find(key);
+            while (it != index_.end() && !it->second.empty() && it->second.front().seq <= seq) {
+                Segment *owner = find_segment(it->second.front().segment);
+                owner->live_num--;
+                stored_num_--;
+                it->second.pop_front();
+            }
+            if (it != index_.end() && it->second.empty()) {
+                index_.erase(it);
+            }
+        }
+        next_seq_ = std::max(next_seq_, seq + 1);
+        offset += size;
+    }
+    segment.size = offset;
+}
+
+Mailbox::Location Mailbox::append_record(
+    uint8_t kind,
+    const std::string &key,
+    uint64_t seq,
+    const void *payload,
+    size_t payload_size
+) {
+    size_t size = RECORD_HEADER_SIZE + key.size() + payload_size;
+    if (segments_.back().size + size > MAILBOX_SEGMENT_SIZE) {
+        // Roll to a new segment.
+        open_segment(segments_.back().number + 1);
+    }
+    Segment &segment = segments_.back();
+    uint8_t *record = segment.base + segment.size;
+    uint32_t size32 = size;
+    memcpy(record + 8, &seq, sizeof(seq));
+    record[16] = kind;
+    record[17] = key.size();
+    memcpy(record + RECORD_HEADER_SIZE, key.data(), key.size());
+    memcpy(record + RECORD_HEADER_SIZE + key.size(), payload, payload_size);
+    uint32_t sum = checksum(record + 8, size - 8);
+    memcpy(record + 4, &sum, sizeof(sum));
+    // Write the size at last, a record is not visible until it is complete.
+    memcpy(record, &size32, sizeof(size32));
+
+    Location location {seq, segment.number, segment.size};
+    segment.size += size;
+    segment.dirty = true;
+    pending_ = true;
+    commit_cond_.notify_one();
+    return location;
+}
+
+Mailbox::Segment *Mailbox::find_segment(uint64_t number) {
+    // Segment numbers are consecutive.
+    return &segments_[number - segments_.front().number];
+}
+
+void Mailbox::remove_delivered_segments() {
+    // Only drop the oldest ones, a later segment may hold the DELIVERED
+    // records of an earlier one. The active segment is always kept.
+    while (segments_.size() > 1 && segments_.front().live_num == 0) {
+        Segment &segment = segments_.front();
+        munmap(segment.base, MAILBOX_SEGMENT_SIZE);
+        close(segment.fd);
+        unlink(segment_path(dir_, segment.number).c_str());
+        segments_.pop_front();
+    }
+}
+
+bool Mailbox::store(
+    const std::string &key,
+    const void *buffer,
+    size_t size,
+    MailboxTicket ticket,
+    std::unique_lock<std::mutex> &lock
+) {
+    check_lock(lock, &mutex_);
+    if (key.size() > UINT8_MAX) {
+        return false;
+    }
+    Location location;
+    try {
+        location = append_record(RECORD_MESSAGE, key, next_seq_, buffer, size);
+    } catch (std::exception &e) {
+        // Out of space, the caller tells the sender.
+        return false;
+    }
+    next_seq_++;
+    index_[key].push_back(location);
+    find_segment(location.segment)->live_num++;
+    stored_num_++;
+    tickets_.push_back(std::move(ticket));
+    return true;
+}
+
+size_t Mailbox::fetch(
+    const std::string &key,
+    uint64_t after_seq,
+    size_t max_num,
+    std::vector<MailboxRecord> &records,
+    std::unique_lock<std::mutex> &lock
+) {
+    check_lock(lock, &mutex_);
+    records.clear();
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+        return 0;
+    }
+    for (const Location &location : it->second) {
+        if (records.size() >= max_num) {
+            break;
+        }
+        if (location.seq <= after_seq) {
+            continue;
+        }
+        const uint8_t *record = find_segment(location.segment)->base + location.offset;
+        uint32_t size;
+        memcpy(&size, record, sizeof(size));
+        size_t header_size = RECORD_HEADER_SIZE + record[17];
+        records.push_back(MailboxRecord {location.seq, record + header_size, size - header_size});
+    }
+    return records.size();
+}
+
+void Mailbox::mark_delivered(const std::string &key, uint64_t seq, std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+        return;
+    }
+    try {
+        append_record(RECORD_DELIVERED, key, seq, nullptr, 0);
+    } catch (std::exception &e) {
+        // Keep them, they are delivered again after restarting.
+        return;
+    }
+    while (!it->second.empty() && it->second.front().seq <= seq) {
+        find_segment(it->second.front().segment)->live_num--;
+        stored_num_--;
+        it->second.pop_front();
+    }
+    if (it->second.empty()) {
+        index_.erase(it);
+    }
+    remove_delivered_segments();
+}
+
+void Mailbox::commit_records() {
+    std::vector<int> fds;
+    std::vector<MailboxTicket> tickets;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        commit_cond_.wait(lock, [this] { return pending_ || stopping_; });
+        if (!pending_) {
+            break;
+        }
+
+        // Take everything appended so far as one batch.
+        // The segments may be unmapped meanwhile, so sync duplicated fds.
+        for (Segment &segment : segments_) {
+            if (segment.dirty) {
+                fds.push_back(dup(segment.fd));
+                segment.dirty = false;
+            }
+        }
+        tickets.swap(tickets_);
+        pending_ = false;
+        lock.unlock();
+
+        // The mapping is shared, so fdatasync also writes back the pages written through it.
+        for (int fd : fds) {
+            fdatasync(fd);
+            close(fd);
+        }
+        fds.clear();
+        if (!tickets.empty() && commit_callback_) {
+            commit_callback_(tickets);
+        }
+        tickets.clear();
+
+        lock.lock();
+        commit_num_++;
+    }
+}
+
+size_t Mailbox::get_stored_num(std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    return stored_num_;
+}
+
+size_t Mailbox::get_segment_num(std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    return segments_.size();
+}
+
+uint64_t Mailbox::get_commit_num(std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    return commit_num_;
+}
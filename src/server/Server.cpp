@@ -1,10 +1,17 @@
 #include "Server.hpp"
+#include "AllocStats.hpp"
 #include <stdexcept>
 #include <iostream>
 #include <chrono>
 #include <ctime>
 #include <cstring>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <algorithm>
 
 ClientInfo::ClientInfo(
     std::string name,
@@ -13,17 +20,37 @@ ClientInfo::ClientInfo(
     uint8_t id,
     Sender *sender,
     Receiver *receiver
-) : sockfd_(sockfd), name_(name), addr_(addr), client_id_(id) {
-    sender_ = std::unique_ptr<Sender>(sender);
-    receiver_ = std::unique_ptr<Receiver>(receiver);
+) : sockfd_(sockfd), name_(std::move(name)), addr_(addr), client_id_(id), gateway_id_(id),
+    has_datagram_addr_(false) {
+    sender_ = std::shared_ptr<Sender>(sender);
+    receiver_ = std::shared_ptr<Receiver>(receiver);
 }
 
+ClientInfo::ClientInfo(std::string name, uint8_t id, ClientInfo &gateway)
+    : sockfd_(gateway.sockfd_), name_(std::move(name)), addr_(gateway.addr_), client_id_(id),
+      gateway_id_(gateway.client_id_), sender_(gateway.sender_), receiver_(gateway.receiver_),
+      has_datagram_addr_(false) {}
+
 ClientInfo::~ClientInfo() {
+    if (gateway_id_ != client_id_) {
+        // The connection is left to its owner.
+        return;
+    }
+    // Flush and stop the sender before the socket is closed.
+    sender_.reset();
     // Close the socket.
     close(sockfd_);
 }
 
-std::string ClientInfo::get_name() {
+int ClientInfo::get_sockfd() {
+    return sockfd_;
+}
+
+uint8_t ClientInfo::get_gateway_id() {
+    return gateway_id_;
+}
+
+const std::string &ClientInfo::get_name() {
     return name_;
 }
 
@@ -39,16 +66,152 @@ Receiver *ClientInfo::get_receiver() {
     return receiver_.get();
 }
 
+void ClientInfo::set_datagram_addr(const sockaddr_in &addr) {
+    datagram_addr_ = addr;
+    has_datagram_addr_ = true;
+}
+
+bool ClientInfo::get_datagram_addr(sockaddr_in &addr) {
+    if (has_datagram_addr_) {
+        addr = datagram_addr_;
+    }
+    return has_datagram_addr_;
+}
+
+TokenBucket &ClientInfo::get_message_bucket() {
+    return message_bucket_;
+}
+
+TokenBucket &ClientInfo::get_byte_bucket() {
+    return byte_bucket_;
+}
+
+void ClientInfo::shutdown_connection() {
+    shutdown(sockfd_, SHUT_RDWR);
+}
+
+PeerLink::PeerLink(int sockfd, std::unique_ptr<Sender> sender, std::unique_ptr<Receiver> receiver)
+    : sockfd(sockfd), sender(std::move(sender)), receiver(std::move(receiver)) {}
+
+PeerLink::~PeerLink() {
+    // Flush and stop the sender before the socket is closed.
+    sender.reset();
+    close(sockfd);
+}
+
 Server::Server(
     std::string name,
     in_addr_t addr,
-    int port
-) : name_(name), self_id_(SERVER_ID), running_(true) {
+    int port,
+    std::string mailbox_dir,
+    std::string unix_path,
+    const std::string &upgrade_path
+) : name_(name), unix_sockfd_(-1), unix_path_(std::move(unix_path)), tcp_accepted_num_(0),
+    unix_accepted_num_(0), shm_accepted_num_(0), attached_num_(0), self_id_(SERVER_ID), running_(true), forwarded_num_(0), forward_alloc_num_(0),
+    published_num_(0), delivered_num_(0), resumed_num_(0), forward_seq_(0),
+    buffered_bytes_(), waiting_senders_(), peak_buffered_bytes_(0), waited_num_(0),
+    message_rate_limit_(RATE_LIMIT_MESSAGES), byte_rate_limit_(RATE_LIMIT_BYTES),
+    connection_limit_(MAX_CONNECTION_NUM), rate_limited_num_(0), rejected_num_(0),
+    keepalive_(false), tracing_(false), heart_beat_num_(0), skipped_heart_beat_num_(0),
+    presence_watchers_(), presence_version_(0), presence_event_num_(0), presence_sent_num_(0),
+    ack_batching_(), ack_batches_(), ack_batch_size_(0), single_ack_in_num_(0), batched_ack_in_num_(0),
+    ack_batch_in_num_(0), single_ack_out_num_(0), batched_ack_out_num_(0), ack_batch_out_num_(0),
+    datagram_fallback_num_(0), releaser_stopping_(false), node_index_(0), node_num_(1), peer_forwarded_num_(0),
+    peer_received_num_(0), peer_relayed_num_(0), handing_over_(false), handed_over_(false), wake_fd_(-1) {
     // Prepare the server_addr_.
     server_addr_.sin_family = AF_INET;
     server_addr_.sin_port = htons(port);
     server_addr_.sin_addr.s_addr = addr;
 
+    // On an upgrade, take the listeners of the running server, which keeps them meanwhile,
+    // so no connection is refused.
+    int upgrade_sockfd = -1;
+    int datagram_sockfd = -1;
+    if (!upgrade_path.empty()) {
+        upgrade_sockfd = take_listeners(upgrade_path, datagram_sockfd);
+    } else {
+        open_tcp_listener();
+        open_unix_listener();
+    }
+    wake_fd_ = eventfd(0, EFD_CLOEXEC);
+
+    // Create the lists.
+    clientinfo_list_ = std::unique_ptr<Map<uint8_t, std::unique_ptr<ClientInfo> > >(
+        new Map<uint8_t, std::unique_ptr<ClientInfo> >()
+    );
+    client_recv_list_ = std::unique_ptr<Map<uint8_t, std::future<void> > >(
+        new Map<uint8_t, std::future<void> >()
+    );
+    client_monitor_list_ = std::unique_ptr<Map<uint8_t, Monitor> >(
+        new Map<uint8_t, Monitor>()
+    );
+    message_status_map_ = std::unique_ptr<Map<uint16_t, PacketInfo> >(
+        new Map<uint16_t, PacketInfo>()
+    );
+    multicast_status_map_ = std::unique_ptr<Map<uint16_t, MulticastInfo> >(
+        new Map<uint16_t, MulticastInfo>()
+    );
+    session_map_ = std::unique_ptr<Map<uint8_t, Session> >(
+        new Map<uint8_t, Session>()
+    );
+    topic_index_ = std::unique_ptr<TopicIndex>(new TopicIndex());
+    client_directory_ = std::unique_ptr<ClientDirectory>(new ClientDirectory());
+    if (!mailbox_dir.empty()) {
+        try {
+            mailbox_ = std::unique_ptr<Mailbox>(new Mailbox(
+                std::move(mailbox_dir),
+                [this](std::vector<MailboxTicket> &tickets) { acknowledge_stored(tickets); }
+            ));
+        } catch (std::exception &e) {
+            close(sockfd_);
+            if (unix_sockfd_ >= 0) {
+                close(unix_sockfd_);
+                unlink(unix_path_.c_str());
+            }
+            if (upgrade_sockfd >= 0) {
+                close(upgrade_sockfd);
+            }
+            close(wake_fd_);
+            throw;
+        }
+    }
+    output_queue_ = std::unique_ptr<Queue<std::string> >(
+        new Queue<std::string>()
+    );
+
+    // Offer a datagram channel on the same port, the heart beats and the DATAGRAMs
+    // queued meanwhile are sent in one batch by the next iteration of the loop.
+    try {
+        auto on_queued = [this] { loop_->post([this] { datagram_channel_->flush(); }); };
+        if (datagram_sockfd >= 0) {
+            datagram_channel_ = std::make_unique<DatagramChannel>(datagram_sockfd, on_queued);
+        } else {
+            datagram_channel_ = std::make_unique<DatagramChannel>(server_addr_, on_queued);
+        }
+    } catch (std::exception &e) {
+        output_queue_->push("[WARN] " + std::string(e.what()));
+        output_queue_->push("[WARN] Datagrams go through TCP.");
+    }
+
+    // Prepare the message handlers.
+    register_handlers();
+
+    // Start releasing the expired sessions and notifying the presence.
+    loop_ = std::make_unique<EventLoop>();
+    loop_->spawn(expire_sessions());
+    loop_->spawn(notify_presence());
+    if (datagram_channel_) {
+        loop_->spawn(receive_datagrams());
+    }
+    loop_thread_ = std::thread(&EventLoop::run, loop_.get());
+    releaser_ = std::thread(&Server::release_connections, this);
+
+    if (upgrade_sockfd >= 0) {
+        take_over(upgrade_sockfd);
+    }
+}
+
+void Server::open_tcp_listener() {
     // Create a socket.
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
@@ -80,22 +243,38 @@ Server::Server(
     // Save the socket.
     sockfd_ = sockfd;
 
-    // Create the lists.
-    clientinfo_list_ = std::unique_ptr<Map<uint8_t, std::unique_ptr<ClientInfo> > >(
-        new Map<uint8_t, std::unique_ptr<ClientInfo> >()
-    );
-    client_recv_list_ = std::unique_ptr<Map<uint8_t, std::unique_ptr<std::thread> > >(
-        new Map<uint8_t, std::unique_ptr<std::thread> >()
-    );
-    client_monitor_list_ = std::unique_ptr<Map<uint8_t, std::unique_ptr<std::thread> > >(
-        new Map<uint8_t, std::unique_ptr<std::thread> >()
-    );
-    message_status_map_ = std::unique_ptr<Map<uint16_t, PacketInfo> >(
-        new Map<uint16_t, PacketInfo>()
-    );
-    output_queue_ = std::unique_ptr<Queue<std::string> >(
-        new Queue<std::string>()
-    );
+}
+
+void Server::open_unix_listener() {
+    // Listen on a unix socket too, so the local clients skip the TCP stack.
+    if (!unix_path_.empty()) {
+        sockaddr_un unix_addr;
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        if (unix_path_.size() >= sizeof(unix_addr.sun_path)) {
+            close(sockfd_);
+            throw std::runtime_error("Server Init failed: the unix socket path is too long.");
+        }
+        memcpy(unix_addr.sun_path, unix_path_.c_str(), unix_path_.size());
+        int unix_sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (unix_sockfd < 0) {
+            close(sockfd_);
+            std::string error_msg = "Server Init failed: failed to create a unix socket. errno: " +
+                                    std::to_string(errno) + " " + strerror(errno);
+            throw std::runtime_error(error_msg);
+        }
+        // Left by a former server, which can not be bound again.
+        unlink(unix_path_.c_str());
+        if (bind(unix_sockfd, cast_sockaddr_in(unix_addr), sizeof(unix_addr)) < 0) {
+            close(unix_sockfd);
+            close(sockfd_);
+            std::string error_msg = "Server Init failed: failed to bind the unix socket to " + unix_path_ +
+                                    ". errno: " + std::to_string(errno) + " " + strerror(errno);
+            throw std::runtime_error(error_msg);
+        }
+        listen(unix_sockfd, MAX_CLIENT_NUM);
+        unix_sockfd_ = unix_sockfd;
+    }
 }
 
 Server::~Server() {
@@ -103,8 +282,24 @@ Server::~Server() {
     output_queue_->push("[INFO] Releasing the threads.");
     output_message();
     join_threads();
+    // The heart beats are all stopped, stop the loop and destroy the periodic coroutines.
+    // Stopped already if the clients are handed over.
+    loop_->stop();
+    if (loop_thread_.joinable()) {
+        loop_thread_.join();
+    }
+    loop_.reset();
+    // Then close the connections it retired.
+    {
+        std::lock_guard<std::mutex> released_lock(released_mutex_);
+        releaser_stopping_ = true;
+    }
+    released_cond_.notify_all();
+    releaser_.join();
     output_queue_->push("[INFO] Released the threads.");
     output_message();
+    // Commit the mailbox before the clients are gone.
+    mailbox_.reset();
 
     // Close all the client connections.
     // Get shared_mutex for clientinfo_list_.
@@ -112,9 +307,13 @@ Server::~Server() {
     std::unique_lock<std::mutex> message_status_map_lock(message_status_map_->get_mutex());
     for (
         auto it = clientinfo_list_->begin(clientinfo_list_lock);
-        it != clientinfo_list_->end(clientinfo_list_lock);
+        it != clientinfo_list_->end(clientinfo_list_lock) && !handed_over_;
         it++
     ) {
+        if (it->second->get_gateway_id() != it->first) {
+            // Leaves with the connection it is attached to.
+            continue;
+        }
         // Send a DISCONNECT REQUEST.
         send_res_t result = it->second->get_sender()->send_disconnect_request(it->first);
         // Insert the message into the message_status_map_.
@@ -125,14 +324,24 @@ Server::~Server() {
                 result.first,
                 SERVER_ID,
                 it->first,
-                MessageType::DISCONNECT
+                MessageType::DISCONNECT,
+                FrameRef(),
+                0,
+                0
             },
             message_status_map_lock
         );
     }
 
-    // Close the socket.
+    // Close the sockets, the new server goes on listening on them once handed over.
     close(sockfd_);
+    if (unix_sockfd_ >= 0) {
+        close(unix_sockfd_);
+        if (!handed_over_) {
+            unlink(unix_path_.c_str());
+        }
+    }
+    close(wake_fd_);
 
     // Output the remaining messages.
     output_queue_->push("[INFO] Released the server.");
@@ -140,10 +349,36 @@ Server::~Server() {
 }
 
 uint8_t Server::wait_for_client() {
+    // Wait on both listeners if the unix socket is enabled, and on wake_fd_ for a handover.
+    int listen_sockfd = sockfd_;
+    pollfd fds[3] = {{sockfd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}, {unix_sockfd_, POLLIN, 0}};
+    if (poll(fds, unix_sockfd_ >= 0 ? 3 : 2, -1) < 0 && errno != EINTR) {
+        std::string error_msg = "Server Wait For Client failed: failed to wait for a connection. errno: " +
+                                std::to_string(errno) + " " + strerror(errno);
+        throw std::runtime_error(error_msg);
+    }
+    if (!running_ || handing_over_) {
+        return 0;
+    }
+    if (unix_sockfd_ >= 0 && fds[2].revents != 0) {
+        listen_sockfd = unix_sockfd_;
+    } else if (fds[0].revents == 0) {
+        // Interrupted.
+        return 0;
+    }
+
     // Accept a connection for client.
     sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
-    int client_sockfd = accept(sockfd_, cast_sockaddr_in(client_addr), &client_addr_len);
+    int client_sockfd = -1;
+    if (listen_sockfd == sockfd_) {
+        client_sockfd = accept(sockfd_, cast_sockaddr_in(client_addr), &client_addr_len);
+    } else {
+        // The local clients have no address, which is marked by the family.
+        client_sockfd = accept(unix_sockfd_, nullptr, nullptr);
+        memset(&client_addr, 0, sizeof(client_addr));
+        client_addr.sin_family = AF_UNIX;
+    }
     if (!running_) {
         // if the server is not running, close the socket and return.
         if (client_sockfd >= 0) {
@@ -156,315 +391,2610 @@ uint8_t Server::wait_for_client() {
                                 std::to_string(errno) + " " + strerror(errno);
         throw std::runtime_error(error_msg);
     }
+    if (listen_sockfd == sockfd_) {
+        tcp_accepted_num_++;
+        if (keepalive_) {
+            // Probe after an idle interval, then every interval, and give up with the heart beats.
+            int opt = 1;
+            int idle = HEART_BEAT_INTERVAL;
+            int count = MAX_LOST_HEART_BEAT;
+            unsigned int user_timeout = HEART_BEAT_INTERVAL * MAX_LOST_HEART_BEAT * 1000;
+            setsockopt(client_sockfd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+            setsockopt(client_sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+            setsockopt(client_sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+            setsockopt(client_sockfd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+            // The probes wait while data is not acknowledged, which is limited on its own.
+            setsockopt(client_sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+        }
+    } else {
+        unix_accepted_num_++;
+    }
+
+    // A local client may pass the fds of two shared memory rings with its first packet,
+    // the one from the client and the one to it.
+    std::unique_ptr<ShmRing> rings[2];
+    if (listen_sockfd == unix_sockfd_) {
+        std::vector<int> fds = peek_fds(client_sockfd);
+        if (fds.size() == 2 * SHM_RING_FD_NUM) {
+            std::exception_ptr error;
+            for (size_t i = 0; i < 2; i++) {
+                try {
+                    rings[i] = std::make_unique<ShmRing>(fds.data() + i * SHM_RING_FD_NUM);
+                } catch (std::exception &e) {
+                    error = std::current_exception();
+                }
+            }
+            if (error) {
+                close(client_sockfd);
+                std::rethrow_exception(error);
+            }
+        } else {
+            for (int fd : fds) {
+                close(fd);
+            }
+        }
+    }
 
     // Receive a CONNECT REQUEST.
-    Message request(false);
-    Receiver *receiver = new Receiver(client_sockfd, SERVER_ID);
-    Sender *sender = new Sender(client_sockfd, SERVER_ID);
+    MessagePtr request = make_message();
+    std::unique_ptr<Receiver> receiver = std::make_unique<Receiver>(client_sockfd, SERVER_ID);
+    std::unique_ptr<Sender> sender = std::make_unique<Sender>(client_sockfd, SERVER_ID);
     receiver->receive(request);
-    // Check if the message is a valid CONNECT REQUEST.
-    if (request.get_type() != MessageType::CONNECT ||
-        request.get_receiver_id() != SERVER_ID) {
+    // Another node of the cluster, the one with the greater index connects.
+    if (request->get_type() == MessageType::PEER) {
+        const data_t &hello = request->get_data();
+        unsigned long node = hello.size() == 2 && hello[0] == "H" ?
+                             strtoul(hello[1].c_str(), nullptr, 10) : node_num_;
+        if (listen_sockfd != sockfd_ || node <= node_index_ || node >= node_num_) {
+            sender.reset();
+            close(client_sockfd);
+            throw std::runtime_error("Server Wait For Client failed: invalid peer.");
+        }
+        std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+        if (!add_peer_link(node, client_sockfd, std::move(sender), std::move(receiver), clientinfo_list_lock)) {
+            throw std::runtime_error("Server Wait For Client failed: node " + std::to_string(node) + " is linked already.");
+        }
+        return 0;
+    }
+    // Check if the message is a valid CONNECT or RESUME REQUEST.
+    if ((request->get_type() != MessageType::CONNECT && request->get_type() != MessageType::RESUME) ||
+        request->get_receiver_id() != SERVER_ID ||
+        request->get_data().size() < 1 || request->get_data().size() > 2) {
         close(client_sockfd);
         throw std::runtime_error("Server Wait For Client failed: invalid connection request.");
     }
 
-    // Get the name of the client.
-    if (request.get_data().size() != 1) {
-        close(client_sockfd);
-        throw std::runtime_error("Server Wait For Client failed: invalid connection request.");
+    // The second element is the port of the datagram channel of the client, if it asks for one.
+    // Only over IPv4, the datagrams are taken from the address of the connection.
+    bool datagram = false;
+    sockaddr_in datagram_addr = client_addr;
+    if (request->get_data().size() == 2 && datagram_channel_ && client_addr.sin_family == AF_INET) {
+        unsigned long datagram_port = strtoul(request->get_data()[1].c_str(), nullptr, 10);
+        if (datagram_port > 0 && datagram_port <= UINT16_MAX) {
+            datagram_addr.sin_port = htons((uint16_t)datagram_port);
+            datagram = true;
+        }
     }
-    std::string client_name = request.get_data()[0];
 
-    // Create a client info.
-    // Find a valid client id.
+    bool resumed = request->get_type() == MessageType::RESUME;
     uint8_t id = 1;
+    std::string client_name;
+    data_t data;
     std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
-    while (clientinfo_list_->check_exist(id, clientinfo_list_lock)) {
-        id++;
+    if (resumed) {
+        // Restore the id of the session.
+        id = accept_resume(request, clientinfo_list_lock);
+        if (id == 0) {
+            // Tell the client to connect again.
+            data.push_back("The session can not be resumed.");
+            sender->send_acknowledge(request->get_pakage_id(), request->get_sender_id(), std::move(data));
+            sender.reset();
+            close(client_sockfd);
+            throw std::runtime_error("Server Wait For Client failed: invalid session.");
+        }
+        std::unique_lock<std::mutex> session_map_lock(session_map_->get_mutex());
+        client_name = session_map_->at(id, session_map_lock).name;
+    } else {
+        // Admit the new clients up to the limit, the resumed ones were admitted before.
+        if (clientinfo_list_->size(clientinfo_list_lock) >= connection_limit_) {
+            rejected_num_++;
+            data.push_back("The server is full.");
+            sender->send_acknowledge(request->get_pakage_id(), SERVER_ID, std::move(data));
+            sender.reset();
+            close(client_sockfd);
+            throw std::runtime_error("Server Wait For Client failed: too many connections.");
+        }
+
+        // Get the name of the client.
+        client_name = std::move(request->get_data()[0]);
+
+        // Find a valid client id of this node.
+        id = find_free_id(clientinfo_list_lock);
         if (id == 0) {
             close(client_sockfd);
             throw std::runtime_error("Server Wait For Client failed: no free client id.");
         }
+
+        // Issue a session token, carried by the CONNECT RESPONSE.
+        std::string token(SESSION_TOKEN_SIZE, '\0');
+        if (getrandom(token.data(), token.size(), 0) != (ssize_t)token.size()) {
+            close(client_sockfd);
+            throw std::runtime_error("Server Wait For Client failed: failed to issue a session token.");
+        }
+        std::unique_lock<std::mutex> session_map_lock(session_map_->get_mutex());
+        session_map_->insert_or_assign(
+            id,
+            Session {token, client_name, false, std::chrono::steady_clock::time_point()},
+            session_map_lock
+        );
+        data.push_back(std::move(token));
+        // Tell the port of the datagram channel, which the client sends to from now on.
+        if (datagram) {
+            data.push_back(std::to_string(datagram_channel_->get_port()));
+        }
+    }
+
+    // From now on the packets go through the rings, starting with the RESPONSE.
+    if (rings[0]) {
+        receiver->attach_ring(std::move(rings[0]));
+        sender->attach_ring(std::move(rings[1]));
+        shm_accepted_num_++;
     }
 
     // Create a client info.
     std::unique_ptr<ClientInfo> client_info = std::make_unique<ClientInfo>(
-        client_name,
+        std::move(client_name),
         client_addr,
         client_sockfd,
         id,
-        sender,
-        receiver
-    );
-    clientinfo_list_->insert_or_assign(id, std::move(client_info), clientinfo_list_lock);
-    // Create threads for the client.
-    std::unique_ptr<std::thread> recv_thread = std::make_unique<std::thread>(
-        &Server::receive_from_client,
-        this,
-        id
+        sender.release(),
+        receiver.release()
     );
-    std::unique_lock<std::mutex> client_recv_list_lock(client_recv_list_->get_mutex());
-    if (client_recv_list_->check_exist(id, client_recv_list_lock)) {
-        client_recv_list_->at(id, client_recv_list_lock)->join();
-        client_recv_list_->at(id, client_recv_list_lock).release();
+    if (datagram) {
+        // Restarting the sequence numbers, a resumed client starts them over too.
+        datagram_channel_->add_peer(datagram_addr, id);
+        client_info->set_datagram_addr(datagram_addr);
     }
-    client_recv_list_->insert_or_assign(id, std::move(recv_thread), client_recv_list_lock);
-
-    std::unique_ptr<std::thread> monitor_thread = std::make_unique<std::thread>(
-        &Server::monitor_client,
-        this,
-        id
+    clientinfo_list_->insert_or_assign(id, std::move(client_info), clientinfo_list_lock);
+    std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+    client_directory_->join(
+        id,
+        clientinfo_list_->at(id, clientinfo_list_lock)->get_name(),
+        client_addr,
+        client_directory_lock
     );
-    std::unique_lock<std::mutex> client_monitor_list_lock(client_monitor_list_->get_mutex());
-    client_monitor_list_->insert_or_assign(id, std::move(monitor_thread), client_monitor_list_lock);
+    client_directory_lock.unlock();
+    announce_member(id, true, clientinfo_list_lock);
+    // Create threads for the client.
+    start_client(id);
 
-    // Send a CONNECT RESPONSE.
+    // Send a CONNECT or RESUME RESPONSE.
     clientinfo_list_->at(id, clientinfo_list_lock)
                     ->get_sender()
-                    ->send_acknowledge(request.get_pakage_id(), id);
+                    ->send_acknowledge(request->get_pakage_id(), id, std::move(data));
+    if (resumed) {
+        // Then the FWDs which were not acknowledged before the connection dropped.
+        replay_forwards(id, clientinfo_list_lock);
+        resumed_num_++;
+    }
+    // Then the messages stored while it was away.
+    deliver_mailbox(id, clientinfo_list_lock);
 
     return id;
 }
 
-void Server::receive_from_client(uint8_t client_id) {
+void Server::start_client(uint8_t client_id) {
+    // The former coroutine of a resumed client has finished with its connection,
+    // it is not waited for, which would hold the lock of clientinfo_list_ the loop may need.
+    std::future<void> done = loop_->spawn(receive_from_client(client_id));
+    std::unique_lock<std::mutex> client_recv_list_lock(client_recv_list_->get_mutex());
+    client_recv_list_->insert_or_assign(client_id, std::move(done), client_recv_list_lock);
+    client_recv_list_lock.unlock();
+
+    Monitor monitor {AsyncEvent(*loop_), AsyncEvent(*loop_)};
+    loop_->spawn(monitor_client(client_id, monitor));
+    std::unique_lock<std::mutex> client_monitor_list_lock(client_monitor_list_->get_mutex());
+    client_monitor_list_->insert_or_assign(client_id, monitor, client_monitor_list_lock);
+}
+
+std::vector<int> Server::peek_fds(int sockfd) {
+    uint8_t byte;
+    iovec iov {&byte, 1};
+    std::vector<uint8_t> control(CMSG_SPACE(sizeof(int) * 2 * SHM_RING_FD_NUM));
+    msghdr header {};
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.data();
+    header.msg_controllen = control.size();
+    std::vector<int> fds;
+    // Peeking gives copies of the fds, the ones with the packet are dropped when the Receiver reads it.
+    if (recvmsg(sockfd, &header, MSG_PEEK | MSG_CMSG_CLOEXEC) <= 0) {
+        return fds;
+    }
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            size_t offset = fds.size();
+            fds.resize(offset + num);
+            memcpy(fds.data() + offset, CMSG_DATA(cmsg), num * sizeof(int));
+        }
+    }
+    return fds;
+}
+
+Task<> Server::receive_from_client(uint8_t client_id) {
     // Check if the client id is valid.
     std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
     if (!clientinfo_list_->check_exist(client_id, clientinfo_list_lock)) {
         throw std::runtime_error("Server Receive From Client failed: invalid client id.");
     }
 
-    Sender *sender = clientinfo_list_->at(client_id, clientinfo_list_lock)->get_sender();
-    Receiver *receiver = clientinfo_list_->at(client_id, clientinfo_list_lock)->get_receiver();
+    // Erased only when this coroutine ends.
+    ClientInfo *client_info = clientinfo_list_->at(client_id, clientinfo_list_lock).get();
+    Sender *sender = client_info->get_sender();
+    Receiver *receiver = client_info->get_receiver();
 
-    Message message;
+    MessagePtr message = make_message();
     output_queue_->push(
         "[INFO] " + clientinfo_list_->at(client_id, clientinfo_list_lock)->get_name() +
         "(ID: " + std::to_string(client_id) + ") connected."
     );
-    output_queue_->push(
-        "[INFO] Address: " +
-        std::string(
-            inet_ntoa(clientinfo_list_->at(client_id, clientinfo_list_lock)->get_addr().sin_addr)
-        )
-    );
-    output_queue_->push(
-        "[INFO] Port: " +
-        std::to_string(
-            ntohs(clientinfo_list_->at(client_id, clientinfo_list_lock)->get_addr().sin_port)
-        )
-    );
+    if (clientinfo_list_->at(client_id, clientinfo_list_lock)->get_addr().sin_family == AF_UNIX) {
+        output_queue_->push("[INFO] Address: " + unix_path_);
+    } else {
+        output_queue_->push(
+            "[INFO] Address: " +
+            std::string(
+                inet_ntoa(clientinfo_list_->at(client_id, clientinfo_list_lock)->get_addr().sin_addr)
+            )
+        );
+        output_queue_->push(
+            "[INFO] Port: " +
+            std::to_string(
+                ntohs(clientinfo_list_->at(client_id, clientinfo_list_lock)->get_addr().sin_port)
+            )
+        );
+    }
     output_queue_->push("[INFO] waiting for message...");
     // delete the unique_lock
     clientinfo_list_lock.unlock();
-    while (receiver->receive(message) && running_) {
-        std::unique_lock<std::mutex> lock(clientinfo_list_->get_mutex());
-        // Check if the message is from the client.
-        if (message.get_sender_id() != client_id) {
-            // Not from the client, do nothing.
-            continue;
+    // Whether the client leaves on purpose, rather than the connection dropped.
+    bool stopped = false;
+    // Count the heap allocations of every iteration forwarding a message, from one receive to the next.
+    // The other coroutines run on the thread while this one is suspended, which is not counted.
+    uint64_t alloc_count = get_thread_alloc_count();
+    bool forwarding = false;
+    size_t batch_num = 0;
+    while (true) {
+        uint64_t next_alloc_count = get_thread_alloc_count();
+        if (forwarding) {
+            forward_alloc_num_ += next_alloc_count - alloc_count;
+            forwarding = false;
         }
-        // Reset the lost_heart_beat.
-        receiver->reset_lost_heart_beat();
-        // If heart beat, do nothing.
-        if (message.get_type() == MessageType::HEARTBEAT) {
+        alloc_count = next_alloc_count;
+        // Send the ACKs batched from what was read at once, before waiting for more.
+        if (ack_batch_size_ > 0 && !receiver->has_buffered()) {
+            std::unique_lock<std::mutex> lock(clientinfo_list_->get_mutex());
+            flush_acks(lock);
+        }
+        if (batch_num == RECEIVE_BATCH) {
+            // Let the other clients have a turn.
+            co_await loop_->yield();
+            batch_num = 0;
+            alloc_count = get_thread_alloc_count();
+        }
+        ssize_t size = receiver->receive(message, 0);
+        if (size < 0) {
+            // Suspend until there is something to read, waking up every TIMEOUT at least
+            // to notice the lost heart beats and the interruption, as a blocking receive does.
+            co_await loop_->readable(receiver->get_fd(), TIMEOUT);
+            batch_num = 0;
+            alloc_count = get_thread_alloc_count();
             continue;
         }
-
-        // Print the message.
-        output_queue_->push("[DEBUG] Received message: " + message.to_string());
-        // check the type of the message
-        if (message.get_type() == MessageType::REQSEND) {
-            // Try to find the receiver.
-            if (!clientinfo_list_->check_exist(message.get_receiver_id(), lock)) {
-                // Not found.
-                data_t data;
-                data.push_back("The receiver is not found.");
-                output_queue_->push("[ERR] The receiver is not found.");
-                sender->send_acknowledge(message.get_pakage_id(), message.get_sender_id(), data);
-                continue;
-            }
-
-            // Found, Send a FWD.
-            send_res_t result = clientinfo_list_->at(message.get_receiver_id(), lock)
-                                                ->get_sender()
-                                                ->send_forward(message);
-            // Insert the message into the massage_type_map_.
-            // Key is FWD's package id, value is the REQSEND's package info.
-            std::unique_lock<std::mutex> message_status_map_lock(message_status_map_->get_mutex());
-            message_status_map_->insert_or_assign(
-                result.first,
-                PacketInfo{
-                    message.get_pakage_id(),
-                    message.get_sender_id(),
-                    message.get_receiver_id(),
-                    MessageType::FWD
-                },
-                message_status_map_lock
-            );
-        } else if (message.get_type() == MessageType::ACK) {
-            // Check if the message is in the message_status_map_.
-            std::unique_lock<std::mutex> message_status_map_lock(message_status_map_->get_mutex());
-            if (!message_status_map_->check_exist(message.get_pakage_id(), message_status_map_lock)) {
-                // Not found, do nothing.
+        batch_num++;
+        if (size == 0 || !running_) {
+            break;
+        }
+        // Check if the message is from the client, or from one attached to its connection,
+        // and charge it to the sender. The lock is only needed to find an attached one.
+        uint8_t sender_id = message->get_sender_id();
+        ClientInfo *sender_info = client_info;
+        std::unique_lock<std::mutex> lock(clientinfo_list_->get_mutex(), std::defer_lock);
+        if (sender_id != client_id) {
+            lock.lock();
+            auto attached = clientinfo_list_->find(sender_id, lock);
+            if (attached == clientinfo_list_->end(lock) || attached->second->get_gateway_id() != client_id) {
+                // Not from the client, do nothing.
                 continue;
             }
+            sender_info = attached->second.get();
+        }
+        // Throttle before contending for the lock with the other clients.
+        if (!admit_request(*message, sender_info->get_message_bucket(), sender_info->get_byte_bucket())) {
+            rate_limited_num_++;
+            sender->send_wait(message->get_pakage_id(), sender_id, SERVER_ID);
+            continue;
+        }
+        if (!lock.owns_lock()) {
+            lock.lock();
+        }
+        // Reset the lost_heart_beat.
+        receiver->reset_lost_heart_beat();
 
-            // Found, check if the original message is a DISCONNECT REQUEST.
-            PacketInfo packet_info = message_status_map_->at(
-                message.get_pakage_id(),
-                message_status_map_lock
-            );
-            message_status_map_->erase(message.get_pakage_id(), message_status_map_lock);
-            if (packet_info.message_type == MessageType::DISCONNECT) {
-                // DISCONNECT REQUEST, close the thread.
-                break;
-            }
-
-            // Then check if the message is a FWD.
-            // Check if the receiver and sender is swapped.
-            if (message.get_sender_id() == packet_info.receiver_id &&
-                message.get_receiver_id() == packet_info.sender_id) {
-                // Swapped, success, send an ACK to the sender before (the receiver now).
-                clientinfo_list_->at(packet_info.sender_id, lock)->get_sender()->send_acknowledge(
-                    packet_info.package_id,
-                    packet_info.sender_id
-                );
-            } else {
-                // Not swapped, send error message to the sender before.
-                data_t data;
-                data.push_back("Error in connection between the server and the receiver.");
-                output_queue_->push("[ERR] " + data[0]);
-                clientinfo_list_->at(packet_info.sender_id, lock)->get_sender()->send_acknowledge(
-                    packet_info.package_id,
-                    packet_info.sender_id,
-                    data
-                );
-            }
-        } else if (message.get_type() == MessageType::REQCLILIST) {
-            // Send a ACK.
-            data_t data;
-            /* In the data, one client occupies 4 elements:
-             * 1. id
-             * 2. name
-             * 3. ip
-             * 4. port
-             */
-            for (auto it = clientinfo_list_->begin(lock); it != clientinfo_list_->end(lock); it++) {
-                std::string id_str = std::to_string(it->first);
-                std::string name_str = it->second->get_name();
-                std::string ip_str = inet_ntoa(it->second->get_addr().sin_addr);
-                std::string port_str = std::to_string(ntohs(it->second->get_addr().sin_port));
-                std::string client_str = id_str + DIVISION_SIGNAL +
-                                         name_str + DIVISION_SIGNAL +
-                                         ip_str + DIVISION_SIGNAL +
-                                         port_str + DIVISION_SIGNAL;
-                data.push_back(client_str);
-            }
-            sender->send_acknowledge(message.get_pakage_id(), message.get_sender_id(), data);
-        } else if (message.get_type() == MessageType::REQTIME) {
-            // Get timestamp.
-            std::time_t timestamp = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-            std::string timestamp_str = std::to_string(timestamp);
-            data_t data;
-            data.push_back(timestamp_str);
-            // Send a ACK.
-            sender->send_acknowledge(message.get_pakage_id(), message.get_sender_id(), data);
-        } else if (message.get_type() == MessageType::REQHOST) {
-            // Send a ACK.
-            data_t data;
-            data.push_back(name_);
-            sender->send_acknowledge(message.get_pakage_id(), message.get_sender_id(), data);
-        } else if (message.get_type () == MessageType::DISCONNECT) {
-            // Send an ACK.
-            sender->send_acknowledge(message.get_pakage_id(), message.get_sender_id());
+        MessageType type = message->get_type();
+        ClientContext context {sender_id, sender, receiver, lock};
+        DispatchResult result = dispatcher_.dispatch(this, context, message);
+        if ((type == MessageType::REQSEND || type == MessageType::REQSEND_NAME) &&
+            result == DispatchResult::DONE && !message) {
+            forwarded_num_++;
+            forwarding = true;
+        }
+        if (result == DispatchResult::STOP && sender_id != client_id) {
+            // Only the attached client leaves, the connection stays.
+            detach_client(sender_id, lock);
+            continue;
+        } else if (result == DispatchResult::STOP) {
+            stopped = true;
             break;
-        } else if (message.get_type() == MessageType::HEARTBEAT) {
-            // Do nothing.
-        } else {
+        } else if (result == DispatchResult::INVALID) {
             output_queue_->push("[ERR] Invalid message type.");
             continue;
+        } else if (result == DispatchResult::MALFORMED) {
+            output_queue_->push("[ERR] Malformed message: " + message->to_string());
+            continue;
+        } else if (result == DispatchResult::IGNORED) {
+            continue;
+        }
+        // Only logged if asked, building the lines allocates.
+        if (tracing_) {
+            // The message may have been handed over, e.g. forwarded.
+            if (message) {
+                output_queue_->push("[DEBUG] Done message: " + message->to_string());
+            }
+            output_queue_->push("[INFO] Waiting for message...");
         }
-        output_queue_->push("[DEBUG] Done message: " + message.to_string());
-        output_queue_->push("[INFO] Waiting for message...");
     }
+    if (handing_over_ && !stopped) {
+        // Passed to the new server as it is, the connection stays up.
+        co_await stop_monitor(client_id);
+        co_return;
+    }
+    receiver->set_lost_heart_beat(MAX_LOST_HEART_BEAT);
+    co_await stop_monitor(client_id);
     // Relock the unique_lock
     clientinfo_list_lock.lock();
+    // The clients attached to the connection leave with it.
+    std::vector<uint8_t> attached_ids;
+    for (
+        auto it = clientinfo_list_->begin(clientinfo_list_lock);
+        it != clientinfo_list_->end(clientinfo_list_lock);
+        it++
+    ) {
+        if (it->first != client_id && it->second->get_gateway_id() == client_id) {
+            attached_ids.push_back(it->first);
+        }
+    }
+    for (uint8_t id : attached_ids) {
+        detach_client(id, clientinfo_list_lock);
+    }
     output_queue_->push(
         "[INFO] " + clientinfo_list_->at(client_id, clientinfo_list_lock)->get_name() +
         "(ID: " + std::to_string(client_id) + ") disconnected."
     );
-    // join the monitor thread.
-    receiver->set_lost_heart_beat(MAX_LOST_HEART_BEAT);
-    std::unique_lock<std::mutex> client_monitor_list_lock(client_monitor_list_->get_mutex());
-    if (client_monitor_list_->check_exist(client_id, client_monitor_list_lock)) {
-        client_monitor_list_->at(client_id, client_monitor_list_lock)->join();
-        client_monitor_list_->at(client_id, client_monitor_list_lock).release();
+
+    std::unique_lock<std::mutex> session_map_lock(session_map_->get_mutex());
+    auto session = session_map_->find(client_id, session_map_lock);
+    if (!stopped && running_ && session != session_map_->end(session_map_lock)) {
+        // The connection dropped, keep the session and the FWDs to replay.
+        session->second.suspended = true;
+        session->second.expire_time = std::chrono::steady_clock::now() +
+                                      std::chrono::seconds(SESSION_GRACE_PERIOD);
+        session_map_lock.unlock();
+        clear_multicast_status_map(client_id, clientinfo_list_lock);
+        output_queue_->push(
+            "[INFO] Keep the session of client " + std::to_string(client_id) +
+            " for " + std::to_string(SESSION_GRACE_PERIOD) + " seconds."
+        );
+    } else {
+        // Remove the client.
+        session_map_lock.unlock();
+        release_client(client_id, clientinfo_list_lock);
     }
-    // Remove the client.
-    clear_message_status_map(client_id, clientinfo_list_lock);
-    clientinfo_list_->erase(client_id, clientinfo_list_lock);
+    // Watch again after resuming, if still interested.
+    presence_watchers_.reset(client_id);
+    // Batched again after resuming too, the ACKs batched meanwhile are lost like the ones sent alone.
+    ack_batching_.reset(client_id);
+    ack_batch_size_ -= ack_batches_[client_id].size();
+    ack_batches_[client_id].clear();
+    std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+    client_directory_->leave(client_id, client_directory_lock);
+    client_directory_lock.unlock();
+    announce_member(client_id, false, clientinfo_list_lock);
+    sockaddr_in datagram_addr;
+    if (clientinfo_list_->at(client_id, clientinfo_list_lock)->get_datagram_addr(datagram_addr)) {
+        datagram_channel_->remove_peer(datagram_addr);
+    }
+    retire_connection(client_id, clientinfo_list_lock);
 }
 
-void Server::monitor_client(uint8_t client_id) {
-    // Check if the client id is valid.
-    std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
-    if (!clientinfo_list_->check_exist(client_id, clientinfo_list_lock)) {
-        throw std::runtime_error("Server Monitor Client failed: invalid client id.");
+bool Server::admit_request(const Message &message, TokenBucket &message_bucket, TokenBucket &byte_bucket) {
+    MessageType type = message.get_type();
+    if (type == MessageType::HEARTBEAT || type == MessageType::ACK || type == MessageType::ACKS ||
+        type == MessageType::DISCONNECT) {
+        return true;
     }
+    // Follow the limits if they are changed.
+    uint32_t message_rate = message_rate_limit_;
+    uint32_t byte_rate = byte_rate_limit_;
+    if (message_bucket.get_rate() != message_rate) {
+        message_bucket.set_rate(message_rate, (double)message_rate * RATE_LIMIT_BURST);
+    }
+    if (byte_bucket.get_rate() != byte_rate) {
+        byte_bucket.set_rate(byte_rate, (double)byte_rate * RATE_LIMIT_BURST);
+    }
+    // steady_clock is read through the vDSO, no syscall.
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    return message_bucket.take(1, now) && byte_bucket.take(message.get_serialized_size(), now);
+}
 
-    // Get the sender and receiver.
-    Sender *sender = clientinfo_list_->at(client_id, clientinfo_list_lock)->get_sender();
-    Receiver *receiver = clientinfo_list_->at(client_id, clientinfo_list_lock)->get_receiver();
-
-    clientinfo_list_lock.unlock();
+uint8_t Server::accept_resume(MessagePtr &request, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    uint8_t id = request->get_sender_id();
+    const std::string &token = request->get_data()[0];
+    for (int i = 0; i < RESUME_RETRY_NUM; i++) {
+        std::unique_lock<std::mutex> session_map_lock(session_map_->get_mutex());
+        auto it = session_map_->find(id, session_map_lock);
+        if (id == SERVER_ID ||
+            it == session_map_->end(session_map_lock) ||
+            it->second.token != token) {
+            return 0;
+        }
+        if (it->second.suspended) {
+            it->second.suspended = false;
+            return id;
+        }
 
-    while (receiver->get_lost_heart_beat() < MAX_LOST_HEART_BEAT) {
-        sleep(HEART_BEAT_INTERVAL);
-        // Send a HEART BEAT.
-        if (running_) {
-            // If the server is not shutdown, send a HEART BEAT.
-            sender->send_heart_beat(client_id);
-            // Pre-increment the lost_heart_beat.
-            receiver->inc_lost_heart_beat();
-        } else {
-            // If the server is shutdown, break.
-            // Notifies the receiver to stop.
-            receiver->set_lost_heart_beat(MAX_LOST_HEART_BEAT);
-            break;
+        // The old connection is not noticed to be dropped yet,
+        // shut it down and wait for its session to be suspended.
+        auto client = clientinfo_list_->find(id, clientinfo_list_lock);
+        if (client != clientinfo_list_->end(clientinfo_list_lock)) {
+            client->second->shutdown_connection();
         }
+        session_map_lock.unlock();
+        clientinfo_list_lock.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(TIMEOUT));
+        clientinfo_list_lock.lock();
     }
+    return 0;
 }
 
-void Server::join_threads() {
-    std::unique_lock<std::mutex> client_recv_list_lock(client_recv_list_->get_mutex());
+void Server::replay_forwards(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    std::vector<std::pair<uint64_t, FrameRef> > frames;
+    std::unique_lock<std::mutex> message_status_map_lock(message_status_map_->get_mutex());
     for (
-        auto it = client_recv_list_->begin(client_recv_list_lock);
-        it != client_recv_list_->end(client_recv_list_lock);
+        auto it = message_status_map_->begin(message_status_map_lock);
+        it != message_status_map_->end(message_status_map_lock);
         it++
     ) {
-        it->second->join();
-    }
-}
-
-void Server::run() {
-    while (running_) {
-        try {
-            // Wait for clients to connect.
-            uint8_t id = wait_for_client();
-            if (!running_) {
-                break;
-            }
-        } catch (std::exception &e) {
-            output_queue_->push("[ERR] " + std::string(e.what()));
+        if (it->second.receiver_id == client_id && it->second.frame) {
+            frames.emplace_back(it->second.seq, it->second.frame);
         }
     }
-}
+    message_status_map_lock.unlock();
 
-void Server::stop() {
-    output_queue_->push("[INFO] Stopping the server...");
-    running_ = false;
-    shutdown(sockfd_, SHUT_RDWR);
+    // Keep the order they were forwarded in.
+    std::sort(frames.begin(), frames.end(), [](const auto &a, const auto &b) {
+        return a.first < b.first;
+    });
+    Sender *sender = clientinfo_list_->at(client_id, clientinfo_list_lock)->get_sender();
+    for (auto &frame : frames) {
+        sender->send_frame(std::move(frame.second));
+    }
+    if (!frames.empty()) {
+        output_queue_->push(
+            "[INFO] Replayed " + std::to_string(frames.size()) +
+            " forward(s) to client " + std::to_string(client_id) + "."
+        );
+    }
+}
+
+bool Server::keep_for_session(
+    ClientContext &context,
+    MessagePtr &message,
+    std::unique_lock<std::mutex> &clientinfo_list_lock
+) {
+    // take_credit() below updates the credit, protected by the lock of clientinfo_list_.
+    check_lock(clientinfo_list_lock, &clientinfo_list_->get_mutex());
+    std::unique_lock<std::mutex> session_map_lock(session_map_->get_mutex());
+    auto it = session_map_->find(message->get_receiver_id(), session_map_lock);
+    if (it == session_map_->end(session_map_lock) || !it->second.suspended) {
+        return false;
+    }
+    session_map_lock.unlock();
+    // Handled either way, kept or told to WAIT.
+    if (!take_credit(context, message)) {
+        return true;
+    }
+
+    // Serialize the FWD now, it is sent when the receiver resumes.
+    PacketInfo packet_info {
+        message->get_pakage_id(),
+        message->get_sender_id(),
+        message->get_receiver_id(),
+        MessageType::FWD,
+        FrameRef::make(),
+        forward_seq_++,
+        0
+    };
+    message->set_type(MessageType::FWD);
+    message->set_pakage_id_to_next();
+    message->serialize(packet_info.frame->get_buffer());
+    std::unique_lock<std::mutex> message_status_map_lock(message_status_map_->get_mutex());
+    message_status_map_->insert_or_assign(message->get_pakage_id(), packet_info, message_status_map_lock);
+    return true;
+}
+
+bool Server::take_credit(ClientContext &context, MessagePtr &message) {
+    uint8_t receiver_id = message->get_receiver_id();
+    size_t size = message->get_serialized_size();
+    size_t &buffered = buffered_bytes_[receiver_id];
+    // A message is always let through to an idle receiver, and a waiting
+    // sender is held back until its CREDIT to keep its messages in order.
+    if (!waiting_senders_[receiver_id].test(context.client_id) &&
+        (buffered == 0 || buffered + size <= MAX_BUFFERED_BYTES)) {
+        buffered += size;
+        peak_buffered_bytes_ = std::max(peak_buffered_bytes_, buffered);
+        return true;
+    }
+    waiting_senders_[receiver_id].set(context.client_id);
+    waited_num_++;
+    context.sender->send_wait(message->get_pakage_id(), context.client_id, receiver_id);
+    return false;
+}
+
+void Server::return_credit(
+    uint8_t receiver_id,
+    size_t size,
+    std::unique_lock<std::mutex> &clientinfo_list_lock
+) {
+    size_t &buffered = buffered_bytes_[receiver_id];
+    buffered -= std::min(buffered, size);
+    std::bitset<MAX_CLIENT_NUM + 1> &waiting = waiting_senders_[receiver_id];
+    // Wait for half of the buffer, not to wake the senders on every ACK.
+    if (waiting.none() || buffered > MAX_BUFFERED_BYTES / 2) {
+        return;
+    }
+    for (size_t id = 1; id <= MAX_CLIENT_NUM; id++) {
+        if (!waiting.test(id)) {
+            continue;
+        }
+        // The sender may be on another node.
+        Sender *sender = route((uint8_t)id, clientinfo_list_lock);
+        if (sender != nullptr) {
+            sender->send_credit((uint8_t)id, receiver_id, MAX_BUFFERED_BYTES - buffered);
+        }
+    }
+    waiting.reset();
+}
+
+void Server::release_client(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    std::unique_lock<std::mutex> session_map_lock(session_map_->get_mutex());
+    session_map_->erase(client_id, session_map_lock);
+    session_map_lock.unlock();
+    clear_message_status_map(client_id, clientinfo_list_lock);
+    mailbox_deliveries_[client_id] = MailboxDelivery();
+    // Nothing is buffered for it any more, let its waiting senders go on.
+    return_credit(client_id, buffered_bytes_[client_id], clientinfo_list_lock);
+    for (auto &waiting : waiting_senders_) {
+        waiting.reset(client_id);
+    }
+    std::unique_lock<std::mutex> topic_index_lock(topic_index_->get_mutex());
+    topic_index_->remove_client(client_id, topic_index_lock);
+}
+
+void Server::retire_connection(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    auto it = clientinfo_list_->find(client_id, clientinfo_list_lock);
+    std::unique_ptr<ClientInfo> client_info = std::move(it->second);
+    clientinfo_list_->erase(it, clientinfo_list_lock);
+    std::unique_lock<std::mutex> released_lock(released_mutex_);
+    released_.push_back(std::move(client_info));
+    released_lock.unlock();
+    released_cond_.notify_one();
+}
+
+void Server::release_connections() {
+    std::vector<std::unique_ptr<ClientInfo> > released;
+    std::unique_lock<std::mutex> released_lock(released_mutex_);
+    while (true) {
+        released_cond_.wait(released_lock, [this] {
+            return releaser_stopping_ || !released_.empty();
+        });
+        if (released_.empty()) {
+            return;
+        }
+        released.swap(released_);
+        // Neither this lock nor the one of clientinfo_list_ is held meanwhile.
+        released_lock.unlock();
+        released.clear();
+        released_lock.lock();
+    }
+}
+
+uint8_t Server::find_free_id(std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    std::unique_lock<std::mutex> session_map_lock(session_map_->get_mutex());
+    for (size_t id = node_index_ + 1; id <= MAX_CLIENT_NUM; id += node_num_) {
+        if (!clientinfo_list_->check_exist(id, clientinfo_list_lock) &&
+            !session_map_->check_exist(id, session_map_lock)) {
+            return id;
+        }
+    }
+    return 0;
+}
+
+void Server::detach_client(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    ClientInfo &client = *clientinfo_list_->at(client_id, clientinfo_list_lock);
+    output_queue_->push(
+        "[INFO] " + client.get_name() + "(ID: " + std::to_string(client_id) +
+        ") detached from the connection of client " + std::to_string(client.get_gateway_id()) + "."
+    );
+    // Without a session of its own, nothing is kept.
+    release_client(client_id, clientinfo_list_lock);
+    presence_watchers_.reset(client_id);
+    std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+    client_directory_->leave(client_id, client_directory_lock);
+    client_directory_lock.unlock();
+    announce_member(client_id, false, clientinfo_list_lock);
+    clientinfo_list_->erase(client_id, clientinfo_list_lock);
+}
+
+Task<> Server::expire_sessions() {
+    std::vector<uint8_t> expired;
+    while (running_) {
+        co_await loop_->sleep_for(std::chrono::seconds(1));
+
+        std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+        std::unique_lock<std::mutex> session_map_lock(session_map_->get_mutex());
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (
+            auto it = session_map_->begin(session_map_lock);
+            it != session_map_->end(session_map_lock);
+            it++
+        ) {
+            if (it->second.suspended && it->second.expire_time <= now) {
+                expired.push_back(it->first);
+            }
+        }
+        session_map_lock.unlock();
+        for (uint8_t client_id : expired) {
+            output_queue_->push("[INFO] The session of client " + std::to_string(client_id) + " expired.");
+            release_client(client_id, clientinfo_list_lock);
+        }
+        expired.clear();
+        clientinfo_list_lock.unlock();
+    }
+}
+
+Task<> Server::notify_presence() {
+    std::chrono::steady_clock::time_point tick = std::chrono::steady_clock::now();
+    while (running_) {
+        // Keep the ticks regular, however long a notification takes.
+        tick += std::chrono::milliseconds(PRESENCE_TICK);
+        co_await loop_->sleep_until(tick);
+
+        std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+        std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+        uint64_t version = client_directory_->get_version(client_directory_lock);
+        if (version != presence_version_ && presence_watchers_.any()) {
+            // One notification with all the changes of the tick, shared by the watchers.
+            FrameRef frame = FrameRef::make();
+            client_directory_->encode_presence(presence_version_, frame->get_buffer(), client_directory_lock);
+            client_directory_lock.unlock();
+            // Once for all the watchers on a connection, e.g. the clients attached to a gateway.
+            std::bitset<MAX_CLIENT_NUM + 1> sent;
+            for (size_t id = 1; id <= MAX_CLIENT_NUM; id++) {
+                if (!presence_watchers_.test(id)) {
+                    continue;
+                }
+                auto it = clientinfo_list_->find((uint8_t)id, clientinfo_list_lock);
+                if (it == clientinfo_list_->end(clientinfo_list_lock) ||
+                    sent.test(it->second->get_gateway_id())) {
+                    continue;
+                }
+                sent.set(it->second->get_gateway_id());
+                if (it->second->get_sender()->send_frame(frame, Lane::CONTROL) >= 0) {
+                    presence_sent_num_++;
+                }
+            }
+            presence_event_num_++;
+        }
+        presence_version_ = version;
+        if (client_directory_lock.owns_lock()) {
+            client_directory_lock.unlock();
+        }
+        clientinfo_list_lock.unlock();
+    }
+}
+
+void Server::register_handlers() {
+    dispatcher_.register_handler<MessageType::HEARTBEAT>(&Server::handle_heart_beat);
+    dispatcher_.register_handler<MessageType::CONNECT>(&Server::handle_connect);
+    dispatcher_.register_handler<MessageType::DISCONNECT>(&Server::handle_disconnect);
+    dispatcher_.register_handler<MessageType::REQTIME>(&Server::handle_request_time);
+    dispatcher_.register_handler<MessageType::REQHOST>(&Server::handle_request_host);
+    dispatcher_.register_handler<MessageType::REQCLILIST>(&Server::handle_request_client_list);
+    dispatcher_.register_handler<MessageType::REQCLILIST_SINCE>(&Server::handle_request_client_list_since);
+    dispatcher_.register_handler<MessageType::REQSEND>(&Server::handle_request_send);
+    dispatcher_.register_handler<MessageType::REQSEND_NAME>(&Server::handle_request_send_by_name);
+    dispatcher_.register_handler<MessageType::REQMULTI>(&Server::handle_request_multicast);
+    dispatcher_.register_handler<MessageType::SUBSCRIBE>(&Server::handle_subscribe);
+    dispatcher_.register_handler<MessageType::UNSUBSCRIBE>(&Server::handle_unsubscribe);
+    dispatcher_.register_handler<MessageType::PUBLISH>(&Server::handle_publish);
+    dispatcher_.register_handler<MessageType::PRESENCE>(&Server::handle_presence);
+    dispatcher_.register_handler<MessageType::ACK>(&Server::handle_acknowledge);
+    dispatcher_.register_handler<MessageType::DATAGRAM>(&Server::handle_datagram);
+    dispatcher_.register_handler<MessageType::REQACKS>(&Server::handle_request_acks);
+    dispatcher_.register_handler<MessageType::ACKS>(&Server::handle_batched_acknowledge);
+}
+
+DispatchResult Server::handle_heart_beat(ClientContext &, MessagePtr &) {
+    // The lost_heart_beat is already reset, do nothing.
+    return DispatchResult::IGNORED;
+}
+
+DispatchResult Server::handle_connect(ClientContext &context, MessagePtr &message) {
+    std::unique_lock<std::mutex> &lock = context.clientinfo_list_lock;
+    // A CONNECT on a connection attaches another client to it, only asked by its owner.
+    ClientInfo &gateway = *clientinfo_list_->at(context.client_id, lock);
+    if (message->get_data_num() != 1 || message->get_data()[0].empty() ||
+        gateway.get_gateway_id() != context.client_id) {
+        return DispatchResult::MALFORMED;
+    }
+    // Admitted up to the limit, like the clients with connections of their own.
+    data_t data;
+    uint8_t id = clientinfo_list_->size(lock) < connection_limit_ ? find_free_id(lock) : 0;
+    if (id == 0) {
+        rejected_num_++;
+        data.push_back("The server is full.");
+        context.sender->send_acknowledge(message->get_pakage_id(), context.client_id, std::move(data));
+        return DispatchResult::DONE;
+    }
+
+    clientinfo_list_->insert_or_assign(
+        id,
+        std::make_unique<ClientInfo>(std::move(message->get_data()[0]), id, gateway),
+        lock
+    );
+    const std::string &name = clientinfo_list_->at(id, lock)->get_name();
+    std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+    client_directory_->join(id, name, gateway.get_addr(), client_directory_lock);
+    client_directory_lock.unlock();
+    announce_member(id, true, lock);
+    attached_num_++;
+    output_queue_->push(
+        "[INFO] " + name + "(ID: " + std::to_string(id) +
+        ") attached to the connection of client " + std::to_string(context.client_id) + "."
+    );
+
+    // Answer with the id, a single byte.
+    data.push_back(std::string(1, (char)id));
+    context.sender->send_acknowledge(message->get_pakage_id(), context.client_id, std::move(data));
+    // Then the messages stored while it was away.
+    deliver_mailbox(id, lock);
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_disconnect(ClientContext &context, MessagePtr &message) {
+    // Send an ACK.
+    context.sender->send_acknowledge(message->get_pakage_id(), message->get_sender_id());
+    return DispatchResult::STOP;
+}
+
+DispatchResult Server::handle_request_time(ClientContext &context, MessagePtr &message) {
+    // Get timestamp.
+    std::time_t timestamp = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    data_t data;
+    data.push_back(std::to_string(timestamp));
+    // Send a ACK.
+    context.sender->send_acknowledge(message->get_pakage_id(), message->get_sender_id(), std::move(data));
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_request_host(ClientContext &context, MessagePtr &message) {
+    // Send a ACK.
+    data_t data;
+    data.push_back(name_);
+    context.sender->send_acknowledge(message->get_pakage_id(), message->get_sender_id(), std::move(data));
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_request_client_list(ClientContext &context, MessagePtr &message) {
+    // The data carries the cursor of the page, none for the first page.
+    uint8_t cursor = message->get_data_num() == 1 && message->get_data()[0].size() == 1 ?
+                     message->get_data()[0][0] : 0;
+    FrameRef frame = FrameRef::make();
+    std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+    frame->get_buffer() = client_directory_->get_page(cursor, client_directory_lock);
+    client_directory_lock.unlock();
+    ClientDirectory::patch_header(frame->get_buffer(), message->get_pakage_id(), context.client_id);
+    context.sender->send_frame(std::move(frame), Lane::CONTROL);
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_request_client_list_since(ClientContext &context, MessagePtr &message) {
+    // A malformed version gets the whole list.
+    uint64_t version = UINT64_MAX;
+    const std::string &version_str = message->get_data()[0];
+    if (version_str.size() == sizeof(version)) {
+        memcpy(&version, version_str.data(), sizeof(version));
+    }
+    FrameRef frame = FrameRef::make();
+    std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+    client_directory_->encode_changes(version, frame->get_buffer(), client_directory_lock);
+    client_directory_lock.unlock();
+    ClientDirectory::patch_header(frame->get_buffer(), message->get_pakage_id(), context.client_id);
+    context.sender->send_frame(std::move(frame), Lane::CONTROL);
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_request_send(ClientContext &context, MessagePtr &message) {
+    std::unique_lock<std::mutex> &lock = context.clientinfo_list_lock;
+    // The receiver belongs to another node, which keeps it for the session or the mailbox as well.
+    uint8_t node = get_node(message->get_receiver_id());
+    if (node != node_index_) {
+        return forward_to_node(context, message, node);
+    }
+    // Try to find the receiver.
+    if (!clientinfo_list_->check_exist(message->get_receiver_id(), lock)) {
+        // Not found, keep it for the receiver if its session is suspended.
+        // Not stored in the mailbox, the id may be given to another client next.
+        if (keep_for_session(context, message, lock)) {
+            return DispatchResult::DONE;
+        }
+        data_t data;
+        data.push_back("The receiver is not found.");
+        output_queue_->push("[ERR] The receiver is not found.");
+        context.sender->send_acknowledge(message->get_pakage_id(), message->get_sender_id(), std::move(data));
+        return DispatchResult::IGNORED;
+    }
+    if (!take_credit(context, message)) {
+        return DispatchResult::DONE;
+    }
+
+    // Found, Send a FWD.
+    // The message is handed over to the sender, keep its package info first.
+    // The FWD is kept until acknowledged, to replay it if the receiver resumes.
+    PacketInfo packet_info {
+        message->get_pakage_id(),
+        message->get_sender_id(),
+        message->get_receiver_id(),
+        MessageType::FWD,
+        FrameRef(),
+        forward_seq_++,
+        0
+    };
+    send_res_t result = clientinfo_list_->at(packet_info.receiver_id, lock)
+                                        ->get_sender()
+                                        ->send_forward(std::move(message), &packet_info.frame);
+    // Insert the message into the massage_type_map_.
+    // Key is FWD's package id, value is the REQSEND's package info.
+    std::unique_lock<std::mutex> message_status_map_lock(message_status_map_->get_mutex());
+    message_status_map_->insert_or_assign(result.first, packet_info, message_status_map_lock);
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_request_send_by_name(ClientContext &context, MessagePtr &message) {
+    // Only hold the directory for the lookup. The clients leave it with
+    // clientinfo_list_ locked, so the id stays valid for the forward.
+    data_t &data = message->get_data();
+    std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+    uint8_t receiver_id = client_directory_->find_by_name(data[0], client_directory_lock);
+    client_directory_lock.unlock();
+
+    // Continue as a REQUEST SEND, the ACK answers the package id all the same.
+    std::string key = "@" + data[0];
+    data.erase(data.begin());
+    message->set_type(MessageType::REQSEND);
+    message->set_receiver_id(receiver_id);
+    if (receiver_id != SERVER_ID) {
+        return handle_request_send(context, message);
+    }
+    // Not found, keep it for the next client with the name if the mailbox is enabled.
+    if (store_in_mailbox(context, message, key)) {
+        return DispatchResult::DONE;
+    }
+    data_t ack_data;
+    ack_data.push_back("The receiver is not found.");
+    output_queue_->push("[ERR] The receiver is not found.");
+    context.sender->send_acknowledge(message->get_pakage_id(), message->get_sender_id(), std::move(ack_data));
+    return DispatchResult::IGNORED;
+}
+
+bool Server::store_in_mailbox(ClientContext &context, MessagePtr &message, const std::string &key) {
+    // The name may be empty.
+    if (!mailbox_ || key.size() < 2) {
+        return false;
+    }
+    FrameRef frame = FrameRef::make();
+    message->serialize(frame->get_buffer());
+    std::unique_lock<std::mutex> mailbox_lock(mailbox_->get_mutex());
+    return mailbox_->store(
+        key,
+        frame->get_buffer().data(),
+        frame->size(),
+        MailboxTicket {message->get_pakage_id(), context.client_id, key},
+        mailbox_lock
+    );
+}
+
+void Server::acknowledge_stored(std::vector<MailboxTicket> &tickets) {
+    std::unique_lock<std::mutex> lock(clientinfo_list_->get_mutex());
+    for (MailboxTicket &ticket : tickets) {
+        Sender *sender = route(ticket.sender_id, lock);
+        if (sender == nullptr) {
+            // The sender is gone, nobody to tell.
+            continue;
+        }
+        // Element 1 is the mailbox, element 2 the notice.
+        data_t data;
+        data.push_back(std::move(ticket.key));
+        data.push_back("The receiver is offline, stored in the mailbox.");
+        sender->send_acknowledge(ticket.package_id, ticket.sender_id, std::move(data));
+    }
+}
+
+void Server::deliver_mailbox(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    if (!mailbox_) {
+        return;
+    }
+    MailboxDelivery &delivery = mailbox_deliveries_[client_id];
+    // Kept through a RESUME, the FWDs not acknowledged are replayed already.
+    if (delivery.key.empty()) {
+        // The messages to the name, if the client holds it.
+        const std::string &name = clientinfo_list_->at(client_id, clientinfo_list_lock)->get_name();
+        std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+        if (client_directory_->find_by_name(name, client_directory_lock) != client_id) {
+            return;
+        }
+        client_directory_lock.unlock();
+        delivery.key = "@" + name;
+        delivery.sent_seq = 0;
+    }
+    send_mailbox(client_id, clientinfo_list_lock);
+}
+
+void Server::send_mailbox(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    MailboxDelivery &delivery = mailbox_deliveries_[client_id];
+    auto client = clientinfo_list_->find(client_id, clientinfo_list_lock);
+    if (!mailbox_ || delivery.key.empty() || client == clientinfo_list_->end(clientinfo_list_lock)) {
+        return;
+    }
+    Sender *sender = client->second->get_sender();
+    size_t &buffered = buffered_bytes_[client_id];
+    std::vector<MailboxRecord> records;
+    size_t sent = 0;
+    bool full = false;
+    std::unique_lock<std::mutex> mailbox_lock(mailbox_->get_mutex());
+    // Charged to the buffer of the client like the REQSENDs, so a backlog is streamed as it is acknowledged.
+    while (!full && mailbox_->fetch(delivery.key, delivery.sent_seq, MAILBOX_BATCH, records, mailbox_lock) > 0) {
+        for (const MailboxRecord &record : records) {
+            if (buffered > 0 && buffered + record.size > MAX_BUFFERED_BYTES) {
+                full = true;
+                break;
+            }
+            delivery.sent_seq = record.seq;
+            MessagePtr message = make_message();
+            try {
+                message->parse(record.data, record.size);
+            } catch (std::exception &e) {
+                output_queue_->push("[ERR] Broken message in the mailbox: " + std::string(e.what()));
+                // Delivered along with the ones before it.
+                delivery.pending.emplace_back(record.seq, true);
+                continue;
+            }
+            message->set_receiver_id(client_id);
+            buffered += message->get_serialized_size();
+            peak_buffered_bytes_ = std::max(peak_buffered_bytes_, buffered);
+            // The sender is answered already, the frame is kept to replay it after a RESUME.
+            PacketInfo packet_info {0, SERVER_ID, client_id, MessageType::FWD, FrameRef(), forward_seq_++, record.seq};
+            send_res_t result = sender->send_forward(std::move(message), &packet_info.frame);
+            std::unique_lock<std::mutex> message_status_map_lock(message_status_map_->get_mutex());
+            message_status_map_->insert_or_assign(result.first, std::move(packet_info), message_status_map_lock);
+            message_status_map_lock.unlock();
+            delivery.pending.emplace_back(record.seq, false);
+            sent++;
+        }
+    }
+    if (sent > 0) {
+        output_queue_->push(
+            "[INFO] Forwarded " + std::to_string(sent) +
+            " stored message(s) to client " + std::to_string(client_id) + "."
+        );
+    }
+}
+
+void Server::acknowledge_mailbox(const PacketInfo &packet_info, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    MailboxDelivery &delivery = mailbox_deliveries_[packet_info.receiver_id];
+    for (auto &pending : delivery.pending) {
+        if (pending.first == packet_info.mailbox_seq) {
+            pending.second = true;
+            break;
+        }
+    }
+    // Only the cursor is kept, so only the messages acknowledged in order are delivered.
+    uint64_t delivered_seq = 0;
+    while (!delivery.pending.empty() && delivery.pending.front().second) {
+        delivered_seq = delivery.pending.front().first;
+        delivery.pending.pop_front();
+    }
+    if (delivered_seq == 0 || !mailbox_) {
+        return;
+    }
+    std::unique_lock<std::mutex> mailbox_lock(mailbox_->get_mutex());
+    mailbox_->mark_delivered(delivery.key, delivered_seq, mailbox_lock);
+    mailbox_lock.unlock();
+    // Not to fetch on every ACK.
+    if (buffered_bytes_[packet_info.receiver_id] <= MAX_BUFFERED_BYTES / 2) {
+        send_mailbox(packet_info.receiver_id, clientinfo_list_lock);
+    }
+}
+
+DispatchResult Server::handle_request_multicast(ClientContext &context, MessagePtr &message) {
+    std::unique_lock<std::mutex> &lock = context.clientinfo_list_lock;
+    MulticastInfo info {
+        message->get_pakage_id(), message->get_sender_id(),
+        std::bitset<MAX_CLIENT_NUM + 1>(), std::bitset<MAX_CLIENT_NUM + 1>(), std::bitset<MAX_CLIENT_NUM + 1>()
+    };
+
+    // Resolve the receivers, an empty list means all the other clients.
+    data_t &data = message->get_data();
+    if (data[0].empty()) {
+        for (auto it = clientinfo_list_->begin(lock); it != clientinfo_list_->end(lock); it++) {
+            if (it->first != info.sender_id) {
+                info.pending.set(it->first);
+            }
+        }
+    } else {
+        for (uint8_t id : data[0]) {
+            if (id != SERVER_ID && clientinfo_list_->check_exist(id, lock)) {
+                info.pending.set(id);
+            } else {
+                info.failed.set(id);
+            }
+        }
+    }
+
+    // Serialize the FWD once, every receiver shares the same frame.
+    BufferPool::local().release(std::move(data[0]));
+    data.erase(data.begin());
+    message->set_type(MessageType::FWD);
+    message->set_pakage_id_to_next();
+    message->set_receiver_id(MULTICAST_ID);
+    FrameRef frame = FrameRef::make();
+    message->serialize(frame->get_buffer());
+    // One frame for all the receivers on a connection, e.g. the clients attached to a gateway.
+    std::bitset<MAX_CLIENT_NUM + 1> sent;
+    std::bitset<MAX_CLIENT_NUM + 1> broken;
+    for (size_t id = 1; id <= MAX_CLIENT_NUM; id++) {
+        if (!info.pending.test(id)) {
+            continue;
+        }
+        ClientInfo &receiver = *clientinfo_list_->at(id, lock);
+        uint8_t connection = receiver.get_gateway_id();
+        if (!sent.test(connection)) {
+            sent.set(connection);
+            if (receiver.get_sender()->send_frame(frame) < 0) {
+                broken.set(connection);
+            }
+        }
+        if (broken.test(connection)) {
+            info.pending.reset(id);
+            info.failed.set(id);
+        }
+    }
+
+    if (info.pending.none()) {
+        // Nothing to wait for.
+        send_multicast_result(info, lock);
+        return DispatchResult::DONE;
+    }
+    // Insert the message into the multicast_status_map_.
+    std::unique_lock<std::mutex> multicast_status_map_lock(multicast_status_map_->get_mutex());
+    multicast_status_map_->insert_or_assign(message->get_pakage_id(), info, multicast_status_map_lock);
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_multicast_acknowledge(ClientContext &context, MessagePtr &message) {
+    std::unique_lock<std::mutex> &lock = context.clientinfo_list_lock;
+    std::unique_lock<std::mutex> multicast_status_map_lock(multicast_status_map_->get_mutex());
+    auto it = multicast_status_map_->find(message->get_pakage_id(), multicast_status_map_lock);
+    if (it == multicast_status_map_->end(multicast_status_map_lock)) {
+        // Not found, do nothing.
+        return DispatchResult::IGNORED;
+    }
+
+    // Check if the ACK is sent back to the sender.
+    if (message->get_receiver_id() != it->second.sender_id) {
+        return DispatchResult::IGNORED;
+    }
+    multicast_status_map_lock.unlock();
+    // It acknowledges the frame for all the receivers on the connection.
+    uint8_t connection = clientinfo_list_->at(context.client_id, lock)->get_gateway_id();
+    if (!acknowledge_multicast(message->get_pakage_id(), connection, lock)) {
+        // Not from one of the receivers.
+        return DispatchResult::IGNORED;
+    }
+    return DispatchResult::DONE;
+}
+
+bool Server::acknowledge_multicast(
+    uint16_t pakage_id,
+    uint8_t connection,
+    std::unique_lock<std::mutex> &clientinfo_list_lock
+) {
+    std::unique_lock<std::mutex> multicast_status_map_lock(multicast_status_map_->get_mutex());
+    auto it = multicast_status_map_->find(pakage_id, multicast_status_map_lock);
+    if (it == multicast_status_map_->end(multicast_status_map_lock)) {
+        return false;
+    }
+    MulticastInfo &info = it->second;
+    std::bitset<MAX_CLIENT_NUM + 1> acknowledged;
+    for (size_t id = 1; id <= MAX_CLIENT_NUM; id++) {
+        if (!info.pending.test(id)) {
+            continue;
+        }
+        auto receiver = clientinfo_list_->find(id, clientinfo_list_lock);
+        if (receiver != clientinfo_list_->end(clientinfo_list_lock) &&
+            receiver->second->get_gateway_id() == connection) {
+            acknowledged.set(id);
+        }
+    }
+    if (acknowledged.none()) {
+        return false;
+    }
+    info.pending &= ~acknowledged;
+    info.succeeded |= acknowledged;
+    if (info.pending.none()) {
+        // All the receivers answered.
+        send_multicast_result(info, clientinfo_list_lock);
+        multicast_status_map_->erase(it, multicast_status_map_lock);
+    }
+    return true;
+}
+
+void Server::send_multicast_result(
+    const MulticastInfo &info,
+    std::unique_lock<std::mutex> &clientinfo_list_lock
+) {
+    auto it = clientinfo_list_->find(info.sender_id, clientinfo_list_lock);
+    if (it == clientinfo_list_->end(clientinfo_list_lock)) {
+        // The sender is gone, nobody to tell.
+        return;
+    }
+    // Element 1 lists the receivers which succeeded, element 2 the ones which failed.
+    data_t data(2);
+    for (size_t id = 1; id <= MAX_CLIENT_NUM; id++) {
+        if (info.succeeded.test(id)) {
+            data[0].push_back((char)id);
+        } else if (info.failed.test(id)) {
+            data[1].push_back((char)id);
+        }
+    }
+    it->second->get_sender()->send_acknowledge(info.package_id, info.sender_id, std::move(data));
+}
+
+DispatchResult Server::handle_subscribe(ClientContext &context, MessagePtr &message) {
+    const std::string &topic = message->get_data()[0];
+    data_t data;
+    if (topic.empty()) {
+        data.push_back("The topic is empty.");
+    } else {
+        std::unique_lock<std::mutex> topic_index_lock(topic_index_->get_mutex());
+        if (!topic_index_->subscribe(topic, context.client_id, topic_index_lock)) {
+            data.push_back("Already subscribed, or too many subscriptions.");
+        }
+    }
+    // Send an ACK, carrying the error message if failed.
+    context.sender->send_acknowledge(message->get_pakage_id(), message->get_sender_id(), std::move(data));
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_unsubscribe(ClientContext &context, MessagePtr &message) {
+    const std::string &topic = message->get_data()[0];
+    data_t data;
+    std::unique_lock<std::mutex> topic_index_lock(topic_index_->get_mutex());
+    if (!topic_index_->unsubscribe(topic, context.client_id, topic_index_lock)) {
+        data.push_back("Not subscribed to the topic.");
+    }
+    topic_index_lock.unlock();
+    // Send an ACK, carrying the error message if failed.
+    context.sender->send_acknowledge(message->get_pakage_id(), message->get_sender_id(), std::move(data));
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_publish(ClientContext &context, MessagePtr &message) {
+    std::unique_lock<std::mutex> &lock = context.clientinfo_list_lock;
+    uint16_t package_id = message->get_pakage_id();
+    std::unique_lock<std::mutex> topic_index_lock(topic_index_->get_mutex());
+    SubscriberSet subscribers = topic_index_->get_subscribers(message->get_data()[0], topic_index_lock);
+    topic_index_lock.unlock();
+    // Not to echo to the publisher.
+    subscribers.reset(context.client_id);
+
+    // Serialize once, every subscriber shares the same frame,
+    // which is written together with the other frames queued to the subscriber.
+    size_t delivered = 0;
+    if (subscribers.any()) {
+        message->set_pakage_id_to_next();
+        message->set_receiver_id(MULTICAST_ID);
+        FrameRef frame = FrameRef::make();
+        message->serialize(frame->get_buffer());
+        // One frame for all the subscribers on a connection, e.g. the clients attached to a gateway.
+        std::bitset<MAX_CLIENT_NUM + 1> sent;
+        std::bitset<MAX_CLIENT_NUM + 1> broken;
+        for (size_t id = 1; id <= MAX_CLIENT_NUM; id++) {
+            if (!subscribers.test(id)) {
+                continue;
+            }
+            auto it = clientinfo_list_->find(id, lock);
+            if (it == clientinfo_list_->end(lock)) {
+                continue;
+            }
+            uint8_t connection = it->second->get_gateway_id();
+            if (!sent.test(connection)) {
+                sent.set(connection);
+                if (it->second->get_sender()->send_frame(frame) < 0) {
+                    broken.set(connection);
+                }
+            }
+            if (!broken.test(connection)) {
+                delivered++;
+            }
+        }
+    }
+    published_num_++;
+    delivered_num_ += delivered;
+
+    // Send an ACK carrying the number of subscribers reached.
+    data_t data;
+    data.push_back(std::to_string(delivered));
+    context.sender->send_acknowledge(package_id, context.client_id, std::move(data));
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_presence(ClientContext &context, MessagePtr &message) {
+    const std::string &flag = message->get_data()[0];
+    data_t data;
+    if (flag == "1") {
+        // Notified from the next tick on, of the changes since the last one.
+        presence_watchers_.set(context.client_id);
+    } else if (flag == "0") {
+        presence_watchers_.reset(context.client_id);
+    } else {
+        data.push_back("Invalid presence flag.");
+    }
+    // Send an ACK, carrying the error message if failed.
+    context.sender->send_acknowledge(message->get_pakage_id(), message->get_sender_id(), std::move(data));
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_acknowledge(ClientContext &context, MessagePtr &message) {
+    std::unique_lock<std::mutex> &lock = context.clientinfo_list_lock;
+    // Check if the message is in the message_status_map_.
+    std::unique_lock<std::mutex> message_status_map_lock(message_status_map_->get_mutex());
+    if (!message_status_map_->check_exist(message->get_pakage_id(), message_status_map_lock)) {
+        // Not found, it may acknowledge a shared FWD.
+        message_status_map_lock.unlock();
+        return handle_multicast_acknowledge(context, message);
+    }
+
+    // Found, check if the original message is a DISCONNECT REQUEST.
+    PacketInfo packet_info = message_status_map_->at(
+        message->get_pakage_id(),
+        message_status_map_lock
+    );
+    message_status_map_->erase(message->get_pakage_id(), message_status_map_lock);
+    message_status_map_lock.unlock();
+    if (packet_info.message_type == MessageType::DISCONNECT) {
+        // DISCONNECT REQUEST, close the thread.
+        return DispatchResult::STOP;
+    }
+    if (packet_info.frame) {
+        return_credit(packet_info.receiver_id, packet_info.frame->size(), lock);
+    }
+    if (packet_info.mailbox_seq != 0) {
+        acknowledge_mailbox(packet_info, lock);
+    }
+    single_ack_in_num_++;
+
+    // Then check if the message is a FWD.
+    Sender *sender = route(packet_info.sender_id, lock);
+    if (sender == nullptr) {
+        // The sender is gone or suspended, nobody to tell.
+        return DispatchResult::DONE;
+    }
+    // Check if the receiver and sender is swapped.
+    if (message->get_sender_id() == packet_info.receiver_id &&
+        message->get_receiver_id() == packet_info.sender_id) {
+        // Swapped, success, send an ACK to the sender before (the receiver now).
+        relay_acknowledge(packet_info, lock);
+    } else {
+        // Not swapped, send error message to the sender before.
+        data_t data;
+        data.push_back("Error in connection between the server and the receiver.");
+        output_queue_->push("[ERR] " + data[0]);
+        sender->send_acknowledge(
+            packet_info.package_id,
+            packet_info.sender_id,
+            std::move(data)
+        );
+    }
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_request_acks(ClientContext &context, MessagePtr &message) {
+    std::unique_lock<std::mutex> &lock = context.clientinfo_list_lock;
+    const std::string &flag = message->get_data()[0];
+    // For the whole connection, the ACKS go to its owner.
+    uint8_t connection = clientinfo_list_->at(context.client_id, lock)->get_gateway_id();
+    data_t data;
+    if (flag == "1") {
+        ack_batching_.set(connection);
+    } else if (flag == "0") {
+        // The ids batched already are still sent.
+        ack_batching_.reset(connection);
+    } else {
+        data.push_back("Invalid batch flag.");
+    }
+    // Send an ACK, carrying the error message if failed.
+    context.sender->send_acknowledge(message->get_pakage_id(), message->get_sender_id(), std::move(data));
+    return DispatchResult::DONE;
+}
+
+DispatchResult Server::handle_batched_acknowledge(ClientContext &context, MessagePtr &message) {
+    std::unique_lock<std::mutex> &lock = context.clientinfo_list_lock;
+    // Only from the owner of the connection, for all the clients on it.
+    if (clientinfo_list_->at(context.client_id, lock)->get_gateway_id() != context.client_id) {
+        return DispatchResult::MALFORMED;
+    }
+    const data_t &data = message->get_data();
+    if (!data[0].empty() && data[0].size() != sizeof(uint16_t)) {
+        return DispatchResult::MALFORMED;
+    }
+    std::vector<uint16_t> pakage_ids;
+    for (size_t i = 1; i < data.size(); i++) {
+        if (!Message::unpack_ack_ranges(data[i], pakage_ids)) {
+            return DispatchResult::MALFORMED;
+        }
+    }
+    auto on_connection = [&](uint8_t receiver_id) {
+        auto it = clientinfo_list_->find(receiver_id, lock);
+        return it != clientinfo_list_->end(lock) && it->second->get_gateway_id() == context.client_id;
+    };
+
+    std::vector<PacketInfo> acknowledged;
+    std::unique_lock<std::mutex> message_status_map_lock(message_status_map_->get_mutex());
+    if (!data[0].empty()) {
+        // The FWDs on the connection are written in order, all the ones before the cumulative
+        // one are received. Not found if acknowledged already, e.g. replayed after a RESUME.
+        uint16_t cumulative;
+        memcpy(&cumulative, data[0].data(), sizeof(cumulative));
+        auto it = message_status_map_->find(ntohs(cumulative), message_status_map_lock);
+        if (it != message_status_map_->end(message_status_map_lock) &&
+            it->second.message_type == MessageType::FWD && on_connection(it->second.receiver_id)) {
+            uint64_t seq = it->second.seq;
+            for (it = message_status_map_->begin(message_status_map_lock);
+                 it != message_status_map_->end(message_status_map_lock);) {
+                if (it->second.message_type == MessageType::FWD && it->second.seq <= seq &&
+                    on_connection(it->second.receiver_id)) {
+                    acknowledged.push_back(std::move(it->second));
+                    it = message_status_map_->erase(it, message_status_map_lock);
+                } else {
+                    it++;
+                }
+            }
+        }
+    }
+    std::vector<uint16_t> multicast_ids;
+    for (uint16_t id : pakage_ids) {
+        auto it = message_status_map_->find(id, message_status_map_lock);
+        if (it == message_status_map_->end(message_status_map_lock)) {
+            // It may be a shared FWD.
+            multicast_ids.push_back(id);
+        } else if (it->second.message_type == MessageType::FWD && on_connection(it->second.receiver_id)) {
+            acknowledged.push_back(std::move(it->second));
+            message_status_map_->erase(it, message_status_map_lock);
+        }
+    }
+    message_status_map_lock.unlock();
+
+    for (const PacketInfo &packet_info : acknowledged) {
+        if (packet_info.frame) {
+            return_credit(packet_info.receiver_id, packet_info.frame->size(), lock);
+        }
+        if (packet_info.mailbox_seq != 0) {
+            acknowledge_mailbox(packet_info, lock);
+        }
+        relay_acknowledge(packet_info, lock);
+    }
+    for (uint16_t id : multicast_ids) {
+        acknowledge_multicast(id, context.client_id, lock);
+    }
+    batched_ack_in_num_ += acknowledged.size() + multicast_ids.size();
+    ack_batch_in_num_++;
+    return DispatchResult::DONE;
+}
+
+void Server::relay_acknowledge(const PacketInfo &packet_info, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    auto it = clientinfo_list_->find(packet_info.sender_id, clientinfo_list_lock);
+    if (it != clientinfo_list_->end(clientinfo_list_lock) && ack_batching_.test(it->second->get_gateway_id())) {
+        ack_batches_[it->second->get_gateway_id()].push_back(packet_info.package_id);
+        ack_batch_size_++;
+        return;
+    }
+    Sender *sender = route(packet_info.sender_id, clientinfo_list_lock);
+    if (sender == nullptr) {
+        // The sender is gone or suspended, or the FWD is from the mailbox, nobody to tell.
+        return;
+    }
+    sender->send_acknowledge(packet_info.package_id, packet_info.sender_id);
+    single_ack_out_num_++;
+}
+
+void Server::flush_acks(std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    for (size_t id = 1; id <= MAX_CLIENT_NUM && ack_batch_size_ > 0; id++) {
+        std::vector<uint16_t> &batch = ack_batches_[id];
+        if (batch.empty()) {
+            continue;
+        }
+        ack_batch_size_ -= batch.size();
+        auto it = clientinfo_list_->find(id, clientinfo_list_lock);
+        if (it != clientinfo_list_->end(clientinfo_list_lock)) {
+            batched_ack_out_num_ += batch.size();
+            ack_batch_out_num_++;
+            it->second->get_sender()->send_acks(id, batch);
+        }
+        batch.clear();
+    }
+}
+
+DispatchResult Server::handle_datagram(ClientContext &context, MessagePtr &message) {
+    // From a client without a datagram channel, or too large for one.
+    relay_datagram(message, context.clientinfo_list_lock);
+    return DispatchResult::DONE;
+}
+
+void Server::relay_datagram(MessagePtr &message, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    auto it = clientinfo_list_->find(message->get_receiver_id(), clientinfo_list_lock);
+    if (it == clientinfo_list_->end(clientinfo_list_lock)) {
+        // Over the link if the receiver belongs to another node, whose channel takes it on.
+        uint8_t node = get_node(message->get_receiver_id());
+        if (node != node_index_ && peer_links_[node]) {
+            peer_links_[node]->sender->send_message(*message);
+            return;
+        }
+        // Not kept for the suspended sessions nor the mailbox, like a lost datagram.
+        return;
+    }
+    sockaddr_in datagram_addr;
+    if (it->second->get_datagram_addr(datagram_addr) && datagram_channel_->send(datagram_addr, *message)) {
+        return;
+    }
+    it->second->get_sender()->send_message(*message);
+    datagram_fallback_num_++;
+}
+
+Task<> Server::receive_datagrams() {
+    std::vector<std::pair<uint8_t, MessagePtr> > messages;
+    while (running_) {
+        if (!co_await loop_->readable(datagram_channel_->get_fd(), TIMEOUT)) {
+            continue;
+        }
+        datagram_channel_->receive(messages);
+        std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+        for (auto &it : messages) {
+            MessagePtr &message = it.second;
+            // Taken only from the address of the client, which must not speak for another.
+            auto client = clientinfo_list_->find(it.first, clientinfo_list_lock);
+            if (client == clientinfo_list_->end(clientinfo_list_lock) || message->get_sender_id() != it.first) {
+                continue;
+            }
+            client->second->get_receiver()->reset_lost_heart_beat();
+            if (message->get_type() == MessageType::DATAGRAM && message->get_data_num() > 0) {
+                relay_datagram(message, clientinfo_list_lock);
+            }
+        }
+        clientinfo_list_lock.unlock();
+        messages.clear();
+    }
+}
+
+uint8_t Server::get_node(uint8_t client_id) const {
+    return client_id == SERVER_ID ? node_index_ : (client_id - 1) % node_num_;
+}
+
+Sender *Server::route(uint8_t client_id, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    auto it = clientinfo_list_->find(client_id, clientinfo_list_lock);
+    if (it != clientinfo_list_->end(clientinfo_list_lock)) {
+        return it->second->get_sender();
+    }
+    uint8_t node = get_node(client_id);
+    if (node != node_index_ && peer_links_[node]) {
+        return peer_links_[node]->sender.get();
+    }
+    return nullptr;
+}
+
+DispatchResult Server::forward_to_node(ClientContext &context, MessagePtr &message, uint8_t node) {
+    if (!peer_links_[node]) {
+        data_t data;
+        data.push_back("The node of the receiver is unreachable.");
+        output_queue_->push("[ERR] The node of the receiver is unreachable.");
+        context.sender->send_acknowledge(message->get_pakage_id(), message->get_sender_id(), std::move(data));
+        return DispatchResult::IGNORED;
+    }
+    // As it is, the node charges its receiver and answers the sender through the link.
+    peer_links_[node]->sender->send_message(*message);
+    peer_forwarded_num_++;
+    message.reset();
+    return DispatchResult::DONE;
+}
+
+void Server::join_cluster(uint8_t node_index, std::vector<sockaddr_in> nodes) {
+    if (nodes.size() < 2 || nodes.size() > MAX_NODE_NUM || node_index >= nodes.size()) {
+        throw std::runtime_error("Server Join Cluster failed: invalid nodes.");
+    }
+    std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+    if (clientinfo_list_->size(clientinfo_list_lock) > 0) {
+        throw std::runtime_error("Server Join Cluster failed: clients are connected already.");
+    }
+    node_index_ = node_index;
+    node_num_ = nodes.size();
+    node_addrs_ = std::move(nodes);
+    clientinfo_list_lock.unlock();
+    output_queue_->push(
+        "[INFO] Node " + std::to_string(node_index_) + " of a cluster of " + std::to_string(node_num_) + "."
+    );
+    loop_->spawn(connect_peers());
+}
+
+Task<> Server::connect_peers() {
+    while (running_) {
+        for (uint8_t node = 0; node < node_index_ && running_; node++) {
+            std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+            bool linked = peer_links_[node] != nullptr;
+            clientinfo_list_lock.unlock();
+            if (linked) {
+                continue;
+            }
+            // Connect without blocking the loop, a node may be down for long.
+            int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (sockfd < 0) {
+                continue;
+            }
+            bool connected = connect(sockfd, cast_sockaddr_in(node_addrs_[node]), sizeof(node_addrs_[node])) == 0;
+            if (!connected && errno == EINPROGRESS) {
+                bool writable = co_await loop_->writable(sockfd, PEER_RETRY_INTERVAL);
+                int error = 0;
+                socklen_t error_len = sizeof(error);
+                connected = writable && getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0;
+            }
+            if (!connected) {
+                close(sockfd);
+                continue;
+            }
+            // Blocking from now on, like the connections of the clients.
+            fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+            int opt = 1;
+            setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            std::unique_ptr<Sender> sender = std::make_unique<Sender>(sockfd, SERVER_ID);
+            std::unique_ptr<Receiver> receiver = std::make_unique<Receiver>(sockfd, SERVER_ID);
+            data_t hello;
+            hello.push_back("H");
+            hello.push_back(std::to_string(node_index_));
+            sender->send_peer(std::move(hello));
+            clientinfo_list_lock.lock();
+            add_peer_link(node, sockfd, std::move(sender), std::move(receiver), clientinfo_list_lock);
+        }
+        co_await loop_->sleep_for(std::chrono::milliseconds(PEER_RETRY_INTERVAL));
+    }
+}
+
+bool Server::add_peer_link(
+    uint8_t node,
+    int sockfd,
+    std::unique_ptr<Sender> sender,
+    std::unique_ptr<Receiver> receiver,
+    std::unique_lock<std::mutex> &clientinfo_list_lock
+) {
+    // Not after join_threads().
+    if (peer_links_[node] || !running_) {
+        sender.reset();
+        close(sockfd);
+        return false;
+    }
+    // The former thread dropped its link, it only returns from now on.
+    if (peer_threads_[node].joinable()) {
+        peer_threads_[node].join();
+    }
+    peer_links_[node] = std::make_unique<PeerLink>(sockfd, std::move(sender), std::move(receiver));
+
+    // The clients connected here, the later joins and leaves follow on the same link.
+    data_t data;
+    data.emplace_back(1, '=');
+    for (
+        auto it = clientinfo_list_->begin(clientinfo_list_lock);
+        it != clientinfo_list_->end(clientinfo_list_lock);
+        it++
+    ) {
+        std::string entry(7, '\0');
+        sockaddr_in addr = it->second->get_addr();
+        entry[0] = it->first;
+        memcpy(&entry[1], &addr.sin_addr.s_addr, 4);
+        memcpy(&entry[5], &addr.sin_port, 2);
+        entry.append(it->second->get_name(), 0, UINT8_MAX - entry.size());
+        data.push_back(std::move(entry));
+    }
+    peer_links_[node]->sender->send_peer(std::move(data));
+    peer_threads_[node] = std::thread(&Server::receive_from_peer, this, node);
+    output_queue_->push("[INFO] Linked with node " + std::to_string(node) + ".");
+    return true;
+}
+
+void Server::announce_member(uint8_t client_id, bool joined, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    if (node_num_ == 1) {
+        return;
+    }
+    // '+' with the id, the address and the name, or '-' with the id.
+    data_t data;
+    data.emplace_back(1, joined ? '+' : '-');
+    std::string entry(1, (char)client_id);
+    if (joined) {
+        const std::unique_ptr<ClientInfo> &client_info = clientinfo_list_->at(client_id, clientinfo_list_lock);
+        sockaddr_in addr = client_info->get_addr();
+        entry.resize(7);
+        memcpy(&entry[1], &addr.sin_addr.s_addr, 4);
+        memcpy(&entry[5], &addr.sin_port, 2);
+        entry.append(client_info->get_name(), 0, UINT8_MAX - entry.size());
+    }
+    data.push_back(std::move(entry));
+    for (std::unique_ptr<PeerLink> &link : peer_links_) {
+        if (link) {
+            link->sender->send_peer(data);
+        }
+    }
+}
+
+void Server::update_members(uint8_t node, MessagePtr &message, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    // peer_links_ is protected by the lock of clientinfo_list_.
+    check_lock(clientinfo_list_lock, &clientinfo_list_->get_mutex());
+    const data_t &data = message->get_data();
+    PeerLink &link = *peer_links_[node];
+    std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+    if (data[0] == "=") {
+        // A new link, forget what the former one told.
+        for (size_t id = 1; id <= MAX_CLIENT_NUM; id++) {
+            if (link.members.test(id)) {
+                client_directory_->leave(id, client_directory_lock);
+            }
+        }
+        link.members.reset();
+    }
+    for (size_t i = 1; i < data.size(); i++) {
+        const std::string &entry = data[i];
+        // Only the clients of the node itself.
+        if (entry.empty() || (uint8_t)entry[0] == SERVER_ID || get_node(entry[0]) != node) {
+            continue;
+        }
+        uint8_t client_id = entry[0];
+        if (data[0] == "-") {
+            if (link.members.test(client_id)) {
+                client_directory_->leave(client_id, client_directory_lock);
+                link.members.reset(client_id);
+            }
+        } else if (entry.size() >= 7) {
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            memcpy(&addr.sin_addr.s_addr, &entry[1], 4);
+            memcpy(&addr.sin_port, &entry[5], 2);
+            client_directory_->join(client_id, entry.substr(7), addr, client_directory_lock);
+            link.members.set(client_id);
+        }
+    }
+}
+
+void Server::receive_from_peer(uint8_t node) {
+    std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+    Sender *sender = peer_links_[node]->sender.get();
+    Receiver *receiver = peer_links_[node]->receiver.get();
+    clientinfo_list_lock.unlock();
+
+    MessagePtr message = make_message();
+    while (receiver->receive(message) > 0 && running_) {
+        std::unique_lock<std::mutex> lock(clientinfo_list_->get_mutex());
+        MessageType type = message->get_type();
+        if (type == MessageType::PEER) {
+            update_members(node, message, lock);
+        } else if (type == MessageType::REQSEND) {
+            // From a client of the node to a client here, like from a local client.
+            if (get_node(message->get_sender_id()) != node || get_node(message->get_receiver_id()) != node_index_) {
+                continue;
+            }
+            ClientContext context {message->get_sender_id(), sender, receiver, lock};
+            if (dispatcher_.dispatch(this, context, message) == DispatchResult::DONE) {
+                peer_received_num_++;
+            }
+        } else if (type == MessageType::DATAGRAM) {
+            if (get_node(message->get_receiver_id()) == node_index_) {
+                relay_datagram(message, lock);
+            }
+        } else if (type == MessageType::ACK || type == MessageType::WAIT || type == MessageType::CREDIT) {
+            // The answers to the REQSENDs forwarded there, for the clients here.
+            auto it = clientinfo_list_->find(message->get_receiver_id(), lock);
+            if (it != clientinfo_list_->end(lock)) {
+                it->second->get_sender()->send_message(*message);
+                peer_relayed_num_++;
+            }
+        }
+    }
+
+    clientinfo_list_lock.lock();
+    std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+    for (size_t id = 1; id <= MAX_CLIENT_NUM; id++) {
+        if (peer_links_[node]->members.test(id)) {
+            client_directory_->leave(id, client_directory_lock);
+        }
+    }
+    client_directory_lock.unlock();
+    peer_links_[node].reset();
+    output_queue_->push("[INFO] Lost the link with node " + std::to_string(node) + ".");
+}
+
+Task<> Server::monitor_client(uint8_t client_id, Monitor monitor) {
+    // Check if the client id is valid.
+    std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+    if (!clientinfo_list_->check_exist(client_id, clientinfo_list_lock)) {
+        monitor.finished.set();
+        throw std::runtime_error("Server Monitor Client failed: invalid client id.");
+    }
+
+    // Get the sender and receiver.
+    Sender *sender = clientinfo_list_->at(client_id, clientinfo_list_lock)->get_sender();
+    Receiver *receiver = clientinfo_list_->at(client_id, clientinfo_list_lock)->get_receiver();
+    sockaddr_in datagram_addr;
+    bool datagram = clientinfo_list_->at(client_id, clientinfo_list_lock)->get_datagram_addr(datagram_addr);
+    // Set on accepting, and kept by the socket through a handover.
+    int keepalive = 0;
+    socklen_t keepalive_len = sizeof(keepalive);
+    getsockopt(
+        clientinfo_list_->at(client_id, clientinfo_list_lock)->get_sockfd(),
+        SOL_SOCKET, SO_KEEPALIVE, &keepalive, &keepalive_len
+    );
+    // The heart beats through the datagram channel also keep its way open.
+    bool probed = keepalive && !datagram;
+
+    clientinfo_list_lock.unlock();
+
+    Message heart_beat(MessageType::HEARTBEAT, SERVER_ID, client_id, {}, false);
+    heart_beat.set_pakage_id(0);
+    const int64_t interval = HEART_BEAT_INTERVAL * 1000;
+    int64_t wait_time = interval;
+    while (receiver->get_lost_heart_beat() < MAX_LOST_HEART_BEAT) {
+        // Woken up early if the client is gone or the server stops.
+        bool stopped = co_await monitor.stop_event.wait(wait_time + rand() % HEART_BEAT_JITTER);
+        if (receiver->get_lost_heart_beat() >= MAX_LOST_HEART_BEAT || (stopped && running_)) {
+            break;
+        }
+        // Any message since the last heart beat answers it, wait until the client has been idle long enough.
+        int64_t idle_time = receiver->get_idle_time();
+        if (running_ && (probed || (receiver->get_lost_heart_beat() == 0 && idle_time < interval))) {
+            skipped_heart_beat_num_++;
+            wait_time = probed ? interval : interval - idle_time;
+            continue;
+        }
+        wait_time = interval;
+        // Send a HEART BEAT.
+        if (running_) {
+            // If the server is not shutdown, send a HEART BEAT.
+            // Through the datagram channel, not to wait behind the frames on the connection,
+            // but through TCP once one is lost, in case the datagrams are blocked on the way.
+            if (!datagram || receiver->get_lost_heart_beat() > 0 ||
+                !datagram_channel_->send(datagram_addr, heart_beat)) {
+                sender->send_heart_beat(client_id);
+            }
+            heart_beat_num_++;
+            // Pre-increment the lost_heart_beat.
+            receiver->inc_lost_heart_beat();
+        } else {
+            // If the server is shutdown, break.
+            // Notifies the receiver to stop.
+            receiver->set_lost_heart_beat(MAX_LOST_HEART_BEAT);
+            break;
+        }
+    }
+    monitor.finished.set();
+}
+
+Task<> Server::stop_monitor(uint8_t client_id) {
+    std::unique_lock<std::mutex> client_monitor_list_lock(client_monitor_list_->get_mutex());
+    auto it = client_monitor_list_->find(client_id, client_monitor_list_lock);
+    if (it == client_monitor_list_->end(client_monitor_list_lock)) {
+        co_return;
+    }
+    Monitor monitor = it->second;
+    client_monitor_list_->erase(it, client_monitor_list_lock);
+    client_monitor_list_lock.unlock();
+    monitor.stop_event.set();
+    // The coroutine uses the Sender and the Receiver of the client until then.
+    co_await monitor.finished.wait();
+}
+
+void Server::join_threads() {
+    std::unique_lock<std::mutex> client_recv_list_lock(client_recv_list_->get_mutex());
+    for (
+        auto it = client_recv_list_->begin(client_recv_list_lock);
+        it != client_recv_list_->end(client_recv_list_lock);
+        it++
+    ) {
+        it->second.wait();
+    }
+    client_recv_list_lock.unlock();
+    drop_peer_links();
+}
+
+void Server::drop_peer_links() {
+    // Shutting the links down stops their threads.
+    std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+    for (std::unique_ptr<PeerLink> &link : peer_links_) {
+        if (link) {
+            shutdown(link->sockfd, SHUT_RDWR);
+        }
+    }
+    clientinfo_list_lock.unlock();
+    for (std::thread &thread : peer_threads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+void Server::run() {
+    while (running_) {
+        // Held while accepting, hand_over() takes it to wait for the accepting to stop.
+        std::lock_guard<std::mutex> accept_lock(accept_mutex_);
+        if (handing_over_) {
+            break;
+        }
+        try {
+            // Wait for clients to connect.
+            uint8_t id = wait_for_client();
+            if (!running_) {
+                break;
+            }
+        } catch (std::exception &e) {
+            output_queue_->push("[ERR] " + std::string(e.what()));
+        }
+    }
+}
+
+void Server::stop() {
+    output_queue_->push("[INFO] Stopping the server...");
+    running_ = false;
+    // Wake up the heart beats, which tell the receiving coroutines to stop.
+    std::unique_lock<std::mutex> client_monitor_list_lock(client_monitor_list_->get_mutex());
+    for (
+        auto it = client_monitor_list_->begin(client_monitor_list_lock);
+        it != client_monitor_list_->end(client_monitor_list_lock);
+        it++
+    ) {
+        it->second.stop_event.set();
+    }
+    client_monitor_list_lock.unlock();
+    uint64_t wake = 1;
+    if (write(wake_fd_, &wake, sizeof(wake)) < 0) {
+        output_queue_->push("[WARN] Failed to wake up the accepting thread.");
+    }
+    // The listeners are shared with the new server once handed over.
+    if (!handed_over_) {
+        shutdown(sockfd_, SHUT_RDWR);
+        if (unix_sockfd_ >= 0) {
+            shutdown(unix_sockfd_, SHUT_RDWR);
+        }
+    }
+}
+
+bool Server::hand_over(const std::string &path) {
+    sockaddr_un unix_addr;
+    memset(&unix_addr, 0, sizeof(unix_addr));
+    unix_addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(unix_addr.sun_path)) {
+        output_queue_->push("[ERR] Invalid upgrade path: " + path);
+        return false;
+    }
+    memcpy(unix_addr.sun_path, path.c_str(), path.size());
+    int listen_sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    if (listen_sockfd < 0 ||
+        bind(listen_sockfd, reinterpret_cast<sockaddr *>(&unix_addr), sizeof(unix_addr)) < 0 ||
+        listen(listen_sockfd, 1) < 0) {
+        output_queue_->push(
+            "[ERR] Failed to wait for the new server on " + path + ". errno: " +
+            std::to_string(errno) + " " + strerror(errno)
+        );
+        if (listen_sockfd >= 0) {
+            close(listen_sockfd);
+        }
+        return false;
+    }
+
+    // Keep serving the clients until the new server connects.
+    output_queue_->push(
+        "[INFO] Waiting " + std::to_string(HANDOVER_TIMEOUT / 1000) + " seconds for the new server on " + path + "..."
+    );
+    output_message();
+    pollfd poll_fd {listen_sockfd, POLLIN, 0};
+    int sockfd = -1;
+    if (poll(&poll_fd, 1, HANDOVER_TIMEOUT) > 0) {
+        sockfd = accept4(listen_sockfd, nullptr, nullptr, SOCK_CLOEXEC);
+    }
+    close(listen_sockfd);
+    unlink(path.c_str());
+    if (sockfd < 0) {
+        output_queue_->push("[ERR] No new server connected, going on.");
+        return false;
+    }
+
+    // Stop accepting, run() returns once the lock is released.
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    handing_over_ = true;
+    uint64_t wake = 1;
+    if (write(wake_fd_, &wake, sizeof(wake)) < 0) {
+        output_queue_->push("[WARN] Failed to wake up the accepting thread.");
+    }
+    std::lock_guard<std::mutex> accept_lock(accept_mutex_);
+
+    // Stop receiving, the bytes not read yet stay in the sockets and the rings.
+    std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+    for (
+        auto it = clientinfo_list_->begin(clientinfo_list_lock);
+        it != clientinfo_list_->end(clientinfo_list_lock);
+        it++
+    ) {
+        it->second->get_receiver()->interrupt();
+    }
+    clientinfo_list_lock.unlock();
+    std::unique_lock<std::mutex> client_recv_list_lock(client_recv_list_->get_mutex());
+    for (
+        auto it = client_recv_list_->begin(client_recv_list_lock);
+        it != client_recv_list_->end(client_recv_list_lock);
+        it++
+    ) {
+        it->second.wait();
+    }
+    client_recv_list_->clear(client_recv_list_lock);
+    client_recv_list_lock.unlock();
+
+    // Then the heart beats, the session expiry and the datagrams, and the links to the other nodes,
+    // which the new server connects again.
+    loop_->stop();
+    loop_thread_.join();
+    drop_peer_links();
+    if (datagram_channel_) {
+        datagram_channel_->flush();
+    }
+    // Commit the mailbox for the new server to open it.
+    mailbox_.reset();
+
+    // Write out what is queued, nothing is written to the clients from now on.
+    clientinfo_list_lock.lock();
+    for (
+        auto it = clientinfo_list_->begin(clientinfo_list_lock);
+        it != clientinfo_list_->end(clientinfo_list_lock);
+        it++
+    ) {
+        if (!it->second->get_sender()->flush(TIMEOUT)) {
+            output_queue_->push("[WARN] Failed to flush the frames to client " + std::to_string(it->first) + ".");
+        }
+    }
+
+    // The listeners, every connection, then the tables.
+    HandoverRecord listeners(HandoverKind::LISTENERS);
+    listeners.put_fd(sockfd_);
+    listeners.put_u8(unix_sockfd_ >= 0);
+    if (unix_sockfd_ >= 0) {
+        listeners.put_fd(unix_sockfd_);
+    }
+    listeners.put_u8(datagram_channel_ != nullptr);
+    if (datagram_channel_) {
+        listeners.put_fd(datagram_channel_->get_fd());
+    }
+    bool passed = listeners.send(sockfd);
+    size_t client_num = 0;
+    // The owners of the connections first, the clients attached to them share their sockets.
+    for (bool attached : {false, true}) {
+        for (
+            auto it = clientinfo_list_->begin(clientinfo_list_lock);
+            passed && it != clientinfo_list_->end(clientinfo_list_lock);
+            it++
+        ) {
+            ClientInfo &client = *it->second;
+            if ((client.get_gateway_id() != it->first) != attached) {
+                continue;
+            }
+            HandoverRecord record(HandoverKind::CLIENT);
+            if (!attached) {
+                record.put_fd(client.get_sockfd());
+                // The ring from the client, then the one to it.
+                for (int fd : client.get_receiver()->get_ring_fds()) {
+                    record.put_fd(fd);
+                }
+                for (int fd : client.get_sender()->get_ring_fds()) {
+                    record.put_fd(fd);
+                }
+            }
+            record.put_u8(it->first);
+            record.put_u8(client.get_gateway_id());
+            record.put_string(client.get_name());
+            record.put_addr(client.get_addr());
+            sockaddr_in datagram_addr;
+            memset(&datagram_addr, 0, sizeof(datagram_addr));
+            bool datagram = client.get_datagram_addr(datagram_addr);
+            record.put_u8(datagram);
+            record.put_addr(datagram_addr);
+            // The client drops the datagrams with a former sequence number.
+            record.put_u32(datagram ? datagram_channel_->get_send_seq(datagram_addr) : 0);
+            record.put_bytes(attached ? std::vector<uint8_t>() : client.get_receiver()->take_buffered());
+            passed = record.send(sockfd);
+            client_num += passed;
+        }
+    }
+    HandoverRecord state(HandoverKind::STATE);
+    save_state(state, clientinfo_list_lock);
+    passed = passed && state.send(sockfd) && HandoverRecord(HandoverKind::END).send(sockfd);
+    clientinfo_list_lock.unlock();
+    close(sockfd);
+
+    // The new server has the sockets either way, the clients not taken reconnect or resume.
+    handed_over_ = true;
+    if (!passed) {
+        output_queue_->push("[ERR] The new server stopped taking the clients, the rest of them reconnect.");
+    }
+    double pause_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+    output_queue_->push(
+        "[INFO] Handed " + std::to_string(client_num) + " client(s) over to the new server, paused for " +
+        std::to_string(pause_time) + " ms."
+    );
+    return true;
+}
+
+int Server::take_listeners(const std::string &path, int &datagram_sockfd) {
+    sockaddr_un unix_addr;
+    memset(&unix_addr, 0, sizeof(unix_addr));
+    unix_addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(unix_addr.sun_path)) {
+        throw std::runtime_error("Server Init failed: the upgrade path is too long.");
+    }
+    memcpy(unix_addr.sun_path, path.c_str(), path.size());
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        std::string error_msg = "Server Init failed: failed to create a unix socket. errno: " +
+                                std::to_string(errno) + " " + strerror(errno);
+        throw std::runtime_error(error_msg);
+    }
+    // The running server may not be told to upgrade yet.
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(HANDOVER_TIMEOUT);
+    while (connect(sockfd, reinterpret_cast<sockaddr *>(&unix_addr), sizeof(unix_addr)) < 0) {
+        if ((errno != ENOENT && errno != ECONNREFUSED) || std::chrono::steady_clock::now() >= deadline) {
+            std::string error_msg = "Server Init failed: failed to connect to the running server on " + path +
+                                    ". errno: " + std::to_string(errno) + " " + strerror(errno);
+            close(sockfd);
+            throw std::runtime_error(error_msg);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    // Sent once the running server has stopped receiving.
+    HandoverRecord record;
+    bool has_unix = false;
+    bool has_datagram = false;
+    try {
+        if (!record.receive(sockfd) || record.get_kind() != HandoverKind::LISTENERS) {
+            throw std::runtime_error("Server Init failed: no listeners from the running server.");
+        }
+        has_unix = record.get_u8();
+        has_datagram = record.get_u8();
+        if (record.get_fds().size() != static_cast<size_t>(1 + has_unix + has_datagram)) {
+            throw std::runtime_error("Server Init failed: invalid listeners from the running server.");
+        }
+    } catch (std::exception &e) {
+        for (int fd : record.get_fds()) {
+            close(fd);
+        }
+        close(sockfd);
+        throw;
+    }
+    std::vector<int> &fds = record.get_fds();
+    sockfd_ = fds[0];
+    // Bound as the running server was, whatever the arguments say.
+    socklen_t addr_len = sizeof(server_addr_);
+    getsockname(sockfd_, cast_sockaddr_in(server_addr_), &addr_len);
+    size_t next = 1;
+    if (has_unix) {
+        // Taken only on the same path.
+        sockaddr_un bound;
+        socklen_t bound_len = sizeof(bound);
+        memset(&bound, 0, sizeof(bound));
+        if (!unix_path_.empty() &&
+            getsockname(fds[next], reinterpret_cast<sockaddr *>(&bound), &bound_len) == 0 &&
+            unix_path_ == bound.sun_path) {
+            unix_sockfd_ = fds[next];
+        } else {
+            close(fds[next]);
+        }
+        next++;
+    }
+    if (unix_sockfd_ < 0) {
+        try {
+            open_unix_listener();
+        } catch (std::exception &e) {
+            if (has_datagram) {
+                close(fds[next]);
+            }
+            close(sockfd);
+            throw;
+        }
+    }
+    if (has_datagram) {
+        datagram_sockfd = fds[next];
+    }
+    return sockfd;
+}
+
+void Server::take_over(int sockfd) {
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    std::vector<uint8_t> client_ids;
+    bool ended = false;
+    std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+    try {
+        HandoverRecord record;
+        while (!ended && record.receive(sockfd)) {
+            switch (record.get_kind()) {
+                case HandoverKind::CLIENT:
+                    client_ids.push_back(adopt_client(record, clientinfo_list_lock));
+                    break;
+                case HandoverKind::STATE:
+                    restore_state(record, clientinfo_list_lock);
+                    break;
+                case HandoverKind::END:
+                    ended = true;
+                    break;
+                default:
+                    for (int fd : record.get_fds()) {
+                        close(fd);
+                    }
+                    break;
+            }
+        }
+    } catch (std::exception &e) {
+        output_queue_->push("[ERR] " + std::string(e.what()));
+    }
+    clientinfo_list_lock.unlock();
+    close(sockfd);
+    if (!ended) {
+        output_queue_->push("[ERR] The former server stopped handing over, the clients not taken reconnect.");
+    }
+
+    // Receive from the clients once the tables they use are complete.
+    for (uint8_t id : client_ids) {
+        clientinfo_list_lock.lock();
+        bool attached = clientinfo_list_->at(id, clientinfo_list_lock)->get_gateway_id() != id;
+        clientinfo_list_lock.unlock();
+        // Received through the connection of its owner.
+        if (!attached) {
+            start_client(id);
+        }
+    }
+    double take_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+    output_queue_->push(
+        "[INFO] Took " + std::to_string(client_ids.size()) + " client(s) over from the former server in " +
+        std::to_string(take_time) + " ms."
+    );
+}
+
+uint8_t Server::adopt_client(HandoverRecord &record, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    std::vector<int> fds = std::move(record.get_fds());
+    uint8_t id;
+    uint8_t gateway_id;
+    std::string name;
+    sockaddr_in addr;
+    bool datagram;
+    sockaddr_in datagram_addr;
+    uint32_t send_seq;
+    std::vector<uint8_t> buffered;
+    try {
+        id = record.get_u8();
+        gateway_id = record.get_u8();
+        // An attached client comes without fds, after the owner of its connection.
+        auto gateway = clientinfo_list_->find(gateway_id, clientinfo_list_lock);
+        bool valid = gateway_id == id ?
+                     fds.size() == 1 || fds.size() == 1 + 2 * SHM_RING_FD_NUM :
+                     fds.empty() && gateway != clientinfo_list_->end(clientinfo_list_lock) &&
+                     gateway->second->get_gateway_id() == gateway_id;
+        if (!valid) {
+            throw std::runtime_error("Server Take Over failed: invalid fds of a client.");
+        }
+        name = record.get_string();
+        addr = record.get_addr();
+        datagram = record.get_u8();
+        datagram_addr = record.get_addr();
+        send_seq = record.get_u32();
+        buffered = record.get_bytes();
+        if (id == SERVER_ID || clientinfo_list_->check_exist(id, clientinfo_list_lock)) {
+            throw std::runtime_error("Server Take Over failed: invalid client id.");
+        }
+    } catch (std::exception &e) {
+        for (int fd : fds) {
+            close(fd);
+        }
+        throw;
+    }
+
+    if (gateway_id != id) {
+        ClientInfo &gateway = *clientinfo_list_->at(gateway_id, clientinfo_list_lock);
+        clientinfo_list_->insert_or_assign(
+            id,
+            std::make_unique<ClientInfo>(std::move(name), id, gateway),
+            clientinfo_list_lock
+        );
+        std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+        client_directory_->join(
+            id,
+            clientinfo_list_->at(id, clientinfo_list_lock)->get_name(),
+            addr,
+            client_directory_lock
+        );
+        return id;
+    }
+
+    int sockfd = fds[0];
+    std::unique_ptr<Receiver> receiver = std::make_unique<Receiver>(sockfd, SERVER_ID);
+    std::unique_ptr<Sender> sender = std::make_unique<Sender>(sockfd, SERVER_ID);
+    if (fds.size() > 1) {
+        // Mapped again, the positions of the rings are in the shared memory.
+        std::unique_ptr<ShmRing> rings[2];
+        std::exception_ptr error;
+        for (size_t i = 0; i < 2; i++) {
+            try {
+                rings[i] = std::make_unique<ShmRing>(fds.data() + 1 + i * SHM_RING_FD_NUM);
+            } catch (std::exception &e) {
+                error = std::current_exception();
+            }
+        }
+        if (error) {
+            sender.reset();
+            close(sockfd);
+            std::rethrow_exception(error);
+        }
+        receiver->attach_ring(std::move(rings[0]));
+        sender->attach_ring(std::move(rings[1]));
+    }
+    // The packet the former server was cut in the middle of.
+    receiver->put_back(buffered);
+
+    std::unique_ptr<ClientInfo> client_info = std::make_unique<ClientInfo>(
+        std::move(name),
+        addr,
+        sockfd,
+        id,
+        sender.release(),
+        receiver.release()
+    );
+    if (datagram && datagram_channel_) {
+        datagram_channel_->add_peer(datagram_addr, id, send_seq);
+        client_info->set_datagram_addr(datagram_addr);
+    }
+    clientinfo_list_->insert_or_assign(id, std::move(client_info), clientinfo_list_lock);
+    std::unique_lock<std::mutex> client_directory_lock(client_directory_->get_mutex());
+    client_directory_->join(
+        id,
+        clientinfo_list_->at(id, clientinfo_list_lock)->get_name(),
+        addr,
+        client_directory_lock
+    );
+    return id;
+}
+
+void Server::save_state(HandoverRecord &record, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    check_lock(clientinfo_list_lock, &clientinfo_list_->get_mutex());
+    // The ids tracked in message_status_map_ are not taken again.
+    record.put_u16(Message::get_pakage_id_counter());
+    record.put_u64(forward_seq_);
+
+    // The sessions of the connected clients and the suspended ones.
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> session_map_lock(session_map_->get_mutex());
+    record.put_u32(session_map_->size(session_map_lock));
+    for (
+        auto it = session_map_->begin(session_map_lock);
+        it != session_map_->end(session_map_lock);
+        it++
+    ) {
+        const Session &session = it->second;
+        record.put_u8(it->first);
+        record.put_string(session.token);
+        record.put_string(session.name);
+        record.put_u8(session.suspended);
+        // The time left, the clocks of the processes are not compared.
+        record.put_u64(session.suspended ?
+            std::max<int64_t>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(session.expire_time - now).count(), 0
+            ) : 0
+        );
+    }
+    session_map_lock.unlock();
+
+    // The FWDs not acknowledged, with the frames to replay, and the DISCONNECTs.
+    std::unique_lock<std::mutex> message_status_map_lock(message_status_map_->get_mutex());
+    record.put_u32(message_status_map_->size(message_status_map_lock));
+    for (
+        auto it = message_status_map_->begin(message_status_map_lock);
+        it != message_status_map_->end(message_status_map_lock);
+        it++
+    ) {
+        const PacketInfo &info = it->second;
+        record.put_u16(it->first);
+        record.put_u16(info.package_id);
+        record.put_u8(info.sender_id);
+        record.put_u8(info.receiver_id);
+        record.put_u8(static_cast<uint8_t>(info.message_type));
+        record.put_u64(info.seq);
+        record.put_u64(info.mailbox_seq);
+        record.put_bytes(info.frame ? info.frame->get_buffer() : std::vector<uint8_t>());
+    }
+    message_status_map_lock.unlock();
+
+    std::unique_lock<std::mutex> multicast_lock(multicast_status_map_->get_mutex());
+    record.put_u32(multicast_status_map_->size(multicast_lock));
+    for (
+        auto it = multicast_status_map_->begin(multicast_lock);
+        it != multicast_status_map_->end(multicast_lock);
+        it++
+    ) {
+        const MulticastInfo &info = it->second;
+        record.put_u16(it->first);
+        record.put_u16(info.package_id);
+        record.put_u8(info.sender_id);
+        record.put_string(info.pending.to_string());
+        record.put_string(info.succeeded.to_string());
+        record.put_string(info.failed.to_string());
+    }
+    multicast_lock.unlock();
+
+    // Flow control and the presence, protected by the lock of clientinfo_list_.
+    std::vector<uint8_t> receiver_ids;
+    for (size_t id = 0; id <= MAX_CLIENT_NUM; id++) {
+        if (buffered_bytes_[id] > 0 || waiting_senders_[id].any()) {
+            receiver_ids.push_back(id);
+        }
+    }
+    record.put_u32(receiver_ids.size());
+    for (uint8_t id : receiver_ids) {
+        record.put_u8(id);
+        record.put_u64(buffered_bytes_[id]);
+        record.put_string(waiting_senders_[id].to_string());
+    }
+    record.put_u64(peak_buffered_bytes_);
+    record.put_string(presence_watchers_.to_string());
+    record.put_string(ack_batching_.to_string());
+    // The stored messages being delivered, the mailbox is opened again by the new server.
+    std::vector<uint8_t> delivery_ids;
+    for (size_t id = 1; id <= MAX_CLIENT_NUM; id++) {
+        if (!mailbox_deliveries_[id].key.empty()) {
+            delivery_ids.push_back(id);
+        }
+    }
+    record.put_u32(delivery_ids.size());
+    for (uint8_t id : delivery_ids) {
+        const MailboxDelivery &delivery = mailbox_deliveries_[id];
+        record.put_u8(id);
+        record.put_string(delivery.key);
+        record.put_u64(delivery.sent_seq);
+        record.put_u32(delivery.pending.size());
+        for (const auto &pending : delivery.pending) {
+            record.put_u64(pending.first);
+            record.put_u8(pending.second);
+        }
+    }
+
+    // The subscriptions, of the suspended clients too.
+    std::unique_lock<std::mutex> topic_index_lock(topic_index_->get_mutex());
+    std::vector<uint8_t> subscriber_ids;
+    for (size_t id = 1; id <= MAX_CLIENT_NUM; id++) {
+        if (!topic_index_->get_topics(id, topic_index_lock).empty()) {
+            subscriber_ids.push_back(id);
+        }
+    }
+    record.put_u32(subscriber_ids.size());
+    for (uint8_t id : subscriber_ids) {
+        const std::vector<std::string> &topics = topic_index_->get_topics(id, topic_index_lock);
+        record.put_u8(id);
+        record.put_u32(topics.size());
+        for (const std::string &topic : topics) {
+            record.put_string(topic);
+        }
+    }
+}
+
+void Server::restore_state(HandoverRecord &record, std::unique_lock<std::mutex> &clientinfo_list_lock) {
+    // Flow control and the presence are protected by the lock of clientinfo_list_.
+    check_lock(clientinfo_list_lock, &clientinfo_list_->get_mutex());
+    Message::set_pakage_id_counter(record.get_u16());
+    forward_seq_ = record.get_u64();
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> session_map_lock(session_map_->get_mutex());
+    for (uint32_t i = record.get_u32(); i > 0; i--) {
+        uint8_t id = record.get_u8();
+        Session session;
+        session.token = record.get_string();
+        session.name = record.get_string();
+        session.suspended = record.get_u8();
+        session.expire_time = now + std::chrono::milliseconds(record.get_u64());
+        session_map_->insert_or_assign(id, std::move(session), session_map_lock);
+    }
+    session_map_lock.unlock();
+
+    std::unique_lock<std::mutex> message_status_map_lock(message_status_map_->get_mutex());
+    for (uint32_t i = record.get_u32(); i > 0; i--) {
+        uint16_t key = record.get_u16();
+        PacketInfo info;
+        info.package_id = record.get_u16();
+        info.sender_id = record.get_u8();
+        info.receiver_id = record.get_u8();
+        info.message_type = static_cast<MessageType>(record.get_u8());
+        info.seq = record.get_u64();
+        info.mailbox_seq = record.get_u64();
+        std::vector<uint8_t> frame = record.get_bytes();
+        if (!frame.empty()) {
+            info.frame = FrameRef::make();
+            info.frame->get_buffer() = std::move(frame);
+        }
+        message_status_map_->insert_or_assign(key, std::move(info), message_status_map_lock);
+    }
+    message_status_map_lock.unlock();
+
+    std::unique_lock<std::mutex> multicast_lock(multicast_status_map_->get_mutex());
+    for (uint32_t i = record.get_u32(); i > 0; i--) {
+        uint16_t key = record.get_u16();
+        MulticastInfo info;
+        info.package_id = record.get_u16();
+        info.sender_id = record.get_u8();
+        info.pending = std::bitset<MAX_CLIENT_NUM + 1>(record.get_string());
+        info.succeeded = std::bitset<MAX_CLIENT_NUM + 1>(record.get_string());
+        info.failed = std::bitset<MAX_CLIENT_NUM + 1>(record.get_string());
+        multicast_status_map_->insert_or_assign(key, std::move(info), multicast_lock);
+    }
+    multicast_lock.unlock();
+
+    for (uint32_t i = record.get_u32(); i > 0; i--) {
+        uint8_t id = record.get_u8();
+        buffered_bytes_[id] = record.get_u64();
+        waiting_senders_[id] = std::bitset<MAX_CLIENT_NUM + 1>(record.get_string());
+    }
+    peak_buffered_bytes_ = record.get_u64();
+    presence_watchers_ = std::bitset<MAX_CLIENT_NUM + 1>(record.get_string());
+    ack_batching_ = std::bitset<MAX_CLIENT_NUM + 1>(record.get_string());
+    for (uint32_t i = record.get_u32(); i > 0; i--) {
+        MailboxDelivery &delivery = mailbox_deliveries_[record.get_u8()];
+        delivery.key = record.get_string();
+        delivery.sent_seq = record.get_u64();
+        for (uint32_t j = record.get_u32(); j > 0; j--) {
+            uint64_t seq = record.get_u64();
+            delivery.pending.emplace_back(seq, record.get_u8() != 0);
+        }
+    }
+
+    std::unique_lock<std::mutex> topic_index_lock(topic_index_->get_mutex());
+    for (uint32_t i = record.get_u32(); i > 0; i--) {
+        uint8_t id = record.get_u8();
+        for (uint32_t j = record.get_u32(); j > 0; j--) {
+            topic_index_->subscribe(record.get_string(), id, topic_index_lock);
+        }
+    }
+}
+
+void Server::set_limits(uint32_t message_rate, uint32_t byte_rate, uint32_t connection_num) {
+    message_rate_limit_ = message_rate;
+    byte_rate_limit_ = byte_rate;
+    connection_limit_ = connection_num;
+    output_queue_->push(
+        "[INFO] Limits: " + std::to_string(message_rate) + " message(s)/s, " +
+        std::to_string(byte_rate) + " byte(s)/s per client, " +
+        std::to_string(connection_num) + " connection(s)."
+    );
+}
+
+void Server::set_keepalive(bool enable) {
+    keepalive_ = enable;
+    output_queue_->push(
+        std::string("[INFO] TCP keepalive ") + (enable ? "enabled" : "disabled") +
+        " for the connections accepted from now on."
+    );
+}
+
+void Server::set_tracing(bool enable) {
+    tracing_ = enable;
+    output_queue_->push(std::string("[INFO] Message tracing ") + (enable ? "enabled." : "disabled."));
+}
+
+void Server::bench_topics(size_t topic_num) {
+    if (topic_num == 0) {
+        return;
+    }
+    // Not the index of the server, its lock is not held meanwhile.
+    std::unique_ptr<TopicIndex> index = std::make_unique<TopicIndex>();
+    std::unique_lock<std::mutex> lock(index->get_mutex());
+    std::vector<std::string> topics(topic_num);
+    for (size_t i = 0; i < topic_num; i++) {
+        topics[i] = "topic-" + std::to_string(i);
+    }
+
+    // The subscribers of a topic are consecutive ids from its rank on, so the tail spreads evenly.
+    size_t subscription_num = 0;
+    size_t rejected_num = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < topic_num; i++) {
+        size_t subscriber_num = std::max<size_t>(MAX_CLIENT_NUM / (i + 1), 1);
+        for (size_t j = 0; j < subscriber_num; j++) {
+            uint8_t client_id = (i + j) % MAX_CLIENT_NUM + 1;
+            if (index->subscribe(topics[i], client_id, lock)) {
+                subscription_num++;
+            } else {
+                rejected_num++;
+            }
+        }
+    }
+    std::chrono::steady_clock::time_point subscribed = std::chrono::steady_clock::now();
+
+    // Every topic published once, then the hottest one as often, which a PUBLISH fans out the most.
+    size_t fanout_num = 0;
+    for (size_t i = 0; i < topic_num; i++) {
+        fanout_num += index->get_subscribers(topics[i], lock).count();
+    }
+    std::chrono::steady_clock::time_point looked_up = std::chrono::steady_clock::now();
+    size_t hot_fanout_num = 0;
+    for (size_t i = 0; i < topic_num; i++) {
+        hot_fanout_num += index->get_subscribers(topics[0], lock).count();
+    }
+    std::chrono::steady_clock::time_point hot_looked_up = std::chrono::steady_clock::now();
+
+    for (size_t id = 1; id <= MAX_CLIENT_NUM; id++) {
+        index->remove_client(id, lock);
+    }
+    std::chrono::steady_clock::time_point removed = std::chrono::steady_clock::now();
+
+    auto ns = [](std::chrono::steady_clock::duration duration, size_t num) {
+        return std::to_string(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() / std::max<size_t>(num, 1)
+        );
+    };
+    output_queue_->push(
+        "[STAT] Topics: " + std::to_string(topic_num) + " topic(s), " + std::to_string(subscription_num) +
+        " subscription(s), " + std::to_string(rejected_num) + " over MAX_SUBSCRIPTION_NUM, " +
+        ns(subscribed - start, subscription_num) + " ns per subscription"
+    );
+    output_queue_->push(
+        "[STAT] Topics: " + ns(looked_up - subscribed, topic_num) + " ns per PUBLISH lookup over all the topics, " +
+        std::to_string((double)fanout_num / topic_num) + " subscriber(s) on average, " +
+        ns(hot_looked_up - looked_up, topic_num) + " ns on the hottest one with " +
+        std::to_string(hot_fanout_num / topic_num) + " subscriber(s)"
+    );
+    output_queue_->push(
+        "[STAT] Topics: " + ns(removed - hot_looked_up, subscription_num) +
+        " ns per subscription dropped when its client disconnects, " +
+        std::to_string(index->get_topic_num(lock)) + " topic(s) left"
+    );
 }
 
 bool Server::output_message() {
@@ -479,6 +3009,156 @@ bool Server::output_message() {
     return true;
 }
 
+bool Server::output_stats() {
+    uint64_t forwarded_num = forwarded_num_;
+    uint64_t forward_alloc_num = forward_alloc_num_;
+    output_queue_->push("[STAT] Forwarded messages: " + std::to_string(forwarded_num));
+    output_queue_->push(
+        "[STAT] Heap allocations on the forward path: " + std::to_string(forward_alloc_num) +
+        " (" + std::to_string(forwarded_num ? (double)forward_alloc_num / forwarded_num : 0.0) +
+        " per message)"
+    );
+    output_queue_->push(
+        "[STAT] ACKs of the forwards: " + std::to_string(single_ack_in_num_.load()) + " taken alone, " +
+        std::to_string(batched_ack_in_num_.load()) + " in " + std::to_string(ack_batch_in_num_.load()) +
+        " ACKS, " + std::to_string(single_ack_out_num_.load()) + " relayed alone, " +
+        std::to_string(batched_ack_out_num_.load()) + " in " + std::to_string(ack_batch_out_num_.load()) + " ACKS"
+    );
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    uint64_t cpu_time = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ull +
+                        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    output_queue_->push(
+        "[STAT] CPU time: " + std::to_string(cpu_time / 1000) + " ms (" +
+        std::to_string(forwarded_num ? (double)cpu_time / forwarded_num : 0.0) + " us per forwarded message)"
+    );
+    std::unique_lock<std::mutex> topic_index_lock(topic_index_->get_mutex());
+    output_queue_->push(
+        "[STAT] Topics: " + std::to_string(topic_index_->get_topic_num(topic_index_lock)) +
+        ", subscriptions: " + std::to_string(topic_index_->get_subscription_num(topic_index_lock))
+    );
+    topic_index_lock.unlock();
+    output_queue_->push(
+        "[STAT] Published messages: " + std::to_string(published_num_.load()) +
+        ", delivered: " + std::to_string(delivered_num_.load())
+    );
+    std::unique_lock<std::mutex> session_map_lock(session_map_->get_mutex());
+    size_t session_num = 0;
+    size_t suspended_num = 0;
+    for (
+        auto it = session_map_->begin(session_map_lock);
+        it != session_map_->end(session_map_lock);
+        it++
+    ) {
+        session_num++;
+        suspended_num += it->second.suspended;
+    }
+    session_map_lock.unlock();
+    output_queue_->push(
+        "[STAT] Sessions: " + std::to_string(session_num) +
+        ", suspended: " + std::to_string(suspended_num) +
+        ", resumed: " + std::to_string(resumed_num_.load())
+    );
+    if (mailbox_) {
+        std::unique_lock<std::mutex> mailbox_lock(mailbox_->get_mutex());
+        output_queue_->push(
+            "[STAT] Mailbox: " + std::to_string(mailbox_->get_stored_num(mailbox_lock)) +
+            " stored message(s) in " + std::to_string(mailbox_->get_segment_num(mailbox_lock)) +
+            " segment(s), " + std::to_string(mailbox_->get_commit_num(mailbox_lock)) + " commit(s)"
+        );
+    }
+    std::unique_lock<std::mutex> clientinfo_list_lock(clientinfo_list_->get_mutex());
+    size_t buffered_bytes = 0;
+    for (size_t bytes : buffered_bytes_) {
+        buffered_bytes += bytes;
+    }
+    output_queue_->push(
+        "[STAT] Flow control: " + std::to_string(buffered_bytes) + " byte(s) buffered, peak " +
+        std::to_string(peak_buffered_bytes_) + " per receiver, " +
+        std::to_string(waited_num_.load()) + " WAIT(s)"
+    );
+    clientinfo_list_lock.unlock();
+    output_queue_->push(
+        "[STAT] Connections: " + std::to_string(tcp_accepted_num_.load()) + " through TCP, " +
+        std::to_string(unix_accepted_num_.load()) + " through the unix socket, " +
+        std::to_string(shm_accepted_num_.load()) + " of them moved to shared memory, " +
+        std::to_string(attached_num_.load()) + " client(s) attached to them"
+    );
+    if (datagram_channel_) {
+        DatagramStats datagram_stats = datagram_channel_->get_stats();
+        output_queue_->push(
+            "[STAT] Datagrams: " + std::to_string(datagram_stats.sent_num) + " sent in " +
+            std::to_string(datagram_stats.batch_num) + " batch(es), " +
+            std::to_string(datagram_stats.received_num) + " received, " +
+            std::to_string(datagram_stats.lost_num) + " lost, " +
+            std::to_string(datagram_stats.late_num) + " late, " +
+            std::to_string(datagram_fallback_num_.load()) + " DATAGRAM(s) relayed through TCP"
+        );
+    }
+    if (node_num_ > 1) {
+        clientinfo_list_lock.lock();
+        size_t link_num = 0;
+        size_t member_num = 0;
+        for (std::unique_ptr<PeerLink> &link : peer_links_) {
+            if (link) {
+                link_num++;
+                member_num += link->members.count();
+            }
+        }
+        clientinfo_list_lock.unlock();
+        output_queue_->push(
+            "[STAT] Cluster: node " + std::to_string(node_index_) + " of " + std::to_string(node_num_) + ", " +
+            std::to_string(link_num) + " link(s) up, " + std::to_string(member_num) + " client(s) on the others, " +
+            std::to_string(peer_forwarded_num_.load()) + " REQSEND(s) forwarded to them, " +
+            std::to_string(peer_received_num_.load()) + " received from them, " +
+            std::to_string(peer_relayed_num_.load()) + " answer(s) relayed back"
+        );
+    }
+    output_queue_->push(
+        "[STAT] Limits: " + std::to_string(rate_limited_num_.load()) + " request(s) throttled, " +
+        std::to_string(rejected_num_.load()) + " connection(s) rejected"
+    );
+    output_queue_->push(
+        "[STAT] Heart beats: " + std::to_string(heart_beat_num_.load()) + " sent, " +
+        std::to_string(skipped_heart_beat_num_.load()) + " skipped for the clients heard of lately or probed by the kernel"
+    );
+    clientinfo_list_lock.lock();
+    size_t watcher_num = presence_watchers_.count();
+    clientinfo_list_lock.unlock();
+    output_queue_->push(
+        "[STAT] Presence: " + std::to_string(watcher_num) + " watcher(s), " +
+        std::to_string(presence_event_num_.load()) + " notification(s) sent " +
+        std::to_string(presence_sent_num_.load()) + " time(s)"
+    );
+    const char *lane_names[LANE_NUM] = {"control", "bulk"};
+    for (size_t i = 0; i < LANE_NUM; i++) {
+        LaneStats lane_stats = Sender::get_lane_stats(static_cast<Lane>(i));
+        output_queue_->push(
+            "[STAT] Lane " + std::string(lane_names[i]) + ": " + std::to_string(lane_stats.frame_num) +
+            " frame(s), queueing delay avg " +
+            std::to_string(lane_stats.frame_num ? lane_stats.total_delay / lane_stats.frame_num : 0) +
+            " us, max " + std::to_string(lane_stats.max_delay) + " us"
+        );
+    }
+    const char *backend_names[IO_BACKEND_NUM] = {"epoll", "io_uring"};
+    for (size_t i = 0; i < IO_BACKEND_NUM; i++) {
+        ReceiverStats receiver_stats = Receiver::get_stats(static_cast<IoBackend>(i));
+        if (receiver_stats.syscall_num == 0) {
+            continue;
+        }
+        output_queue_->push(
+            "[STAT] Receiver " + std::string(backend_names[i]) + ": " +
+            std::to_string(receiver_stats.syscall_num) + " system call(s) for " +
+            std::to_string(receiver_stats.message_num) + " message(s) (" +
+            std::to_string(receiver_stats.message_num ?
+                           (double)receiver_stats.syscall_num / receiver_stats.message_num : 0) +
+            " per message)"
+        );
+    }
+    output_queue_->push("[STAT] Heap allocations in total: " + std::to_string(get_alloc_count()));
+    return true;
+}
+
 bool Server::clear_message_status_map(
     uint16_t client_id,
     std::unique_lock<std::mutex> &clientinfo_list_lock
@@ -486,7 +3166,13 @@ bool Server::clear_message_status_map(
     std::unique_lock<std::mutex> lock(message_status_map_->get_mutex());
     for (auto it = message_status_map_->begin(lock); it != message_status_map_->end(lock);) {
         if (it->second.sender_id == client_id) {
-            // Erase the message.
+            // Erase the message, nobody tracks its bytes any more.
+            if (it->second.frame) {
+                return_credit(it->second.receiver_id, it->second.frame->size(), clientinfo_list_lock);
+            }
+            it = message_status_map_->erase(it, lock);
+        } else if (it->second.receiver_id == client_id && it->second.sender_id == SERVER_ID) {
+            // From the mailbox, nobody to tell, it stays stored for the next client with the name.
             it = message_status_map_->erase(it, lock);
         } else if (it->second.receiver_id == client_id) {
             // check if the sender is still connected.
@@ -503,7 +3189,7 @@ bool Server::clear_message_status_map(
                             ->send_acknowledge(
                                 it->second.package_id,
                                 it->second.sender_id,
-                                data
+                                std::move(data)
                             );
             // Erase the message.
             it = message_status_map_->erase(it, lock);
@@ -511,9 +3197,36 @@ bool Server::clear_message_status_map(
             it++;
         }
     }
+
+    clear_multicast_status_map(client_id, clientinfo_list_lock);
     output_queue_->push(
         "[DEBUG] Cleared message_status_map_ with client id: " +
         std::to_string(client_id)
     );
     return true;
 }
+
+void Server::clear_multicast_status_map(
+    uint16_t client_id,
+    std::unique_lock<std::mutex> &clientinfo_list_lock
+) {
+    // Fail the shared FWDs waiting for the client.
+    std::unique_lock<std::mutex> multicast_lock(multicast_status_map_->get_mutex());
+    for (auto it = multicast_status_map_->begin(multicast_lock); it != multicast_status_map_->end(multicast_lock);) {
+        MulticastInfo &info = it->second;
+        if (info.sender_id == client_id) {
+            it = multicast_status_map_->erase(it, multicast_lock);
+            continue;
+        }
+        if (info.pending.test(client_id)) {
+            info.pending.reset(client_id);
+            info.failed.set(client_id);
+            if (info.pending.none()) {
+                send_multicast_result(info, clientinfo_list_lock);
+                it = multicast_status_map_->erase(it, multicast_lock);
+                continue;
+            }
+        }
+        it++;
+    }
+}
@@ -0,0 +1,85 @@
+#include "TopicIndex.hpp"
+#include <algorithm>
+
+bool TopicIndex::subscribe(
+    const std::string &topic,
+    uint8_t client_id,
+    std::unique_lock<std::mutex> &lock
+) {
+    check_lock(lock, &mutex_);
+    std::vector<std::string> &client_topics = client_topics_[client_id];
+    if (client_topics.size() >= MAX_SUBSCRIPTION_NUM) {
+        return false;
+    }
+    SubscriberSet &subscribers = topics_[topic];
+    if (subscribers.test(client_id)) {
+        return false;
+    }
+    subscribers.set(client_id);
+    client_topics.push_back(topic);
+    subscription_num_++;
+    return true;
+}
+
+bool TopicIndex::unsubscribe(
+    const std::string &topic,
+    uint8_t client_id,
+    std::unique_lock<std::mutex> &lock
+) {
+    check_lock(lock, &mutex_);
+    auto it = topics_.find(topic);
+    if (it == topics_.end() || !it->second.test(client_id)) {
+        return false;
+    }
+    it->second.reset(client_id);
+    if (it->second.none()) {
+        topics_.erase(it);
+    }
+    std::vector<std::string> &client_topics = client_topics_[client_id];
+    auto pos = std::find(client_topics.begin(), client_topics.end(), topic);
+    // Order does not matter, swap with the last one.
+    *pos = std::move(client_topics.back());
+    client_topics.pop_back();
+    subscription_num_--;
+    return true;
+}
+
+size_t TopicIndex::remove_client(uint8_t client_id, std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    std::vector<std::string> &client_topics = client_topics_[client_id];
+    size_t removed = client_topics.size();
+    for (const std::string &topic : client_topics) {
+        auto it = topics_.find(topic);
+        it->second.reset(client_id);
+        if (it->second.none()) {
+            topics_.erase(it);
+        }
+    }
+    client_topics.clear();
+    subscription_num_ -= removed;
+    return removed;
+}
+
+SubscriberSet TopicIndex::get_subscribers(const std::string &topic, std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    auto it = topics_.find(topic);
+    if (it == topics_.end()) {
+        return SubscriberSet();
+    }
+    return it->second;
+}
+
+const std::vector<std::string> &TopicIndex::get_topics(uint8_t client_id, std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    return client_topics_[client_id];
+}
+
+size_t TopicIndex::get_topic_num(std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    return topics_.size();
+}
+
+size_t TopicIndex::get_subscription_num(std::unique_lock<std::mutex> &lock) {
+    check_lock(lock, &mutex_);
+    return subscription_num_;
+}
@@ -1,6 +1,10 @@
 #include "Server.hpp"
 #include <iostream>
 #include <future>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
 
 std::string get_command() {
     std::string command;
@@ -16,9 +20,14 @@ int main(int argc, char *argv[]) {
     delete[] hostname;
     in_addr_t addr = SERVER_ADDR;
     int port = SERVER_PORT;
+    std::string mailbox_dir;
+    std::string unix_path;
+    std::string upgrade_path;
 
     // If there are arguments, use them.
-    // in order: <name> <addr> <port>
+    // in order: <name> <addr> <port> <mailbox dir, - for none> <epoll|uring> <unix socket path, - for none>
+    //           <cluster, <index>@<host:port>,<host:port>,... listing all the nodes, - for none>
+    //           <upgrade path, where the running server hands its clients over, - for none>
     if (argc > 1) {
         name = argv[1];
     }
@@ -28,15 +37,80 @@ int main(int argc, char *argv[]) {
     if (argc > 3) {
         port = atoi(argv[3]);
     }
+    if (argc > 4 && std::string(argv[4]) != "-") {
+        mailbox_dir = argv[4];
+    }
+    if (argc > 5) {
+        std::string backend = argv[5];
+        if (backend == "uring") {
+            if (!Receiver::set_backend(IoBackend::IO_URING)) {
+                std::cout << "[WARN] io_uring is not supported, using epoll." << std::endl;
+            }
+        } else if (backend != "epoll") {
+            std::cout << "[ERR] Unknown backend: " << backend << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc > 6 && std::string(argv[6]) != "-") {
+        unix_path = argv[6];
+    }
+
+    int node_index = -1;
+    std::vector<sockaddr_in> nodes;
+    if (argc > 7 && std::string(argv[7]) != "-") {
+        std::string cluster = argv[7];
+        size_t at = cluster.find('@');
+        node_index = at == std::string::npos ? -1 : atoi(cluster.substr(0, at).c_str());
+        size_t start = at + 1;
+        while (at != std::string::npos && start < cluster.size()) {
+            size_t end = std::min(cluster.find(',', start), cluster.size());
+            std::string node = cluster.substr(start, end - start);
+            size_t colon = node.rfind(':');
+            sockaddr_in node_addr;
+            memset(&node_addr, 0, sizeof(node_addr));
+            node_addr.sin_family = AF_INET;
+            if (colon == std::string::npos ||
+                inet_pton(AF_INET, node.substr(0, colon).c_str(), &node_addr.sin_addr) != 1) {
+                std::cout << "[ERR] Invalid node: " << node << std::endl;
+                return 1;
+            }
+            node_addr.sin_port = htons(atoi(node.substr(colon + 1).c_str()));
+            nodes.push_back(node_addr);
+            start = end + 1;
+        }
+        if (node_index < 0 || node_index >= (int)nodes.size()) {
+            std::cout << "[ERR] Usage: <index>@<host:port>,<host:port>,..." << std::endl;
+            return 1;
+        }
+    }
+
+    if (argc > 8 && std::string(argv[8]) != "-") {
+        upgrade_path = argv[8];
+    }
 
     std::cout << "[INFO] Server host name: " << name << std::endl;
     std::cout << "[INFO] Server address: " << inet_ntoa(*(in_addr *)&addr) << std::endl;
     std::cout << "[INFO] Server port: " << port << std::endl;
+    if (!mailbox_dir.empty()) {
+        std::cout << "[INFO] Server mailbox: " << mailbox_dir << std::endl;
+    }
+    if (!unix_path.empty()) {
+        std::cout << "[INFO] Server unix socket: " << unix_path << std::endl;
+    }
+    std::cout << "[INFO] Server backend: "
+              << (Receiver::get_backend() == IoBackend::IO_URING ? "io_uring" : "epoll") << std::endl;
+    if (!upgrade_path.empty()) {
+        std::cout << "[INFO] Server taking over from: " << upgrade_path << std::endl;
+    }
 
     // Create a server.
     std::unique_ptr<Server> server;
     try {
-        server = std::unique_ptr<Server>(new Server(name, addr, port));
+        server = std::unique_ptr<Server>(new Server(name, addr, port, mailbox_dir, unix_path, upgrade_path));
+        if (node_index >= 0) {
+            server->join_cluster(node_index, std::move(nodes));
+        }
     } catch (std::exception &e) {
         std::cout << "[ERR] " << e.what() << std::endl;
         return 1;
@@ -71,8 +145,44 @@ int main(int argc, char *argv[]) {
 
             if (command == "exit") {
                 break;
+            } else if (command == "stats") {
+                server->output_stats();
+            } else if (command.rfind("limit ", 0) == 0) {
+                // limit <messages/s> <bytes/s> <connections>
+                unsigned int message_rate;
+                unsigned int byte_rate;
+                unsigned int connection_num;
+                if (sscanf(command.c_str(), "limit %u %u %u", &message_rate, &byte_rate, &connection_num) == 3) {
+                    server->set_limits(message_rate, byte_rate, connection_num);
+                } else {
+                    std::cout << "[ERR] Usage: limit <messages/s> <bytes/s> <connections>" << std::endl;
+                }
+            } else if (command == "keepalive on" || command == "keepalive off") {
+                server->set_keepalive(command == "keepalive on");
+            } else if (command == "trace on" || command == "trace off") {
+                server->set_tracing(command == "trace on");
+            } else if (command.rfind("bench ", 0) == 0) {
+                size_t topic_num;
+                if (sscanf(command.c_str(), "bench %lu", &topic_num) == 1) {
+                    server->bench_topics(topic_num);
+                } else {
+                    std::cout << "[ERR] Usage: bench <topics>" << std::endl;
+                }
+            } else if (command.rfind("upgrade ", 0) == 0) {
+                // The new server has the clients, exit without disconnecting them.
+                if (server->hand_over(command.substr(8))) {
+                    break;
+                }
             } else {
-                std::cout << "[INFO] Please enter \"exit\" to close the server." << std::endl;
+                std::cout << "[INFO] Please enter \"exit\" to close the server, "
+                          << "\"stats\" to print the statistics, "
+                          << "\"limit <messages/s> <bytes/s> <connections>\" to change the limits "
+                          << "(0 for unlimited rates), "
+                          << "\"keepalive <on|off>\" to let the kernel probe the idle TCP connections, "
+                          << "\"trace <on|off>\" to log every message received, "
+                          << "\"bench <topics>\" to measure the topic index with skewed subscriber counts, "
+                          << "or \"upgrade <path>\" to hand the clients over to a new server "
+                          << "started with the same path." << std::endl;
             }
         }
     } catch (std::exception &e) {